@@ -0,0 +1,244 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include "CommandQueue.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION queues the commands received from each client (JMRI
+and other TCP clients, WebSocket clients, the USB serial port and MQTT) rather
+than processing them as they arrive. The queues are serviced round-robin by a
+scheduler task so a single client sending a flood of commands (a looping
+script or a throttle slider sending every position) can not delay the
+commands of the other clients.
+
+Each client is also limited by a token bucket, it can send a burst of
+COMMAND_RATE_BURST commands after which its commands are processed at no more
+than COMMAND_RATE_LIMIT per second. Commands waiting for a token are counted as
+delayed. Stream clients (TCP and the serial port) stop reading further
+commands while their queue is full, the commands stay in the client's receive
+buffer (and TCP flow control slows the client down). For WebSocket and MQTT
+clients commands that arrive while the queue is full are dropped and answered
+with <X>.
+
+When all client slots are in use additional clients share a single slot (and
+its rate limit).
+
+**********************************************************************/
+
+struct CommandQueueClient {
+  bool inUse;
+  char name[16];
+  // available tokens in thousandths of a command
+  uint32_t tokens;
+  uint8_t head;
+  uint8_t count;
+  // set once the command at the head of the queue has waited for a token
+  bool headDelayed;
+  uint32_t processed;
+  uint32_t dropped;
+  uint32_t delayed;
+};
+
+CommandQueueClient commandQueueClients[COMMAND_QUEUE_MAX_CLIENTS];
+char commandQueueCommands[COMMAND_QUEUE_MAX_CLIENTS][COMMAND_QUEUE_DEPTH][COMMAND_QUEUE_MAX_LENGTH];
+portMUX_TYPE commandQueueMux = portMUX_INITIALIZER_UNLOCKED;
+
+// next client to be serviced by update
+uint8_t commandQueueNext = 0;
+uint32_t commandQueueLastRefill = 0;
+
+// totals for all clients, including those that have since disconnected
+uint32_t commandQueueProcessed = 0;
+uint32_t commandQueueDropped = 0;
+uint32_t commandQueueDelayed = 0;
+uint32_t commandQueueOversize = 0;
+
+void commandQueueResetClient(CommandQueueClient &client, const char *name) {
+  client.tokens = COMMAND_RATE_BURST * 1000;
+  client.head = 0;
+  client.count = 0;
+  client.headDelayed = false;
+  client.processed = 0;
+  client.dropped = 0;
+  client.delayed = 0;
+  strlcpy(client.name, name, sizeof(client.name));
+}
+
+void CommandQueue::init() {
+  memset(commandQueueClients, 0, sizeof(commandQueueClients));
+  commandQueueResetClient(commandQueueClients[COMMAND_QUEUE_SHARED_CLIENT], "shared");
+  commandQueueClients[COMMAND_QUEUE_SHARED_CLIENT].inUse = true;
+  commandQueueLastRefill = millis();
+  log_i("[CommandQueue] %d clients, %d commands/sec (burst %d) per client",
+    COMMAND_QUEUE_MAX_CLIENTS, COMMAND_RATE_LIMIT, COMMAND_RATE_BURST);
+}
+
+// allocates a queue for a new client, when all queues are in use the client
+// is given the shared queue.
+int8_t CommandQueue::registerClient(const char *type, int id) {
+  char name[16];
+  if(id >= 0) {
+    snprintf(name, sizeof(name), "%s:%d", type, id);
+  } else {
+    strlcpy(name, type, sizeof(name));
+  }
+  int8_t slot = COMMAND_QUEUE_SHARED_CLIENT;
+  portENTER_CRITICAL(&commandQueueMux);
+  for(uint8_t index = 0; index < COMMAND_QUEUE_MAX_CLIENTS; index++) {
+    if(!commandQueueClients[index].inUse) {
+      commandQueueResetClient(commandQueueClients[index], name);
+      commandQueueClients[index].inUse = true;
+      slot = index;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&commandQueueMux);
+  if(slot == COMMAND_QUEUE_SHARED_CLIENT) {
+    log_w("[CommandQueue] No queue available for %s, using the shared queue", name);
+  }
+  return slot;
+}
+
+// releases the queue of a disconnected client, any commands still pending
+// for the client are discarded.
+void CommandQueue::releaseClient(int8_t slot) {
+  if(slot <= COMMAND_QUEUE_SHARED_CLIENT || slot >= COMMAND_QUEUE_MAX_CLIENTS) {
+    return;
+  }
+  portENTER_CRITICAL(&commandQueueMux);
+  commandQueueClients[slot].inUse = false;
+  commandQueueClients[slot].count = 0;
+  portEXIT_CRITICAL(&commandQueueMux);
+}
+
+// adds a command (without the < >) to the queue of a client. When the queue is
+// full the command is dropped, or when dropWhenFull is false it is left with
+// the caller (COMMAND_QUEUE_FULL) to be offered again later. Oversize commands
+// are always dropped. This can be called from any task.
+COMMAND_QUEUE_RESULT CommandQueue::enqueue(int8_t slot, const char *command, bool dropWhenFull) {
+  if(slot < 0 || slot >= COMMAND_QUEUE_MAX_CLIENTS) {
+    slot = COMMAND_QUEUE_SHARED_CLIENT;
+  }
+  if(strlen(command) >= COMMAND_QUEUE_MAX_LENGTH) {
+    log_w("[CommandQueue] Dropping oversize command from %s", commandQueueClients[slot].name);
+    commandQueueOversize++;
+    wifiInterface.printf(F("<X>"));
+    return COMMAND_DROPPED;
+  }
+  COMMAND_QUEUE_RESULT result = COMMAND_QUEUED;
+  portENTER_CRITICAL(&commandQueueMux);
+  CommandQueueClient &client = commandQueueClients[slot];
+  if(client.count < COMMAND_QUEUE_DEPTH) {
+    strcpy(commandQueueCommands[slot][(client.head + client.count) % COMMAND_QUEUE_DEPTH], command);
+    client.count++;
+  } else if(dropWhenFull) {
+    client.dropped++;
+    commandQueueDropped++;
+    result = COMMAND_DROPPED;
+  } else {
+    result = COMMAND_QUEUE_FULL;
+  }
+  portEXIT_CRITICAL(&commandQueueMux);
+  if(result == COMMAND_DROPPED) {
+    wifiInterface.printf(F("<X>"));
+  }
+  return result;
+}
+
+void CommandQueue::update() {
+  // refill the token buckets for the time since the last refill
+  const uint32_t now = millis();
+  const uint32_t refill = (now - commandQueueLastRefill) * COMMAND_RATE_LIMIT;
+  commandQueueLastRefill = now;
+  portENTER_CRITICAL(&commandQueueMux);
+  for(uint8_t index = 0; index < COMMAND_QUEUE_MAX_CLIENTS; index++) {
+    CommandQueueClient &client = commandQueueClients[index];
+    client.tokens = min(client.tokens + refill, (uint32_t)COMMAND_RATE_BURST * 1000);
+  }
+  portEXIT_CRITICAL(&commandQueueMux);
+
+  // service the clients round-robin, one command per client per pass, until
+  // no client can send a command or the per update limit is reached.
+  char command[COMMAND_QUEUE_MAX_LENGTH];
+  uint8_t processed = 0;
+  bool progress = true;
+  while(progress && processed < COMMAND_QUEUE_MAX_PER_UPDATE) {
+    progress = false;
+    for(uint8_t pass = 0; pass < COMMAND_QUEUE_MAX_CLIENTS && processed < COMMAND_QUEUE_MAX_PER_UPDATE; pass++) {
+      const uint8_t slot = (commandQueueNext + pass) % COMMAND_QUEUE_MAX_CLIENTS;
+      bool ready = false;
+      portENTER_CRITICAL(&commandQueueMux);
+      CommandQueueClient &client = commandQueueClients[slot];
+      if(client.inUse && client.count) {
+        if(client.tokens >= 1000) {
+          client.tokens -= 1000;
+          strcpy(command, commandQueueCommands[slot][client.head]);
+          client.head = (client.head + 1) % COMMAND_QUEUE_DEPTH;
+          client.count--;
+          client.headDelayed = false;
+          client.processed++;
+          ready = true;
+        } else if(!client.headDelayed) {
+          client.headDelayed = true;
+          client.delayed++;
+          commandQueueDelayed++;
+        }
+      }
+      portEXIT_CRITICAL(&commandQueueMux);
+      if(ready) {
+        wifiInterface.printf(F("<%s>"), command);
+        log_d("Command: <%s>", command);
+        DCCPPProtocolHandler::process(command);
+        commandQueueProcessed++;
+        processed++;
+        progress = true;
+      }
+    }
+  }
+  // start the next update with the following client so the per update limit
+  // does not favour the lower numbered clients.
+  commandQueueNext = (commandQueueNext + 1) % COMMAND_QUEUE_MAX_CLIENTS;
+}
+
+void CommandQueue::getState(JsonObject &root) {
+  root[F("rateLimit")] = COMMAND_RATE_LIMIT;
+  root[F("burst")] = COMMAND_RATE_BURST;
+  root[F("depth")] = COMMAND_QUEUE_DEPTH;
+  root[F("processed")] = commandQueueProcessed;
+  root[F("dropped")] = commandQueueDropped;
+  root[F("delayed")] = commandQueueDelayed;
+  root[F("oversize")] = commandQueueOversize;
+  JsonArray &clients = root.createNestedArray(F("clients"));
+  for(uint8_t index = 0; index < COMMAND_QUEUE_MAX_CLIENTS; index++) {
+    CommandQueueClient client;
+    portENTER_CRITICAL(&commandQueueMux);
+    client = commandQueueClients[index];
+    portEXIT_CRITICAL(&commandQueueMux);
+    if(!client.inUse) {
+      continue;
+    }
+    JsonObject &clientNode = clients.createNestedObject();
+    clientNode[F("name")] = String(client.name);
+    clientNode[F("queued")] = client.count;
+    clientNode[F("tokens")] = client.tokens / 1000;
+    clientNode[F("processed")] = client.processed;
+    clientNode[F("dropped")] = client.dropped;
+    clientNode[F("delayed")] = client.delayed;
+  }
+}
@@ -0,0 +1,44 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _COMMAND_QUEUE_H_
+#define _COMMAND_QUEUE_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// queue slot shared by all clients that could not be given their own slot
+#define COMMAND_QUEUE_SHARED_CLIENT 0
+
+enum COMMAND_QUEUE_RESULT {
+  COMMAND_QUEUED,
+  COMMAND_DROPPED,
+  // the client queue is full and the command was left with the caller
+  COMMAND_QUEUE_FULL
+};
+
+class CommandQueue {
+public:
+  static void init();
+  static int8_t registerClient(const char *, int=-1);
+  static void releaseClient(int8_t);
+  static COMMAND_QUEUE_RESULT enqueue(int8_t, const char *, bool=true);
+  static void update();
+  static void getState(JsonObject &);
+};
+
+#endif
@@ -62,6 +62,20 @@ COPYRIGHT (c) 2017 Mike Dunston
 // PROG TRACK MOTORBOARD MOTOR_BOARD_TYPE
 #define MOTORBOARD_TYPE_PROG MOTOR_BOARD_TYPE::ARDUINO_SHIELD
 
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE ADDITIONAL BOOSTER DISTRICTS
+//
+// Each booster district receives a copy of the OPERATIONS track DCC signal on
+// its own signal pin and has its own motor board with enable pin and current
+// sense for independent power control and over current protection. Booster
+// districts do not require additional hardware timers. Each entry is:
+// {SIGNAL PIN, ENABLE PIN, CURRENT SENSE ADC1 CHANNEL, MOTOR BOARD TYPE, NAME}
+
+//#define BOOSTER_DISTRICTS \
+//  {21, 22, ADC1_CHANNEL_4, MOTOR_BOARD_TYPE::ARDUINO_SHIELD, "DISTRICT1"}, \
+//  {4, 13, ADC1_CHANNEL_5, MOTOR_BOARD_TYPE::ARDUINO_SHIELD, "DISTRICT2"}
+
 /////////////////////////////////////////////////////////////////////////////////////
 //
 // DEFINE WHICH PINS ARE USED FOR DCC SIGNAL GENERATION
@@ -71,6 +85,23 @@ COPYRIGHT (c) 2017 Mike Dunston
 // PROGRAMMING TRACK DCC SIGNAL PIN
 #define DCC_SIGNAL_PIN_PROGRAMMING 18
 
+// CPU core and interrupt level (1-3) used for the DCC signal timer interrupts,
+// by default level 3 interrupts on core 1 are used since the WiFi stack runs
+// on core 0. The <D JITTER> command reports the resulting edge latency.
+//#define DCC_SIGNAL_CORE 1
+//#define DCC_SIGNAL_INTERRUPT_LEVEL 3
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE USB SERIAL COMMAND INTERFACE Parameters
+//
+// When enabled DCC++ commands are also accepted on the USB serial port (for
+// example JMRI using a serial connection), responses are sent to both the WiFi
+// clients and the serial port.
+
+//#define SERIAL_INTERFACE_ENABLED true
+//#define SERIAL_INTERFACE_BAUD 115200
+
 /////////////////////////////////////////////////////////////////////////////////////
 //
 // DEFINE WiFi Parameters
@@ -110,6 +141,133 @@ COPYRIGHT (c) 2017 Mike Dunston
 // S88_MAX_SENSORS_PER_BUS is defined as 512.
 //#define S88_FIRST_SENSOR S88_MAX_SENSORS_PER_BUS
 
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE RAILCOM Parameters
+//
+// When enabled a RailCom cutout will be generated on the OPERATIONS track and
+// RailCom data from a detector connected to RAILCOM_UART_RX_PIN will be decoded.
+// The motor board must short the track outputs during the cutout, for motor
+// boards with a BRAKE input (LMD18200) define RAILCOM_BRAKE_PIN, otherwise the
+// MAIN track enable pin will be set LOW for the duration of the cutout.
+
+//#define RAILCOM_ENABLED true
+//#define RAILCOM_UART_RX_PIN 34
+//#define RAILCOM_BRAKE_PIN 26
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE Z21 LAN PROTOCOL SERVER Parameters
+//
+// When enabled the base station will accept Z21 LAN protocol requests on UDP
+// port 21105 from throttle apps such as the Roco Z21 app.
+
+//#define Z21_ENABLED true
+
+// Sensors are reported to Z21 clients as R-Bus feedback inputs starting with
+// this sensor ID (160 inputs are available).
+//#define Z21_RBUS_FIRST_SENSOR 0
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE MQTT Parameters
+//
+// When enabled the base station will publish sensor, turnout, output, power and
+// locomotive state to the MQTT broker as retained messages and accept commands
+// from it. MQTT_BROKER_HOST can be a hostname or IP address.
+
+//#define MQTT_ENABLED true
+//#define MQTT_BROKER_HOST "192.168.0.2"
+//#define MQTT_BROKER_PORT 1883
+//#define MQTT_TOPIC_PREFIX "dccpp"
+
+// MQTT_USERNAME and MQTT_PASSWORD are optional, when not defined the connection
+// will be anonymous.
+//#define MQTT_USERNAME ""
+//#define MQTT_PASSWORD ""
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE OpenLCB (LCC) Parameters
+//
+// When enabled the base station will connect to an OpenLCB hub using the
+// GridConnect TCP protocol and produce/consume events for sensors, turnouts and
+// outputs. LCC_NODE_ID should be a unique 48 bit node ID, when not defined one
+// will be generated in the 05.01.01.01.22.xx range.
+
+//#define LCC_ENABLED true
+//#define LCC_HUB_HOST "192.168.0.2"
+//#define LCC_HUB_PORT 12021
+//#define LCC_NODE_ID 0x050101012200
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE UDP MULTICAST Parameters
+//
+// When enabled the base station will send sensor, turnout, output and track
+// power state changes to a UDP multicast group for passive listeners such as
+// dispatch panels. MULTICAST_GROUP is the group address as four comma separated
+// octets.
+
+//#define MULTICAST_ENABLED true
+//#define MULTICAST_GROUP 239, 255, 21, 1
+//#define MULTICAST_PORT 21200
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE FEDERATION Parameters
+//
+// When enabled several base stations can be combined, the master handles all
+// client commands and streams the OPERATIONS track packets and track power
+// state to the nodes which act as remote boosters and report their sensors to
+// the master. Each node needs a unique FEDERATION_NODE_ID (1-255) and the
+// hostname or IP address of the master.
+
+//#define FEDERATION_ENABLED true
+//#define FEDERATION_ROLE FEDERATION_ROLE_MASTER
+//#define FEDERATION_ROLE FEDERATION_ROLE_NODE
+//#define FEDERATION_NODE_ID 1
+//#define FEDERATION_MASTER_HOST "192.168.0.115"
+//#define FEDERATION_PORT 21210
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE HOT RESTART Parameters
+//
+// When enabled the locomotive registers, functions and track power state are
+// kept in RTC memory and restored after a watchdog, panic, brownout or software
+// reset. With HOT_RESTART_SAFE_STOP the restored locomotives are stopped rather
+// than resuming their previous speed.
+
+//#define HOT_RESTART_ENABLED true
+//#define HOT_RESTART_SAFE_STOP true
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE STARTUP SYNC Parameters
+//
+// When enabled the stored turnout positions and output states are sent again,
+// one every STARTUP_SYNC_INTERVAL ms, once track power is turned on after
+// startup. Outputs that should be on stay off until they are synced.
+
+//#define STARTUP_SYNC_ENABLED true
+//#define STARTUP_SYNC_INTERVAL 100
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// DEFINE FAULT CAPTURE Parameters
+//
+// When enabled the current of each motor board is sampled every
+// FAULT_CAPTURE_SAMPLE_INTERVAL microseconds and the samples from before and
+// after an overcurrent trip are kept along with the last DCC packets sent to
+// the track. The captures are available from http://<station>/faults.
+
+//#define FAULT_CAPTURE_ENABLED true
+//#define FAULT_CAPTURE_SAMPLE_INTERVAL 2000
+//#define FAULT_CAPTURE_PRE_SAMPLES 100
+//#define FAULT_CAPTURE_POST_SAMPLES 100
+//#define FAULT_CAPTURE_EVENTS 4
+
 /////////////////////////////////////////////////////////////////////////////////////
 //
 // DEFINE INFO SCREEN Parameters
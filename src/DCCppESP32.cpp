@@ -103,6 +103,10 @@ DCC++ESP32 BASE STATION in split into multiple modules, each with its own header
   DCCppProtocol:    contains methods to read and interpret text commands,
 										process those instructions.
 
+  CommandQueue:     contains the per-client command queues which are rate
+										limited and serviced round-robin before the commands are
+										processed.
+
 	InfoScreen:       contains methods to display information on an OLED, LCD or
 										Serial display of status, etc.
 
@@ -121,6 +125,19 @@ DCC++ESP32 BASE STATION in split into multiple modules, each with its own header
 										optionally-defined sensors connected to various pins on the
 										ESP32.
 
+	ScratchArena:     contains the per-task bump allocator used for temporary
+										allocations while processing commands.
+
+	Scheduler:        contains the cooperative deadline scheduler that runs each
+										subsystem from loop() at its configured period.
+
+	StallWatchdog:    contains methods to detect and record stalls of the main
+										loop along with the subsystem and command that caused it.
+
+	StateObserver:    contains the observer interface used to notify additional
+										network interfaces of sensor, turnout, output, power and
+										locomotive state changes.
+
 	SignalGenerator:  contains methods to generate the DCC signal for PROGRAMMING
 										and OPERATIONS tracks, additional methods are present for
 										reading and writing CV values on both PROGRAMMING and
@@ -135,7 +152,40 @@ DCC++ESP32 BASE STATION in split into multiple modules, each with its own header
 										add/remove/update turnouts, sensors and output pins.
 
 	WebSocketClient:  contains adapter code for WebSockets used by the web based
-										throttle.
+										throttle, each client can subscribe to the topics
+										(throttle, sensors, power, programmer, accessories) it
+										wants to receive with <subscribe TOPIC ...>.
+
+  RailCom:          contains the RailCom datagram decoder and receiver for data
+										received during the OPERATIONS track RailCom cutout.
+
+  Z21Server:        contains the Roco Z21 LAN protocol (UDP) server.
+
+  MQTTInterface:    contains methods to publish layout state to an MQTT broker
+										and accept commands from it.
+
+  LCCInterface:     contains the OpenLCB (LCC) node that maps sensors, turnouts
+										and outputs onto events via an OpenLCB TCP hub.
+
+  MulticastBroadcaster: contains methods to send sequenced state changes to a UDP
+										multicast group for passive listeners.
+
+  SerialInterface:  contains the DCC++ command interface for the USB serial port.
+
+  HotRestart:       contains methods to checkpoint the locomotive and track
+										power state in RTC memory and restore it after an
+										unplanned reset.
+
+  FaultCapture:     contains methods to record the motor board current and the
+										last DCC packets around an overcurrent trip.
+
+  StartupSync:      contains methods to send the stored turnout positions and
+										output states again, paced, once track power is on after
+										startup.
+
+  Federation:       contains the master and node roles used to federate several
+										base stations, the master streams OPERATIONS track packets
+										to the nodes and the nodes report their sensors.
 
   WiFiInterface:		contains methods to connect the DCC++ESP32 BASE STATION to
 										a wireless access point and manages the WebServer and
@@ -154,13 +204,30 @@ present in DCCppESP32.cpp in the setup() method.
 #include "Sensors.h"
 #include "S88Sensors.h"
 #include "SignalGenerator.h"
+#include "Scheduler.h"
+#include "StallWatchdog.h"
+#include "Z21Server.h"
+#include "MQTTInterface.h"
+#include "LCCInterface.h"
+#include "MulticastBroadcaster.h"
+#include "Federation.h"
+#include "RailCom.h"
+#include "HotRestart.h"
+#include "SerialInterface.h"
+#include "CommandQueue.h"
+#include "StartupSync.h"
+#include "FaultCapture.h"
 
 const char * buildTime = __DATE__ " " __TIME__;
 Preferences configStore;
 WiFiInterface wifiInterface;
 
 void setup() {
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+	Serial.begin(SERIAL_INTERFACE_BAUD);
+#else
 	Serial.begin(115200L);
+#endif
 	log_i("DCC++ ESP starting up");
 	// set up ADC1 here since we use it for all motor boards
 	adc1_config_width(ADC_WIDTH_BIT_12);
@@ -168,12 +235,16 @@ void setup() {
 	// Initialize the Configuration storage
 	configStore.begin("DCCpp");
 
+	StallWatchdog::init();
+
 	InfoScreen::init();
 	InfoScreen::replaceLine(INFO_SCREEN_STATION_INFO_LINE, F("DCC++ESP: v%s"), VERSION);
 #if INFO_SCREEN_STATION_INFO_LINE == INFO_SCREEN_IP_ADDR_LINE
 	delay(250);
 #endif
+#if !defined(HOT_RESTART_ENABLED) || !HOT_RESTART_ENABLED
 	wifiInterface.begin();
+#endif
   MotorBoardManager::registerBoard(MOTORBOARD_CURRENT_SENSE_MAIN,
 		MOTORBOARD_ENABLE_PIN_MAIN, MOTORBOARD_TYPE_MAIN, MOTORBOARD_NAME_MAIN);
   MotorBoardManager::registerBoard(MOTORBOARD_CURRENT_SENSE_PROG,
@@ -182,23 +253,106 @@ void setup() {
 	InfoScreen::replaceLine(INFO_SCREEN_TRACK_POWER_LINE, F("TRACK POWER: OFF"));
 #endif
 	DCCPPProtocolHandler::init();
+	CommandQueue::init();
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+	SerialInterface::init();
+#endif
 	OutputManager::init();
 	TurnoutManager::init();
 	SensorManager::init();
 #if defined(S88_ENABLED) && S88_ENABLED
 	S88BusManager::init();
+#endif
+#if defined(STARTUP_SYNC_ENABLED) && STARTUP_SYNC_ENABLED
+	StartupSync::init();
+#endif
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+	RailComManager::init();
 #endif
 	configureDCCSignalGenerators();
+#if defined(BOOSTER_DISTRICTS)
+	const BoosterDistrict boosterDistricts[] = { BOOSTER_DISTRICTS };
+	for(const auto& district : boosterDistricts) {
+		MotorBoardManager::registerBoard(district.currentSense, district.enablePin,
+			district.type, district.name);
+		addDCCSignalBooster(district.signalPin, district.enablePin);
+	}
+#endif
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+	FaultCapture::init();
+#endif
+#if defined(HOT_RESTART_ENABLED) && HOT_RESTART_ENABLED
+	// the layout state is restored before connecting to WiFi so the locomotive
+	// packets are sent again straight away after an unplanned reset.
+	HotRestart::init();
+	wifiInterface.begin();
+#endif
+#if defined(Z21_ENABLED) && Z21_ENABLED
+	Z21Server::init();
+#endif
+#if defined(MQTT_ENABLED) && MQTT_ENABLED
+	MQTTInterface::init();
+#endif
+#if defined(LCC_ENABLED) && LCC_ENABLED
+	LCCInterface::init();
+#endif
+#if defined(MULTICAST_ENABLED) && MULTICAST_ENABLED
+	MulticastBroadcaster::init();
+#endif
+#if defined(FEDERATION_ENABLED) && FEDERATION_ENABLED
+	Federation::init();
+#endif
+#if defined(HOT_RESTART_ENABLED) && HOT_RESTART_ENABLED
+	// the interfaces above registered their observers after the restore, let
+	// them pick up the restored track power and locomotives.
+	HotRestart::announce();
+#endif
+
+	// register all periodic subsystems with the scheduler, the period and
+	// budget for each task are in microseconds.
+	Scheduler::registerTask("WiFi", []() { wifiInterface.update(); }, 5000, 2000);
+	Scheduler::registerTask("Commands", CommandQueue::update, 5000, 5000);
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+	Scheduler::registerTask("Serial", SerialInterface::update, 2000, 1000);
+#endif
+#if defined(Z21_ENABLED) && Z21_ENABLED
+	Scheduler::registerTask("Z21", Z21Server::update, 5000, 2000);
+#endif
+#if defined(MQTT_ENABLED) && MQTT_ENABLED
+	Scheduler::registerTask("MQTT", MQTTInterface::update, 10000, 5000);
+#endif
+#if defined(LCC_ENABLED) && LCC_ENABLED
+	Scheduler::registerTask("LCC", LCCInterface::update, 10000, 5000);
+#endif
+#if defined(MULTICAST_ENABLED) && MULTICAST_ENABLED
+	Scheduler::registerTask("Multicast", MulticastBroadcaster::update, 10000, 2000);
+#endif
+#if defined(FEDERATION_ENABLED) && FEDERATION_ENABLED
+	Scheduler::registerTask("Federation", Federation::update, 5000, 2000);
+#endif
+	Scheduler::registerTask("Loco", LocomotiveManager::update, 10000, 1000);
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+	Scheduler::registerTask("RailCom", RailComManager::update, 10000, 500);
+#endif
+#if defined(HOT_RESTART_ENABLED) && HOT_RESTART_ENABLED
+	Scheduler::registerTask("HotRestart", HotRestart::checkpoint, 100000, 500);
+#endif
+	Scheduler::registerTask("Sensors", SensorManager::check, 20000, 500);
+	Scheduler::registerTask("Turnouts", TurnoutManager::check, 50000, 500);
+#if defined(STARTUP_SYNC_ENABLED) && STARTUP_SYNC_ENABLED
+	Scheduler::registerTask("StartupSync", StartupSync::update,
+		STARTUP_SYNC_INTERVAL * 1000, 2000);
+#endif
+#if defined(S88_ENABLED) && S88_ENABLED
+	Scheduler::registerTask("S88", S88BusManager::update, 50000, 20000);
+#endif
+	Scheduler::registerTask("MotorBoards", MotorBoardManager::check,
+		motorBoardCheckInterval * 1000, 500);
+	Scheduler::registerTask("InfoScreen", InfoScreen::update, 100000, 10000);
+	Scheduler::registerTask("Jitter", checkDCCSignalJitter, 50000, 1000);
 	log_i("DCC++ READY!");
 }
 
 void loop() {
-	wifiInterface.update();
-	InfoScreen::update();
-	MotorBoardManager::check();
-	SensorManager::check();
-	#if defined(S88_ENABLED) && S88_ENABLED
-	S88BusManager::update();
-	#endif
-	LocomotiveManager::update();
+	Scheduler::run();
 }
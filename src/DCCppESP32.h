@@ -28,6 +28,37 @@ COPYRIGHT (c) 2017 Mike Dunston
 // Maximum clients connected to
 #define MAX_DCCPP_CLIENTS 10
 
+// Bytes buffered for each TCP client, no more data is read from a client while
+// its command queue is full and this many bytes are waiting.
+#define DCCPP_CLIENT_MAX_BUFFER 512
+
+// Size (in bytes) of the per-task scratch arena used for command processing
+// temporaries and the maximum number of tasks that can process commands. This
+// covers the loop, async_tcp, MQTTConnect, LCCConnect, RailCom and
+// StallWatchdog tasks with room to spare, any further task uses the heap.
+#define SCRATCH_ARENA_SIZE 1024
+#define SCRATCH_ARENA_MAX_TASKS 8
+
+// Time (in ms) a task can spend in a single subsystem or command before it is
+// recorded as a stall, how often the stall watchdog checks and how many stall
+// events are kept.
+#define STALL_WATCHDOG_THRESHOLD 100
+#define STALL_WATCHDOG_CHECK_INTERVAL 20
+#define STALL_WATCHDOG_HISTORY 8
+#define STALL_WATCHDOG_MAX_TASKS 4
+
+// Commands each client can send per second once it has used its burst of
+// commands, the commands that can be waiting for each client and the longest
+// command (without the < >) that can be queued. All clients beyond
+// COMMAND_QUEUE_MAX_CLIENTS share one queue. At most COMMAND_QUEUE_MAX_PER_UPDATE
+// commands are processed each time the queues are serviced.
+#define COMMAND_RATE_LIMIT 20
+#define COMMAND_RATE_BURST 10
+#define COMMAND_QUEUE_DEPTH 8
+#define COMMAND_QUEUE_MAX_LENGTH 80
+#define COMMAND_QUEUE_MAX_CLIENTS 16
+#define COMMAND_QUEUE_MAX_PER_UPDATE 8
+
 /////////////////////////////////////////////////////////////////////////////////////
 // S88 Timing values (in microseconds)
 /////////////////////////////////////////////////////////////////////////////////////
@@ -24,6 +24,8 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include "Outputs.h"
 #include "Sensors.h"
 #include "S88Sensors.h"
+#include "StallWatchdog.h"
+#include "RailCom.h"
 
 LinkedList<DCCPPProtocolCommand *> registeredCommands([](DCCPPProtocolCommand *command) {delete command; });
 
@@ -32,7 +34,7 @@ LinkedList<DCCPPProtocolCommand *> registeredCommands([](DCCPPProtocolCommand *c
 // will need to be reconfigured after sending this command.
 class ConfigErase : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     stopDCCSignalGenerators();
     configStore.clear();
     TurnoutManager::clear();
@@ -44,7 +46,7 @@ public:
     wifiInterface.printf(F("<O>"));
     startDCCSignalGenerators();
   }
-  String getID() {
+  const char *getID() {
     return "e";
   }
 };
@@ -54,7 +56,7 @@ public:
 // subsequent startups.
 class ConfigStore : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     stopDCCSignalGenerators();
 #if defined(S88_ENABLED) && S88_ENABLED
     wifiInterface.printf(F("<e %d %d %d %d>"),
@@ -70,7 +72,7 @@ public:
 #endif
     startDCCSignalGenerators();
   }
-  String getID() {
+  const char *getID() {
     return "E";
   }
 };
@@ -80,7 +82,7 @@ public:
 // the actual CV value or -1 when there is a failure reading or verifying the CV.
 class ReadCVCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     int cvNumber = arguments[0].toInt();
     wifiInterface.printf(F("<r%d|%d|%d %d>"),
       arguments[1].toInt(),
@@ -89,7 +91,7 @@ public:
       readCV(cvNumber));
   }
 
-  String getID() {
+  const char *getID() {
     return "R";
   }
 };
@@ -100,7 +102,7 @@ public:
 // verifying the CV value.
 class WriteCVByteProgCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     int cvNumber = arguments[0].toInt();
     uint8_t cvValue = arguments[1].toInt();
     if(!writeProgCVByte(cvNumber, cvValue)) {
@@ -113,7 +115,7 @@ public:
       cvValue);
   }
 
-  String getID() {
+  const char *getID() {
     return "W";
   }
 };
@@ -124,7 +126,7 @@ public:
 // there is a failure writing or verifying the CV value.
 class WriteCVBitProgCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     int cvNumber = arguments[0].toInt();
     uint8_t bit = arguments[1].toInt();
     int8_t bitValue = arguments[1].toInt();
@@ -139,7 +141,7 @@ public:
       bitValue);
   }
 
-  String getID() {
+  const char *getID() {
     return "B";
   }
 };
@@ -148,13 +150,13 @@ public:
 // on the MAIN OPERATIONS track for a given LOCO. No verification is attempted.
 class WriteCVByteOpsCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     writeOpsCVByte(arguments[1].toInt(),
       arguments[1].toInt(),
       arguments[2].toInt());
   }
 
-  String getID() {
+  const char *getID() {
     return "w";
   }
 };
@@ -164,24 +166,49 @@ public:
 // is attempted.
 class WriteCVBitOpsCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     writeOpsCVBit(arguments[1].toInt(),
       arguments[1].toInt(),
       arguments[2].toInt(),
       arguments[3].toInt() == 1);
   }
 
-  String getID() {
+  const char *getID() {
     return "b";
   }
 };
 
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+// <r {LOCO} {CV}> command handler, this command reads a CV from a LOCO on the
+// MAIN OPERATIONS track using a RailCom POM reply. The reply is sent once the
+// POM reply has been received, the returned value will be the CV value or -1
+// when the locomotive did not reply or another read is still pending.
+class ReadCVOpsCommand : public DCCPPProtocolCommand {
+public:
+  void process(const DCCPPProtocolArguments &arguments) {
+    if(arguments.size() != 2) {
+      wifiInterface.printf(F("<X>"));
+      return;
+    }
+    int locoNumber = arguments[0].toInt();
+    int cvNumber = arguments[1].toInt();
+    if(!readOpsCV(locoNumber, cvNumber)) {
+      wifiInterface.printf(F("<r %d %d -1>"), locoNumber, cvNumber);
+    }
+  }
+
+  const char *getID() {
+    return "r";
+  }
+};
+#endif
+
 // <s> command handler, this command sends the current status for all parts of
 // the DCC++ESP32 BASE STATION. JMRI uses this command as a keep-alive heartbeat
 // command.
 class StatusCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     wifiInterface.printf(F("<iDCC++ BASE STATION FOR ESP32: V-%s / %s %s>"), VERSION, __DATE__, __TIME__);
     MotorBoardManager::showStatus();
     LocomotiveManager::showStatus();
@@ -190,14 +217,42 @@ public:
     wifiInterface.showInitInfo();
   }
 
-  String getID() {
+  const char *getID() {
     return "s";
   }
 };
 
+// <D {SUBCOMMAND}> command handler, this command provides diagnostic information
+// about the DCC++ESP32 BASE STATION.
+//    <D STALLS>: returns <D STALLS COUNT> followed by
+//                <D STALL TIMESTAMP DURATION TASK SUBSYSTEM COMMAND> for each
+//                recently recorded main loop or task stall.
+//    <D JITTER {DURATION}>: measures the DCC signal edge latency for DURATION
+//                ms (default 1000, max 10000), when the measurement completes
+//                <D JITTER NAME EDGES AVG MAX HISTOGRAM...> is sent for each
+//                signal.
+class DiagnosticsCommand : public DCCPPProtocolCommand {
+public:
+  void process(const DCCPPProtocolArguments &arguments) {
+    if(arguments.size() == 1 && arguments[0].equalsIgnoreCase("STALLS")) {
+      StallWatchdog::showStatus();
+    } else if(arguments.size() >= 1 && arguments.size() <= 2 && arguments[0].equalsIgnoreCase("JITTER")) {
+      uint32_t duration = arguments.size() == 2 ? arguments[1].toInt() : 1000;
+      showDCCSignalJitter(constrain(duration, 1, 10000));
+    } else {
+      wifiInterface.printf(F("<X>"));
+    }
+  }
+
+  const char *getID() {
+    return "D";
+  }
+};
+
 void DCCPPProtocolHandler::init() {
   registerCommand(new ThrottleCommandAdapter());
   registerCommand(new FunctionCommandAdapter());
+  registerCommand(new AddressFunctionCommandAdapter());
   registerCommand(new AccessoryCommand());
   registerCommand(new PowerOnCommand());
   registerCommand(new PowerOffCommand());
@@ -208,64 +263,75 @@ void DCCPPProtocolHandler::init() {
   registerCommand(new WriteCVBitProgCommand());
   registerCommand(new WriteCVByteOpsCommand());
   registerCommand(new WriteCVBitOpsCommand());
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  registerCommand(new ReadCVOpsCommand());
+#endif
   registerCommand(new ConfigErase());
   registerCommand(new ConfigStore());
+  registerCommand(new DiagnosticsCommand());
   registerCommand(new OutputCommandAdapter());
   registerCommand(new TurnoutCommandAdapter());
   registerCommand(new SensorCommandAdapter());
+  registerCommand(new SensorEventsCommand());
+  registerCommand(new SensorBitmapCommand());
 #if defined(S88_ENABLED) && S88_ENABLED
   registerCommand(new S88BusCommandAdapter());
 #endif
 }
 
-void DCCPPProtocolHandler::process(const String commandString) {
-  std::vector<String> parts;
-  if(commandString.indexOf(' ') > 0) {
-    int index = 0;
-    while(index < commandString.length()) {
-      int previousIndex = index;
-      index = commandString.indexOf(' ', previousIndex);
-      if(index < 0) {
-        index = commandString.length();
-      }
-      parts.push_back(commandString.substring(previousIndex, index));
-      // move past the space
-      index++;
-    }
-  } else {
-    parts.push_back(commandString);
+void DCCPPProtocolHandler::process(const char *commandString) {
+  // all temporaries for this command are released when the scope ends, it
+  // must be declared before anything that is allocated from the arena.
+  ScratchArenaScope scratchScope;
+  StallWatchdogScope watchdogScope("Protocol", commandString);
+  // tokenize a scratch copy of the command in place
+  size_t commandLength = strlen(commandString);
+  char *commandBuffer = (char *)ScratchArena::current().allocate(commandLength + 1);
+  memcpy(commandBuffer, commandString, commandLength + 1);
+  DCCPPProtocolArguments parts;
+  parts.reserve(6);
+  char *tokenState = NULL;
+  char *token = strtok_r(commandBuffer, " ", &tokenState);
+  if(token == NULL) {
+    log_e("Empty command received");
+    wifiInterface.printf(F("<X>"));
+    ScratchArena::current().deallocate(commandBuffer);
+    return;
+  }
+  const char *commandID = token;
+  while((token = strtok_r(NULL, " ", &tokenState)) != NULL) {
+    parts.emplace_back(token);
   }
-  String commandID = parts.front();
-  parts.erase(parts.begin());
-  //log_i("Command: %s, argument count: %d", commandID.c_str(), parts.size());
+  //log_i("Command: %s, argument count: %d", commandID, parts.size());
   bool processed = false;
   for (const auto& command : registeredCommands) {
-    if(commandID == command->getID()) {
+    if(!strcmp(command->getID(), commandID)) {
       command->process(parts);
       processed = true;
     }
   }
   if(!processed) {
-    log_e("No command handler for [%s]", commandID.c_str());
+    log_e("No command handler for [%s]", commandID);
     wifiInterface.printf(F("<X>"));
   }
+  ScratchArena::current().deallocate(commandBuffer);
 }
 
 void DCCPPProtocolHandler::registerCommand(DCCPPProtocolCommand *cmd) {
   for (const auto& command : registeredCommands) {
-		if(command->getID() == cmd->getID()) {
+		if(!strcmp(command->getID(), cmd->getID())) {
       log_e("Ignoring attempt to register second command with ID: %s",
-        cmd->getID().c_str());
+        cmd->getID());
       return;
     }
 	}
-  log_v("Registering interface command %s", cmd->getID().c_str());
+  log_v("Registering interface command %s", cmd->getID());
   registeredCommands.add(cmd);
 }
 
-DCCPPProtocolCommand *DCCPPProtocolHandler::getCommandHandler(const String id) {
+DCCPPProtocolCommand *DCCPPProtocolHandler::getCommandHandler(const char *id) {
   for (const auto& command : registeredCommands) {
-    if(command->getID() == id) {
+    if(!strcmp(command->getID(), id)) {
       return command;
     }
   }
@@ -19,22 +19,47 @@ COPYRIGHT (c) 2017 Mike Dunston
 #define _DCCPP_PROTOCOL_H_
 
 #include <vector>
+#include <stdlib.h>
+#include <string.h>
 #include <WString.h>
+#include "ScratchArena.h"
+
+// A single command argument, this refers to the token in the scratch copy of
+// the command and is only valid while the command is being processed.
+class DCCPPProtocolArgument {
+public:
+  DCCPPProtocolArgument(const char *value) : _value(value) {}
+  long toInt() const {
+    return atol(_value);
+  }
+  const char *c_str() const {
+    return _value;
+  }
+  bool equalsIgnoreCase(const char *value) const {
+    return !strcasecmp(_value, value);
+  }
+private:
+  const char *_value;
+};
+
+// Command arguments are parsed into the calling task's scratch arena which is
+// rewound once the command has been processed.
+typedef std::vector<DCCPPProtocolArgument, ScratchAllocator<DCCPPProtocolArgument> > DCCPPProtocolArguments;
 
 // Class definition for a single protocol command
 class DCCPPProtocolCommand {
 public:
-  virtual void process(const std::vector<String>) = 0;
-  virtual String getID() = 0;
+  virtual void process(const DCCPPProtocolArguments &) = 0;
+  virtual const char *getID() = 0;
 };
 
 // Class definition for the Protocol Interpreter
 class DCCPPProtocolHandler {
 public:
   static void init();
-  static void process(const String);
+  static void process(const char *);
   static void registerCommand(DCCPPProtocolCommand *);
-  static DCCPPProtocolCommand *getCommandHandler(const String);
+  static DCCPPProtocolCommand *getCommandHandler(const char *);
 };
 
 #endif
@@ -0,0 +1,240 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <esp_timer.h>
+
+#include "FaultCapture.h"
+#include "MotorBoard.h"
+#include "SignalGenerator.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can record the current drawn by each motor board around
+an overcurrent trip. The current of every powered motor board is sampled every
+FAULT_CAPTURE_SAMPLE_INTERVAL microseconds into a ring buffer and the first
+sample over the motor board trip current is remembered as the fault onset.
+When the motor board check trips, the capture is stored once
+FAULT_CAPTURE_POST_SAMPLES samples from the onset have been collected, along
+with the FAULT_CAPTURE_PRE_SAMPLES before the onset and the last packets queued
+for the track the motor board is powering.
+
+The waveform tells apart a hard short (derailment, a wheel across a gap) where
+the current jumps to the limit, and the inrush of a sound decoder which rises
+and decays over a few milliseconds. The last FAULT_CAPTURE_EVENTS captures are
+available from the /faults endpoint of the web server.
+
+NOTE: the motor board check only runs every motorBoardCheckInterval ms so the
+onset may be up to that long before the trip, the ring buffer holds enough
+samples to cover this. An onset that has not led to a trip within that time
+was a transient and is forgotten.
+
+**********************************************************************/
+
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+
+// samples between the fault onset and the motor board check noticing it, this
+// allows for the check running up to one interval late.
+#define FAULT_CAPTURE_ONSET_SAMPLES (((2 * motorBoardCheckInterval * 1000UL) / FAULT_CAPTURE_SAMPLE_INTERVAL) + 1)
+#define FAULT_CAPTURE_RING_SAMPLES (FAULT_CAPTURE_SAMPLES + FAULT_CAPTURE_ONSET_SAMPLES + 1)
+
+struct FaultCaptureChannel {
+  GenericMotorBoard *board;
+  adc1_channel_t senseChannel;
+  uint16_t triggerValue;
+  // the DCC signal the motor board is powering
+  uint8_t signal;
+  uint16_t samples[FAULT_CAPTURE_RING_SAMPLES];
+  uint16_t head;
+  // ring index of the first sample over the trigger value and the number of
+  // samples taken since, onsetAge is -1 when there is no onset.
+  uint16_t onset;
+  int16_t onsetAge;
+  // event being captured for this board, -1 when not capturing
+  int8_t event;
+  uint32_t sequence;
+  uint16_t postRemaining;
+};
+
+FaultCaptureChannel faultCaptureChannels[FAULT_CAPTURE_MAX_BOARDS];
+uint8_t faultCaptureChannelCount = 0;
+FaultCaptureEvent faultCaptureEvents[FAULT_CAPTURE_EVENTS];
+uint8_t faultCaptureNextEvent = 0;
+uint32_t faultCaptureSequence = 0;
+portMUX_TYPE faultCaptureMux = portMUX_INITIALIZER_UNLOCKED;
+esp_timer_handle_t faultCaptureTimer = NULL;
+
+// runs from the esp_timer task every FAULT_CAPTURE_SAMPLE_INTERVAL
+void faultCaptureTimerTick(void *arg) {
+  for(uint8_t index = 0; index < faultCaptureChannelCount; index++) {
+    FaultCaptureChannel &channel = faultCaptureChannels[index];
+    const bool on = channel.board->isOn();
+    uint16_t reading = 0;
+    if(on || channel.event >= 0) {
+      reading = adc1_get_raw(channel.senseChannel);
+    }
+    portENTER_CRITICAL(&faultCaptureMux);
+    const uint16_t sampleIndex = channel.head;
+    channel.samples[sampleIndex] = reading;
+    channel.head = (channel.head + 1) % FAULT_CAPTURE_RING_SAMPLES;
+    if(channel.onsetAge >= 0) {
+      channel.onsetAge++;
+      if(channel.event < 0 && channel.onsetAge > (int16_t)FAULT_CAPTURE_ONSET_SAMPLES) {
+        // the motor board did not trip, this was a transient
+        channel.onsetAge = -1;
+      }
+    }
+    if(channel.onsetAge < 0 && channel.event < 0 && on && reading >= channel.triggerValue) {
+      channel.onset = sampleIndex;
+      channel.onsetAge = 0;
+    }
+    if(channel.event >= 0 && --channel.postRemaining == 0) {
+      // the ring now holds the samples from before and after the onset
+      FaultCaptureEvent &event = faultCaptureEvents[channel.event];
+      if(event.sequence == channel.sequence) {
+        const uint16_t first = (channel.onset + FAULT_CAPTURE_RING_SAMPLES - FAULT_CAPTURE_PRE_SAMPLES) %
+          FAULT_CAPTURE_RING_SAMPLES;
+        for(uint16_t sample = 0; sample < FAULT_CAPTURE_SAMPLES; sample++) {
+          event.samples[sample] = channel.samples[(first + sample) % FAULT_CAPTURE_RING_SAMPLES];
+        }
+        event.complete = true;
+      }
+      channel.event = -1;
+      channel.onsetAge = -1;
+    }
+    portEXIT_CRITICAL(&faultCaptureMux);
+  }
+}
+
+// must be called after all motor boards have been registered
+void FaultCapture::init() {
+  memset(faultCaptureEvents, 0, sizeof(faultCaptureEvents));
+  for (const auto& name : MotorBoardManager::getBoardNames()) {
+    if(faultCaptureChannelCount == FAULT_CAPTURE_MAX_BOARDS) {
+      log_w("[FaultCapture] Only the first %d motor boards are captured", FAULT_CAPTURE_MAX_BOARDS);
+      break;
+    }
+    FaultCaptureChannel &channel = faultCaptureChannels[faultCaptureChannelCount++];
+    memset(&channel, 0, sizeof(FaultCaptureChannel));
+    channel.board = MotorBoardManager::getBoardByName(name);
+    channel.senseChannel = channel.board->getADC1Channel();
+    channel.triggerValue = channel.board->getTriggerValue();
+    channel.onsetAge = -1;
+    channel.signal = name == MOTORBOARD_NAME_PROG ? DCC_SIGNAL_PROGRAMMING : DCC_SIGNAL_OPERATIONS;
+    channel.event = -1;
+  }
+  esp_timer_create_args_t timerArgs;
+  memset(&timerArgs, 0, sizeof(esp_timer_create_args_t));
+  timerArgs.callback = faultCaptureTimerTick;
+  timerArgs.name = "FaultCapture";
+  esp_timer_create(&timerArgs, &faultCaptureTimer);
+  esp_timer_start_periodic(faultCaptureTimer, FAULT_CAPTURE_SAMPLE_INTERVAL);
+  log_i("[FaultCapture] Sampling %d motor boards every %dus, %d samples per capture",
+    faultCaptureChannelCount, FAULT_CAPTURE_SAMPLE_INTERVAL, FAULT_CAPTURE_SAMPLES);
+}
+
+// starts a capture for the motor board, called by GenericMotorBoard::check
+// when the motor board trips.
+void FaultCapture::trigger(GenericMotorBoard *board) {
+  FaultCaptureChannel *channel = NULL;
+  uint8_t boardIndex = 0;
+  for(; boardIndex < faultCaptureChannelCount; boardIndex++) {
+    if(faultCaptureChannels[boardIndex].board == board) {
+      channel = &faultCaptureChannels[boardIndex];
+      break;
+    }
+  }
+  if(channel == NULL) {
+    return;
+  }
+  RecentPacket packets[DCC_RECENT_PACKETS];
+  const uint8_t packetCount = dccSignal[channel->signal].getRecentPackets(packets);
+  bool started = false;
+  portENTER_CRITICAL(&faultCaptureMux);
+  if(channel->event < 0) {
+    FaultCaptureEvent &event = faultCaptureEvents[faultCaptureNextEvent];
+    event.sequence = ++faultCaptureSequence;
+    event.time = millis();
+    event.board = boardIndex;
+    event.tripReading = board->getLastRead();
+    event.complete = false;
+    event.packetCount = packetCount;
+    memcpy(event.packets, packets, sizeof(RecentPacket) * packetCount);
+    channel->sequence = event.sequence;
+    if(channel->onsetAge < 0) {
+      // the trip reading was not seen by the sampling, use the latest sample
+      channel->onset = (channel->head + FAULT_CAPTURE_RING_SAMPLES - 1) % FAULT_CAPTURE_RING_SAMPLES;
+      channel->onsetAge = 0;
+    }
+    event.tripSample = FAULT_CAPTURE_PRE_SAMPLES + channel->onsetAge;
+    // collect the rest of the samples after the onset, the capture is stored
+    // by the next sample when they have all been taken already.
+    channel->postRemaining = max(FAULT_CAPTURE_POST_SAMPLES - channel->onsetAge - 1, 1);
+    channel->event = faultCaptureNextEvent;
+    faultCaptureNextEvent = (faultCaptureNextEvent + 1) % FAULT_CAPTURE_EVENTS;
+    started = true;
+  }
+  portEXIT_CRITICAL(&faultCaptureMux);
+  if(started) {
+    log_i("[FaultCapture] Capturing fault %d on %s", faultCaptureSequence, board->getName().c_str());
+  }
+}
+
+// adds the completed captures to the array, newest first. Currents are in mA
+// and the packet offsets are in ms relative to the trip.
+void FaultCapture::getState(JsonArray &array) {
+  FaultCaptureEvent *event = new FaultCaptureEvent();
+  for(uint8_t age = 1; age <= FAULT_CAPTURE_EVENTS; age++) {
+    portENTER_CRITICAL(&faultCaptureMux);
+    *event = faultCaptureEvents[(faultCaptureNextEvent + FAULT_CAPTURE_EVENTS - age) % FAULT_CAPTURE_EVENTS];
+    portEXIT_CRITICAL(&faultCaptureMux);
+    if(!event->complete) {
+      continue;
+    }
+    GenericMotorBoard *board = faultCaptureChannels[event->board].board;
+    const uint32_t maxMilliAmps = board->getMaxMilliAmps();
+    JsonObject &node = array.createNestedObject();
+    node[F("sequence")] = event->sequence;
+    node[F("board")] = board->getName();
+    node[F("time")] = event->time;
+    node[F("age")] = millis() - event->time;
+    node[F("tripCurrent")] = (event->tripReading * maxMilliAmps) / 4096;
+    node[F("sampleInterval")] = FAULT_CAPTURE_SAMPLE_INTERVAL;
+    node[F("preTrigger")] = FAULT_CAPTURE_PRE_SAMPLES;
+    node[F("tripSample")] = event->tripSample;
+    JsonArray &samples = node.createNestedArray(F("samples"));
+    for(uint16_t sample = 0; sample < FAULT_CAPTURE_SAMPLES; sample++) {
+      samples.add((event->samples[sample] * maxMilliAmps) / 4096);
+    }
+    JsonArray &packets = node.createNestedArray(F("packets"));
+    for(uint8_t index = 0; index < event->packetCount; index++) {
+      const RecentPacket &packet = event->packets[index];
+      JsonObject &packetNode = packets.createNestedObject();
+      packetNode[F("offset")] = (int32_t)(packet.time - event->time);
+      packetNode[F("repeats")] = packet.repeats;
+      String packetHex = "";
+      for(uint8_t byte = 0; byte < packet.length; byte++) {
+        char hex[4];
+        snprintf(hex, sizeof(hex), byte ? " %02X" : "%02X", packet.data[byte]);
+        packetHex += hex;
+      }
+      packetNode[F("data")] = packetHex;
+    }
+  }
+  delete event;
+}
+#endif
@@ -0,0 +1,72 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _FAULT_CAPTURE_H_
+#define _FAULT_CAPTURE_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "SignalGenerator.h"
+
+// time (in microseconds) between current samples
+#ifndef FAULT_CAPTURE_SAMPLE_INTERVAL
+#define FAULT_CAPTURE_SAMPLE_INTERVAL 2000
+#endif
+// samples kept from before and collected after the start of an overcurrent
+// fault, with the default sample interval this is 200ms on either side of the
+// first sample over the motor board trip current.
+#ifndef FAULT_CAPTURE_PRE_SAMPLES
+#define FAULT_CAPTURE_PRE_SAMPLES 100
+#endif
+#ifndef FAULT_CAPTURE_POST_SAMPLES
+#define FAULT_CAPTURE_POST_SAMPLES 100
+#endif
+// number of fault captures kept, the oldest is replaced by a new fault
+#ifndef FAULT_CAPTURE_EVENTS
+#define FAULT_CAPTURE_EVENTS 4
+#endif
+// number of motor boards that are sampled
+#define FAULT_CAPTURE_MAX_BOARDS 4
+
+#define FAULT_CAPTURE_SAMPLES (FAULT_CAPTURE_PRE_SAMPLES + FAULT_CAPTURE_POST_SAMPLES)
+
+class GenericMotorBoard;
+
+struct FaultCaptureEvent {
+  uint32_t sequence;
+  // millis() when the trip was detected
+  uint32_t time;
+  uint8_t board;
+  uint16_t tripReading;
+  // index of the sample taken when the trip was detected, the fault onset is
+  // at FAULT_CAPTURE_PRE_SAMPLES. This is beyond the last sample when the
+  // trip was detected more than FAULT_CAPTURE_POST_SAMPLES after the onset.
+  uint16_t tripSample;
+  bool complete;
+  uint16_t samples[FAULT_CAPTURE_SAMPLES];
+  uint8_t packetCount;
+  RecentPacket packets[DCC_RECENT_PACKETS];
+};
+
+class FaultCapture {
+public:
+  static void init();
+  static void trigger(GenericMotorBoard *);
+  static void getState(JsonArray &);
+};
+
+#endif
@@ -0,0 +1,600 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+#include "Federation.h"
+#include "StateObserver.h"
+#include "MotorBoard.h"
+#include "SignalGenerator.h"
+#include "Sensors.h"
+
+/**********************************************************************
+
+Several DCC++ESP32 BASE STATIONs can be federated to control a larger layout.
+One station is the command master, it handles all throttle, turnout and output
+commands from clients and generates the DCC packets for the OPERATIONS track.
+The other stations are nodes that act as remote boosters and sensor inputs:
+
+  * every packet loaded for the OPERATIONS track on the master is streamed to
+    all nodes which load it into their own OPERATIONS track signal with the
+    same number of repeats.
+  * the track power state of the master's MAIN motor board is sent to all
+    nodes which turn all of their motor boards on or off to match. A node
+    turns off its track power when it has not heard from the master for
+    FEDERATION_TIMEOUT ms.
+  * sensor changes on a node are reported to the master where they appear as
+    sensors with pin -2. Sensor IDs must be unique across all stations.
+  * the master sends a latency ping to each node every
+    FEDERATION_HEARTBEAT_INTERVAL ms, the round trip times are reported as
+    part of /espinfo.
+
+All datagrams are sent via UDP and start with a 14 byte header (multi-byte
+values little endian):
+
+  0-1:   'D' 'F'
+  2:     version (1)
+  3:     kind
+  4:     node ID of the sender (0 for the master)
+  5:     number of records
+  6-9:   sequence number
+  10-13: timestamp (sender micros)
+
+followed by the records for the datagram kind:
+
+  1 HELLO (node to master):    one record, the node power state (0 = off,
+                               1 = on, 2 = off due to over current). Sent
+                               every FEDERATION_HEARTBEAT_INTERVAL ms.
+  2 PACKETS (master to node):  records of REPEATS, LENGTH, LENGTH packet bytes
+                               (without checksum). The sequence number is
+                               incremented for every PACKETS datagram so nodes
+                               can count missed datagrams.
+  3 SENSORS (node to master):  3 byte records of sensor ID (2 bytes), STATE.
+  4 POWER (master to node):    one record, 1 = track power on, 0 = off.
+  5 PING (master to node):     one record, track power state as in POWER.
+  6 PONG (node to master):     no records, the timestamp of the PING is echoed
+                               back.
+
+The master listens on FEDERATION_PORT, each node listens on FEDERATION_PORT +
+FEDERATION_NODE_ID so a master and nodes can share a single host (localhost).
+When a node connects (or reconnects) to the master it sends the state of all
+of its sensors.
+
+**********************************************************************/
+
+#if defined(FEDERATION_ENABLED) && FEDERATION_ENABLED
+
+#ifndef FEDERATION_ROLE
+#define FEDERATION_ROLE FEDERATION_ROLE_MASTER
+#endif
+
+#ifndef FEDERATION_PORT
+#define FEDERATION_PORT 21210
+#endif
+
+#if FEDERATION_ROLE == FEDERATION_ROLE_MASTER
+#undef FEDERATION_NODE_ID
+#define FEDERATION_NODE_ID 0
+#elif !defined(FEDERATION_NODE_ID)
+#define FEDERATION_NODE_ID 1
+#endif
+
+#ifndef FEDERATION_MASTER_HOST
+#define FEDERATION_MASTER_HOST "127.0.0.1"
+#endif
+
+#define FEDERATION_PROTOCOL_VERSION 1
+
+extern LinkedList<Sensor *> sensors;
+
+WiFiUDP federationSocket;
+uint32_t federationSequence = 0;
+uint32_t federationDatagramsSent = 0;
+uint32_t federationDatagramsReceived = 0;
+uint32_t federationInvalidDatagrams = 0;
+uint32_t federationLastHeartbeat = 0;
+
+void federationWrite32(uint8_t *buffer, uint32_t value) {
+  for(uint8_t index = 0; index < 4; index++) {
+    buffer[index] = (value >> (index * 8)) & 0xFF;
+  }
+}
+
+uint32_t federationRead32(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
+}
+
+void federationBuildHeader(uint8_t *datagram, uint8_t kind, uint8_t count, uint32_t sequence,
+  uint32_t timestamp) {
+  datagram[0] = 'D';
+  datagram[1] = 'F';
+  datagram[2] = FEDERATION_PROTOCOL_VERSION;
+  datagram[3] = kind;
+  datagram[4] = FEDERATION_NODE_ID;
+  datagram[5] = count;
+  federationWrite32(&datagram[6], sequence);
+  federationWrite32(&datagram[10], timestamp);
+}
+
+void federationSend(const IPAddress &address, uint16_t port, const uint8_t *datagram, uint16_t length) {
+  federationSocket.beginPacket(address, port);
+  federationSocket.write(datagram, length);
+  federationSocket.endPacket();
+  federationDatagramsSent++;
+}
+
+#if FEDERATION_ROLE == FEDERATION_ROLE_MASTER
+
+FederationNode federationNodes[FEDERATION_MAX_NODES];
+
+// packets loaded for the OPERATIONS track that have not been sent to the nodes
+// yet, these are added by the signal generator from any task.
+uint8_t federationPendingPackets[FEDERATION_MAX_DATAGRAM];
+uint16_t federationPendingLength = FEDERATION_HEADER_SIZE;
+uint8_t federationPendingCount = 0;
+uint32_t federationPacketsForwarded = 0;
+uint32_t federationOverflows = 0;
+portMUX_TYPE federationPendingMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint8_t federationPowerState = 0;
+volatile bool federationPowerChanged = false;
+
+void federationSendToNodes(const uint8_t *datagram, uint16_t length) {
+  for(uint8_t index = 0; index < FEDERATION_MAX_NODES; index++) {
+    if(federationNodes[index].active) {
+      federationSend(federationNodes[index].address, federationNodes[index].port, datagram, length);
+    }
+  }
+}
+
+void federationSendPower(FederationNode *node, uint8_t kind) {
+  uint8_t datagram[FEDERATION_HEADER_SIZE + 1];
+  federationBuildHeader(datagram, kind, 1, federationSequence, micros());
+  datagram[FEDERATION_HEADER_SIZE] = federationPowerState;
+  if(node) {
+    if(kind == FEDERATION_KIND_PING) {
+      node->pingsSent++;
+    }
+    federationSend(node->address, node->port, datagram, sizeof(datagram));
+  } else {
+    federationSendToNodes(datagram, sizeof(datagram));
+  }
+}
+
+void federationFlushPackets() {
+  uint8_t datagram[FEDERATION_MAX_DATAGRAM];
+  portENTER_CRITICAL(&federationPendingMux);
+  uint16_t length = federationPendingLength;
+  uint8_t count = federationPendingCount;
+  memcpy(datagram, federationPendingPackets, length);
+  federationPendingLength = FEDERATION_HEADER_SIZE;
+  federationPendingCount = 0;
+  portEXIT_CRITICAL(&federationPendingMux);
+  if(count) {
+    federationBuildHeader(datagram, FEDERATION_KIND_PACKETS, count, ++federationSequence, micros());
+    federationSendToNodes(datagram, length);
+  }
+}
+
+// updates (or creates) the sensor for a state reported by a node
+void federationSetRemoteSensor(uint8_t nodeID, uint16_t sensorID, bool state) {
+  for (const auto& sensor : sensors) {
+    if(sensor->getID() == sensorID) {
+      if(sensor->getPin() == FEDERATION_REMOTE_SENSOR_PIN) {
+        static_cast<RemoteSensor *>(sensor)->setState(state);
+      } else {
+        log_w("[Federation] Node %d reported sensor %d which is a local sensor", nodeID, sensorID);
+      }
+      return;
+    }
+  }
+  RemoteSensor *sensor = new RemoteSensor(sensorID, nodeID);
+  sensors.add(sensor);
+  log_i("[Federation] Sensor %d added for node %d", sensorID, nodeID);
+  StateObservers::layoutChanged();
+  sensor->setState(state);
+}
+
+FederationNode *federationFindNode(uint8_t nodeID, const IPAddress &address, uint16_t port,
+  bool create) {
+  FederationNode *freeSlot = NULL;
+  for(uint8_t index = 0; index < FEDERATION_MAX_NODES; index++) {
+    FederationNode &node = federationNodes[index];
+    if(node.active && node.id == nodeID) {
+      return &node;
+    } else if(!node.active && freeSlot == NULL) {
+      freeSlot = &node;
+    }
+  }
+  if(!create) {
+    return NULL;
+  }
+  if(freeSlot == NULL) {
+    log_w("[Federation] Unable to add node %d, all %d slots are in use", nodeID, FEDERATION_MAX_NODES);
+    return NULL;
+  }
+  memset(freeSlot, 0, sizeof(FederationNode));
+  freeSlot->address = address;
+  freeSlot->port = port;
+  freeSlot->id = nodeID;
+  freeSlot->rttMin = UINT32_MAX;
+  freeSlot->active = true;
+  log_i("[Federation] Node %d connected from %s:%d", nodeID, address.toString().c_str(), port);
+  // let the new node know the current track power state straight away
+  federationSendPower(freeSlot, FEDERATION_KIND_POWER);
+  return freeSlot;
+}
+
+void federationHandleDatagram(const IPAddress &address, uint16_t port, const uint8_t *datagram,
+  uint16_t length) {
+  const uint8_t kind = datagram[3];
+  FederationNode *node = federationFindNode(datagram[4], address, port, kind == FEDERATION_KIND_HELLO);
+  if(node == NULL) {
+    federationInvalidDatagrams++;
+    return;
+  }
+  node->lastSeen = millis();
+  node->address = address;
+  node->port = port;
+  const uint8_t *record = &datagram[FEDERATION_HEADER_SIZE];
+  const uint8_t count = datagram[5];
+  if(kind == FEDERATION_KIND_HELLO && count && length > FEDERATION_HEADER_SIZE) {
+    node->powerState = record[0];
+  } else if(kind == FEDERATION_KIND_SENSORS) {
+    for(uint8_t index = 0; index < count && record + FEDERATION_SENSOR_RECORD_SIZE <= datagram + length;
+      index++, record += FEDERATION_SENSOR_RECORD_SIZE) {
+      federationSetRemoteSensor(node->id, record[0] | (record[1] << 8), record[2]);
+      node->sensorReports++;
+    }
+  } else if(kind == FEDERATION_KIND_PONG) {
+    const uint32_t rtt = micros() - federationRead32(&datagram[10]);
+    node->pongsReceived++;
+    node->rttLast = rtt;
+    node->rttTotal += rtt;
+    if(rtt < node->rttMin) {
+      node->rttMin = rtt;
+    }
+    if(rtt > node->rttMax) {
+      node->rttMax = rtt;
+    }
+  }
+}
+
+class FederationMasterObserver : public StateObserver {
+public:
+  void powerChanged(const String &name, bool on, bool overCurrent) {
+    if(name == MOTORBOARD_NAME_MAIN) {
+      federationPowerState = on;
+      federationPowerChanged = true;
+    }
+  }
+};
+
+#else
+
+IPAddress federationMasterAddress;
+bool federationMasterResolved = false;
+bool federationMasterConnected = false;
+uint32_t federationMasterLastSeen = 0;
+uint32_t federationLastPacketSequence = 0;
+uint32_t federationMissedDatagrams = 0;
+uint32_t federationPacketsLoaded = 0;
+int8_t federationTrackPower = -1;
+
+// sensor changes pending transmission to the master, these are added by the
+// observer which can be called from any task.
+uint8_t federationPendingSensors[FEDERATION_MAX_SENSOR_RECORDS * FEDERATION_SENSOR_RECORD_SIZE];
+uint8_t federationPendingCount = 0;
+uint32_t federationOverflows = 0;
+volatile bool federationSnapshotRequired = false;
+portMUX_TYPE federationPendingMux = portMUX_INITIALIZER_UNLOCKED;
+
+void federationSendToMaster(uint8_t kind, const uint8_t *records, uint8_t count, uint16_t recordsLength,
+  uint32_t timestamp) {
+  uint8_t datagram[FEDERATION_MAX_DATAGRAM];
+  federationBuildHeader(datagram, kind, count, ++federationSequence, timestamp);
+  if(recordsLength) {
+    memcpy(&datagram[FEDERATION_HEADER_SIZE], records, recordsLength);
+  }
+  federationSend(federationMasterAddress, FEDERATION_PORT, datagram, FEDERATION_HEADER_SIZE + recordsLength);
+}
+
+uint8_t federationNodePowerState() {
+  uint8_t state = 0;
+  for (const auto& name : MotorBoardManager::getBoardNames()) {
+    GenericMotorBoard *board = MotorBoardManager::getBoardByName(name);
+    if(board->isOn()) {
+      return 1;
+    } else if(board->isOverCurrent()) {
+      state = 2;
+    }
+  }
+  return state;
+}
+
+void federationApplyTrackPower(bool on) {
+  if(federationTrackPower != on) {
+    federationTrackPower = on;
+    log_i("[Federation] Master turned track power %s", on ? "on" : "off");
+    if(on) {
+      MotorBoardManager::powerOnAll();
+    } else {
+      MotorBoardManager::powerOffAll();
+    }
+  }
+}
+
+void federationQueueSensor(uint16_t id, bool state) {
+  portENTER_CRITICAL(&federationPendingMux);
+  bool queued = false;
+  for(uint8_t index = 0; index < federationPendingCount && !queued; index++) {
+    uint8_t *record = &federationPendingSensors[index * FEDERATION_SENSOR_RECORD_SIZE];
+    if((record[0] | (record[1] << 8)) == id) {
+      record[2] = state;
+      queued = true;
+    }
+  }
+  if(!queued) {
+    if(federationPendingCount < FEDERATION_MAX_SENSOR_RECORDS) {
+      uint8_t *record = &federationPendingSensors[federationPendingCount++ * FEDERATION_SENSOR_RECORD_SIZE];
+      record[0] = lowByte(id);
+      record[1] = highByte(id);
+      record[2] = state;
+    } else {
+      // the master will get the change via a snapshot
+      federationOverflows++;
+      federationSnapshotRequired = true;
+    }
+  }
+  portEXIT_CRITICAL(&federationPendingMux);
+}
+
+void federationFlushSensors() {
+  uint8_t records[FEDERATION_MAX_SENSOR_RECORDS * FEDERATION_SENSOR_RECORD_SIZE];
+  portENTER_CRITICAL(&federationPendingMux);
+  uint8_t count = federationPendingCount;
+  memcpy(records, federationPendingSensors, count * FEDERATION_SENSOR_RECORD_SIZE);
+  federationPendingCount = 0;
+  portEXIT_CRITICAL(&federationPendingMux);
+  if(count) {
+    federationSendToMaster(FEDERATION_KIND_SENSORS, records, count, count * FEDERATION_SENSOR_RECORD_SIZE, micros());
+  }
+}
+
+void federationSendSensorSnapshot() {
+  uint8_t records[FEDERATION_MAX_SENSOR_RECORDS * FEDERATION_SENSOR_RECORD_SIZE];
+  uint8_t count = 0;
+  for (const auto& sensor : sensors) {
+    if(count == FEDERATION_MAX_SENSOR_RECORDS) {
+      federationSendToMaster(FEDERATION_KIND_SENSORS, records, count, count * FEDERATION_SENSOR_RECORD_SIZE, micros());
+      count = 0;
+    }
+    uint8_t *record = &records[count++ * FEDERATION_SENSOR_RECORD_SIZE];
+    record[0] = lowByte(sensor->getID());
+    record[1] = highByte(sensor->getID());
+    record[2] = sensor->isActive();
+  }
+  if(count) {
+    federationSendToMaster(FEDERATION_KIND_SENSORS, records, count, count * FEDERATION_SENSOR_RECORD_SIZE, micros());
+  }
+}
+
+void federationLoadPackets(const uint8_t *datagram, uint16_t length) {
+  const uint32_t sequence = federationRead32(&datagram[6]);
+  if(federationLastPacketSequence && sequence > federationLastPacketSequence + 1) {
+    federationMissedDatagrams += sequence - federationLastPacketSequence - 1;
+  }
+  federationLastPacketSequence = sequence;
+  const uint8_t *record = &datagram[FEDERATION_HEADER_SIZE];
+  const uint8_t *end = datagram + length;
+  for(uint8_t index = 0; index < datagram[5] && record + 2 <= end; index++) {
+    const uint8_t repeats = record[0];
+    const uint8_t packetLength = record[1];
+    record += 2;
+    if(packetLength < 2 || packetLength >= MAX_BYTES_IN_PACKET || record + packetLength > end) {
+      federationInvalidDatagrams++;
+      return;
+    }
+    std::vector<uint8_t> packet(record, record + packetLength);
+    dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packet, repeats);
+    federationPacketsLoaded++;
+    record += packetLength;
+  }
+}
+
+void federationHandleDatagram(const IPAddress &address, uint16_t port, const uint8_t *datagram,
+  uint16_t length) {
+  if(!(address == federationMasterAddress) || datagram[4] != 0) {
+    federationInvalidDatagrams++;
+    return;
+  }
+  federationMasterLastSeen = millis();
+  if(!federationMasterConnected) {
+    log_i("[Federation] Connected to master %s", federationMasterAddress.toString().c_str());
+    federationMasterConnected = true;
+    federationSnapshotRequired = true;
+  }
+  const uint8_t kind = datagram[3];
+  if(kind == FEDERATION_KIND_PACKETS) {
+    federationLoadPackets(datagram, length);
+  } else if((kind == FEDERATION_KIND_POWER || kind == FEDERATION_KIND_PING) &&
+    length > FEDERATION_HEADER_SIZE) {
+    federationApplyTrackPower(datagram[FEDERATION_HEADER_SIZE]);
+    if(kind == FEDERATION_KIND_PING) {
+      federationSendToMaster(FEDERATION_KIND_PONG, NULL, 0, 0, federationRead32(&datagram[10]));
+    }
+  }
+}
+
+class FederationNodeObserver : public StateObserver {
+public:
+  void sensorChanged(uint16_t id, bool active) {
+    federationQueueSensor(id, active);
+  }
+};
+
+#endif
+
+void Federation::init() {
+#if FEDERATION_ROLE == FEDERATION_ROLE_MASTER
+  log_i("[Federation] Master listening on port %d", FEDERATION_PORT);
+  memset(federationNodes, 0, sizeof(federationNodes));
+  federationSocket.begin(FEDERATION_PORT);
+  StateObservers::registerObserver(new FederationMasterObserver());
+#else
+  log_i("[Federation] Node %d listening on port %d, master %s", FEDERATION_NODE_ID,
+    FEDERATION_PORT + FEDERATION_NODE_ID, FEDERATION_MASTER_HOST);
+  federationSocket.begin(FEDERATION_PORT + FEDERATION_NODE_ID);
+  StateObservers::registerObserver(new FederationNodeObserver());
+#endif
+}
+
+void Federation::update() {
+  uint8_t datagram[FEDERATION_MAX_DATAGRAM];
+  int datagramSize = federationSocket.parsePacket();
+  while(datagramSize > 0) {
+    IPAddress remoteAddress = federationSocket.remoteIP();
+    uint16_t remotePort = federationSocket.remotePort();
+    int length = federationSocket.read(datagram, sizeof(datagram));
+    if(length >= FEDERATION_HEADER_SIZE && datagram[0] == 'D' && datagram[1] == 'F' &&
+      datagram[2] == FEDERATION_PROTOCOL_VERSION) {
+      federationDatagramsReceived++;
+      federationHandleDatagram(remoteAddress, remotePort, datagram, length);
+    } else if(length > 0) {
+      federationInvalidDatagrams++;
+    }
+    datagramSize = federationSocket.parsePacket();
+  }
+#if FEDERATION_ROLE == FEDERATION_ROLE_MASTER
+  federationFlushPackets();
+  if(federationPowerChanged) {
+    federationPowerChanged = false;
+    federationSendPower(NULL, FEDERATION_KIND_POWER);
+  }
+  if(millis() - federationLastHeartbeat >= FEDERATION_HEARTBEAT_INTERVAL) {
+    federationLastHeartbeat = millis();
+    for(uint8_t index = 0; index < FEDERATION_MAX_NODES; index++) {
+      FederationNode &node = federationNodes[index];
+      if(!node.active) {
+        continue;
+      }
+      if(millis() - node.lastSeen >= FEDERATION_TIMEOUT) {
+        log_w("[Federation] Node %d has not been heard from in %dms, removing", node.id, FEDERATION_TIMEOUT);
+        node.active = false;
+      } else {
+        federationSendPower(&node, FEDERATION_KIND_PING);
+      }
+    }
+  }
+#else
+  if(!federationMasterResolved && millis() - federationLastHeartbeat >= FEDERATION_HEARTBEAT_INTERVAL) {
+    federationLastHeartbeat = millis();
+    federationMasterResolved = federationMasterAddress.fromString(FEDERATION_MASTER_HOST) ||
+      (WiFi.isConnected() && WiFi.hostByName(FEDERATION_MASTER_HOST, federationMasterAddress));
+    return;
+  }
+  if(!federationMasterResolved) {
+    return;
+  }
+  if(federationMasterConnected && millis() - federationMasterLastSeen >= FEDERATION_TIMEOUT) {
+    log_e("[Federation] Lost connection to master, turning off track power");
+    federationMasterConnected = false;
+    federationApplyTrackPower(false);
+  }
+  if(millis() - federationLastHeartbeat >= FEDERATION_HEARTBEAT_INTERVAL) {
+    federationLastHeartbeat = millis();
+    uint8_t powerState = federationNodePowerState();
+    federationSendToMaster(FEDERATION_KIND_HELLO, &powerState, 1, 1, micros());
+  }
+  if(federationMasterConnected && federationSnapshotRequired) {
+    federationSnapshotRequired = false;
+    // the snapshot covers anything that is pending
+    portENTER_CRITICAL(&federationPendingMux);
+    federationPendingCount = 0;
+    portEXIT_CRITICAL(&federationPendingMux);
+    federationSendSensorSnapshot();
+  } else if(federationMasterConnected) {
+    federationFlushSensors();
+  }
+#endif
+}
+
+// called by the OPERATIONS track signal generator for every packet it loads,
+// on the master the packet is queued for all nodes.
+void Federation::forwardPacket(const std::vector<uint8_t> &packet, uint8_t repeats) {
+#if FEDERATION_ROLE == FEDERATION_ROLE_MASTER
+  portENTER_CRITICAL(&federationPendingMux);
+  if(federationPendingLength + packet.size() + 2 <= FEDERATION_MAX_DATAGRAM && federationPendingCount < 255) {
+    federationPendingPackets[federationPendingLength++] = repeats;
+    federationPendingPackets[federationPendingLength++] = packet.size();
+    for(const auto& data : packet) {
+      federationPendingPackets[federationPendingLength++] = data;
+    }
+    federationPendingCount++;
+    federationPacketsForwarded++;
+  } else {
+    federationOverflows++;
+  }
+  portEXIT_CRITICAL(&federationPendingMux);
+#endif
+}
+
+void Federation::getState(JsonObject &root) {
+  root[F("port")] = FEDERATION_PORT + FEDERATION_NODE_ID;
+  root[F("nodeID")] = FEDERATION_NODE_ID;
+  root[F("sequence")] = federationSequence;
+  root[F("sent")] = federationDatagramsSent;
+  root[F("received")] = federationDatagramsReceived;
+  root[F("invalid")] = federationInvalidDatagrams;
+  root[F("overflows")] = federationOverflows;
+#if FEDERATION_ROLE == FEDERATION_ROLE_MASTER
+  root[F("role")] = "master";
+  root[F("packetsForwarded")] = federationPacketsForwarded;
+  JsonArray &nodes = root.createNestedArray(F("nodes"));
+  for(uint8_t index = 0; index < FEDERATION_MAX_NODES; index++) {
+    FederationNode &node = federationNodes[index];
+    if(!node.active) {
+      continue;
+    }
+    JsonObject &nodeJson = nodes.createNestedObject();
+    nodeJson[F("id")] = node.id;
+    nodeJson[F("address")] = node.address.toString();
+    nodeJson[F("port")] = node.port;
+    nodeJson[F("lastSeen")] = millis() - node.lastSeen;
+    nodeJson[F("power")] = node.powerState;
+    nodeJson[F("sensorReports")] = node.sensorReports;
+    nodeJson[F("pings")] = node.pingsSent;
+    nodeJson[F("pongs")] = node.pongsReceived;
+    if(node.pongsReceived) {
+      JsonObject &rtt = nodeJson.createNestedObject(F("rtt"));
+      rtt[F("last")] = node.rttLast;
+      rtt[F("min")] = node.rttMin;
+      rtt[F("max")] = node.rttMax;
+      rtt[F("avg")] = (uint32_t)(node.rttTotal / node.pongsReceived);
+    }
+  }
+#else
+  root[F("role")] = "node";
+  root[F("master")] = FEDERATION_MASTER_HOST;
+  root[F("connected")] = federationMasterConnected;
+  root[F("lastSeen")] = millis() - federationMasterLastSeen;
+  root[F("packetsLoaded")] = federationPacketsLoaded;
+  root[F("missedDatagrams")] = federationMissedDatagrams;
+#endif
+}
+#endif
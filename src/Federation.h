@@ -0,0 +1,100 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _FEDERATION_H_
+#define _FEDERATION_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <IPAddress.h>
+#include <vector>
+#include "Sensors.h"
+
+// roles a station can have in a federation
+#define FEDERATION_ROLE_MASTER 0
+#define FEDERATION_ROLE_NODE 1
+
+// maximum number of nodes a master will send packets to
+#define FEDERATION_MAX_NODES 8
+// interval (in ms) between node heartbeats and master latency pings
+#define FEDERATION_HEARTBEAT_INTERVAL 1000
+// a node (or master) that has not sent anything in this many ms is considered
+// lost, a node turns off its track power when the master is lost.
+#define FEDERATION_TIMEOUT 3000
+// maximum number of sensor changes in a single datagram
+#define FEDERATION_MAX_SENSOR_RECORDS 64
+// largest datagram sent or processed
+#define FEDERATION_MAX_DATAGRAM 512
+
+#define FEDERATION_HEADER_SIZE 14
+#define FEDERATION_SENSOR_RECORD_SIZE 3
+
+// datagram kinds
+#define FEDERATION_KIND_HELLO 1
+#define FEDERATION_KIND_PACKETS 2
+#define FEDERATION_KIND_SENSORS 3
+#define FEDERATION_KIND_POWER 4
+#define FEDERATION_KIND_PING 5
+#define FEDERATION_KIND_PONG 6
+
+// pin used by sensors that are reported by a federation node, this is used to
+// tell them apart from local and S88 sensors.
+#define FEDERATION_REMOTE_SENSOR_PIN -2
+
+struct FederationNode {
+  IPAddress address;
+  uint16_t port;
+  uint8_t id;
+  bool active;
+  uint8_t powerState;
+  uint32_t lastSeen;
+  uint32_t sensorReports;
+  uint32_t pingsSent;
+  uint32_t pongsReceived;
+  uint32_t rttLast;
+  uint32_t rttMin;
+  uint32_t rttMax;
+  uint64_t rttTotal;
+};
+
+// sensor on a federation node, the state is updated when the node reports it
+// and it is not stored on the master.
+class RemoteSensor : public Sensor {
+public:
+  RemoteSensor(uint16_t id, uint8_t nodeID) : Sensor(id, FEDERATION_REMOTE_SENSOR_PIN, false, false),
+    _nodeID(nodeID) {}
+  void store(uint16_t) {}
+  void check() {}
+  void setState(bool state) {
+    set(state);
+  }
+  const uint8_t getNodeID() {
+    return _nodeID;
+  }
+private:
+  uint8_t _nodeID;
+};
+
+class Federation {
+public:
+  static void init();
+  static void update();
+  static void getState(JsonObject &);
+  static void forwardPacket(const std::vector<uint8_t> &, uint8_t);
+};
+
+#endif
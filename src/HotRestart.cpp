@@ -0,0 +1,231 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <rom/crc.h>
+
+#include "HotRestart.h"
+#include "Locomotive.h"
+#include "MotorBoard.h"
+#include "StateObserver.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION keeps a checkpoint of the locomotive registers (address,
+speed, direction and functions) and the track power state in RTC slow memory.
+The checkpoint is rewritten by a scheduler task shortly after any of these
+change.
+
+When the base station restarts after an unplanned reset (watchdog, panic,
+brownout or software restart) and the checkpoint is valid, the locomotive
+registers and track power are restored during startup before connecting to
+WiFi, so the speed and function packets are sent again within milliseconds of
+the restart rather than after the base station has reconnected and the clients
+have resent their state. When HOT_RESTART_SAFE_STOP is enabled the restored
+locomotives are stopped (speed 0) instead of resuming their previous speed.
+
+A power cycle or reset via the EN pin always starts with an empty layout state.
+
+**********************************************************************/
+
+#if defined(HOT_RESTART_ENABLED) && HOT_RESTART_ENABLED
+
+RTC_NOINIT_ATTR HotRestartCheckpoint hotRestartCheckpoint;
+
+volatile bool hotRestartDirty = false;
+uint32_t hotRestartCheckpoints = 0;
+bool hotRestartRestored = false;
+uint8_t hotRestartRestoredLocos = 0;
+
+uint32_t hotRestartChecksum() {
+  return crc32_le(0, (const uint8_t *)&hotRestartCheckpoint,
+    offsetof(HotRestartCheckpoint, checksum));
+}
+
+bool hotRestartIsUnplannedReset(esp_reset_reason_t reason) {
+  switch(reason) {
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+const char *hotRestartReasonName(esp_reset_reason_t reason) {
+  switch(reason) {
+    case ESP_RST_POWERON:
+      return "powerOn";
+    case ESP_RST_EXT:
+      return "external";
+    case ESP_RST_SW:
+      return "software";
+    case ESP_RST_PANIC:
+      return "panic";
+    case ESP_RST_INT_WDT:
+      return "interruptWatchdog";
+    case ESP_RST_TASK_WDT:
+      return "taskWatchdog";
+    case ESP_RST_WDT:
+      return "watchdog";
+    case ESP_RST_DEEPSLEEP:
+      return "deepSleep";
+    case ESP_RST_BROWNOUT:
+      return "brownout";
+    case ESP_RST_SDIO:
+      return "sdio";
+    default:
+      return "unknown";
+  }
+}
+
+void hotRestartRestore() {
+  auto boardNames = MotorBoardManager::getBoardNames();
+  for(uint8_t index = 0; index < hotRestartCheckpoint.locoCount; index++) {
+    const HotRestartLoco &saved = hotRestartCheckpoint.locos[index];
+    Locomotive *loco = new Locomotive(saved.registerNumber);
+    loco->setLocoNumber(saved.locoNumber);
+#if defined(HOT_RESTART_SAFE_STOP) && HOT_RESTART_SAFE_STOP
+    loco->setSpeed(0);
+#else
+    loco->setSpeed(saved.speed);
+#endif
+    loco->setDirection(saved.direction);
+    loco->setFunctions(saved.functions);
+    LocomotiveManager::addLocomotive(loco);
+    log_i("[HotRestart] Loco(%d) locoNumber: %d, speed: %d, direction: %s restored",
+      saved.registerNumber, saved.locoNumber, loco->getSpeed(), saved.direction ? "FWD" : "REV");
+  }
+  for(uint8_t index = 0; index < boardNames.size() && index < 8; index++) {
+    if(bitRead(hotRestartCheckpoint.poweredBoards, index)) {
+      log_i("[HotRestart] Restoring track power for %s", boardNames[index].c_str());
+      MotorBoardManager::getBoardByName(boardNames[index])->powerOn();
+    }
+  }
+  // send the speed and function packets straight away, the periodic speed
+  // refresh takes over once the scheduler is running.
+  for (const auto& loco : LocomotiveManager::getLocomotives()) {
+    loco->sendLocoUpdate();
+    for(uint8_t group = 0; group < 5; group++) {
+      loco->sendFunctionGroup(group);
+    }
+  }
+  hotRestartRestoredLocos = hotRestartCheckpoint.locoCount;
+  hotRestartRestored = true;
+}
+
+class HotRestartObserver : public StateObserver {
+public:
+  void powerChanged(const String &name, bool on, bool overCurrent) {
+    hotRestartDirty = true;
+  }
+  void locomotiveChanged(Locomotive *loco) {
+    hotRestartDirty = true;
+  }
+};
+
+void HotRestart::init() {
+  const esp_reset_reason_t reason = esp_reset_reason();
+  const bool valid = hotRestartCheckpoint.magic == HOT_RESTART_MAGIC &&
+    hotRestartCheckpoint.locoCount <= HOT_RESTART_MAX_LOCOS &&
+    hotRestartCheckpoint.checksum == hotRestartChecksum();
+  log_i("[HotRestart] Reset reason: %s, checkpoint %s", hotRestartReasonName(reason),
+    valid ? "valid" : "not available");
+  if(valid && hotRestartIsUnplannedReset(reason)) {
+    hotRestartRestore();
+  } else if(!valid) {
+    hotRestartCheckpoint.generation = 0;
+  }
+  StateObservers::registerObserver(new HotRestartObserver());
+  // write a fresh checkpoint for the restored (or empty) state
+  hotRestartDirty = true;
+  checkpoint();
+}
+
+// notifies the observers of the restored state, called once all interfaces
+// have registered their observers since the restore runs before WiFi is up.
+void HotRestart::announce() {
+  if(!hotRestartRestored) {
+    return;
+  }
+  for (const auto& name : MotorBoardManager::getBoardNames()) {
+    if(MotorBoardManager::getBoardByName(name)->isOn()) {
+      StateObservers::powerChanged(name, true, false);
+    }
+  }
+  for (const auto& loco : LocomotiveManager::getLocomotives()) {
+    StateObservers::locomotiveChanged(loco);
+  }
+}
+
+void HotRestart::checkpoint() {
+  if(!hotRestartDirty) {
+    return;
+  }
+  hotRestartDirty = false;
+  // invalidate the checkpoint while it is being written so a reset part way
+  // through does not restore a partial state.
+  hotRestartCheckpoint.magic = 0;
+  uint8_t locoCount = 0;
+  for (const auto& loco : LocomotiveManager::getLocomotives()) {
+    if(locoCount == HOT_RESTART_MAX_LOCOS) {
+      break;
+    }
+    HotRestartLoco &saved = hotRestartCheckpoint.locos[locoCount++];
+    memset(&saved, 0, sizeof(HotRestartLoco));
+    saved.locoNumber = loco->getLocoNumber();
+    saved.registerNumber = loco->getRegister();
+    saved.speed = loco->getSpeed();
+    saved.direction = loco->isDirectionForward();
+    saved.functions = loco->getFunctions();
+  }
+  hotRestartCheckpoint.locoCount = locoCount;
+  hotRestartCheckpoint.poweredBoards = 0;
+  uint8_t index = 0;
+  for (const auto& name : MotorBoardManager::getBoardNames()) {
+    if(index < 8 && MotorBoardManager::getBoardByName(name)->isOn()) {
+      bitSet(hotRestartCheckpoint.poweredBoards, index);
+    }
+    index++;
+  }
+  hotRestartCheckpoint.reserved = 0;
+  hotRestartCheckpoint.generation++;
+  hotRestartCheckpoint.magic = HOT_RESTART_MAGIC;
+  hotRestartCheckpoint.checksum = hotRestartChecksum();
+  hotRestartCheckpoints++;
+}
+
+void HotRestart::getState(JsonObject &root) {
+  root[F("resetReason")] = hotRestartReasonName(esp_reset_reason());
+  root[F("restored")] = hotRestartRestored;
+  root[F("restoredLocos")] = hotRestartRestoredLocos;
+  root[F("generation")] = hotRestartCheckpoint.generation;
+  root[F("checkpoints")] = hotRestartCheckpoints;
+  root[F("locos")] = hotRestartCheckpoint.locoCount;
+#if defined(HOT_RESTART_SAFE_STOP) && HOT_RESTART_SAFE_STOP
+  root[F("safeStop")] = true;
+#else
+  root[F("safeStop")] = false;
+#endif
+}
+#endif
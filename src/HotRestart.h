@@ -0,0 +1,59 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _HOT_RESTART_H_
+#define _HOT_RESTART_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// maximum number of locomotive registers kept in the checkpoint
+#define HOT_RESTART_MAX_LOCOS 32
+// identifies a checkpoint written by this version of the checkpoint layout
+#define HOT_RESTART_MAGIC 0x44435031
+
+struct HotRestartLoco {
+  uint16_t locoNumber;
+  uint8_t registerNumber;
+  int8_t speed;
+  uint8_t direction;
+  uint8_t reserved[3];
+  uint32_t functions;
+};
+
+// checkpoint of the layout state kept in RTC slow memory, this survives
+// watchdog, panic, software and brownout resets but not a power cycle.
+struct HotRestartCheckpoint {
+  uint32_t magic;
+  uint32_t generation;
+  // motor boards that were powered, in the order of getBoardNames
+  uint8_t poweredBoards;
+  uint8_t locoCount;
+  uint16_t reserved;
+  HotRestartLoco locos[HOT_RESTART_MAX_LOCOS];
+  uint32_t checksum;
+};
+
+class HotRestart {
+public:
+  static void init();
+  static void announce();
+  static void checkpoint();
+  static void getState(JsonObject &);
+};
+
+#endif
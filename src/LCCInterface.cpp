@@ -0,0 +1,590 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <WiFi.h>
+#include <algorithm>
+
+#include "LCCInterface.h"
+#include "StateObserver.h"
+#include "Turnouts.h"
+#include "Outputs.h"
+#include "Sensors.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can act as an OpenLCB (LCC) node connected to an
+OpenLCB hub via TCP using the GridConnect frame format. Sensors, turnouts and
+outputs are mapped onto event IDs in the node's own event ID space:
+
+  NODE_ID (48 bits) | TYPE (2 bits) | ID (13 bits) | STATE (1 bit)
+
+    TYPE:  0 for sensors, 1 for turnouts and 2 for outputs.
+    ID:    sensor, turnout or output ID (0-8191).
+    STATE: 1 for ACTIVE/THROWN/ON, 0 for INACTIVE/CLOSED/OFF.
+
+The base station produces the events for all sensors, turnouts and outputs,
+a Producer/Consumer Event Report is sent every time the state changes. The
+base station consumes the events for turnouts and outputs, receiving an event
+will set the turnout or output to the state in the event.
+
+The following OpenLCB messages are handled:
+
+  Verify Node ID (global and addressed), Protocol Support Inquiry
+  Identify Events (global and addressed), Identify Producer, Identify Consumer
+  Producer/Consumer Event Report
+  Alias Mapping Enquiry and alias conflict detection
+
+Identify Events is answered with a range identified message per type followed
+by the current state of every entry, the entries are sent LCC_IDENTIFY_BATCH
+at a time from the compact event table so large layouts do not block other
+work. The event table is rebuilt only when sensors, turnouts or outputs are
+added or removed.
+
+The hub connection is established by a separate task so that an unreachable
+hub (or a slow DNS lookup) does not block the scheduler, failed attempts are
+retried with an exponential backoff.
+
+**********************************************************************/
+
+#if defined(LCC_ENABLED) && LCC_ENABLED
+
+#ifndef LCC_HUB_PORT
+#define LCC_HUB_PORT LCC_DEFAULT_HUB_PORT
+#endif
+
+// when no node ID has been configured one is generated in the DIY range
+// 05.01.01.01.22.xx using the low byte of the ESP32 MAC address.
+#ifndef LCC_NODE_ID
+#define LCC_NODE_ID (0x0501010122ULL << 8 | (ESP.getEfuseMac() & 0xFF))
+#endif
+
+// OpenLCB message type indicators
+#define LCC_MTI_INIT_COMPLETE 0x100
+#define LCC_MTI_VERIFIED_NODE_ID 0x170
+#define LCC_MTI_VERIFY_NODE_ID_ADDRESSED 0x488
+#define LCC_MTI_VERIFY_NODE_ID_GLOBAL 0x490
+#define LCC_MTI_PROTOCOL_SUPPORT_REPLY 0x668
+#define LCC_MTI_PROTOCOL_SUPPORT_INQUIRY 0x828
+#define LCC_MTI_CONSUMER_RANGE_IDENTIFIED 0x4A4
+#define LCC_MTI_CONSUMER_IDENTIFIED_VALID 0x4C4
+#define LCC_MTI_CONSUMER_IDENTIFIED_INVALID 0x4C5
+#define LCC_MTI_PRODUCER_RANGE_IDENTIFIED 0x524
+#define LCC_MTI_PRODUCER_IDENTIFIED_VALID 0x544
+#define LCC_MTI_PRODUCER_IDENTIFIED_INVALID 0x545
+#define LCC_MTI_PCER 0x5B4
+#define LCC_MTI_IDENTIFY_CONSUMER 0x8F4
+#define LCC_MTI_IDENTIFY_PRODUCER 0x914
+#define LCC_MTI_IDENTIFY_EVENTS_ADDRESSED 0x968
+#define LCC_MTI_IDENTIFY_EVENTS_GLOBAL 0x970
+// MTI bit indicating the message is addressed to a single node
+#define LCC_MTI_ADDRESSED 0x008
+
+// CAN control frame content fields
+#define LCC_CAN_RID 0x0700
+#define LCC_CAN_AMD 0x0701
+#define LCC_CAN_AME 0x0702
+#define LCC_CAN_AMR 0x0703
+
+// Protocol Support Inquiry reply flags
+#define LCC_PIP_EVENT_EXCHANGE 0x04
+
+enum LCC_NODE_STATE {
+  LCC_DISCONNECTED,
+  LCC_CONNECTING,
+  LCC_CONNECT_FAILED,
+  LCC_CONNECTED,
+  LCC_RESERVING_ALIAS,
+  LCC_PERMITTED
+};
+
+extern LinkedList<Sensor *> sensors;
+extern LinkedList<Turnout *> turnouts;
+extern LinkedList<Output *> outputs;
+
+WiFiClient lccSocket;
+// the connect task only changes the state while it is LCC_CONNECTING
+volatile LCC_NODE_STATE lccState = LCC_DISCONNECTED;
+TaskHandle_t lccConnectTaskHandle = NULL;
+uint64_t lccNodeID = 0;
+uint16_t lccAlias = 0;
+uint32_t lccAliasSeed[2] = {0, 0};
+uint32_t lccStateChangeTime = 0;
+uint32_t lccLastConnectAttempt = 0;
+uint32_t lccReconnectInterval = LCC_RECONNECT_MIN_INTERVAL;
+char lccFrame[LCC_MAX_FRAME_LENGTH];
+uint8_t lccFrameLength = 0;
+uint32_t lccFramesReceived = 0;
+uint32_t lccFramesSent = 0;
+uint32_t lccAliasConflicts = 0;
+
+std::vector<LCCEventEntry> lccEvents;
+volatile bool lccEventsDirty = true;
+// next entry in lccEvents to be identified, -1 when not identifying
+int32_t lccIdentifyIndex = -1;
+
+// state changes are queued by the observer (which can be called from any
+// task) and sent from LCCInterface::update.
+LCCEventEntry lccPendingEvents[LCC_MAX_PENDING_EVENTS];
+uint8_t lccPendingHead = 0;
+uint8_t lccPendingCount = 0;
+uint32_t lccPendingOverflows = 0;
+// set when a state change could not be queued, the state of everything is
+// then resent
+volatile bool lccResyncRequired = false;
+portMUX_TYPE lccPendingMux = portMUX_INITIALIZER_UNLOCKED;
+
+uint64_t lccEventID(uint8_t type, uint16_t id, bool state) {
+  return (lccNodeID << 16) | ((uint64_t)type << 14) | ((id & 0x1FFF) << 1) | (state ? 1 : 0);
+}
+
+uint64_t lccReadEventID(const uint8_t *data) {
+  uint64_t event = 0;
+  for(uint8_t index = 0; index < 8; index++) {
+    event = (event << 8) | data[index];
+  }
+  return event;
+}
+
+uint64_t lccReadNodeID(const uint8_t *data) {
+  uint64_t nodeID = 0;
+  for(uint8_t index = 0; index < 6; index++) {
+    nodeID = (nodeID << 8) | data[index];
+  }
+  return nodeID;
+}
+
+void lccWriteBytes(uint64_t value, uint8_t *data, uint8_t length) {
+  for(int8_t index = length - 1; index >= 0; index--) {
+    data[index] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+void lccSendFrame(uint32_t header, const uint8_t *data, uint8_t length) {
+  char frame[LCC_MAX_FRAME_LENGTH];
+  int frameLength = snprintf(frame, sizeof(frame), ":X%08XN", header);
+  for(uint8_t index = 0; index < length; index++) {
+    frameLength += snprintf(&frame[frameLength], sizeof(frame) - frameLength, "%02X", data[index]);
+  }
+  frame[frameLength++] = ';';
+  lccSocket.write((const uint8_t *)frame, frameLength);
+  lccFramesSent++;
+}
+
+void lccSendControlFrame(uint16_t content, const uint8_t *data = NULL, uint8_t length = 0) {
+  lccSendFrame(0x10000000 | ((uint32_t)content << 12) | lccAlias, data, length);
+}
+
+void lccSendMessage(uint16_t mti, const uint8_t *data = NULL, uint8_t length = 0) {
+  lccSendFrame(0x19000000 | ((uint32_t)mti << 12) | lccAlias, data, length);
+}
+
+void lccSendNodeIDMessage(uint16_t mti) {
+  uint8_t data[6];
+  lccWriteBytes(lccNodeID, data, 6);
+  lccSendMessage(mti, data, 6);
+}
+
+void lccSendEventMessage(uint16_t mti, uint64_t event) {
+  uint8_t data[8];
+  lccWriteBytes(event, data, 8);
+  lccSendMessage(mti, data, 8);
+}
+
+// OpenLCB alias generator, the seed starts as the node ID and is advanced
+// every time a new alias is needed.
+void lccNextAlias() {
+  do {
+    uint32_t temp1 = ((lccAliasSeed[0] << 9) | ((lccAliasSeed[1] >> 15) & 0x1FF)) & 0xFFFFFF;
+    uint32_t temp2 = (lccAliasSeed[1] << 9) & 0xFFFFFF;
+    lccAliasSeed[0] = lccAliasSeed[0] + temp1 + 0x1B0CA3;
+    lccAliasSeed[1] = lccAliasSeed[1] + temp2 + 0x7A4BA9;
+    lccAliasSeed[0] = (lccAliasSeed[0] & 0xFFFFFF) + ((lccAliasSeed[1] & 0xFF000000) >> 24);
+    lccAliasSeed[1] &= 0xFFFFFF;
+    lccAlias = (lccAliasSeed[0] ^ lccAliasSeed[1] ^ (lccAliasSeed[0] >> 12) ^ (lccAliasSeed[1] >> 12)) & 0xFFF;
+  } while(lccAlias == 0);
+}
+
+// sends the four Check ID frames for a new alias, the alias can be used once
+// LCC_ALIAS_RESERVE_DELAY has passed without a conflict being reported.
+void lccReserveAlias() {
+  lccNextAlias();
+  log_i("[LCC] Reserving alias %03X", lccAlias);
+  for(uint8_t frame = 0; frame < 4; frame++) {
+    uint16_t nodeIDBits = (lccNodeID >> (36 - (frame * 12))) & 0xFFF;
+    lccSendFrame(0x10000000 | ((uint32_t)(7 - frame) << 24) | ((uint32_t)nodeIDBits << 12) | lccAlias, NULL, 0);
+  }
+  lccState = LCC_RESERVING_ALIAS;
+  lccStateChangeTime = millis();
+}
+
+bool lccEventEntryLess(const LCCEventEntry &a, const LCCEventEntry &b) {
+  return a.type < b.type || (a.type == b.type && a.id < b.id);
+}
+
+void lccAddEventEntry(uint8_t type, uint16_t id, bool state) {
+  if(id > 0x1FFF) {
+    log_w("[LCC] ID %d is out of range for events, ignoring", id);
+    return;
+  }
+  lccEvents.push_back({id, type, state});
+}
+
+void lccRebuildEvents() {
+  lccEventsDirty = false;
+  lccEvents.clear();
+  lccEvents.reserve(sensors.length() + turnouts.length() + outputs.length());
+  for (const auto& sensor : sensors) {
+    lccAddEventEntry(LCC_EVENT_SENSOR, sensor->getID(), sensor->isActive());
+  }
+  for (const auto& turnout : turnouts) {
+    lccAddEventEntry(LCC_EVENT_TURNOUT, turnout->getID(), turnout->isThrown());
+  }
+  for (const auto& output : outputs) {
+    lccAddEventEntry(LCC_EVENT_OUTPUT, output->getID(), output->isActive());
+  }
+  std::sort(lccEvents.begin(), lccEvents.end(), lccEventEntryLess);
+  log_i("[LCC] Event table rebuilt with %d entries (%d bytes)", lccEvents.size(),
+    lccEvents.size() * sizeof(LCCEventEntry));
+}
+
+LCCEventEntry *lccFindEventEntry(uint8_t type, uint16_t id) {
+  const LCCEventEntry key = {id, type, 0};
+  auto entry = std::lower_bound(lccEvents.begin(), lccEvents.end(), key, lccEventEntryLess);
+  if(entry != lccEvents.end() && entry->type == type && entry->id == id) {
+    return &(*entry);
+  }
+  return NULL;
+}
+
+// returns the event table entry for an event ID in this node's event space
+LCCEventEntry *lccFindEventEntry(uint64_t event) {
+  if((event >> 16) != lccNodeID) {
+    return NULL;
+  }
+  return lccFindEventEntry((event >> 14) & 0x03, (event >> 1) & 0x1FFF);
+}
+
+void lccSendRangeIdentified(uint16_t mti, uint8_t type) {
+  // the range is encoded by filling the low bits with the inverse of the
+  // lowest type bit
+  uint64_t base = lccEventID(type, 0, false);
+  lccSendEventMessage(mti, (type & 0x01) ? base : base | 0x3FFF);
+}
+
+void lccStartIdentifyEvents() {
+  lccSendRangeIdentified(LCC_MTI_PRODUCER_RANGE_IDENTIFIED, LCC_EVENT_SENSOR);
+  lccSendRangeIdentified(LCC_MTI_PRODUCER_RANGE_IDENTIFIED, LCC_EVENT_TURNOUT);
+  lccSendRangeIdentified(LCC_MTI_PRODUCER_RANGE_IDENTIFIED, LCC_EVENT_OUTPUT);
+  lccSendRangeIdentified(LCC_MTI_CONSUMER_RANGE_IDENTIFIED, LCC_EVENT_TURNOUT);
+  lccSendRangeIdentified(LCC_MTI_CONSUMER_RANGE_IDENTIFIED, LCC_EVENT_OUTPUT);
+  lccIdentifyIndex = 0;
+}
+
+void lccSendProducerIdentified(const LCCEventEntry &entry) {
+  lccSendEventMessage(LCC_MTI_PRODUCER_IDENTIFIED_VALID, lccEventID(entry.type, entry.id, entry.state));
+  lccSendEventMessage(LCC_MTI_PRODUCER_IDENTIFIED_INVALID, lccEventID(entry.type, entry.id, !entry.state));
+}
+
+void lccHandleEvent(uint16_t mti, uint64_t event) {
+  LCCEventEntry *entry = lccFindEventEntry(event);
+  if(entry == NULL) {
+    return;
+  }
+  bool state = event & 0x01;
+  if(mti == LCC_MTI_PCER) {
+    if(entry->type == LCC_EVENT_TURNOUT) {
+      TurnoutManager::set(entry->id, state);
+    } else if(entry->type == LCC_EVENT_OUTPUT) {
+      OutputManager::set(entry->id, state);
+    }
+  } else if(mti == LCC_MTI_IDENTIFY_PRODUCER) {
+    lccSendEventMessage(entry->state == state ? LCC_MTI_PRODUCER_IDENTIFIED_VALID :
+      LCC_MTI_PRODUCER_IDENTIFIED_INVALID, event);
+  } else if(mti == LCC_MTI_IDENTIFY_CONSUMER && entry->type != LCC_EVENT_SENSOR) {
+    lccSendEventMessage(entry->state == state ? LCC_MTI_CONSUMER_IDENTIFIED_VALID :
+      LCC_MTI_CONSUMER_IDENTIFIED_INVALID, event);
+  }
+}
+
+void lccHandleMessage(uint16_t mti, uint16_t sourceAlias, const uint8_t *data, uint8_t length) {
+  if(mti & LCC_MTI_ADDRESSED) {
+    if(length < 2 || (((data[0] & 0x0F) << 8) | data[1]) != lccAlias) {
+      return;
+    }
+    data += 2;
+    length -= 2;
+  }
+  switch(mti) {
+    case LCC_MTI_VERIFY_NODE_ID_GLOBAL:
+      if(length < 6 || lccReadNodeID(data) == lccNodeID) {
+        lccSendNodeIDMessage(LCC_MTI_VERIFIED_NODE_ID);
+      }
+      break;
+    case LCC_MTI_VERIFY_NODE_ID_ADDRESSED:
+      lccSendNodeIDMessage(LCC_MTI_VERIFIED_NODE_ID);
+      break;
+    case LCC_MTI_PROTOCOL_SUPPORT_INQUIRY:
+      {
+        uint8_t reply[8] = {(uint8_t)(sourceAlias >> 8), (uint8_t)(sourceAlias & 0xFF),
+          LCC_PIP_EVENT_EXCHANGE, 0, 0, 0, 0, 0};
+        lccSendMessage(LCC_MTI_PROTOCOL_SUPPORT_REPLY, reply, sizeof(reply));
+      }
+      break;
+    case LCC_MTI_IDENTIFY_EVENTS_GLOBAL:
+    case LCC_MTI_IDENTIFY_EVENTS_ADDRESSED:
+      lccStartIdentifyEvents();
+      break;
+    case LCC_MTI_PCER:
+    case LCC_MTI_IDENTIFY_PRODUCER:
+    case LCC_MTI_IDENTIFY_CONSUMER:
+      if(length == 8) {
+        lccHandleEvent(mti, lccReadEventID(data));
+      }
+      break;
+  }
+}
+
+void lccHandleFrame(uint32_t header, const uint8_t *data, uint8_t length) {
+  uint16_t sourceAlias = header & 0xFFF;
+  uint8_t frameType = (header >> 24) & 0x07;
+  bool messageFrame = header & 0x08000000;
+  bool checkIDFrame = !messageFrame && frameType >= 4;
+  if(lccState == LCC_DISCONNECTED) {
+    return;
+  }
+  // alias conflict detection
+  if(sourceAlias == lccAlias) {
+    if(checkIDFrame && lccState == LCC_PERMITTED) {
+      // another node is trying to reserve our alias
+      lccSendControlFrame(LCC_CAN_RID);
+    } else {
+      log_w("[LCC] Alias %03X is in use by another node", lccAlias);
+      lccAliasConflicts++;
+      if(lccState == LCC_PERMITTED) {
+        uint8_t nodeID[6];
+        lccWriteBytes(lccNodeID, nodeID, 6);
+        lccSendControlFrame(LCC_CAN_AMR, nodeID, 6);
+      }
+      lccReserveAlias();
+    }
+    return;
+  }
+  if(lccState != LCC_PERMITTED) {
+    return;
+  }
+  if(!messageFrame) {
+    if(!checkIDFrame && ((header >> 12) & 0x7FFF) == LCC_CAN_AME &&
+      (length < 6 || lccReadNodeID(data) == lccNodeID)) {
+      uint8_t nodeID[6];
+      lccWriteBytes(lccNodeID, nodeID, 6);
+      lccSendControlFrame(LCC_CAN_AMD, nodeID, 6);
+    }
+  } else if(frameType == 1) {
+    lccHandleMessage((header >> 12) & 0xFFF, sourceAlias, data, length);
+  }
+}
+
+int8_t lccHexValue(char value) {
+  if(value >= '0' && value <= '9') {
+    return value - '0';
+  } else if(value >= 'A' && value <= 'F') {
+    return value - 'A' + 10;
+  } else if(value >= 'a' && value <= 'f') {
+    return value - 'a' + 10;
+  }
+  return -1;
+}
+
+// parses a GridConnect frame of the form :X<header>N<data> (without the
+// trailing ;), anything else is silently dropped.
+void lccParseFrame(const char *frame, uint8_t length) {
+  if(length < 11 || frame[0] != ':' || frame[1] != 'X' || frame[10] != 'N') {
+    return;
+  }
+  uint32_t header = 0;
+  for(uint8_t index = 2; index < 10; index++) {
+    int8_t nibble = lccHexValue(frame[index]);
+    if(nibble < 0) {
+      return;
+    }
+    header = (header << 4) | nibble;
+  }
+  uint8_t data[8];
+  uint8_t dataLength = 0;
+  for(uint8_t index = 11; index + 1 < length && dataLength < sizeof(data); index += 2) {
+    int8_t high = lccHexValue(frame[index]);
+    int8_t low = lccHexValue(frame[index + 1]);
+    if(high < 0 || low < 0) {
+      return;
+    }
+    data[dataLength++] = (high << 4) | low;
+  }
+  lccFramesReceived++;
+  lccHandleFrame(header, data, dataLength);
+}
+
+class LCCStateObserver : public StateObserver {
+public:
+  void sensorChanged(uint16_t id, bool active) {
+    queueEvent(LCC_EVENT_SENSOR, id, active);
+  }
+  void turnoutChanged(uint16_t id, bool thrown) {
+    queueEvent(LCC_EVENT_TURNOUT, id, thrown);
+  }
+  void outputChanged(uint16_t id, bool active) {
+    queueEvent(LCC_EVENT_OUTPUT, id, active);
+  }
+  void layoutChanged() {
+    lccEventsDirty = true;
+  }
+private:
+  void queueEvent(uint8_t type, uint16_t id, bool state) {
+    portENTER_CRITICAL(&lccPendingMux);
+    if(lccPendingCount < LCC_MAX_PENDING_EVENTS) {
+      lccPendingEvents[(lccPendingHead + lccPendingCount++) % LCC_MAX_PENDING_EVENTS] = {id, type, state};
+    } else {
+      lccPendingOverflows++;
+      lccResyncRequired = true;
+    }
+    portEXIT_CRITICAL(&lccPendingMux);
+  }
+};
+
+// connects to the hub when notified by update, the socket is not used by
+// update while the state is LCC_CONNECTING.
+void lccConnectTask(void *arg) {
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    log_i("[LCC] Connecting to hub %s:%d", LCC_HUB_HOST, LCC_HUB_PORT);
+    if(lccSocket.connect(LCC_HUB_HOST, LCC_HUB_PORT)) {
+      lccState = LCC_CONNECTED;
+    } else {
+      log_w("[LCC] Unable to connect to hub");
+      lccState = LCC_CONNECT_FAILED;
+    }
+  }
+}
+
+void LCCInterface::init() {
+  lccNodeID = LCC_NODE_ID & 0xFFFFFFFFFFFFULL;
+  lccAliasSeed[0] = (lccNodeID >> 24) & 0xFFFFFF;
+  lccAliasSeed[1] = lccNodeID & 0xFFFFFF;
+  log_i("[LCC] Node ID %04X%08X", (uint32_t)(lccNodeID >> 32), (uint32_t)lccNodeID);
+  lccRebuildEvents();
+  StateObservers::registerObserver(new LCCStateObserver());
+  xTaskCreate(lccConnectTask, "LCCConnect", 4096, NULL, 1, &lccConnectTaskHandle);
+}
+
+void LCCInterface::update() {
+  if(lccEventsDirty) {
+    lccRebuildEvents();
+    // entries may have moved, restart any identification in progress
+    if(lccIdentifyIndex >= 0) {
+      lccIdentifyIndex = 0;
+    }
+  }
+  if(lccState == LCC_CONNECTING) {
+    return;
+  } else if(lccState == LCC_CONNECT_FAILED) {
+    // back off between connection attempts while the hub is unavailable
+    lccReconnectInterval = min(lccReconnectInterval * 2, (uint32_t)LCC_RECONNECT_MAX_INTERVAL);
+    lccLastConnectAttempt = millis();
+    lccState = LCC_DISCONNECTED;
+  } else if(lccState == LCC_CONNECTED) {
+    lccReconnectInterval = LCC_RECONNECT_MIN_INTERVAL;
+    lccSocket.setNoDelay(true);
+    lccFrameLength = 0;
+    lccReserveAlias();
+  } else if(lccState != LCC_DISCONNECTED && !lccSocket.connected()) {
+    log_w("[LCC] Disconnected from hub");
+    lccState = LCC_DISCONNECTED;
+  }
+  if(lccState == LCC_DISCONNECTED) {
+    if(millis() - lccLastConnectAttempt >= lccReconnectInterval) {
+      lccLastConnectAttempt = millis();
+      lccState = LCC_CONNECTING;
+      xTaskNotifyGive(lccConnectTaskHandle);
+    }
+    return;
+  }
+  while(lccSocket.available()) {
+    char ch = lccSocket.read();
+    if(ch == ':') {
+      lccFrameLength = 0;
+    } else if(ch == ';') {
+      lccParseFrame(lccFrame, lccFrameLength);
+      lccFrameLength = 0;
+      continue;
+    }
+    if(lccFrameLength < LCC_MAX_FRAME_LENGTH) {
+      lccFrame[lccFrameLength++] = ch;
+    }
+  }
+  if(lccState == LCC_RESERVING_ALIAS && millis() - lccStateChangeTime >= LCC_ALIAS_RESERVE_DELAY) {
+    uint8_t nodeID[6];
+    lccWriteBytes(lccNodeID, nodeID, 6);
+    lccSendControlFrame(LCC_CAN_RID);
+    lccSendControlFrame(LCC_CAN_AMD, nodeID, 6);
+    lccSendNodeIDMessage(LCC_MTI_INIT_COMPLETE);
+    lccState = LCC_PERMITTED;
+    lccStateChangeTime = millis();
+    log_i("[LCC] Node initialized with alias %03X", lccAlias);
+    // announce the current state of everything
+    lccStartIdentifyEvents();
+  }
+  if(lccState != LCC_PERMITTED) {
+    return;
+  }
+  // send any pending state changes
+  while(lccPendingCount) {
+    portENTER_CRITICAL(&lccPendingMux);
+    LCCEventEntry event = lccPendingEvents[lccPendingHead];
+    lccPendingHead = (lccPendingHead + 1) % LCC_MAX_PENDING_EVENTS;
+    lccPendingCount--;
+    portEXIT_CRITICAL(&lccPendingMux);
+    LCCEventEntry *entry = lccFindEventEntry(event.type, event.id);
+    if(entry != NULL) {
+      entry->state = event.state;
+      lccSendEventMessage(LCC_MTI_PCER, lccEventID(event.type, event.id, event.state));
+    }
+  }
+  if(lccResyncRequired) {
+    lccResyncRequired = false;
+    lccStartIdentifyEvents();
+  }
+  if(lccIdentifyIndex >= 0) {
+    for(uint8_t count = 0; count < LCC_IDENTIFY_BATCH && (size_t)lccIdentifyIndex < lccEvents.size(); count++) {
+      lccSendProducerIdentified(lccEvents[lccIdentifyIndex++]);
+    }
+    if((size_t)lccIdentifyIndex >= lccEvents.size()) {
+      lccIdentifyIndex = -1;
+    }
+  }
+}
+
+void LCCInterface::getState(JsonObject &root) {
+  root[F("connected")] = lccState == LCC_PERMITTED;
+  root[F("alias")] = lccAlias;
+  root[F("events")] = lccEvents.size();
+  root[F("received")] = lccFramesReceived;
+  root[F("sent")] = lccFramesSent;
+  root[F("aliasConflicts")] = lccAliasConflicts;
+  root[F("droppedEvents")] = lccPendingOverflows;
+}
+#endif
@@ -0,0 +1,61 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _LCC_INTERFACE_H_
+#define _LCC_INTERFACE_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// default TCP port used by OpenLCB GridConnect hubs
+#define LCC_DEFAULT_HUB_PORT 12021
+// time (in ms) to wait after sending CID frames before claiming the alias
+#define LCC_ALIAS_RESERVE_DELAY 200
+// minimum and maximum time (in ms) between hub connection attempts
+#define LCC_RECONNECT_MIN_INTERVAL 5000
+#define LCC_RECONNECT_MAX_INTERVAL 60000
+// maximum number of event state changes that can be pending transmission
+#define LCC_MAX_PENDING_EVENTS 64
+// number of event table entries identified per update when replying to an
+// Identify Events request
+#define LCC_IDENTIFY_BATCH 16
+// largest GridConnect frame that will be accepted from the hub
+#define LCC_MAX_FRAME_LENGTH 32
+
+// event table entry types, these form bits 14-15 of the event ID
+enum LCC_EVENT_TYPE {
+  LCC_EVENT_SENSOR = 0,
+  LCC_EVENT_TURNOUT = 1,
+  LCC_EVENT_OUTPUT = 2
+};
+
+// compact event table entry, the table is kept sorted by type and ID so that
+// event lookups do not need to walk the sensor/turnout/output lists.
+struct LCCEventEntry {
+  uint16_t id;
+  uint8_t type;
+  uint8_t state;
+};
+
+class LCCInterface {
+public:
+  static void init();
+  static void update();
+  static void getState(JsonObject &);
+};
+
+#endif
@@ -19,12 +19,19 @@ COPYRIGHT (c) 2017 Mike Dunston
 
 #include "Locomotive.h"
 #include "SignalGenerator.h"
+#include "StateObserver.h"
 
 LinkedList<Locomotive *> LocomotiveManager::_locos([](Locomotive *loco) {delete loco; });
+std::map<uint16_t, Locomotive *> LocomotiveManager::_locosByAddress;
+
+// functions covered by each of the function groups used by sendFunctionGroup
+const uint32_t locomotiveFunctionGroups[] = {
+  0x0000001F, 0x000001E0, 0x00001E00, 0x001FE000, 0x1FE00000
+};
 
 Locomotive::Locomotive(uint8_t registerNumber) :
   _registerNumber(registerNumber), _locoNumber(0), _speed(0), _direction(0),
-  _lastUpdate(0) {
+  _lastUpdate(0), _functions(0) {
 }
 
 void Locomotive::sendLocoUpdate() {
@@ -34,23 +41,113 @@ void Locomotive::sendLocoUpdate() {
   }
   packetBuffer.push_back(lowByte(_locoNumber));
   packetBuffer.push_back(0x3F);
+  DCC_PACKET_CLASS packetClass = DCC_PACKET_SPEED;
   if(_speed < 0) {
     _speed = 0;
     packetBuffer.push_back(1);
+    packetClass = DCC_PACKET_EMERGENCY_STOP;
   } else {
-    packetBuffer.push_back((uint8_t)(_speed + (_speed > 0) + _direction * 128));
+    packetBuffer.push_back(getSpeedByte());
   }
-  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, 0);
+  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, packetClass);
   _lastUpdate = millis();
 }
 
+void Locomotive::setFunction(uint8_t function, bool enabled) {
+  if(function > MAX_LOCOMOTIVE_FUNCTION) {
+    return;
+  }
+  bitWrite(_functions, function, enabled);
+  if(function <= 4) {
+    sendFunctionGroup(0);
+  } else if(function <= 8) {
+    sendFunctionGroup(1);
+  } else if(function <= 12) {
+    sendFunctionGroup(2);
+  } else if(function <= 20) {
+    sendFunctionGroup(3);
+  } else {
+    sendFunctionGroup(4);
+  }
+}
+
+// sets the state of all functions and sends the function groups that changed
+void Locomotive::setAllFunctions(uint32_t functions) {
+  functions &= (1UL << (MAX_LOCOMOTIVE_FUNCTION + 1)) - 1;
+  const uint32_t changed = _functions ^ functions;
+  _functions = functions;
+  for(uint8_t group = 0; group < 5; group++) {
+    if(changed & locomotiveFunctionGroups[group]) {
+      sendFunctionGroup(group);
+    }
+  }
+}
+
+// updates the tracked function state from the raw <f> command bytes, the
+// packet itself is sent by LocomotiveManager::processFunction.
+void Locomotive::updateFunctions(uint8_t functionByte, int16_t secondaryFunctionByte) {
+  if(secondaryFunctionByte >= 0) {
+    uint8_t firstFunction = (functionByte & 0x01) ? 21 : 13;
+    for(uint8_t bit = 0; bit < 8; bit++) {
+      bitWrite(_functions, firstFunction + bit, bitRead(secondaryFunctionByte, bit));
+    }
+  } else if((functionByte & 0xE0) == 0x80) {
+    // 100D DDDD: F0 is bit 4, F1-F4 are bits 0-3
+    bitWrite(_functions, 0, bitRead(functionByte, 4));
+    for(uint8_t bit = 0; bit < 4; bit++) {
+      bitWrite(_functions, 1 + bit, bitRead(functionByte, bit));
+    }
+  } else {
+    // 1011 DDDD: F5-F8, 1010 DDDD: F9-F12
+    uint8_t firstFunction = (functionByte & 0x10) ? 5 : 9;
+    for(uint8_t bit = 0; bit < 4; bit++) {
+      bitWrite(_functions, firstFunction + bit, bitRead(functionByte, bit));
+    }
+  }
+}
+
+// sends the function packet for one of the function groups:
+// 0: F0-F4, 1: F5-F8, 2: F9-F12, 3: F13-F20, 4: F21-F28
+void Locomotive::sendFunctionGroup(uint8_t group) {
+  std::vector<uint8_t> packetBuffer;
+  if(_locoNumber > 127) {
+    packetBuffer.push_back((uint8_t)(0xC0 | highByte(_locoNumber)));
+  }
+  packetBuffer.push_back(lowByte(_locoNumber));
+  switch(group) {
+    case 0:
+      packetBuffer.push_back(0x80 | (isFunctionEnabled(0) << 4) | ((_functions >> 1) & 0x0F));
+      break;
+    case 1:
+      packetBuffer.push_back(0xB0 | ((_functions >> 5) & 0x0F));
+      break;
+    case 2:
+      packetBuffer.push_back(0xA0 | ((_functions >> 9) & 0x0F));
+      break;
+    case 3:
+      packetBuffer.push_back(0xDE);
+      packetBuffer.push_back((_functions >> 13) & 0xFF);
+      break;
+    case 4:
+      packetBuffer.push_back(0xDF);
+      packetBuffer.push_back((_functions >> 21) & 0xFF);
+      break;
+  }
+  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, DCC_PACKET_FUNCTION);
+  StateObservers::locomotiveChanged(this);
+}
+
 void Locomotive::showStatus() {
   log_i("Loco(%d) locoNumber: %d, speed: %d, direction: %s",
     _registerNumber, _locoNumber, _speed, _direction ? "FWD" : "REV");
   wifiInterface.printf(F("<T %d %d %d>"), _registerNumber, _speed, _direction);
 }
 
-void LocomotiveManager::processThrottle(const std::vector<String> arguments) {
+void Locomotive::showState() {
+  wifiInterface.printf(F("<l %d %d %d %d>"), _locoNumber, _registerNumber, getSpeedByte(), _functions);
+}
+
+void LocomotiveManager::processThrottle(const DCCPPProtocolArguments &arguments) {
   int registerNumber = arguments[0].toInt();
   Locomotive *instance = NULL;
   for (const auto& loco : _locos) {
@@ -62,14 +159,115 @@ void LocomotiveManager::processThrottle(const std::vector<String> arguments) {
     instance = new Locomotive(registerNumber);
     _locos.add(instance);
   }
-  instance->setLocoNumber(arguments[1].toInt());
+  setLocoNumber(instance, arguments[1].toInt());
   instance->setSpeed(arguments[2].toInt());
   instance->setDirection(arguments[3].toInt() == 1);
   instance->sendLocoUpdate();
   instance->showStatus();
+  StateObservers::locomotiveChanged(instance);
+}
+
+// returns the locomotive register currently in use for the provided loco
+// number, if there is no register in use a new one is allocated using the
+// lowest available register number.
+Locomotive *LocomotiveManager::getLocomotive(const uint16_t locoNumber, const bool create) {
+  auto entry = _locosByAddress.find(locoNumber);
+  if(entry != _locosByAddress.end()) {
+    return entry->second;
+  }
+  if(!create) {
+    return NULL;
+  }
+  uint8_t registerNumber = 1;
+  bool registerInUse = true;
+  while(registerInUse) {
+    registerInUse = false;
+    for (const auto& loco : _locos) {
+      if(loco->getRegister() == registerNumber) {
+        registerInUse = true;
+        registerNumber++;
+      }
+    }
+  }
+  Locomotive *instance = new Locomotive(registerNumber);
+  instance->setLocoNumber(locoNumber);
+  addLocomotive(instance);
+  return instance;
+}
+
+// adds a locomotive that already has its register and loco number assigned
+void LocomotiveManager::addLocomotive(Locomotive *loco) {
+  _locos.add(loco);
+  _locosByAddress[loco->getLocoNumber()] = loco;
+}
+
+// changes the loco number of a register and keeps the address index in step
+void LocomotiveManager::setLocoNumber(Locomotive *loco, const uint16_t locoNumber) {
+  auto entry = _locosByAddress.find(loco->getLocoNumber());
+  if(loco->getLocoNumber() == locoNumber && entry != _locosByAddress.end() && entry->second == loco) {
+    return;
+  }
+  if(entry != _locosByAddress.end() && entry->second == loco) {
+    _locosByAddress.erase(entry);
+    // another register may still be using the previous address
+    for (const auto& other : _locos) {
+      if(other != loco && other->getLocoNumber() == loco->getLocoNumber()) {
+        _locosByAddress[other->getLocoNumber()] = other;
+      }
+    }
+  }
+  loco->setLocoNumber(locoNumber);
+  _locosByAddress[locoNumber] = loco;
+}
+
+void LocomotiveManager::processAddressThrottle(const DCCPPProtocolArguments &arguments) {
+  uint16_t locoNumber = arguments[0].toInt();
+  if(arguments.size() == 1) {
+    Locomotive *instance = getLocomotive(locoNumber, false);
+    if(instance != NULL) {
+      instance->showState();
+    } else {
+      wifiInterface.printf(F("<X>"));
+    }
+    return;
+  }
+  Locomotive *instance = getLocomotive(locoNumber);
+  instance->setSpeed(arguments[1].toInt());
+  instance->setDirection(arguments[2].toInt() == 1);
+  instance->sendLocoUpdate();
+  instance->showState();
+  StateObservers::locomotiveChanged(instance);
+}
+
+void LocomotiveManager::processAddressFunction(const DCCPPProtocolArguments &arguments) {
+  if(arguments.size() != 2 && arguments.size() != 3) {
+    wifiInterface.printf(F("<X>"));
+    return;
+  }
+  Locomotive *instance = getLocomotive(arguments[0].toInt());
+  if(arguments.size() == 3) {
+    uint8_t function = arguments[1].toInt();
+    if(function > MAX_LOCOMOTIVE_FUNCTION) {
+      wifiInterface.printf(F("<X>"));
+      return;
+    }
+    instance->setFunction(function, arguments[2].toInt() == 1);
+  } else {
+    instance->setAllFunctions(strtoul(arguments[1].c_str(), NULL, 10));
+  }
+  instance->showState();
 }
 
-void LocomotiveManager::processFunction(const std::vector<String> arguments) {
+void LocomotiveManager::emergencyStop() {
+  for (const auto& loco : _locos) {
+    loco->setSpeed(-1);
+    loco->sendLocoUpdate();
+    loco->showStatus();
+    StateObservers::locomotiveChanged(loco);
+  }
+}
+
+void LocomotiveManager::processFunction(const DCCPPProtocolArguments &arguments) {
   std::vector<uint8_t> packetBuffer;
   int locoNumber = arguments[0].toInt();
   int functionByte = arguments[1].toInt();
@@ -91,7 +289,13 @@ void LocomotiveManager::processFunction(const std::vector<String> arguments) {
     // be of binary form 10XX which should always be the case for FL,F1-F12
     packetBuffer.push_back((functionByte | 0x80) & 0xBF);
   }
-  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, 4);
+  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, DCC_PACKET_FUNCTION);
+  Locomotive *instance = getLocomotive(locoNumber, false);
+  if(instance != NULL) {
+    instance->updateFunctions(functionByte,
+      arguments.size() > 2 ? arguments[2].toInt() : -1);
+    StateObservers::locomotiveChanged(instance);
+  }
 }
 
 void LocomotiveManager::showStatus() {
@@ -19,6 +19,7 @@ COPYRIGHT (c) 2017 Mike Dunston
 #define _LOCOMOTIVE_H_
 
 #include <functional>
+#include <map>
 #include <StringArray.h>
 #include "DCCppProtocol.h"
 
@@ -40,6 +41,9 @@ public:
   int8_t setSpeed() {
     return _speed;
   }
+  int8_t getSpeed() {
+    return _speed;
+  }
   void setDirection(bool forward) {
     _direction = forward;
   }
@@ -49,38 +53,82 @@ public:
   uint32_t getLastUpdate() {
     return _lastUpdate;
   }
+  bool isFunctionEnabled(uint8_t function) {
+    return bitRead(_functions, function);
+  }
+  uint32_t getFunctions() {
+    return _functions;
+  }
+  void setFunctions(uint32_t functions) {
+    _functions = functions;
+  }
+  // speed and direction as sent in the DCC speed packet
+  uint8_t getSpeedByte() {
+    return _speed + (_speed > 0) + _direction * 128;
+  }
+  void setFunction(uint8_t, bool);
+  void setAllFunctions(uint32_t);
+  void updateFunctions(uint8_t, int16_t=-1);
   void sendLocoUpdate();
+  void sendFunctionGroup(uint8_t);
   void showStatus();
+  void showState();
 private:
   uint8_t _registerNumber;
   uint16_t _locoNumber;
   int8_t _speed;
   bool _direction;
   uint32_t _lastUpdate;
+  uint32_t _functions;
 };
 
+// maximum function number supported by the function packets (F0-F28)
+#define MAX_LOCOMOTIVE_FUNCTION 28
+
 class LocomotiveManager {
 public:
   static void update();
-  static void processThrottle(const std::vector<String> arguments);
-  static void processFunction(const std::vector<String> arguments);
+  static void processThrottle(const DCCPPProtocolArguments &arguments);
+  static void processFunction(const DCCPPProtocolArguments &arguments);
+  static void processAddressThrottle(const DCCPPProtocolArguments &arguments);
+  static void processAddressFunction(const DCCPPProtocolArguments &arguments);
   static void showStatus();
+  static Locomotive *getLocomotive(const uint16_t, const bool=true);
+  static void addLocomotive(Locomotive *);
+  static void emergencyStop();
   static uint8_t getActiveLocoCount() {
     return _locos.length();
   }
+  static LinkedList<Locomotive *> &getLocomotives() {
+    return _locos;
+  }
 private:
+  static void setLocoNumber(Locomotive *, const uint16_t);
   static LinkedList<Locomotive *> _locos;
+  // locomotives by loco number (address), when more than one register uses
+  // the same address this is the register that was assigned it last.
+  static std::map<uint16_t, Locomotive *> _locosByAddress;
 };
 
 // <t {REGISTER} {LOCO} {SPEED} {DIRECTION}> command handler, this command
 // converts the provided locomotive control command into a compatible DCC
 // locomotive control packet.
+// <t {LOCO} {SPEED} {DIRECTION}> is the register-less (DCC-EX) form of the
+// same command, a register is assigned to the LOCO automatically and the
+// reply is <l {LOCO} {REGISTER} {SPEEDBYTE} {FUNCTIONS}>.
+// <t {LOCO}> replies with the <l> state of the LOCO or <X> if it is unknown.
 class ThrottleCommandAdapter : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
-    LocomotiveManager::processThrottle(arguments);
+  void process(const DCCPPProtocolArguments &arguments) {
+    if(arguments.size() == 4) {
+      LocomotiveManager::processThrottle(arguments);
+    } else if(arguments.size() == 3 || arguments.size() == 1) {
+      LocomotiveManager::processAddressThrottle(arguments);
+    } else {
+      wifiInterface.printf(F("<X>"));
+    }
   }
-  String getID() {
+  const char *getID() {
     return "t";
   }
 };
@@ -89,11 +137,26 @@ public:
 // locomotive function update into a compatible DCC function control packet.
 class FunctionCommandAdapter : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments) {
+  void process(const DCCPPProtocolArguments &arguments) {
     LocomotiveManager::processFunction(arguments);
   }
-  String getID() {
+  const char *getID() {
     return "f";
   }
 };
+
+// <F {LOCO} {FUNCTION} {STATE}> command handler, this command turns a single
+// function (0-28) of the LOCO on (1) or off (0).
+// <F {LOCO} {FUNCTIONS}> sets the state of all functions of the LOCO from a
+// bitmap (bit 0 is F0), only the function groups that changed are sent.
+// Both forms reply with <l {LOCO} {REGISTER} {SPEEDBYTE} {FUNCTIONS}>.
+class AddressFunctionCommandAdapter : public DCCPPProtocolCommand {
+public:
+  void process(const DCCPPProtocolArguments &arguments) {
+    LocomotiveManager::processAddressFunction(arguments);
+  }
+  const char *getID() {
+    return "F";
+  }
+};
 #endif
@@ -0,0 +1,457 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <WiFi.h>
+#include <PubSubClient.h>
+
+#include "MQTTInterface.h"
+#include "StateObserver.h"
+#include "MotorBoard.h"
+#include "Locomotive.h"
+#include "Turnouts.h"
+#include "Outputs.h"
+#include "Sensors.h"
+#include "CommandQueue.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can publish the layout state to an MQTT broker and
+accept commands from it. All topics are prefixed with MQTT_TOPIC_PREFIX.
+
+State is published as retained messages so that a new subscriber receives the
+current state immediately:
+
+  PREFIX/status                 online / offline (last will)
+  PREFIX/sensor/ID              ACTIVE / INACTIVE
+  PREFIX/turnout/ID             THROWN / CLOSED / FAILED (feedback sensors
+                                did not confirm the position)
+  PREFIX/output/ID              ON / OFF
+  PREFIX/power/NAME             ON / OFF / FAULT
+  PREFIX/loco/ADDRESS           {"speed":SPEED,"forward":DIR,"functions":BITS}
+
+State changes are collected for MQTT_BATCH_WINDOW ms before being published,
+multiple changes to the same topic within the window are only published once.
+The full state is published every time the broker connection is established.
+
+Commands are accepted on the following topics:
+
+  PREFIX/turnout/ID/set               THROWN / CLOSED / TOGGLE
+  PREFIX/output/ID/set                ON / OFF / TOGGLE
+  PREFIX/power/set                    ON / OFF
+  PREFIX/loco/ADDRESS/set             {"speed":SPEED,"forward":DIR}
+  PREFIX/loco/ADDRESS/function/N/set  ON / OFF / TOGGLE
+  PREFIX/command                      any DCC++ command, ie: <T 1 1>
+
+The broker connection is established by a separate task so that an
+unreachable broker (or a slow DNS lookup) does not block the scheduler, the
+MQTT client is not used by update while a connection attempt is in progress.
+
+**********************************************************************/
+
+#if defined(MQTT_ENABLED) && MQTT_ENABLED
+
+#ifndef MQTT_BROKER_PORT
+#define MQTT_BROKER_PORT 1883
+#endif
+
+#ifndef MQTT_TOPIC_PREFIX
+#define MQTT_TOPIC_PREFIX "dccpp"
+#endif
+
+// largest command payload that will be accepted
+#define MQTT_MAX_COMMAND_PAYLOAD 128
+
+// pending publish record types
+#define MQTT_RECORD_SENSOR 0
+#define MQTT_RECORD_TURNOUT 1
+#define MQTT_RECORD_OUTPUT 2
+#define MQTT_RECORD_POWER 3
+#define MQTT_RECORD_LOCO 4
+
+// broker connection states
+#define MQTT_STATE_DISCONNECTED 0
+#define MQTT_STATE_CONNECTING 1
+#define MQTT_STATE_CONNECT_FAILED 2
+#define MQTT_STATE_CONNECT_DONE 3
+#define MQTT_STATE_CONNECTED 4
+
+struct MQTTPendingRecord {
+  uint8_t type;
+  uint16_t id;
+  uint8_t state;
+};
+
+extern LinkedList<Sensor *> sensors;
+extern LinkedList<Turnout *> turnouts;
+extern LinkedList<Output *> outputs;
+
+WiFiClient mqttSocket;
+PubSubClient mqttClient(mqttSocket);
+// state changes pending publish, these are added by the observer which can be
+// called from any task. The topic and payload are only formatted when the
+// record is published by update.
+MQTTPendingRecord mqttPendingPublish[MQTT_MAX_PENDING_PUBLISH];
+uint8_t mqttPendingCount = 0;
+uint32_t mqttBatchStart = 0;
+volatile bool mqttSnapshotRequired = false;
+portMUX_TYPE mqttPendingMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t mqttLastConnectAttempt = 0;
+uint32_t mqttReconnectInterval = MQTT_RECONNECT_MIN_INTERVAL;
+uint32_t mqttPublishCount = 0;
+uint32_t mqttCommandCount = 0;
+uint32_t mqttConnectCount = 0;
+uint32_t mqttOverflowCount = 0;
+int8_t mqttCommandQueue = COMMAND_QUEUE_SHARED_CLIENT;
+TaskHandle_t mqttConnectTaskHandle = NULL;
+volatile uint8_t mqttState = MQTT_STATE_DISCONNECTED;
+
+void mqttQueuePublish(uint8_t type, uint16_t id, uint8_t state) {
+  portENTER_CRITICAL(&mqttPendingMux);
+  if(!mqttPendingCount) {
+    mqttBatchStart = millis();
+  }
+  bool queued = false;
+  for(uint8_t index = 0; index < mqttPendingCount && !queued; index++) {
+    if(mqttPendingPublish[index].type == type && mqttPendingPublish[index].id == id) {
+      mqttPendingPublish[index].state = state;
+      queued = true;
+    }
+  }
+  if(!queued) {
+    if(mqttPendingCount < MQTT_MAX_PENDING_PUBLISH) {
+      mqttPendingPublish[mqttPendingCount++] = {type, id, state};
+    } else {
+      // the batch is full, the change will be published via a snapshot
+      mqttOverflowCount++;
+      mqttSnapshotRequired = true;
+    }
+  }
+  portEXIT_CRITICAL(&mqttPendingMux);
+}
+
+void mqttClearPending() {
+  portENTER_CRITICAL(&mqttPendingMux);
+  mqttPendingCount = 0;
+  portEXIT_CRITICAL(&mqttPendingMux);
+}
+
+// publishes immediately, bypassing the batch window
+void mqttPublish(const String &topic, const String &payload) {
+  String fullTopic = String(MQTT_TOPIC_PREFIX "/") + topic;
+  mqttClient.publish(fullTopic.c_str(), payload.c_str(), true);
+  mqttPublishCount++;
+}
+
+String mqttLocomotivePayload(Locomotive *loco) {
+  return String("{\"speed\":") + String(loco->getSpeed()) +
+    String(",\"forward\":") + String(loco->isDirectionForward() ? "true" : "false") +
+    String(",\"functions\":") + String(loco->getFunctions()) + String("}");
+}
+
+const char *mqttTurnoutPayload(bool thrown, bool failed) {
+  return failed ? "FAILED" : (thrown ? "THROWN" : "CLOSED");
+}
+
+const char *mqttPowerPayload(bool on, bool overCurrent) {
+  return on ? "ON" : (overCurrent ? "FAULT" : "OFF");
+}
+
+// publishes the full layout state, this is done directly rather than via the
+// batch queue since every topic is distinct.
+void mqttPublishSnapshot() {
+  for (const auto& sensor : sensors) {
+    mqttPublish(String("sensor/") + String(sensor->getID()), sensor->isActive() ? "ACTIVE" : "INACTIVE");
+  }
+  for (const auto& turnout : turnouts) {
+    mqttPublish(String("turnout/") + String(turnout->getID()), mqttTurnoutPayload(turnout->isThrown(),
+      turnout->isPositionFailed()));
+  }
+  for (const auto& output : outputs) {
+    mqttPublish(String("output/") + String(output->getID()), output->isActive() ? "ON" : "OFF");
+  }
+  for (const auto& name : MotorBoardManager::getBoardNames()) {
+    GenericMotorBoard *board = MotorBoardManager::getBoardByName(name);
+    mqttPublish(String("power/") + name, mqttPowerPayload(board->isOn(), board->isOverCurrent()));
+  }
+  for (const auto& loco : LocomotiveManager::getLocomotives()) {
+    mqttPublish(String("loco/") + String(loco->getLocoNumber()), mqttLocomotivePayload(loco));
+  }
+}
+
+void mqttPublishRecord(const MQTTPendingRecord &record) {
+  if(record.type == MQTT_RECORD_SENSOR) {
+    mqttPublish(String("sensor/") + String(record.id), record.state ? "ACTIVE" : "INACTIVE");
+  } else if(record.type == MQTT_RECORD_TURNOUT) {
+    mqttPublish(String("turnout/") + String(record.id), mqttTurnoutPayload(record.state == 1, record.state == 2));
+  } else if(record.type == MQTT_RECORD_OUTPUT) {
+    mqttPublish(String("output/") + String(record.id), record.state ? "ON" : "OFF");
+  } else if(record.type == MQTT_RECORD_POWER) {
+    std::vector<String> boardNames = MotorBoardManager::getBoardNames();
+    if(record.id < boardNames.size()) {
+      mqttPublish(String("power/") + boardNames[record.id], mqttPowerPayload(record.state == 1, record.state == 2));
+    }
+  } else if(record.type == MQTT_RECORD_LOCO) {
+    Locomotive *loco = LocomotiveManager::getLocomotive(record.id, false);
+    if(loco != NULL) {
+      mqttPublish(String("loco/") + String(record.id), mqttLocomotivePayload(loco));
+    }
+  }
+}
+
+void mqttFlush() {
+  MQTTPendingRecord records[MQTT_MAX_PENDING_PUBLISH];
+  portENTER_CRITICAL(&mqttPendingMux);
+  uint8_t count = mqttPendingCount;
+  memcpy(records, mqttPendingPublish, sizeof(MQTTPendingRecord) * count);
+  mqttPendingCount = 0;
+  portEXIT_CRITICAL(&mqttPendingMux);
+  for(uint8_t index = 0; index < count; index++) {
+    mqttPublishRecord(records[index]);
+  }
+}
+
+// returns 1 for ON/THROWN/ACTIVE/1, 0 for OFF/CLOSED/INACTIVE/0, 2 for TOGGLE
+// and -1 for anything else.
+int8_t mqttParseState(const char *payload) {
+  if(!strcasecmp(payload, "ON") || !strcasecmp(payload, "THROWN") ||
+     !strcasecmp(payload, "ACTIVE") || !strcmp(payload, "1")) {
+    return 1;
+  } else if(!strcasecmp(payload, "OFF") || !strcasecmp(payload, "CLOSED") ||
+     !strcasecmp(payload, "INACTIVE") || !strcmp(payload, "0")) {
+    return 0;
+  } else if(!strcasecmp(payload, "TOGGLE")) {
+    return 2;
+  }
+  return -1;
+}
+
+void mqttMessageReceived(char *topic, byte *data, unsigned int length) {
+  char payload[MQTT_MAX_COMMAND_PAYLOAD];
+  length = min(length, (unsigned int)sizeof(payload) - 1);
+  memcpy(payload, data, length);
+  payload[length] = 0;
+  const size_t prefixLength = strlen(MQTT_TOPIC_PREFIX "/");
+  if(strncmp(topic, MQTT_TOPIC_PREFIX "/", prefixLength)) {
+    return;
+  }
+  log_d("[MQTT] %s: %s", topic, payload);
+  mqttCommandCount++;
+  // split the remainder of the topic into its parts
+  char *parts[5] = {NULL};
+  uint8_t partCount = 0;
+  char *tokenState = NULL;
+  char *token = strtok_r(topic + prefixLength, "/", &tokenState);
+  while(token != NULL && partCount < 5) {
+    parts[partCount++] = token;
+    token = strtok_r(NULL, "/", &tokenState);
+  }
+  int8_t state = mqttParseState(payload);
+  if(partCount == 1 && !strcmp(parts[0], "command")) {
+    // strip the optional < > around the command
+    char *command = payload;
+    if(command[0] == '<') {
+      command++;
+    }
+    char *end = strchr(command, '>');
+    if(end != NULL) {
+      *end = 0;
+    }
+    CommandQueue::enqueue(mqttCommandQueue, command);
+  } else if(partCount == 2 && !strcmp(parts[0], "power") && !strcmp(parts[1], "set")) {
+    if(state == 1) {
+      MotorBoardManager::powerOnAll();
+    } else if(state == 0) {
+      MotorBoardManager::powerOffAll();
+    }
+  } else if(partCount == 3 && !strcmp(parts[0], "turnout") && !strcmp(parts[2], "set")) {
+    uint16_t turnoutID = atoi(parts[1]);
+    if(state == 2) {
+      TurnoutManager::toggle(turnoutID);
+    } else if(state >= 0) {
+      TurnoutManager::set(turnoutID, state == 1);
+    }
+  } else if(partCount == 3 && !strcmp(parts[0], "output") && !strcmp(parts[2], "set")) {
+    uint16_t outputID = atoi(parts[1]);
+    if(state == 2) {
+      OutputManager::toggle(outputID);
+    } else if(state >= 0) {
+      OutputManager::set(outputID, state == 1);
+    }
+  } else if(partCount == 3 && !strcmp(parts[0], "loco") && !strcmp(parts[2], "set")) {
+    StaticJsonBuffer<200> jsonBuffer;
+    JsonObject &root = jsonBuffer.parseObject(payload);
+    if(root.success()) {
+      Locomotive *loco = LocomotiveManager::getLocomotive(atoi(parts[1]));
+      if(root.containsKey("speed")) {
+        loco->setSpeed(root["speed"].as<int>());
+      }
+      if(root.containsKey("forward")) {
+        loco->setDirection(root["forward"].as<bool>());
+      }
+      loco->sendLocoUpdate();
+      loco->showStatus();
+      StateObservers::locomotiveChanged(loco);
+    } else {
+      log_w("[MQTT] Unable to parse loco command: %s", payload);
+    }
+  } else if(partCount == 5 && !strcmp(parts[0], "loco") &&
+    !strcmp(parts[2], "function") && !strcmp(parts[4], "set") && state >= 0) {
+    const int function = atoi(parts[3]);
+    if(function < 0 || function > MAX_LOCOMOTIVE_FUNCTION) {
+      log_w("[MQTT] Invalid function %d for loco %s", function, parts[1]);
+      return;
+    }
+    Locomotive *loco = LocomotiveManager::getLocomotive(atoi(parts[1]));
+    loco->setFunction(function, state == 2 ? !loco->isFunctionEnabled(function) : state == 1);
+  } else {
+    log_w("[MQTT] Unsupported topic %s", topic);
+  }
+}
+
+// establishes the broker connection when notified by update, the result is
+// handed back to update via mqttState.
+void mqttConnectTask(void *arg) {
+  const String clientID = String(HOSTNAME "-") + String((uint32_t)ESP.getEfuseMac(), HEX);
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    log_i("[MQTT] Connecting to %s:%d", MQTT_BROKER_HOST, MQTT_BROKER_PORT);
+#if defined(MQTT_USERNAME) && defined(MQTT_PASSWORD)
+    bool connected = mqttClient.connect(clientID.c_str(), MQTT_USERNAME, MQTT_PASSWORD,
+      MQTT_TOPIC_PREFIX "/status", 0, true, "offline");
+#else
+    bool connected = mqttClient.connect(clientID.c_str(), MQTT_TOPIC_PREFIX "/status", 0, true, "offline");
+#endif
+    if(connected) {
+      log_i("[MQTT] Connected as %s", clientID.c_str());
+      mqttState = MQTT_STATE_CONNECT_DONE;
+    } else {
+      log_w("[MQTT] Connection failed, state: %d", mqttClient.state());
+      mqttState = MQTT_STATE_CONNECT_FAILED;
+    }
+  }
+}
+
+// completes a new broker connection, this is called by update once the
+// connect task has connected.
+void mqttConnected() {
+  mqttConnectCount++;
+  mqttClient.publish(MQTT_TOPIC_PREFIX "/status", "online", true);
+  mqttClient.subscribe(MQTT_TOPIC_PREFIX "/command");
+  mqttClient.subscribe(MQTT_TOPIC_PREFIX "/power/set");
+  mqttClient.subscribe(MQTT_TOPIC_PREFIX "/turnout/+/set");
+  mqttClient.subscribe(MQTT_TOPIC_PREFIX "/output/+/set");
+  mqttClient.subscribe(MQTT_TOPIC_PREFIX "/loco/+/set");
+  mqttClient.subscribe(MQTT_TOPIC_PREFIX "/loco/+/function/+/set");
+  // anything pending is covered by the snapshot
+  mqttSnapshotRequired = false;
+  mqttClearPending();
+  mqttPublishSnapshot();
+}
+
+void mqttStartConnect() {
+  mqttLastConnectAttempt = millis();
+  mqttState = MQTT_STATE_CONNECTING;
+  xTaskNotifyGive(mqttConnectTaskHandle);
+}
+
+class MQTTStateObserver : public StateObserver {
+public:
+  void sensorChanged(uint16_t id, bool active) {
+    mqttQueuePublish(MQTT_RECORD_SENSOR, id, active);
+  }
+  void turnoutChanged(uint16_t id, bool thrown) {
+    mqttQueuePublish(MQTT_RECORD_TURNOUT, id, thrown);
+  }
+  void turnoutFailed(uint16_t id, bool thrown) {
+    mqttQueuePublish(MQTT_RECORD_TURNOUT, id, 2);
+  }
+  void outputChanged(uint16_t id, bool active) {
+    mqttQueuePublish(MQTT_RECORD_OUTPUT, id, active);
+  }
+  void powerChanged(const String &name, bool on, bool overCurrent) {
+    uint16_t boardIndex = 0;
+    for (const auto& boardName : MotorBoardManager::getBoardNames()) {
+      if(boardName == name) {
+        mqttQueuePublish(MQTT_RECORD_POWER, boardIndex, on ? 1 : (overCurrent ? 2 : 0));
+        return;
+      }
+      boardIndex++;
+    }
+  }
+  void locomotiveChanged(Locomotive *loco) {
+    // the payload is built from the locomotive state when it is published
+    mqttQueuePublish(MQTT_RECORD_LOCO, loco->getLocoNumber(), 0);
+  }
+};
+
+void MQTTInterface::init() {
+  mqttCommandQueue = CommandQueue::registerClient("mqtt");
+  mqttClient.setServer(MQTT_BROKER_HOST, MQTT_BROKER_PORT);
+  mqttClient.setCallback(mqttMessageReceived);
+  StateObservers::registerObserver(new MQTTStateObserver());
+  xTaskCreate(mqttConnectTask, "MQTTConnect", 4096, NULL, 1, &mqttConnectTaskHandle);
+  mqttStartConnect();
+}
+
+void MQTTInterface::update() {
+  if(mqttState == MQTT_STATE_CONNECT_DONE) {
+    mqttReconnectInterval = MQTT_RECONNECT_MIN_INTERVAL;
+    mqttState = MQTT_STATE_CONNECTED;
+    mqttConnected();
+  } else if(mqttState == MQTT_STATE_CONNECT_FAILED) {
+    // back off between connection attempts while the broker is unavailable
+    mqttReconnectInterval = min(mqttReconnectInterval * 2, (uint32_t)MQTT_RECONNECT_MAX_INTERVAL);
+    mqttLastConnectAttempt = millis();
+    mqttState = MQTT_STATE_DISCONNECTED;
+  } else if(mqttState == MQTT_STATE_CONNECTED && !mqttClient.connected()) {
+    log_w("[MQTT] Connection lost, state: %d", mqttClient.state());
+    mqttState = MQTT_STATE_DISCONNECTED;
+  }
+  if(mqttState != MQTT_STATE_CONNECTED) {
+    if(mqttState == MQTT_STATE_DISCONNECTED &&
+      millis() - mqttLastConnectAttempt >= mqttReconnectInterval) {
+      mqttStartConnect();
+    }
+    // drop anything older than the batch window while disconnected, the
+    // full state will be published on reconnect.
+    if(mqttPendingCount && millis() - mqttBatchStart >= MQTT_BATCH_WINDOW) {
+      mqttClearPending();
+    }
+    mqttSnapshotRequired = false;
+    return;
+  }
+  mqttClient.loop();
+  if(mqttSnapshotRequired) {
+    mqttSnapshotRequired = false;
+    // the snapshot covers anything that is pending
+    mqttClearPending();
+    mqttPublishSnapshot();
+  } else if(mqttPendingCount && millis() - mqttBatchStart >= MQTT_BATCH_WINDOW) {
+    mqttFlush();
+  }
+}
+
+void MQTTInterface::getState(JsonObject &root) {
+  root[F("connected")] = mqttState == MQTT_STATE_CONNECTED;
+  root[F("connects")] = mqttConnectCount;
+  root[F("published")] = mqttPublishCount;
+  root[F("commands")] = mqttCommandCount;
+  root[F("pending")] = mqttPendingCount;
+  root[F("overflows")] = mqttOverflowCount;
+}
+#endif
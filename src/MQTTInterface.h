@@ -0,0 +1,40 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _MQTT_INTERFACE_H_
+#define _MQTT_INTERFACE_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// time (in ms) state changes are collected before being published, multiple
+// changes to the same topic within the window are published once.
+#define MQTT_BATCH_WINDOW 50
+// maximum number of distinct topics that can be pending publish
+#define MQTT_MAX_PENDING_PUBLISH 64
+// minimum and maximum time (in ms) between broker connection attempts
+#define MQTT_RECONNECT_MIN_INTERVAL 5000
+#define MQTT_RECONNECT_MAX_INTERVAL 60000
+
+class MQTTInterface {
+public:
+  static void init();
+  static void update();
+  static void getState(JsonObject &);
+};
+
+#endif
@@ -17,12 +17,11 @@ COPYRIGHT (c) 2017 Mike Dunston
 
 #include "DCCppESP32.h"
 #include "MotorBoard.h"
+#include "StateObserver.h"
+#include "FaultCapture.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
-const uint16_t motorBoardCheckInterval = 250;
-const uint16_t motorBoardCheckFaultCountdownInterval = 40;
-
 LinkedList<GenericMotorBoard *> motorBoards([](GenericMotorBoard *board) {delete board; });
 
 GenericMotorBoard::GenericMotorBoard(adc1_channel_t senseChannel, uint8_t enablePin,
@@ -39,15 +38,24 @@ GenericMotorBoard::GenericMotorBoard(adc1_channel_t senseChannel, uint8_t enable
 
 void GenericMotorBoard::powerOn(bool announce) {
   log_i("[%s] Enabling DCC Signal", _name.c_str());
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  setRailComTrackPower(_enablePin, true);
+#endif
   digitalWrite(_enablePin, HIGH);
   _state = true;
 	if(announce) {
 		wifiInterface.printf(F("<p1 %s>"), _name.c_str());
 	}
+	StateObservers::powerChanged(_name, true, false);
 }
 
 void GenericMotorBoard::powerOff(bool announce, bool overCurrent) {
   log_i("[%s] Disabling DCC Signal", _name.c_str());
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  // this must be cleared before the pin is set LOW so an active RailCom
+  // cutout does not turn the track back on.
+  setRailComTrackPower(_enablePin, false);
+#endif
   digitalWrite(_enablePin, LOW);
   _state = false;
 	if(announce) {
@@ -57,6 +65,7 @@ void GenericMotorBoard::powerOff(bool announce, bool overCurrent) {
 			wifiInterface.printf(F("<p0 %s>"), _name.c_str());
 		}
 	}
+	StateObservers::powerChanged(_name, false, overCurrent);
 }
 
 void GenericMotorBoard::showStatus() {
@@ -69,30 +78,31 @@ void GenericMotorBoard::showStatus() {
 }
 
 void GenericMotorBoard::check() {
-	// if we have exceeded the CURRENT_SAMPLE_TIME we need to check if we are over/under current.
-	if(millis() - _lastCheckTime > motorBoardCheckInterval) {
-    _lastCheckTime = millis();
-		_current = adc1_get_raw(_senseChannel);
-		if(_current >= _triggerValue && isOn()) {
-      log_i("[%s] Overcurrent detected %2.2f mA", _name.c_str(), getCurrentDraw());
-			powerOff(true, true);
-			_triggered = true;
-      _triggerClearedCountdown = motorBoardCheckFaultCountdownInterval;
-      _triggerRecurrenceCount = 0;
-    } else if(_current >= _triggerValue && _triggered) {
-      _triggerRecurrenceCount++;
-      log_i("[%s] Overcurrent persists (%d ms) %2.2f mA", _name.c_str(), _triggerRecurrenceCount * motorBoardCheckInterval, getCurrentDraw());
-		} else if(_current < _triggerValue && _triggered) {
-      _triggerClearedCountdown--;
-      if(_triggerClearedCountdown == 0) {
-        log_i("[%s] Overcurrent cleared, enabling", _name.c_str());
-  			powerOn();
-  			_triggered=false;
-      } else {
-        log_i("[%s] Overcurrent cleared, %d ms before re-enable", _name.c_str(), _triggerClearedCountdown * motorBoardCheckInterval);
-      }
+	// this is called by the scheduler every motorBoardCheckInterval ms to check
+	// if we are over/under current.
+	_current = adc1_get_raw(_senseChannel);
+	if(_current >= _triggerValue && isOn()) {
+    log_i("[%s] Overcurrent detected %2.2f mA", _name.c_str(), getCurrentDraw());
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+		FaultCapture::trigger(this);
+#endif
+		powerOff(true, true);
+		_triggered = true;
+    _triggerClearedCountdown = motorBoardCheckFaultCountdownInterval;
+    _triggerRecurrenceCount = 0;
+  } else if(_current >= _triggerValue && _triggered) {
+    _triggerRecurrenceCount++;
+    log_i("[%s] Overcurrent persists (%d ms) %2.2f mA", _name.c_str(), _triggerRecurrenceCount * motorBoardCheckInterval, getCurrentDraw());
+	} else if(_current < _triggerValue && _triggered) {
+    _triggerClearedCountdown--;
+    if(_triggerClearedCountdown == 0) {
+      log_i("[%s] Overcurrent cleared, enabling", _name.c_str());
+			powerOn();
+			_triggered=false;
+    } else {
+      log_i("[%s] Overcurrent cleared, %d ms before re-enable", _name.c_str(), _triggerClearedCountdown * motorBoardCheckInterval);
     }
-	}
+  }
 }
 
 GenericMotorBoard * MotorBoardManager::registerBoard(adc1_channel_t sensePin, uint8_t enablePin, MOTOR_BOARD_TYPE type, String name) {
@@ -168,9 +178,9 @@ bool MotorBoardManager::powerOff(const String name) {
   return false;
 }
 
-int MotorBoardManager::getLastRead(const String name) {
+int MotorBoardManager::getLastRead(const char *name) {
   for (const auto& board : motorBoards) {
-    if(name.equalsIgnoreCase(board->getName()) == 0) {
+    if(!strcasecmp(name, board->getName().c_str())) {
       return board->getLastRead();
     }
   }
@@ -210,21 +220,21 @@ void MotorBoardManager::getState(JsonArray &array) {
  	}
 }
 
-void CurrentDrawCommand::process(const std::vector<String> arguments) {
+void CurrentDrawCommand::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.size() == 0) {
     MotorBoardManager::showStatus();
   } else {
-    wifiInterface.printf(F("<a %d %s>"), MotorBoardManager::getLastRead(arguments[0]), arguments[0].c_str());
+    wifiInterface.printf(F("<a %d %s>"), MotorBoardManager::getLastRead(arguments[0].c_str()), arguments[0].c_str());
   }
 }
 
-void PowerOnCommand::process(const std::vector<String> arguments) {
+void PowerOnCommand::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.size() == 0) {
     MotorBoardManager::powerOnAll();
   }
 }
 
-void PowerOffCommand::process(const std::vector<String> arguments) {
+void PowerOffCommand::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.size() == 0) {
     MotorBoardManager::powerOffAll();
   }
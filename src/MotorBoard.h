@@ -25,8 +25,23 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include "DCCppProtocol.h"
 #include "SignalGenerator.h"
 
+// interval (in ms) between current checks of each motor board
+const uint16_t motorBoardCheckInterval = 250;
+// number of check intervals a fault must be clear before re-enabling power
+const uint16_t motorBoardCheckFaultCountdownInterval = 40;
+
 enum MOTOR_BOARD_TYPE { ARDUINO_SHIELD, POLOLU, BTS7960B_5A, BTS7960B_10A };
 
+// additional power district driven from the OPERATIONS DCC signal, see
+// BOOSTER_DISTRICTS in Config.h.
+struct BoosterDistrict {
+	uint8_t signalPin;
+	uint8_t enablePin;
+	adc1_channel_t currentSense;
+	MOTOR_BOARD_TYPE type;
+	const char *name;
+};
+
 class GenericMotorBoard {
 public:
 	GenericMotorBoard(adc1_channel_t, uint8_t, uint16_t, uint32_t, String);
@@ -40,7 +55,7 @@ public:
 	bool isOverCurrent() {
 		return _triggered;
 	}
-	const String getName() {
+	const String &getName() {
 		return _name;
 	}
 	const adc1_channel_t getADC1Channel() {
@@ -52,6 +67,9 @@ public:
 	const uint32_t getMaxMilliAmps() {
 		return _maxMilliAmps;
 	}
+	const uint32_t getTriggerValue() {
+		return _triggerValue;
+	}
 	float getCurrentDraw() {
 		return (float)((_current * _maxMilliAmps) / 4096.0f);
 	}
@@ -62,7 +80,6 @@ private:
 	const uint32_t _maxMilliAmps;
 	const uint32_t _triggerValue;
 	uint32_t _current;
-	uint32_t _lastCheckTime;
 	bool _state;
 	bool _triggered;
 	uint8_t _triggerClearedCountdown;
@@ -80,31 +97,31 @@ public:
 	static bool powerOn(const String);
 	static void powerOffAll();
 	static bool powerOff(const String);
-	static int getLastRead(const String);
+	static int getLastRead(const char *);
 	static void showStatus();
 	static void getState(JsonArray &);
 };
 
 class CurrentDrawCommand : public DCCPPProtocolCommand {
 public:
-	void process(const std::vector<String>);
-	String getID() {
+	void process(const DCCPPProtocolArguments &);
+	const char *getID() {
     return "c";
   }
 };
 
 class PowerOnCommand : public DCCPPProtocolCommand {
 public:
-	void process(const std::vector<String>);
-	String getID() {
+	void process(const DCCPPProtocolArguments &);
+	const char *getID() {
     return "1";
   }
 };
 
 class PowerOffCommand : public DCCPPProtocolCommand {
 public:
-	void process(const std::vector<String>);
-	String getID() {
+	void process(const DCCPPProtocolArguments &);
+	const char *getID() {
     return "0";
   }
 };
@@ -0,0 +1,304 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <WiFiUdp.h>
+
+#include "MulticastBroadcaster.h"
+#include "StateObserver.h"
+#include "MotorBoard.h"
+#include "Turnouts.h"
+#include "Outputs.h"
+#include "Sensors.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can send sensor, turnout, output and track power state
+changes to a UDP multicast group so that any number of passive listeners
+(dispatch panels, signal displays, loggers) can follow the layout state without
+using one of the MAX_DCCPP_CLIENTS TCP connections.
+
+Every datagram starts with a 13 byte header (multi-byte values little endian):
+
+  0-1:   'D' 'M'
+  2:     version (1)
+  3:     kind, 1 = state changes, 2 = snapshot, 3 = last snapshot datagram
+  4-7:   sequence number
+  8-11:  base station uptime in ms
+  12:    number of records
+
+followed by 4 byte records of TYPE, ID (2 bytes) and STATE:
+
+  TYPE 1: sensor, STATE 1 = active, 0 = inactive
+  TYPE 2: turnout, STATE 1 = thrown, 0 = closed, 2 = position not confirmed
+          by the feedback sensors
+  TYPE 3: output, STATE 1 = on, 0 = off
+  TYPE 4: track power, ID is the motor board index as listed by /powerStatus,
+          STATE 1 = on, 0 = off, 2 = off due to over current
+
+State changes are collected for MULTICAST_BATCH_WINDOW ms and sent together,
+multiple changes to the same item within the window are merged. The sequence
+number is incremented for every state change datagram so listeners can detect
+lost datagrams, snapshot datagrams carry the sequence number of the last state
+change datagram sent.
+
+Listeners can send the following requests as a unicast datagram to
+MULTICAST_PORT on the base station, the reply is sent only to the requester:
+
+  'S'              : request a snapshot of the current state.
+  'R' SEQUENCE     : resend the state change datagrams starting with SEQUENCE
+                     (4 bytes), if these are no longer available a snapshot is
+                     sent instead.
+
+**********************************************************************/
+
+#if defined(MULTICAST_ENABLED) && MULTICAST_ENABLED
+
+#ifndef MULTICAST_GROUP
+#define MULTICAST_GROUP 239, 255, 21, 1
+#endif
+
+#ifndef MULTICAST_PORT
+#define MULTICAST_PORT 21200
+#endif
+
+#define MULTICAST_PROTOCOL_VERSION 1
+#define MULTICAST_REQUEST_SNAPSHOT 'S'
+#define MULTICAST_REQUEST_RESEND 'R'
+
+extern LinkedList<Sensor *> sensors;
+extern LinkedList<Turnout *> turnouts;
+extern LinkedList<Output *> outputs;
+
+WiFiUDP multicastSocket;
+const IPAddress multicastGroup(MULTICAST_GROUP);
+uint32_t multicastSequence = 0;
+uint32_t multicastDatagramsSent = 0;
+uint32_t multicastSnapshotsSent = 0;
+uint32_t multicastRequestsReceived = 0;
+uint32_t multicastOverflows = 0;
+
+// state changes pending transmission, these are added by the observer which can
+// be called from any task.
+MulticastRecord multicastPending[MULTICAST_MAX_RECORDS];
+uint8_t multicastPendingCount = 0;
+uint32_t multicastBatchStart = 0;
+volatile bool multicastSnapshotRequired = false;
+portMUX_TYPE multicastPendingMux = portMUX_INITIALIZER_UNLOCKED;
+
+// recently sent state change datagrams, indexed by sequence number
+uint8_t multicastHistory[MULTICAST_HISTORY][MULTICAST_MAX_DATAGRAM];
+uint8_t multicastHistoryLength[MULTICAST_HISTORY];
+
+uint8_t multicastBuildDatagram(uint8_t *datagram, uint8_t kind, uint32_t sequence,
+  const MulticastRecord *records, uint8_t count) {
+  const uint32_t now = millis();
+  datagram[0] = 'D';
+  datagram[1] = 'M';
+  datagram[2] = MULTICAST_PROTOCOL_VERSION;
+  datagram[3] = kind;
+  for(uint8_t index = 0; index < 4; index++) {
+    datagram[4 + index] = (sequence >> (index * 8)) & 0xFF;
+    datagram[8 + index] = (now >> (index * 8)) & 0xFF;
+  }
+  datagram[12] = count;
+  uint8_t *record = &datagram[MULTICAST_HEADER_SIZE];
+  for(uint8_t index = 0; index < count; index++) {
+    record[0] = records[index].type;
+    record[1] = lowByte(records[index].id);
+    record[2] = highByte(records[index].id);
+    record[3] = records[index].state;
+    record += MULTICAST_RECORD_SIZE;
+  }
+  return MULTICAST_HEADER_SIZE + (count * MULTICAST_RECORD_SIZE);
+}
+
+void multicastSend(const IPAddress &address, uint16_t port, const uint8_t *datagram, uint8_t length) {
+  if(port) {
+    multicastSocket.beginPacket(address, port);
+  } else {
+    multicastSocket.beginMulticastPacket();
+  }
+  multicastSocket.write(datagram, length);
+  multicastSocket.endPacket();
+  multicastDatagramsSent++;
+}
+
+void multicastQueueRecord(uint8_t type, uint16_t id, uint8_t state) {
+  portENTER_CRITICAL(&multicastPendingMux);
+  if(!multicastPendingCount) {
+    multicastBatchStart = millis();
+  }
+  bool queued = false;
+  for(uint8_t index = 0; index < multicastPendingCount && !queued; index++) {
+    if(multicastPending[index].type == type && multicastPending[index].id == id) {
+      multicastPending[index].state = state;
+      queued = true;
+    }
+  }
+  if(!queued) {
+    if(multicastPendingCount < MULTICAST_MAX_RECORDS) {
+      multicastPending[multicastPendingCount++] = {type, id, state};
+    } else {
+      // the batch is full, listeners will get the change via a snapshot
+      multicastOverflows++;
+      multicastSnapshotRequired = true;
+    }
+  }
+  portEXIT_CRITICAL(&multicastPendingMux);
+}
+
+void multicastFlush() {
+  MulticastRecord records[MULTICAST_MAX_RECORDS];
+  portENTER_CRITICAL(&multicastPendingMux);
+  uint8_t count = multicastPendingCount;
+  memcpy(records, multicastPending, sizeof(MulticastRecord) * count);
+  multicastPendingCount = 0;
+  portEXIT_CRITICAL(&multicastPendingMux);
+  if(count) {
+    multicastSequence++;
+    uint8_t slot = multicastSequence % MULTICAST_HISTORY;
+    multicastHistoryLength[slot] = multicastBuildDatagram(multicastHistory[slot],
+      MULTICAST_KIND_CHANGES, multicastSequence, records, count);
+    multicastSend(multicastGroup, 0, multicastHistory[slot], multicastHistoryLength[slot]);
+  }
+}
+
+uint8_t multicastPowerState(GenericMotorBoard *board) {
+  return board->isOn() ? 1 : (board->isOverCurrent() ? 2 : 0);
+}
+
+// sends the full state, when port is zero it is sent to the multicast group.
+void multicastSendSnapshot(const IPAddress &address, uint16_t port) {
+  uint8_t datagram[MULTICAST_MAX_DATAGRAM];
+  MulticastRecord records[MULTICAST_MAX_RECORDS];
+  uint8_t count = 0;
+  auto addRecord = [&](uint8_t type, uint16_t id, uint8_t state) {
+    if(count == MULTICAST_MAX_RECORDS) {
+      multicastSend(address, port, datagram, multicastBuildDatagram(datagram,
+        MULTICAST_KIND_SNAPSHOT, multicastSequence, records, count));
+      count = 0;
+    }
+    records[count++] = {type, id, state};
+  };
+  for (const auto& sensor : sensors) {
+    addRecord(MULTICAST_RECORD_SENSOR, sensor->getID(), sensor->isActive());
+  }
+  for (const auto& turnout : turnouts) {
+    addRecord(MULTICAST_RECORD_TURNOUT, turnout->getID(), turnout->isPositionFailed() ? 2 : turnout->isThrown());
+  }
+  for (const auto& output : outputs) {
+    addRecord(MULTICAST_RECORD_OUTPUT, output->getID(), output->isActive());
+  }
+  uint16_t boardIndex = 0;
+  for (const auto& name : MotorBoardManager::getBoardNames()) {
+    addRecord(MULTICAST_RECORD_POWER, boardIndex++, multicastPowerState(MotorBoardManager::getBoardByName(name)));
+  }
+  multicastSend(address, port, datagram, multicastBuildDatagram(datagram,
+    MULTICAST_KIND_SNAPSHOT_END, multicastSequence, records, count));
+  multicastSnapshotsSent++;
+}
+
+void multicastHandleRequest(const IPAddress &address, uint16_t port, const uint8_t *request, int length) {
+  multicastRequestsReceived++;
+  if(request[0] == MULTICAST_REQUEST_SNAPSHOT) {
+    multicastSendSnapshot(address, port);
+  } else if(request[0] == MULTICAST_REQUEST_RESEND && length >= 5) {
+    uint32_t sequence = request[1] | (request[2] << 8) | (request[3] << 16) | (request[4] << 24);
+    // sequences outside the history (or in the future) result in a snapshot
+    if(sequence == 0 || sequence > multicastSequence || multicastSequence - sequence >= MULTICAST_HISTORY) {
+      multicastSendSnapshot(address, port);
+      return;
+    }
+    for(; sequence <= multicastSequence; sequence++) {
+      uint8_t slot = sequence % MULTICAST_HISTORY;
+      multicastSend(address, port, multicastHistory[slot], multicastHistoryLength[slot]);
+    }
+  }
+}
+
+class MulticastStateObserver : public StateObserver {
+public:
+  void sensorChanged(uint16_t id, bool active) {
+    multicastQueueRecord(MULTICAST_RECORD_SENSOR, id, active);
+  }
+  void turnoutChanged(uint16_t id, bool thrown) {
+    multicastQueueRecord(MULTICAST_RECORD_TURNOUT, id, thrown);
+  }
+  void turnoutFailed(uint16_t id, bool thrown) {
+    multicastQueueRecord(MULTICAST_RECORD_TURNOUT, id, 2);
+  }
+  void outputChanged(uint16_t id, bool active) {
+    multicastQueueRecord(MULTICAST_RECORD_OUTPUT, id, active);
+  }
+  void powerChanged(const String &name, bool on, bool overCurrent) {
+    uint16_t boardIndex = 0;
+    for (const auto& boardName : MotorBoardManager::getBoardNames()) {
+      if(boardName == name) {
+        multicastQueueRecord(MULTICAST_RECORD_POWER, boardIndex, on ? 1 : (overCurrent ? 2 : 0));
+        return;
+      }
+      boardIndex++;
+    }
+  }
+};
+
+void MulticastBroadcaster::init() {
+  log_i("[Multicast] Sending state changes to %s:%d", multicastGroup.toString().c_str(), MULTICAST_PORT);
+  memset(multicastHistoryLength, 0, sizeof(multicastHistoryLength));
+  multicastSocket.beginMulticast(multicastGroup, MULTICAST_PORT);
+  StateObservers::registerObserver(new MulticastStateObserver());
+  // let any listeners that are already running know the current state
+  multicastSnapshotRequired = true;
+}
+
+void MulticastBroadcaster::update() {
+  uint8_t request[8];
+  int requestSize = multicastSocket.parsePacket();
+  while(requestSize > 0) {
+    IPAddress remoteAddress = multicastSocket.remoteIP();
+    uint16_t remotePort = multicastSocket.remotePort();
+    int length = multicastSocket.read(request, sizeof(request));
+    // our own datagrams are looped back by the multicast group, only requests
+    // are processed.
+    if(length > 0 && request[0] != 'D') {
+      multicastHandleRequest(remoteAddress, remotePort, request, length);
+    }
+    requestSize = multicastSocket.parsePacket();
+  }
+  if(multicastSnapshotRequired) {
+    multicastSnapshotRequired = false;
+    // the snapshot covers anything that is pending
+    portENTER_CRITICAL(&multicastPendingMux);
+    multicastPendingCount = 0;
+    portEXIT_CRITICAL(&multicastPendingMux);
+    multicastSendSnapshot(multicastGroup, 0);
+  } else if(multicastPendingCount && millis() - multicastBatchStart >= MULTICAST_BATCH_WINDOW) {
+    multicastFlush();
+  }
+}
+
+void MulticastBroadcaster::getState(JsonObject &root) {
+  root[F("group")] = multicastGroup.toString();
+  root[F("port")] = MULTICAST_PORT;
+  root[F("sequence")] = multicastSequence;
+  root[F("sent")] = multicastDatagramsSent;
+  root[F("snapshots")] = multicastSnapshotsSent;
+  root[F("requests")] = multicastRequestsReceived;
+  root[F("overflows")] = multicastOverflows;
+}
+#endif
@@ -0,0 +1,59 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _MULTICAST_BROADCASTER_H_
+#define _MULTICAST_BROADCASTER_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// time (in ms) state changes are collected before being sent
+#define MULTICAST_BATCH_WINDOW 20
+// maximum number of records in a single datagram
+#define MULTICAST_MAX_RECORDS 32
+// number of sent datagrams kept for resend requests
+#define MULTICAST_HISTORY 16
+
+#define MULTICAST_HEADER_SIZE 13
+#define MULTICAST_RECORD_SIZE 4
+#define MULTICAST_MAX_DATAGRAM (MULTICAST_HEADER_SIZE + (MULTICAST_MAX_RECORDS * MULTICAST_RECORD_SIZE))
+
+// datagram kinds
+#define MULTICAST_KIND_CHANGES 1
+#define MULTICAST_KIND_SNAPSHOT 2
+#define MULTICAST_KIND_SNAPSHOT_END 3
+
+// record types
+#define MULTICAST_RECORD_SENSOR 1
+#define MULTICAST_RECORD_TURNOUT 2
+#define MULTICAST_RECORD_OUTPUT 3
+#define MULTICAST_RECORD_POWER 4
+
+struct MulticastRecord {
+  uint8_t type;
+  uint16_t id;
+  uint8_t state;
+};
+
+class MulticastBroadcaster {
+public:
+  static void init();
+  static void update();
+  static void getState(JsonObject &);
+};
+
+#endif
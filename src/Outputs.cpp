@@ -17,6 +17,9 @@ COPYRIGHT (c) 2017 Mike Dunston
 
 #include "DCCppESP32.h"
 #include "Outputs.h"
+#include "StateObserver.h"
+#include "StartupSync.h"
+#include <driver/ledc.h>
 
 /**********************************************************************
 
@@ -93,9 +96,179 @@ of each output in the form <Y ID STATE> is generated by this sketch whenever the
 the state of any outputs being monitored or controlled by a separate interface
 or GUI program.
 
+Outputs can also be PWM dimmed using the LEDC peripheral (up to
+OUTPUT_PWM_CHANNELS outputs), this sets IFLAG bit 3:
+
+  <Z ID PIN IFLAG BRIGHTNESS FADE EFFECT PERIOD>: creates or updates output ID
+                    as a PWM output.
+        returns: <O> if successful and <X> if unsuccessful (e.g. no free PWM
+        channel)
+where
+  BRIGHTNESS: the brightness (0-255) of the output when ACTIVE
+  FADE: time (in ms) the LEDC hardware takes to fade between INACTIVE and
+        ACTIVE, 0 to switch immediately
+  EFFECT: effect shown while the output is ACTIVE
+          0 = none (steady at BRIGHTNESS)
+          1 = flash, on for the first half of PERIOD and off for the second
+          2 = alternate flash, off for the first half of PERIOD and on for the
+              second. Together with a flash output using the same PERIOD this
+              can be used for ditch lights or crossing flashers.
+          3 = flicker, randomly varies between 60% and 100% of BRIGHTNESS
+  PERIOD: time (in ms) of a single flash cycle
+
+Effects are run by a single low priority software timer every
+OUTPUT_EFFECT_TICK ms and only update the LEDC duty when it changes, no
+commands from clients are required to animate the outputs.
+
 **********************************************************************/
 LinkedList<Output *> outputs([](Output *output) {delete output; });
 
+// state of each LEDC channel used by a PWM output, the effect timer only uses
+// this table so it never needs to access the outputs list. Only the timer
+// service task writes to the LEDC hardware, Output::set queues the new level in
+// the pending fields under outputPWMMux and asks the timer task to apply it.
+struct OutputPWMChannel {
+  bool inUse;
+  bool active;
+  bool inverted;
+  uint8_t effect;
+  uint8_t brightness;
+  uint16_t period;
+  int16_t duty;
+  bool pending;
+  uint8_t pendingDuty;
+  uint16_t pendingFadeTime;
+};
+
+OutputPWMChannel outputPWMChannels[OUTPUT_PWM_CHANNELS];
+portMUX_TYPE outputPWMMux = portMUX_INITIALIZER_UNLOCKED;
+TimerHandle_t outputEffectTimer = NULL;
+
+const char *outputEffectNames[MAX_OUTPUT_EFFECT] = {
+  "none", "flash", "flashAlternate", "flicker"
+};
+
+// only called from the timer service task.
+void outputPWMWrite(uint8_t channel, uint8_t duty, bool inverted, uint16_t fadeTime) {
+  if(inverted) {
+    duty = OUTPUT_PWM_MAX_DUTY - duty;
+  }
+  if(fadeTime) {
+    ledc_set_fade_with_time(LEDC_HIGH_SPEED_MODE, (ledc_channel_t)channel, duty, fadeTime);
+    ledc_fade_start(LEDC_HIGH_SPEED_MODE, (ledc_channel_t)channel, LEDC_FADE_NO_WAIT);
+  } else {
+    ledc_set_duty(LEDC_HIGH_SPEED_MODE, (ledc_channel_t)channel, duty);
+    ledc_update_duty(LEDC_HIGH_SPEED_MODE, (ledc_channel_t)channel);
+  }
+}
+
+void outputEffectTimerTick(TimerHandle_t timer) {
+  const uint32_t now = millis();
+  for(uint8_t channel = 0; channel < OUTPUT_PWM_CHANNELS; channel++) {
+    OutputPWMChannel &pwmChannel = outputPWMChannels[channel];
+    // take a consistent copy of the channel and claim any pending level
+    portENTER_CRITICAL(&outputPWMMux);
+    OutputPWMChannel state = pwmChannel;
+    pwmChannel.pending = false;
+    if(state.inUse && state.pending) {
+      pwmChannel.duty = state.pendingDuty;
+    }
+    portEXIT_CRITICAL(&outputPWMMux);
+    if(!state.inUse) {
+      continue;
+    }
+    if(state.pending) {
+      outputPWMWrite(channel, state.pendingDuty, state.inverted, state.pendingFadeTime);
+      state.duty = state.pendingDuty;
+    }
+    if(!state.active || state.effect == OUTPUT_EFFECT_NONE) {
+      continue;
+    }
+    const bool firstHalf = state.period && (now % state.period) < (state.period / 2);
+    uint8_t duty = state.brightness;
+    if(state.effect == OUTPUT_EFFECT_FLASH) {
+      duty = firstHalf ? state.brightness : 0;
+    } else if(state.effect == OUTPUT_EFFECT_FLASH_ALTERNATE) {
+      duty = firstHalf ? 0 : state.brightness;
+    } else if(state.effect == OUTPUT_EFFECT_FLICKER) {
+      duty = (state.brightness * (60 + (esp_random() % 41))) / 100;
+    }
+    if(duty == state.duty) {
+      continue;
+    }
+    // only write the effect level if the output was not turned off meanwhile,
+    // a later set() leaves a pending level that the next pass applies.
+    bool write = false;
+    portENTER_CRITICAL(&outputPWMMux);
+    if(pwmChannel.inUse && pwmChannel.active && !pwmChannel.pending) {
+      pwmChannel.duty = duty;
+      write = true;
+    }
+    portEXIT_CRITICAL(&outputPWMMux);
+    if(write) {
+      outputPWMWrite(channel, duty, state.inverted, 0);
+    }
+  }
+}
+
+void outputPWMApply(void *, uint32_t) {
+  outputEffectTimerTick(outputEffectTimer);
+}
+
+// records the new state of a PWM channel and has the timer task apply it, when
+// the request can't be queued the next effect tick picks up the pending level.
+void outputPWMSet(uint8_t channel, bool active, uint8_t duty, uint16_t fadeTime, bool writeDuty) {
+  OutputPWMChannel &pwmChannel = outputPWMChannels[channel];
+  portENTER_CRITICAL(&outputPWMMux);
+  pwmChannel.active = active;
+  if(writeDuty) {
+    pwmChannel.pendingDuty = duty;
+    pwmChannel.pendingFadeTime = fadeTime;
+    pwmChannel.pending = true;
+  }
+  portEXIT_CRITICAL(&outputPWMMux);
+  xTimerPendFunctionCall(outputPWMApply, NULL, 0, 0);
+}
+
+// returns a free LEDC channel configured for the pin or -1 if all channels are
+// in use. The LEDC timer, fade support and effect timer are set up on first use.
+int8_t allocateOutputPWMChannel(uint8_t pin) {
+  if(outputEffectTimer == NULL) {
+    ledc_timer_config_t timerConfig;
+    memset(&timerConfig, 0, sizeof(ledc_timer_config_t));
+    timerConfig.speed_mode = LEDC_HIGH_SPEED_MODE;
+    timerConfig.duty_resolution = LEDC_TIMER_8_BIT;
+    timerConfig.timer_num = LEDC_TIMER_0;
+    timerConfig.freq_hz = OUTPUT_PWM_FREQUENCY;
+    ledc_timer_config(&timerConfig);
+    ledc_fade_func_install(0);
+    outputEffectTimer = xTimerCreate("OutputFX", pdMS_TO_TICKS(OUTPUT_EFFECT_TICK), pdTRUE,
+      NULL, outputEffectTimerTick);
+    xTimerStart(outputEffectTimer, 0);
+  }
+  for(uint8_t channel = 0; channel < OUTPUT_PWM_CHANNELS; channel++) {
+    if(!outputPWMChannels[channel].inUse) {
+      ledc_channel_config_t channelConfig;
+      memset(&channelConfig, 0, sizeof(ledc_channel_config_t));
+      channelConfig.gpio_num = pin;
+      channelConfig.speed_mode = LEDC_HIGH_SPEED_MODE;
+      channelConfig.channel = (ledc_channel_t)channel;
+      channelConfig.intr_type = LEDC_INTR_DISABLE;
+      channelConfig.timer_sel = LEDC_TIMER_0;
+      channelConfig.duty = 0;
+      ledc_channel_config(&channelConfig);
+      portENTER_CRITICAL(&outputPWMMux);
+      outputPWMChannels[channel].active = false;
+      outputPWMChannels[channel].pending = false;
+      outputPWMChannels[channel].duty = -1;
+      outputPWMChannels[channel].inUse = true;
+      portEXIT_CRITICAL(&outputPWMMux);
+      return channel;
+    }
+  }
+  return -1;
+}
+
 void OutputManager::init() {
   log_i("Initializing outputs");
   uint16_t outputCount = configStore.getUShort("OutputCount", 0);
@@ -103,11 +276,13 @@ void OutputManager::init() {
   for(int index = 0; index < outputCount; index++) {
     outputs.add(new Output(index));
   }
+  StateObservers::layoutChanged();
 }
 
 void OutputManager::clear() {
   configStore.putUShort("OutputCount", 0);
   outputs.free();
+  StateObservers::layoutChanged();
 }
 
 uint16_t OutputManager::store() {
@@ -139,6 +314,31 @@ bool OutputManager::toggle(uint16_t id) {
   return false;
 }
 
+bool OutputManager::setPWM(const uint16_t id, const uint8_t brightness, const uint16_t fadeTime,
+  const uint8_t effect, const uint16_t period) {
+  for (const auto& output : outputs) {
+    if(output->getID() == id) {
+      output->setPWM(brightness, fadeTime, effect, period);
+      return output->isPWM();
+    }
+  }
+  return false;
+}
+
+const char *OutputManager::getEffectName(const uint8_t effect) {
+  return effect < MAX_OUTPUT_EFFECT ? outputEffectNames[effect] : outputEffectNames[OUTPUT_EFFECT_NONE];
+}
+
+// accepts either the effect name or number
+uint8_t OutputManager::getEffectByName(const String &name) {
+  for(uint8_t effect = 0; effect < MAX_OUTPUT_EFFECT; effect++) {
+    if(name.equalsIgnoreCase(outputEffectNames[effect])) {
+      return effect;
+    }
+  }
+  return name.toInt() < MAX_OUTPUT_EFFECT ? name.toInt() : OUTPUT_EFFECT_NONE;
+}
+
 void OutputManager::getState(JsonArray & array) {
   for (const auto& output : outputs) {
     JsonObject &outputJson = array.createNestedObject();
@@ -165,6 +365,12 @@ void OutputManager::getState(JsonArray & array) {
     } else {
       outputJson[F("active")] = "Off";
     }
+    if(output->isPWM()) {
+      outputJson[F("brightness")] = output->getBrightness();
+      outputJson[F("fadeTime")] = output->getFadeTime();
+      outputJson[F("effect")] = getEffectName(output->getEffect());
+      outputJson[F("period")] = output->getEffectPeriod();
+    }
   }
 }
 
@@ -182,6 +388,7 @@ void OutputManager::createOrUpdate(const uint16_t id, const uint8_t pin, const u
     }
   }
   outputs.add(new Output(id, pin, flags));
+  StateObservers::layoutChanged();
 }
 
 bool OutputManager::remove(const uint16_t id) {
@@ -193,12 +400,16 @@ bool OutputManager::remove(const uint16_t id) {
   }
   if(outputToRemove != NULL) {
     outputs.remove(outputToRemove);
+    StateObservers::layoutChanged();
     return true;
   }
   return false;
 }
 
-Output::Output(uint16_t id, uint8_t pin, uint8_t flags) : _id(id), _pin(pin), _flags(flags), _active(false) {
+Output::Output(uint16_t id, uint8_t pin, uint8_t flags) : _id(id), _pin(pin), _flags(flags), _active(false),
+  _held(false), _pwmChannel(-1), _brightness(OUTPUT_PWM_MAX_DUTY), _fadeTime(0), _effect(OUTPUT_EFFECT_NONE),
+  _effectPeriod(1000) {
+  configurePin();
   String flagsString = "";
   if(bitRead(_flags, OUTPUT_IFLAG_INVERT)) {
     flagsString += "activeLow";
@@ -218,7 +429,6 @@ Output::Output(uint16_t id, uint8_t pin, uint8_t flags) : _id(id), _pin(pin), _f
     set(false, false);
   }
   log_i("Output(%d) on pin %d created, flags: %s", _id, _pin, flagsString.c_str());
-  pinMode(_pin, OUTPUT);
 }
 
 Output::Output(uint16_t index) {
@@ -228,6 +438,14 @@ Output::Output(uint16_t index) {
   _id = configStore.getUShort(outputIDKey.c_str(), index);
   _pin = configStore.getUChar(outputPinKey.c_str(), 0);
   _flags = configStore.getUChar(outputFlagsKey.c_str(), 0);
+  _active = false;
+  _held = false;
+  _pwmChannel = -1;
+  _brightness = configStore.getUChar((outputIDKey + String("_b")).c_str(), OUTPUT_PWM_MAX_DUTY);
+  _fadeTime = configStore.getUShort((outputIDKey + String("_t")).c_str(), 0);
+  _effect = configStore.getUChar((outputIDKey + String("_e")).c_str(), OUTPUT_EFFECT_NONE);
+  _effectPeriod = configStore.getUShort((outputIDKey + String("_r")).c_str(), 1000);
+  configurePin();
   String flagsString = "";
   if(bitRead(_flags, OUTPUT_IFLAG_INVERT)) {
     flagsString += "activeLow";
@@ -237,37 +455,114 @@ Output::Output(uint16_t index) {
   if(bitRead(_flags, OUTPUT_IFLAG_RESTORE_STATE)) {
     if(bitRead(_flags, OUTPUT_IFLAG_FORCE_STATE)) {
       flagsString += ",force(on)";
-      set(true, false);
+      restore(true);
     } else {
       flagsString += ",force(off)";
-      set(false, false);
+      restore(false);
     }
   } else {
     String outputStateKey = outputIDKey + String("_s");
     if(configStore.getBool(outputStateKey.c_str(), false)) {
       flagsString += ",restoreState(on)";
-      set(true, false);
+      restore(true);
     } else {
       flagsString += ",restoreState(off)";
-      set(false, false);
+      restore(false);
     }
   }
   log_i("Output(%d) on pin %d loaded, flags: %s", _id, _pin, flagsString.c_str());
+}
+
+Output::~Output() {
+  releasePWMChannel();
+}
+
+void Output::configurePin() {
+  releasePWMChannel();
+  if(bitRead(_flags, OUTPUT_IFLAG_PWM)) {
+    _pwmChannel = allocateOutputPWMChannel(_pin);
+    if(_pwmChannel >= 0) {
+      OutputPWMChannel &pwmChannel = outputPWMChannels[_pwmChannel];
+      portENTER_CRITICAL(&outputPWMMux);
+      pwmChannel.inverted = bitRead(_flags, OUTPUT_IFLAG_INVERT);
+      pwmChannel.brightness = _brightness;
+      pwmChannel.effect = _effect;
+      pwmChannel.period = _effectPeriod;
+      portEXIT_CRITICAL(&outputPWMMux);
+      log_i("Output(%d) on pin %d using PWM channel %d", _id, _pin, _pwmChannel);
+      return;
+    }
+    log_w("Output(%d) no PWM channel available for pin %d, using on/off", _id, _pin);
+  }
   pinMode(_pin, OUTPUT);
 }
 
+void Output::releasePWMChannel() {
+  if(_pwmChannel >= 0) {
+    portENTER_CRITICAL(&outputPWMMux);
+    outputPWMChannels[_pwmChannel].active = false;
+    outputPWMChannels[_pwmChannel].pending = false;
+    outputPWMChannels[_pwmChannel].inUse = false;
+    portEXIT_CRITICAL(&outputPWMMux);
+    ledc_stop(LEDC_HIGH_SPEED_MODE, (ledc_channel_t)_pwmChannel, 0);
+    pinMatrixOutDetach(_pin, false, false);
+    _pwmChannel = -1;
+  }
+}
+
+void Output::setPWM(uint8_t brightness, uint16_t fadeTime, uint8_t effect, uint16_t period) {
+  _brightness = brightness;
+  _fadeTime = fadeTime;
+  _effect = effect < MAX_OUTPUT_EFFECT ? effect : OUTPUT_EFFECT_NONE;
+  _effectPeriod = period;
+  bitSet(_flags, OUTPUT_IFLAG_PWM);
+  configurePin();
+  drive(_active && !_held);
+}
+
+// sets the initial state of an output loaded from the configuration, when the
+// startup sync is enabled outputs that should be on are held off and turned on
+// by it after track power is on.
+void Output::restore(bool active) {
+#if defined(STARTUP_SYNC_ENABLED) && STARTUP_SYNC_ENABLED
+  if(active) {
+    StartupSync::deferOutput(_id);
+    _active = true;
+    _held = true;
+    drive(false);
+    log_i("Output(%d) held OFF until track power is on", _id);
+    return;
+  }
+#endif
+  set(active, false);
+}
+
 void Output::set(bool active, bool announce) {
   _active = active;
-  digitalWrite(_pin, _active);
+  _held = false;
+  drive(_active);
   log_i("Output(%d) set to %s", _id, _active ? "ON" : "OFF");
   if(announce) {
     wifiInterface.printf(F("<Y %d %d>"), _id, !_active);
+    StateObservers::outputChanged(_id, _active);
+  }
+}
+
+void Output::drive(bool on) {
+  if(_pwmChannel >= 0) {
+    // effects are run by the effect timer, otherwise fade to the new level
+    outputPWMSet(_pwmChannel, on, on ? _brightness : 0, _fadeTime,
+      !on || _effect == OUTPUT_EFFECT_NONE);
+  } else {
+    digitalWrite(_pin, on);
   }
 }
 
 void Output::update(uint8_t pin, uint8_t flags) {
+  releasePWMChannel();
   _pin = pin;
   _flags = flags;
+  configurePin();
   String flagsString = "";
   if(bitRead(_flags, OUTPUT_IFLAG_INVERT)) {
     flagsString += "activeLow";
@@ -287,7 +582,6 @@ void Output::update(uint8_t pin, uint8_t flags) {
     }
   }
   log_i("Output(%d) on pin %d updated, flags: %s", _id, _pin, flagsString.c_str());
-  pinMode(_pin, OUTPUT);
 }
 
 void Output::store(uint16_t index) {
@@ -299,13 +593,19 @@ void Output::store(uint16_t index) {
   configStore.putUChar(outputPinKey.c_str(), _pin);
   configStore.putUChar(outputFlagsKey.c_str(), _flags);
   configStore.putBool(outputStateKey.c_str(), _active);
+  if(bitRead(_flags, OUTPUT_IFLAG_PWM)) {
+    configStore.putUChar((outputIDKey + String("_b")).c_str(), _brightness);
+    configStore.putUShort((outputIDKey + String("_t")).c_str(), _fadeTime);
+    configStore.putUChar((outputIDKey + String("_e")).c_str(), _effect);
+    configStore.putUShort((outputIDKey + String("_r")).c_str(), _effectPeriod);
+  }
 }
 
 void Output::showStatus() {
   wifiInterface.printf(F("<Y %d %d %d %d>"), _id, _pin, _flags, !_active);
 }
 
-void OutputCommandAdapter::process(const std::vector<String> arguments) {
+void OutputCommandAdapter::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.empty()) {
     // list all outputs
     OutputManager::showStatus();
@@ -320,6 +620,16 @@ void OutputCommandAdapter::process(const std::vector<String> arguments) {
       // create output
       OutputManager::createOrUpdate(outputID, arguments[1].toInt(), arguments[2].toInt());
       wifiInterface.printf(F("<O>"));
+    } else if (arguments.size() == 7) {
+      // create PWM output
+      OutputManager::createOrUpdate(outputID, arguments[1].toInt(),
+        arguments[2].toInt() | (1 << OUTPUT_IFLAG_PWM));
+      if(OutputManager::setPWM(outputID, arguments[3].toInt(), arguments[4].toInt(),
+        arguments[5].toInt(), arguments[6].toInt())) {
+        wifiInterface.printf(F("<O>"));
+      } else {
+        wifiInterface.printf(F("<X>"));
+      }
     } else {
       wifiInterface.printf(F("<X>"));
     }
@@ -21,12 +21,29 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include <ArduinoJson.h>
 #include "DCCppProtocol.h"
 
+// PWM outputs use the high speed LEDC channels and timer 0
+#define OUTPUT_PWM_CHANNELS 8
+#define OUTPUT_PWM_FREQUENCY 5000
+#define OUTPUT_PWM_MAX_DUTY 255
+// interval (in ms) of the software timer that runs the output effects
+#define OUTPUT_EFFECT_TICK 20
+
+enum OUTPUT_EFFECT {
+  OUTPUT_EFFECT_NONE,
+  OUTPUT_EFFECT_FLASH,
+  OUTPUT_EFFECT_FLASH_ALTERNATE,
+  OUTPUT_EFFECT_FLICKER,
+  MAX_OUTPUT_EFFECT
+};
+
 class Output {
 public:
   Output(uint16_t, uint8_t, uint8_t);
   Output(uint16_t);
+  virtual ~Output();
   void set(bool=false, bool=true);
   void update(uint8_t, uint8_t);
+  void setPWM(uint8_t, uint16_t, uint8_t, uint16_t);
   void store(uint16_t);
   const uint16_t getID() {
     return _id;
@@ -40,12 +57,40 @@ public:
   const bool isActive() {
     return _active;
   }
+  const bool isPWM() {
+    return _pwmChannel >= 0;
+  }
+  const uint8_t getBrightness() {
+    return _brightness;
+  }
+  const uint16_t getFadeTime() {
+    return _fadeTime;
+  }
+  const uint8_t getEffect() {
+    return _effect;
+  }
+  const uint16_t getEffectPeriod() {
+    return _effectPeriod;
+  }
   void showStatus();
 private:
+  void configurePin();
+  void releasePWMChannel();
+  void restore(bool);
+  void drive(bool);
   uint16_t _id;
   uint8_t _pin;
   uint8_t _flags;
   bool _active;
+  // set while an output that should be active is held off until the startup
+  // sync turns it on, _active keeps the intended state.
+  bool _held;
+  // PWM settings, only used when OUTPUT_IFLAG_PWM is set
+  int8_t _pwmChannel;
+  uint8_t _brightness;
+  uint16_t _fadeTime;
+  uint8_t _effect;
+  uint16_t _effectPeriod;
 };
 
 class OutputManager {
@@ -58,13 +103,16 @@ class OutputManager {
     static void getState(JsonArray &);
     static void showStatus();
     static void createOrUpdate(const uint16_t, const uint8_t, const uint8_t);
+    static bool setPWM(const uint16_t, const uint8_t, const uint16_t, const uint8_t, const uint16_t);
+    static const char *getEffectName(const uint8_t);
+    static uint8_t getEffectByName(const String &);
     static bool remove(const uint16_t);
 };
 
 class OutputCommandAdapter : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String> arguments);
-  String getID() {
+  void process(const DCCPPProtocolArguments &arguments);
+  const char *getID() {
     return "Z";
   }
 };
@@ -72,5 +120,6 @@ public:
 const uint8_t OUTPUT_IFLAG_INVERT = 0;
 const uint8_t OUTPUT_IFLAG_RESTORE_STATE = 1;
 const uint8_t OUTPUT_IFLAG_FORCE_STATE = 2;
+const uint8_t OUTPUT_IFLAG_PWM = 3;
 
 #endif
@@ -0,0 +1,214 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include "RailCom.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can generate a RailCom cutout on the OPERATIONS track
+after every packet and decode the RailCom data received by a detector connected
+to a UART (RAILCOM_UART_RX_PIN).
+
+The cutout starts RAILCOM_CUTOUT_START us after the packet end bit and ends
+RAILCOM_CUTOUT_END us after it. During the cutout the track outputs are either
+shorted via the motor board BRAKE pin (RAILCOM_BRAKE_PIN) or disabled via the
+MAIN motor board enable pin.
+
+The bytes received during a cutout are decoded using the 4-of-8 encoding:
+
+  Channel 1: ADR_HIGH / ADR_LOW datagrams, the address of any locomotive on
+             the track is reported by combining the two.
+  Channel 2: POM datagrams from the locomotive addressed by the packet before
+             the cutout, these are used to read CVs on the OPERATIONS track via
+             the <r LOCO CV> command.
+
+The decoding itself is in RailComDecoder.h which does not depend on the
+Arduino core.
+
+A POM read does not block the command processing, the <r LOCO CV VALUE> reply
+is sent by RailComManager::update once the POM datagram has been received or
+with a VALUE of -1 after RAILCOM_POM_TIMEOUT ms. Only one POM read can be
+pending at a time.
+
+**********************************************************************/
+
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+
+#ifndef RAILCOM_UART
+#define RAILCOM_UART 2
+#endif
+
+HardwareSerial railComSerial(RAILCOM_UART);
+QueueHandle_t railComCutoutQueue = NULL;
+// pending POM read, guarded by railComPOMMux since the value is set by the
+// RailCom task and the read is started and completed by the loop task.
+portMUX_TYPE railComPOMMux = portMUX_INITIALIZER_UNLOCKED;
+uint16_t railComPOMAddress = 0;
+uint16_t railComPOMCV = 0;
+int16_t railComPOMValue = -1;
+uint32_t railComPOMStart = 0;
+uint8_t railComAddressHigh = 0;
+bool railComAddressHighReceived = false;
+uint16_t railComLastAddress = 0;
+uint32_t railComLastAddressTime = 0;
+uint32_t railComCutouts = 0;
+uint32_t railComCutoutsDropped = 0;
+uint32_t railComCutoutsSkipped = 0;
+uint32_t railComBytesReceived = 0;
+uint32_t railComDatagramsReceived = 0;
+uint32_t railComUndecodedCutouts = 0;
+uint32_t railComPOMReplies = 0;
+
+void railComProcessDatagram(uint16_t packetAddress, const RailComDatagram &datagram) {
+  if(datagram.channel == 1 && datagram.id == RAILCOM_ID_ADR_HIGH) {
+    railComAddressHigh = datagram.value;
+    railComAddressHighReceived = true;
+  } else if(datagram.channel == 1 && datagram.id == RAILCOM_ID_ADR_LOW && railComAddressHighReceived) {
+    uint16_t address = 0;
+    if(railComAddressHigh == 0) {
+      address = datagram.value;
+    } else if((railComAddressHigh & 0xC0) == 0x80) {
+      address = ((railComAddressHigh & 0x3F) << 8) | datagram.value;
+    }
+    if(address) {
+      if(address != railComLastAddress) {
+        log_d("[RailCom] Locomotive %d detected", address);
+      }
+      railComLastAddress = address;
+      railComLastAddressTime = millis();
+    }
+  } else if(datagram.channel == 2 && datagram.id == RAILCOM_ID_POM && packetAddress) {
+    portENTER_CRITICAL(&railComPOMMux);
+    if(packetAddress == railComPOMAddress && railComPOMValue < 0) {
+      railComPOMValue = datagram.value & 0xFF;
+      railComPOMReplies++;
+    }
+    portEXIT_CRITICAL(&railComPOMMux);
+  }
+}
+
+void railComTask(void *arg) {
+  uint16_t packetAddress;
+  uint8_t data[RAILCOM_MAX_BYTES];
+  RailComDatagram datagrams[RAILCOM_MAX_BYTES / 2];
+  while(true) {
+    if(xQueueReceive(railComCutoutQueue, &packetAddress, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    railComCutouts++;
+    // give the UART time to move the last bytes of the cutout into the receive
+    // buffer, the next cutout is at least a full packet away.
+    vTaskDelay(1);
+    uint8_t length = 0;
+    while(railComSerial.available()) {
+      uint8_t value = railComSerial.read();
+      if(length < RAILCOM_MAX_BYTES) {
+        data[length++] = value;
+      }
+    }
+    // if another cutout has completed in the meantime the bytes can not be
+    // attributed to a single cutout.
+    if(uxQueueMessagesWaiting(railComCutoutQueue)) {
+      railComCutoutsSkipped++;
+      continue;
+    }
+    if(!length) {
+      continue;
+    }
+    railComBytesReceived += length;
+    uint8_t count = RailComDecoder::decode(data, length, datagrams, RAILCOM_MAX_BYTES / 2);
+    // cutouts that only contain ACK/NACK/BUSY or collided data are counted
+    if(!count) {
+      railComUndecodedCutouts++;
+      continue;
+    }
+    railComDatagramsReceived += count;
+    for(uint8_t index = 0; index < count; index++) {
+      railComProcessDatagram(packetAddress, datagrams[index]);
+    }
+  }
+}
+
+void RailComManager::init() {
+  log_i("[RailCom] Receiving RailCom data on pin %d", RAILCOM_UART_RX_PIN);
+  RailComDecoder::init();
+  railComSerial.begin(RAILCOM_BAUD_RATE, SERIAL_8N1, RAILCOM_UART_RX_PIN, -1);
+  railComCutoutQueue = xQueueCreate(RAILCOM_CUTOUT_QUEUE_SIZE, sizeof(uint16_t));
+  xTaskCreate(railComTask, "RailCom", 2048, NULL, 3, NULL);
+}
+
+// called from the DCC signal timer ISR when a cutout has ended.
+void IRAM_ATTR RailComManager::cutoutComplete(uint16_t packetAddress) {
+  if(railComCutoutQueue != NULL) {
+    BaseType_t taskWoken = pdFALSE;
+    if(xQueueSendFromISR(railComCutoutQueue, &packetAddress, &taskWoken) != pdTRUE) {
+      railComCutoutsDropped++;
+    }
+    if(taskWoken) {
+      portYIELD_FROM_ISR();
+    }
+  }
+}
+
+// records a POM read for the locomotive, returns false when another read is
+// still waiting for its reply.
+bool RailComManager::expectPOM(uint16_t address, uint16_t cv) {
+  bool started = false;
+  portENTER_CRITICAL(&railComPOMMux);
+  if(!railComPOMAddress) {
+    railComPOMAddress = address;
+    railComPOMCV = cv;
+    railComPOMValue = -1;
+    railComPOMStart = millis();
+    started = true;
+  }
+  portEXIT_CRITICAL(&railComPOMMux);
+  return started;
+}
+
+// sends the reply for a pending POM read once the value has been received or
+// the read has timed out.
+void RailComManager::update() {
+  portENTER_CRITICAL(&railComPOMMux);
+  const uint16_t address = railComPOMAddress;
+  const uint16_t cv = railComPOMCV;
+  const int16_t value = railComPOMValue;
+  const bool complete = address && (value >= 0 || millis() - railComPOMStart >= RAILCOM_POM_TIMEOUT);
+  if(complete) {
+    railComPOMAddress = 0;
+  }
+  portEXIT_CRITICAL(&railComPOMMux);
+  if(complete) {
+    if(value < 0) {
+      log_w("[OPS] CV %d for loco %d, no RailCom reply received", cv, address);
+    }
+    wifiInterface.printf(F("<r %d %d %d>"), address, cv, value);
+  }
+}
+
+void RailComManager::getState(JsonObject &root) {
+  root[F("lastAddress")] = railComLastAddress;
+  root[F("lastAddressAge")] = railComLastAddress ? millis() - railComLastAddressTime : 0;
+  root[F("cutouts")] = railComCutouts;
+  root[F("dropped")] = railComCutoutsDropped + railComCutoutsSkipped;
+  root[F("bytes")] = railComBytesReceived;
+  root[F("datagrams")] = railComDatagramsReceived;
+  root[F("undecoded")] = railComUndecodedCutouts;
+  root[F("pomReplies")] = railComPOMReplies;
+}
+#endif
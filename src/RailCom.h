@@ -0,0 +1,47 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _RAILCOM_H_
+#define _RAILCOM_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "RailComDecoder.h"
+
+// RailCom cutout timing (in microseconds) measured from the end of the packet
+// end bit, S-9.3.2 requires the cutout to start between 26us and 32us and end
+// between 454us and 488us.
+#define RAILCOM_CUTOUT_START 29
+#define RAILCOM_CUTOUT_END 470
+
+// RailCom detectors send data at 250kbps 8N1
+#define RAILCOM_BAUD_RATE 250000
+// number of completed cutouts that can be waiting to be processed
+#define RAILCOM_CUTOUT_QUEUE_SIZE 4
+// time (in ms) to wait for a POM reply
+#define RAILCOM_POM_TIMEOUT 250
+
+class RailComManager {
+public:
+  static void init();
+  static void IRAM_ATTR cutoutComplete(uint16_t);
+  static bool expectPOM(uint16_t, uint16_t);
+  static void update();
+  static void getState(JsonObject &);
+};
+
+#endif
@@ -0,0 +1,156 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _RAILCOM_DECODER_H_
+#define _RAILCOM_DECODER_H_
+
+// This header only depends on the C library so the decoder can also be built
+// on a host.
+#include <stdint.h>
+#include <string.h>
+
+// channel 1 carries two bytes and channel 2 up to six bytes
+#define RAILCOM_CHANNEL1_BYTES 2
+#define RAILCOM_CHANNEL2_BYTES 6
+#define RAILCOM_MAX_BYTES (RAILCOM_CHANNEL1_BYTES + RAILCOM_CHANNEL2_BYTES)
+
+// decoded 4-of-8 symbol values that are not 6 bit data
+#define RAILCOM_SYMBOL_ACK 0x40
+#define RAILCOM_SYMBOL_NACK 0x41
+#define RAILCOM_SYMBOL_BUSY 0x42
+#define RAILCOM_SYMBOL_INVALID 0xFF
+
+// datagram IDs
+#define RAILCOM_ID_POM 0
+#define RAILCOM_ID_ADR_HIGH 1
+#define RAILCOM_ID_ADR_LOW 2
+#define RAILCOM_ID_EXT 3
+#define RAILCOM_ID_DYN 7
+#define RAILCOM_ID_XPOM_FIRST 8
+#define RAILCOM_ID_XPOM_LAST 11
+
+struct RailComDatagram {
+  uint8_t channel;
+  uint8_t id;
+  uint32_t value;
+};
+
+// lookup table from a received byte to its 6 bit value or one of the
+// RAILCOM_SYMBOL_* values.
+struct RailComDecodeTable {
+  uint8_t values[256];
+  RailComDecodeTable() {
+    // 4-of-8 code for each 6 bit value as defined in S-9.3.2
+    static const uint8_t encodeTable[64] = {
+      0xAC, 0xAA, 0xA9, 0xA5, 0xA3, 0xA6, 0x9C, 0x9A, 0x99, 0x95, 0x93, 0x96, 0x8E, 0x8D, 0x8B, 0xB1,
+      0xB2, 0xB4, 0xB8, 0x74, 0x72, 0x6C, 0x6A, 0x69, 0x65, 0x63, 0x66, 0x5C, 0x5A, 0x59, 0x55, 0x53,
+      0x56, 0x4E, 0x4D, 0x4B, 0x47, 0x71, 0xE8, 0xE4, 0xE2, 0xD1, 0xC9, 0xC5, 0xD8, 0xD4, 0xD2, 0xCA,
+      0xC6, 0xCC, 0x78, 0x17, 0x1B, 0x1D, 0x1E, 0x2E, 0x36, 0x3A, 0x27, 0x2B, 0x2D, 0x35, 0x39, 0x33
+    };
+    memset(values, RAILCOM_SYMBOL_INVALID, sizeof(values));
+    for(uint8_t value = 0; value < 64; value++) {
+      values[encodeTable[value]] = value;
+    }
+    values[0x0F] = RAILCOM_SYMBOL_ACK;
+    values[0xF0] = RAILCOM_SYMBOL_ACK;
+    values[0x3C] = RAILCOM_SYMBOL_NACK;
+    values[0xE1] = RAILCOM_SYMBOL_BUSY;
+  }
+};
+
+// Decodes the bytes received from a RailCom detector during a single cutout.
+// This has no hardware dependencies.
+class RailComDecoder {
+public:
+  // builds the decode table, this is otherwise done on the first decode.
+  static void init() {
+    decodeSymbol(0);
+  }
+
+  static uint8_t decodeSymbol(uint8_t value) {
+    static const RailComDecodeTable table;
+    return table.values[value];
+  }
+
+  // returns the number of symbols used by a datagram, zero for unknown IDs
+  static uint8_t datagramSymbols(uint8_t id) {
+    if(id <= RAILCOM_ID_ADR_LOW) {
+      return 2;
+    } else if(id == RAILCOM_ID_EXT || id == RAILCOM_ID_DYN) {
+      return 3;
+    } else if(id >= RAILCOM_ID_XPOM_FIRST && id <= RAILCOM_ID_XPOM_LAST) {
+      return 6;
+    }
+    return 0;
+  }
+
+  // decodes the bytes received during a single cutout and returns the number
+  // of datagrams decoded. The detector does not report where channel 1 ends,
+  // the first two bytes are treated as channel 1 when there are more bytes
+  // than channel 2 can hold or when they contain an address datagram.
+  static uint8_t decode(const uint8_t *data, uint8_t length,
+    RailComDatagram *datagrams, uint8_t maxDatagrams) {
+    uint8_t count = 0;
+    uint8_t offset = 0;
+    if(length >= RAILCOM_CHANNEL1_BYTES && maxDatagrams) {
+      const uint8_t first = decodeSymbol(data[0]);
+      const uint8_t second = decodeSymbol(data[1]);
+      if(length > RAILCOM_CHANNEL2_BYTES) {
+        offset = RAILCOM_CHANNEL1_BYTES;
+      }
+      if(first < RAILCOM_SYMBOL_ACK && second < RAILCOM_SYMBOL_ACK) {
+        const uint8_t id = first >> 2;
+        if(id == RAILCOM_ID_ADR_HIGH || id == RAILCOM_ID_ADR_LOW) {
+          datagrams[count++] = {1, id, (uint32_t)(((first & 0x03) << 6) | second)};
+          offset = RAILCOM_CHANNEL1_BYTES;
+        }
+      }
+    }
+    while(offset < length && count < maxDatagrams) {
+      const uint8_t symbol = decodeSymbol(data[offset]);
+      if(symbol == RAILCOM_SYMBOL_ACK || symbol == RAILCOM_SYMBOL_NACK ||
+         symbol == RAILCOM_SYMBOL_BUSY) {
+        offset++;
+        continue;
+      } else if(symbol == RAILCOM_SYMBOL_INVALID) {
+        break;
+      }
+      const uint8_t id = symbol >> 2;
+      const uint8_t symbolCount = datagramSymbols(id);
+      if(!symbolCount || offset + symbolCount > length) {
+        break;
+      }
+      uint32_t value = symbol & 0x03;
+      uint8_t index = 1;
+      for(; index < symbolCount; index++) {
+        const uint8_t next = decodeSymbol(data[offset + index]);
+        if(next >= RAILCOM_SYMBOL_ACK) {
+          break;
+        }
+        value = (value << 6) | next;
+      }
+      if(index < symbolCount) {
+        break;
+      }
+      datagrams[count++] = {2, id, value};
+      offset += symbolCount;
+    }
+    return count;
+  }
+};
+
+#endif
@@ -132,6 +132,7 @@ bool S88BusManager::createOrUpdateBus(const uint8_t id, const uint8_t dataPin, c
     }
   }
   s88SensorBus.add(new S88SensorBus(id, dataPin, sensorCount));
+  StateObservers::layoutChanged();
   return true;
 }
 
@@ -201,6 +202,7 @@ void S88SensorBus::update(const uint8_t dataPin, const uint16_t sensorCount) {
   }
   log_i("S88SensorBus(%d) updated to use data pin %d, updating %d sensors",
     _id, _dataPin, _sensors.size());
+  StateObservers::layoutChanged();
   show();
 }
 
@@ -237,6 +239,7 @@ void S88SensorBus::removeSensors(int16_t sensorCount) {
       sensors.remove(removedSensor);
     }
   }
+  StateObservers::layoutChanged();
 }
 
 String S88SensorBus::getStateString() {
@@ -265,7 +268,7 @@ void S88SensorBus::show() {
   }
 }
 
-void S88BusCommandAdapter::process(const std::vector<String> arguments) {
+void S88BusCommandAdapter::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.empty()) {
     // list all sensor groups
     for (const auto& sensorBus : s88SensorBus) {
@@ -0,0 +1,112 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <esp_timer.h>
+
+#include "Scheduler.h"
+#include "StallWatchdog.h"
+
+/**********************************************************************
+
+The DCC++ESP32 BASE STATION main loop is driven by a cooperative deadline
+scheduler rather than calling every subsystem on every pass of loop(). Each
+subsystem is registered with:
+
+  NAME:    short name used for logging and the /espinfo task statistics
+  PERIOD:  how often the subsystem should be run (in microseconds)
+  BUDGET:  how long a single run is expected to take (in microseconds)
+
+On each pass of loop() the scheduler runs the task with the earliest deadline
+that is due. A run that takes longer than the task budget is counted as an
+overrun, a run that starts more than one period after it was due is counted as
+late and the task is re-based to the current time so it does not try to catch
+up with a burst of back to back runs. When no task is due the loop task yields
+so that the idle task and the WiFi stack get the CPU.
+
+**********************************************************************/
+
+std::vector<ScheduledTask *> scheduledTasks;
+
+ScheduledTask::ScheduledTask(const char *name, std::function<void()> callback,
+  uint32_t periodMicros, uint32_t budgetMicros) : _name(name), _callback(callback),
+  _periodMicros(periodMicros), _budgetMicros(budgetMicros),
+  _nextRun(esp_timer_get_time()), _runCount(0), _overrunCount(0), _lateCount(0),
+  _maxDurationMicros(0) {
+  log_i("ScheduledTask(%s) created, period: %dus, budget: %dus", _name,
+    _periodMicros, _budgetMicros);
+}
+
+void ScheduledTask::run(uint64_t now) {
+  {
+    StallWatchdogScope watchdogScope(_name);
+    _callback();
+  }
+  uint32_t duration = esp_timer_get_time() - now;
+  _runCount++;
+  if(duration > _maxDurationMicros) {
+    _maxDurationMicros = duration;
+  }
+  if(duration > _budgetMicros) {
+    _overrunCount++;
+    log_d("ScheduledTask(%s) overrun %dus (budget %dus)", _name, duration, _budgetMicros);
+  }
+  _nextRun += _periodMicros;
+  if(_nextRun < now) {
+    _lateCount++;
+    _nextRun = now + _periodMicros;
+  }
+}
+
+void ScheduledTask::getState(JsonObject &task) {
+  task[F("name")] = _name;
+  task[F("period")] = _periodMicros;
+  task[F("budget")] = _budgetMicros;
+  task[F("runs")] = _runCount;
+  task[F("overruns")] = _overrunCount;
+  task[F("late")] = _lateCount;
+  task[F("maxDuration")] = _maxDurationMicros;
+}
+
+void Scheduler::registerTask(const char *name, std::function<void()> callback,
+  uint32_t periodMicros, uint32_t budgetMicros) {
+  scheduledTasks.push_back(new ScheduledTask(name, callback, periodMicros, budgetMicros));
+}
+
+void Scheduler::run() {
+  uint64_t now = esp_timer_get_time();
+  ScheduledTask *nextTask = NULL;
+  for (const auto& task : scheduledTasks) {
+    if(task->getNextRun() <= now &&
+      (nextTask == NULL || task->getNextRun() < nextTask->getNextRun())) {
+      nextTask = task;
+    }
+  }
+  if(nextTask != NULL) {
+    nextTask->run(now);
+  } else {
+    // nothing is due, give the remaining time to other tasks
+    delay(1);
+  }
+}
+
+void Scheduler::getState(JsonArray &array) {
+  for (const auto& task : scheduledTasks) {
+    JsonObject &taskJson = array.createNestedObject();
+    task->getState(taskJson);
+  }
+}
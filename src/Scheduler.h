@@ -0,0 +1,59 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <functional>
+
+class ScheduledTask {
+public:
+  ScheduledTask(const char *, std::function<void()>, uint32_t, uint32_t);
+  void run(uint64_t);
+  const char *getName() {
+    return _name;
+  }
+  uint64_t getNextRun() {
+    return _nextRun;
+  }
+  void getState(JsonObject &);
+private:
+  const char *_name;
+  std::function<void()> _callback;
+  const uint32_t _periodMicros;
+  const uint32_t _budgetMicros;
+  uint64_t _nextRun;
+  uint32_t _runCount;
+  uint32_t _overrunCount;
+  uint32_t _lateCount;
+  uint32_t _maxDurationMicros;
+};
+
+// Cooperative scheduler for the main loop. Each subsystem registers the
+// period it needs to run at and a time budget for a single run, the scheduler
+// runs whichever task has the earliest deadline and records any run that
+// exceeded its budget or started after its deadline.
+class Scheduler {
+public:
+  static void registerTask(const char *, std::function<void()>, uint32_t, uint32_t);
+  static void run();
+  static void getState(JsonArray &);
+};
+
+#endif
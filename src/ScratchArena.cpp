@@ -0,0 +1,129 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <esp_heap_caps.h>
+
+#include "ScratchArena.h"
+
+// all allocations are rounded up to this size to keep returned pointers
+// suitably aligned for any type.
+const size_t scratchArenaAlignment = 8;
+
+struct ScratchArenaSlot {
+  TaskHandle_t task;
+  ScratchArena *arena;
+};
+
+ScratchArenaSlot scratchArenas[SCRATCH_ARENA_MAX_TASKS];
+portMUX_TYPE scratchArenaMux = portMUX_INITIALIZER_UNLOCKED;
+
+// used by tasks that could not be given a slot, it has no buffer so every
+// allocation comes from the heap and is freed individually.
+ScratchArena scratchArenaHeapFallback(0);
+uint32_t scratchArenaFallbacks = 0;
+
+ScratchArena::ScratchArena(size_t size) : _buffer(size ? (uint8_t *)malloc(size) : NULL),
+  _size(size), _offset(0), _highWaterMark(0), _overflowCount(0) {
+}
+
+void *ScratchArena::allocate(size_t size) {
+  size = (size + scratchArenaAlignment - 1) & ~(scratchArenaAlignment - 1);
+  if(_buffer == NULL || _offset + size > _size) {
+    _overflowCount++;
+    return malloc(size);
+  }
+  void *ptr = _buffer + _offset;
+  _offset += size;
+  if(_offset > _highWaterMark) {
+    _highWaterMark = _offset;
+  }
+  return ptr;
+}
+
+void ScratchArena::deallocate(void *ptr) {
+  // memory inside the arena is reclaimed by rewinding, anything else was an
+  // overflow allocation from the heap.
+  if(ptr != NULL && !owns(ptr)) {
+    free(ptr);
+  }
+}
+
+ScratchArena &ScratchArena::current() {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  bool slotAvailable = false;
+  for(int index = 0; index < SCRATCH_ARENA_MAX_TASKS; index++) {
+    if(scratchArenas[index].task == task) {
+      return *scratchArenas[index].arena;
+    } else if(scratchArenas[index].task == NULL) {
+      slotAvailable = true;
+    }
+  }
+  if(slotAvailable) {
+    // first use from this task, create the arena outside of the critical
+    // section and then claim a slot for it.
+    ScratchArena *arena = new ScratchArena(SCRATCH_ARENA_SIZE);
+    portENTER_CRITICAL(&scratchArenaMux);
+    for(int index = 0; index < SCRATCH_ARENA_MAX_TASKS; index++) {
+      if(scratchArenas[index].task == NULL) {
+        scratchArenas[index].task = task;
+        scratchArenas[index].arena = arena;
+        portEXIT_CRITICAL(&scratchArenaMux);
+        log_i("ScratchArena(%s) created with %d bytes", pcTaskGetTaskName(task), SCRATCH_ARENA_SIZE);
+        return *arena;
+      }
+    }
+    portEXIT_CRITICAL(&scratchArenaMux);
+    delete arena;
+  }
+  // no free slots, another task's arena can not be shared since its scope
+  // could be rewound while this task is still using it.
+  portENTER_CRITICAL(&scratchArenaMux);
+  const bool firstFallback = scratchArenaFallbacks++ == 0;
+  portEXIT_CRITICAL(&scratchArenaMux);
+  if(firstFallback) {
+    log_e("ScratchArena(%s) no free task slots (SCRATCH_ARENA_MAX_TASKS: %d), using the heap",
+      pcTaskGetTaskName(task), SCRATCH_ARENA_MAX_TASKS);
+  }
+  return scratchArenaHeapFallback;
+}
+
+void ScratchArena::getState(JsonObject &root) {
+  root[F("freeHeap")] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  root[F("minFreeHeap")] = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  root[F("largestFreeBlock")] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  root[F("heapFragmentation")] = getHeapFragmentation();
+  root[F("scratchArenaFallbacks")] = scratchArenaFallbacks;
+  JsonArray &arenas = root.createNestedArray(F("scratchArenas"));
+  for(int index = 0; index < SCRATCH_ARENA_MAX_TASKS; index++) {
+    if(scratchArenas[index].task != NULL) {
+      JsonObject &arena = arenas.createNestedObject();
+      arena[F("task")] = pcTaskGetTaskName(scratchArenas[index].task);
+      arena[F("size")] = scratchArenas[index].arena->getSize();
+      arena[F("highWater")] = scratchArenas[index].arena->getHighWaterMark();
+      arena[F("overflows")] = scratchArenas[index].arena->getOverflowCount();
+    }
+  }
+}
+
+uint8_t getHeapFragmentation() {
+  size_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  if(freeHeap == 0) {
+    return 100;
+  }
+  return 100 - ((heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) * 100) / freeHeap);
+}
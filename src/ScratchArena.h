@@ -0,0 +1,110 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _SCRATCH_ARENA_H_
+#define _SCRATCH_ARENA_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Bump allocator for short lived command processing temporaries. Each task
+// that processes commands (the Arduino loop task and the AsyncTCP task) gets
+// its own arena which is allocated once and reused for the lifetime of the
+// base station. Allocations are released by rewinding the arena, individual
+// frees are ignored. When the arena is exhausted allocations fall back to the
+// heap so a large command will still be processed, tasks beyond
+// SCRATCH_ARENA_MAX_TASKS only use the heap.
+class ScratchArena {
+public:
+  ScratchArena(size_t);
+  void *allocate(size_t);
+  void deallocate(void *);
+  bool owns(const void *ptr) {
+    return ptr >= _buffer && ptr < _buffer + _size;
+  }
+  size_t getOffset() {
+    return _offset;
+  }
+  void rewind(size_t offset) {
+    _offset = offset;
+  }
+  void reset() {
+    _offset = 0;
+  }
+  size_t getSize() {
+    return _size;
+  }
+  size_t getHighWaterMark() {
+    return _highWaterMark;
+  }
+  uint32_t getOverflowCount() {
+    return _overflowCount;
+  }
+  static ScratchArena &current();
+  static void getState(JsonObject &);
+private:
+  uint8_t *_buffer;
+  const size_t _size;
+  size_t _offset;
+  size_t _highWaterMark;
+  uint32_t _overflowCount;
+};
+
+// Records the current arena position and rewinds to it when it goes out of
+// scope, anything allocated from the arena inside the scope is released.
+class ScratchArenaScope {
+public:
+  ScratchArenaScope() : _arena(ScratchArena::current()), _offset(_arena.getOffset()) {}
+  ~ScratchArenaScope() {
+    _arena.rewind(_offset);
+  }
+private:
+  ScratchArena &_arena;
+  const size_t _offset;
+};
+
+// STL compatible allocator backed by the calling task's ScratchArena.
+template<typename T>
+class ScratchAllocator {
+public:
+  typedef T value_type;
+  ScratchAllocator() {}
+  template<typename U>
+  ScratchAllocator(const ScratchAllocator<U> &) {}
+  T *allocate(size_t count) {
+    return static_cast<T *>(ScratchArena::current().allocate(count * sizeof(T)));
+  }
+  void deallocate(T *ptr, size_t) {
+    ScratchArena::current().deallocate(ptr);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const ScratchAllocator<T> &, const ScratchAllocator<U> &) {
+  return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const ScratchAllocator<T> &, const ScratchAllocator<U> &) {
+  return false;
+}
+
+// Returns the percentage of free heap that is not usable as a single block,
+// zero is a completely unfragmented heap.
+uint8_t getHeapFragmentation();
+
+#endif
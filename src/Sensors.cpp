@@ -17,6 +17,7 @@ COPYRIGHT (c) 2017 Mike Dunston
 
 #include "DCCppESP32.h"
 #include "Sensors.h"
+#include <base64.h>
 
 /**********************************************************************
 
@@ -73,10 +74,99 @@ Depending on whether the physical sensor is acting as an "event-trigger" or a
 "detection-sensor," you may decide to ignore the <q ID> return and only react to
 <Q ID> triggers.
 
+The last SENSOR_EVENT_HISTORY sensor transitions (GPIO and S88) are kept with a
+timestamp and sequence number so that a client which has reconnected or missed
+a message can catch up without requesting the state of every sensor:
+
+  <QE SEQ>:             returns the recorded events with a sequence number of
+                        SEQ or later.
+        returns: <QE FIRST NEXT> followed by <QE SEQ TIMESTAMP ID STATE> for
+        each event, FIRST is the sequence number of the first event returned
+        (when it is greater than SEQ older events have been lost) and NEXT is
+        the sequence number to request next time.
+
+The same information is available from the /sensorEvents?since=SEQ web
+endpoint.
+
+The state of all sensors (GPIO and S88) in a range of IDs can be retrieved as a
+packed bitmap:
+
+  <QB FIRST COUNT>:     returns the state of sensors FIRST to FIRST+COUNT-1,
+                        COUNT defaults to all IDs up to the highest sensor ID
+                        and is limited to SENSOR_BITMAP_MAX_IDS.
+        returns: <QB FIRST COUNT BITMAP> where BITMAP is the base64 encoded
+        bitmap, bit N (LSB first within each byte) is set when sensor
+        FIRST+N is active. Sensors that are not defined are reported as
+        inactive.
+
+The same bitmap is available from the /sensorBitmap?first=FIRST&count=COUNT
+web endpoint.
+
 **********************************************************************/
 
 LinkedList<Sensor *> sensors([](Sensor *sensor) {delete sensor; });
 
+SensorEvent sensorEvents[SENSOR_EVENT_HISTORY];
+uint32_t sensorEventNextSequence = 0;
+portMUX_TYPE sensorEventLock = portMUX_INITIALIZER_UNLOCKED;
+
+void SensorEventHistory::record(uint16_t sensorID, bool state) {
+  const uint32_t timestamp = millis();
+  portENTER_CRITICAL(&sensorEventLock);
+  SensorEvent &event = sensorEvents[sensorEventNextSequence % SENSOR_EVENT_HISTORY];
+  event.timestamp = timestamp;
+  event.sensorID = sensorID;
+  event.state = state;
+  event.reserved = 0;
+  sensorEventNextSequence++;
+  portEXIT_CRITICAL(&sensorEventLock);
+}
+
+uint32_t SensorEventHistory::getNextSequence() {
+  return sensorEventNextSequence;
+}
+
+// copies the events with a sequence number of since or later into events and
+// returns the sequence number of the first event copied.
+uint32_t SensorEventHistory::getEventsSince(uint32_t since, std::vector<SensorEvent> &events) {
+  events.reserve(SENSOR_EVENT_HISTORY);
+  portENTER_CRITICAL(&sensorEventLock);
+  const uint32_t next = sensorEventNextSequence;
+  const uint32_t oldest = next > SENSOR_EVENT_HISTORY ? next - SENSOR_EVENT_HISTORY : 0;
+  // a sequence number from before a restart can be larger than next
+  const uint32_t first = since > next ? next : std::max(since, oldest);
+  for(uint32_t sequence = first; sequence < next; sequence++) {
+    events.push_back(sensorEvents[sequence % SENSOR_EVENT_HISTORY]);
+  }
+  portEXIT_CRITICAL(&sensorEventLock);
+  return first;
+}
+
+void SensorEventHistory::getState(JsonObject &root, uint32_t since) {
+  std::vector<SensorEvent> events;
+  uint32_t sequence = getEventsSince(since, events);
+  root[F("first")] = sequence;
+  root[F("next")] = sequence + events.size();
+  JsonArray &array = root.createNestedArray(F("events"));
+  for (const auto& event : events) {
+    JsonObject &eventJson = array.createNestedObject();
+    eventJson[F("seq")] = sequence++;
+    eventJson[F("time")] = event.timestamp;
+    eventJson[F("id")] = event.sensorID;
+    eventJson[F("active")] = event.state == 1;
+  }
+}
+
+void SensorEventHistory::show(uint32_t since) {
+  std::vector<SensorEvent> events;
+  uint32_t sequence = getEventsSince(since, events);
+  wifiInterface.printf(F("<QE %d %d>"), sequence, sequence + events.size());
+  for (const auto& event : events) {
+    wifiInterface.printf(F("<QE %d %d %d %d>"), sequence++, event.timestamp,
+      event.sensorID, event.state);
+  }
+}
+
 void SensorManager::init() {
   log_i("Initializing sensors list");
   uint16_t sensorCount = configStore.getUShort("SensorCount", 0);
@@ -84,11 +174,13 @@ void SensorManager::init() {
   for(int index = 0; index < sensorCount; index++) {
     sensors.add(new Sensor(index));
   }
+  StateObservers::layoutChanged();
 }
 
 void SensorManager::clear() {
   configStore.putUShort("SensorCount", 0);
   sensors.free();
+  StateObservers::layoutChanged();
 }
 
 uint16_t SensorManager::store() {
@@ -122,11 +214,16 @@ void SensorManager::createOrUpdate(const uint16_t id, const uint8_t pin, const b
   // check for duplicate ID or PIN
   for (const auto& sensor : sensors) {
     if(sensor->getID() == id) {
-      sensor->update(pin, pullUp);
+      if(sensor->getPin() < 0) {
+        log_w("Sensor %d is an S88 or federation sensor and can't be updated", id);
+      } else {
+        sensor->update(pin, pullUp);
+      }
       return;
     }
   }
   sensors.add(new Sensor(id, pin, pullUp));
+  StateObservers::layoutChanged();
 }
 
 bool SensorManager::remove(const uint16_t id) {
@@ -137,20 +234,51 @@ bool SensorManager::remove(const uint16_t id) {
       sensorToRemove = sensor;
     }
   }
-  if(sensorToRemove != NULL) {
+  // S88 and federation sensors (negative pins) are owned by their bus or node
+  if(sensorToRemove != NULL && sensorToRemove->getPin() >= 0) {
     sensors.remove(sensorToRemove);
+    StateObservers::layoutChanged();
     return true;
   }
   return false;
 }
 
-uint8_t SensorManager::getSensorPin(const uint16_t id) {
+int8_t SensorManager::getSensorPin(const uint16_t id) {
   for (const auto& sensor : sensors) {
     if(sensor->getID() == id) {
       return sensor->getPin();
     }
   }
-  return -1;
+  return SENSOR_NOT_FOUND_PIN;
+}
+
+uint16_t SensorManager::getMaxSensorID() {
+  uint16_t maxID = 0;
+  for (const auto& sensor : sensors) {
+    maxID = std::max(maxID, sensor->getID());
+  }
+  return maxID;
+}
+
+// packs the state of sensors first to first+count-1 into bitmap, one bit per
+// sensor ID starting with the LSB of the first byte.
+void SensorManager::getStateBitmap(const uint16_t first, const uint16_t count, std::vector<uint8_t> &bitmap) {
+  bitmap.assign((count + 7) / 8, 0);
+  for (const auto& sensor : sensors) {
+    const uint16_t id = sensor->getID();
+    if(id >= first && id - first < count && sensor->isActive()) {
+      bitmap[(id - first) / 8] |= (1 << ((id - first) % 8));
+    }
+  }
+}
+
+String SensorManager::getStateBitmapBase64(const uint16_t first, const uint16_t count) {
+  std::vector<uint8_t> bitmap;
+  getStateBitmap(first, count, bitmap);
+  if(bitmap.empty()) {
+    return "";
+  }
+  return base64::encode(bitmap.data(), bitmap.size());
 }
 
 Sensor::Sensor(uint16_t sensorID, int8_t pin, bool pullUp, bool announce) : _sensorID(sensorID), _pin(pin), _pullUp(pullUp), _lastState(false) {
@@ -207,7 +335,35 @@ void Sensor::show() {
   wifiInterface.printf(F("<Q %d %d %d>"), _sensorID, _pin, _pullUp);
 }
 
-void SensorCommandAdapter::process(const std::vector<String> arguments) {
+void SensorBitmapCommand::process(const DCCPPProtocolArguments &arguments) {
+  if(arguments.size() > 2) {
+    wifiInterface.printf(F("<X>"));
+    return;
+  }
+  uint16_t first = arguments.size() > 0 ? arguments[0].toInt() : 0;
+  uint16_t count = SensorManager::getMaxSensorID() >= first ?
+    SensorManager::getMaxSensorID() - first + 1 : 0;
+  if(arguments.size() > 1) {
+    count = arguments[1].toInt();
+  }
+  count = std::min(count, (uint16_t)SENSOR_BITMAP_MAX_IDS);
+  // the bitmap can be far larger than the printf buffer so the reply is
+  // formatted into a buffer sized for it.
+  const String bitmap = SensorManager::getStateBitmapBase64(first, count);
+  std::vector<char> reply(bitmap.length() + 32);
+  snprintf(reply.data(), reply.size(), "<QB %d %d %s>", first, count, bitmap.c_str());
+  wifiInterface.send(reply.data());
+}
+
+void SensorEventsCommand::process(const DCCPPProtocolArguments &arguments) {
+  if(arguments.size() == 1) {
+    SensorEventHistory::show(arguments[0].toInt());
+  } else {
+    wifiInterface.printf(F("<X>"));
+  }
+}
+
+void SensorCommandAdapter::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.empty()) {
     // list all sensors
     for (const auto& sensor : sensors) {
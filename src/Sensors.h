@@ -19,6 +19,37 @@ COPYRIGHT (c) 2017 Mike Dunston
 #define _SENSORS_H_
 
 #include "DCCppESP32.h"
+#include "StateObserver.h"
+
+// maximum number of sensor IDs covered by a single sensor state bitmap
+#define SENSOR_BITMAP_MAX_IDS 4096
+
+// returned by SensorManager::getSensorPin when there is no sensor with the ID,
+// sensors owned by an S88 bus or a federation node use other negative pins.
+#define SENSOR_NOT_FOUND_PIN INT8_MIN
+
+// number of sensor events kept in the history ring, must be a power of two
+#define SENSOR_EVENT_HISTORY 256
+
+// compact record of a sensor transition, the sequence number of an event is
+// implied by its position in the history ring.
+struct SensorEvent {
+  uint32_t timestamp;
+  uint16_t sensorID;
+  uint8_t state;
+  uint8_t reserved;
+};
+
+// Fixed size history of sensor transitions that clients can use to catch up
+// on the events they missed since a sequence number.
+class SensorEventHistory {
+public:
+  static void record(uint16_t, bool);
+  static uint32_t getNextSequence();
+  static uint32_t getEventsSince(uint32_t, std::vector<SensorEvent> &);
+  static void getState(JsonObject &, uint32_t);
+  static void show(uint32_t);
+};
 
 class Sensor {
 public:
@@ -50,6 +81,8 @@ protected:
       } else {
         wifiInterface.printf(F("<q %d>"), _sensorID);
       }
+      SensorEventHistory::record(_sensorID, state);
+      StateObservers::sensorChanged(_sensorID, state);
     }
   }
   void setID(uint16_t id) {
@@ -71,13 +104,32 @@ public:
   static void getState(JsonArray &);
   static void createOrUpdate(const uint16_t, const uint8_t, const bool);
   static bool remove(const uint16_t);
-  static uint8_t getSensorPin(const uint16_t);
+  static int8_t getSensorPin(const uint16_t);
+  static uint16_t getMaxSensorID();
+  static void getStateBitmap(const uint16_t, const uint16_t, std::vector<uint8_t> &);
+  static String getStateBitmapBase64(const uint16_t, const uint16_t);
+};
+
+class SensorBitmapCommand : public DCCPPProtocolCommand {
+public:
+  void process(const DCCPPProtocolArguments &);
+  const char *getID() {
+    return "QB";
+  }
+};
+
+class SensorEventsCommand : public DCCPPProtocolCommand {
+public:
+  void process(const DCCPPProtocolArguments &);
+  const char *getID() {
+    return "QE";
+  }
 };
 
 class SensorCommandAdapter : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String>);
-  String getID() {
+  void process(const DCCPPProtocolArguments &);
+  const char *getID() {
     return "S";
   }
 };
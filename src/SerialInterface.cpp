@@ -0,0 +1,131 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include "SerialInterface.h"
+#include "CommandQueue.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can accept DCC++ commands over the USB serial port in
+addition to the WiFi clients, this allows JMRI to be connected by cable using
+the standard DCC++ serial connection at SERIAL_INTERFACE_BAUD.
+
+Received data is split into <COMMAND> frames by the same decoder used for the
+TCP clients, all responses and broadcasts sent to the WiFi clients are also
+sent to the serial port. Responses are queued and written by the scheduler
+task as the UART has room for them so a slow serial link never blocks the task
+generating the response.
+
+NOTE: the ESP32 log output uses the same serial port, JMRI ignores anything
+outside of a <> frame but CORE_DEBUG_LEVEL should be lowered to reduce the
+noise on the link.
+
+**********************************************************************/
+
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+
+std::vector<uint8_t> serialRxBuffer;
+int8_t serialCommandQueue = COMMAND_QUEUE_SHARED_CLIENT;
+
+// ring buffer of responses pending transmission, these can be added from any
+// task.
+uint8_t serialTxQueue[SERIAL_INTERFACE_TX_QUEUE];
+uint16_t serialTxHead = 0;
+uint16_t serialTxTail = 0;
+portMUX_TYPE serialTxMux = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t serialBytesReceived = 0;
+uint32_t serialBytesSent = 0;
+uint32_t serialResponsesDropped = 0;
+uint32_t serialFramesDiscarded = 0;
+uint16_t serialTxHighWater = 0;
+
+uint16_t serialTxQueued() {
+  return (serialTxTail + SERIAL_INTERFACE_TX_QUEUE - serialTxHead) % SERIAL_INTERFACE_TX_QUEUE;
+}
+
+void SerialInterface::init() {
+  log_i("[Serial] Accepting commands at %d baud", SERIAL_INTERFACE_BAUD);
+  serialRxBuffer.reserve(SERIAL_INTERFACE_MAX_FRAME);
+  serialCommandQueue = CommandQueue::registerClient("serial");
+}
+
+void SerialInterface::update() {
+  // anything that does not fit in the buffer is left in the UART receive buffer
+  int available = std::min(Serial.available(), (int)(SERIAL_INTERFACE_MAX_FRAME - serialRxBuffer.size()));
+  if(available > 0) {
+    auto readDest = serialRxBuffer.insert(serialRxBuffer.end(), available, 0);
+    auto added = Serial.readBytes(&*readDest, available);
+    serialRxBuffer.erase(readDest + added, serialRxBuffer.end());
+    serialBytesReceived += added;
+  }
+  if(!serialRxBuffer.empty() &&
+    !wifiInterface.processFrames(serialRxBuffer, serialCommandQueue) &&
+    serialRxBuffer.size() >= SERIAL_INTERFACE_MAX_FRAME) {
+    // no complete command in the buffer, this is noise or a runaway frame
+    serialFramesDiscarded++;
+    serialRxBuffer.clear();
+  }
+  // write as much of the queue as the UART can take without blocking
+  int room = Serial.availableForWrite();
+  while(room > 0) {
+    uint8_t chunk[64];
+    uint16_t length = 0;
+    portENTER_CRITICAL(&serialTxMux);
+    while(length < sizeof(chunk) && length < room && serialTxHead != serialTxTail) {
+      chunk[length++] = serialTxQueue[serialTxHead];
+      serialTxHead = (serialTxHead + 1) % SERIAL_INTERFACE_TX_QUEUE;
+    }
+    portEXIT_CRITICAL(&serialTxMux);
+    if(!length) {
+      break;
+    }
+    Serial.write(chunk, length);
+    serialBytesSent += length;
+    room -= length;
+  }
+}
+
+void SerialInterface::send(const char *buf) {
+  const uint16_t length = strlen(buf);
+  portENTER_CRITICAL(&serialTxMux);
+  // one slot is always kept free to tell a full queue from an empty one
+  if(serialTxQueued() + length < SERIAL_INTERFACE_TX_QUEUE) {
+    for(uint16_t index = 0; index < length; index++) {
+      serialTxQueue[serialTxTail] = buf[index];
+      serialTxTail = (serialTxTail + 1) % SERIAL_INTERFACE_TX_QUEUE;
+    }
+    if(serialTxQueued() > serialTxHighWater) {
+      serialTxHighWater = serialTxQueued();
+    }
+  } else {
+    serialResponsesDropped++;
+  }
+  portEXIT_CRITICAL(&serialTxMux);
+}
+
+void SerialInterface::getState(JsonObject &root) {
+  root[F("baud")] = SERIAL_INTERFACE_BAUD;
+  root[F("received")] = serialBytesReceived;
+  root[F("sent")] = serialBytesSent;
+  root[F("queued")] = serialTxQueued();
+  root[F("queueHighWater")] = serialTxHighWater;
+  root[F("dropped")] = serialResponsesDropped;
+  root[F("discarded")] = serialFramesDiscarded;
+}
+#endif
@@ -0,0 +1,43 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _SERIAL_INTERFACE_H_
+#define _SERIAL_INTERFACE_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#ifndef SERIAL_INTERFACE_BAUD
+#define SERIAL_INTERFACE_BAUD 115200
+#endif
+
+// size (in bytes) of the queue of responses waiting to be written to the
+// serial port, responses that do not fit are dropped.
+#define SERIAL_INTERFACE_TX_QUEUE 2048
+// received data buffered for the serial port, data without a complete command
+// beyond this size is discarded
+#define SERIAL_INTERFACE_MAX_FRAME 256
+
+class SerialInterface {
+public:
+  static void init();
+  static void update();
+  static void send(const char *);
+  static void getState(JsonObject &);
+};
+
+#endif
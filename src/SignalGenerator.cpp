@@ -19,9 +19,12 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include <esp32-hal-timer.h>
 #include <driver/adc.h>
 #include <esp_adc_cal.h>
+#include <esp_ipc.h>
 
 #include "SignalGenerator.h"
 #include "MotorBoard.h"
+#include "RailCom.h"
+#include "Federation.h"
 
 // Define constants for DCC Signal pattern
 
@@ -43,11 +46,39 @@ SignalGenerator dccSignal[MAX_DCC_SIGNAL_GENERATORS];
 uint8_t idlePacket[] = {0xFF, 0x00};
 uint8_t resetPacket[] = {0x00, 0x00};
 
+// number of repeats used for each DCC_PACKET_CLASS, the maximum is used when
+// the track is idle and the minimum when the track is fully utilised.
+struct DCCPacketRepeatPolicy {
+  const char *name;
+  uint8_t minRepeats;
+  uint8_t maxRepeats;
+};
+
+const DCCPacketRepeatPolicy packetRepeatPolicy[MAX_DCC_PACKET_CLASS] = {
+  // speed packets are refreshed every 50ms by the LocomotiveManager
+  {"speed", 0, 2},
+  {"emergencyStop", 3, 6},
+  {"function", 1, 5},
+  // turnouts and signals are not refreshed so they always get a few repeats
+  {"accessory", 2, 6},
+  // S-9.2.1 requires decoders to receive a POM write packet twice before it
+  // is acted on
+  {"opsCV", 2, 5}
+};
+
 void configureDCCSignalGenerators() {
   dccSignal[DCC_SIGNAL_OPERATIONS].configureSignal<DCC_SIGNAL_OPERATIONS>("OPS",
     DCC_SIGNAL_PIN_OPERATIONS, 512);
   dccSignal[DCC_SIGNAL_PROGRAMMING].configureSignal<DCC_SIGNAL_PROGRAMMING>("PROG",
     DCC_SIGNAL_PIN_PROGRAMMING, 64);
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  // RailCom is only supported on the OPERATIONS track
+#if defined(RAILCOM_BRAKE_PIN)
+  dccSignal[DCC_SIGNAL_OPERATIONS].configureRailComCutout(RAILCOM_BRAKE_PIN, true);
+#else
+  dccSignal[DCC_SIGNAL_OPERATIONS].configureRailComCutout(MOTORBOARD_ENABLE_PIN_MAIN, false);
+#endif
+#endif
 }
 
 void startDCCSignalGenerators() {
@@ -60,6 +91,15 @@ void stopDCCSignalGenerators() {
   dccSignal[DCC_SIGNAL_PROGRAMMING].stopSignal<DCC_SIGNAL_PROGRAMMING>();
 }
 
+// mirrors the OPERATIONS DCC signal onto a booster output, the booster's
+// enable pin is controlled by its own motor board.
+void addDCCSignalBooster(const uint8_t signalPin, const uint8_t enablePin) {
+  dccSignal[DCC_SIGNAL_OPERATIONS].addOutputPin(signalPin);
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED && !defined(RAILCOM_BRAKE_PIN)
+  dccSignal[DCC_SIGNAL_OPERATIONS].configureRailComCutout(enablePin, false);
+#endif
+}
+
 void loadBytePacket(SignalGenerator &signalGenerator, uint8_t *data, uint8_t length, uint8_t repeatCount) {
   std::vector<uint8_t> packet;
   for(int i = 0; i < length; i++) {
@@ -68,8 +108,11 @@ void loadBytePacket(SignalGenerator &signalGenerator, uint8_t *data, uint8_t len
   signalGenerator.loadPacket(packet, repeatCount);
 }
 
+void loadBytePacket(SignalGenerator &signalGenerator, uint8_t *data, uint8_t length, DCC_PACKET_CLASS packetClass) {
+  loadBytePacket(signalGenerator, data, length, signalGenerator.getRepeatCount(packetClass));
+}
+
 bool IRAM_ATTR SignalGenerator::getNextBitToSend() {
-  const uint8_t bitMask[] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
   bool result = false;
   // if we are processing a packet, check if we have sent all bits or repeats
   if(_currentPacket != NULL) {
@@ -90,8 +133,7 @@ bool IRAM_ATTR SignalGenerator::getNextBitToSend() {
   // queue up an idle packet
   if (_currentPacket == NULL) {
     if(!_toSend.empty()) {
-      _currentPacket = _toSend.front();
-      _toSend.pop();
+      _currentPacket = _toSend.pop();
     } else {
       _currentPacket = &_idlePacket;
       _currentPacket->currentBit = 0;
@@ -99,24 +141,82 @@ bool IRAM_ATTR SignalGenerator::getNextBitToSend() {
   }
   // if we have a packet to send, get the next bit from the packet
   if(_currentPacket != NULL) {
-    result = _currentPacket->buffer[_currentPacket->currentBit / 8] & bitMask[_currentPacket->currentBit % 8];
+    if(_currentPacket->currentBit == 0) {
+      if(_currentPacket == &_idlePacket) {
+        _idleTransmissions++;
+      } else {
+        _packetTransmissions++;
+      }
+    }
+    result = _currentPacket->buffer[_currentPacket->currentBit / 8] & (0x80 >> (_currentPacket->currentBit % 8));
     _currentPacket->currentBit++;
   }
   return result;
 }
 
+void SignalGenerator::loadPacket(std::vector<uint8_t> data, DCC_PACKET_CLASS packetClass) {
+  loadPacket(data, getRepeatCount(packetClass));
+}
+
+// returns the percentage of packet transmissions in the last
+// DCC_UTILISATION_WINDOW that were not the idle packet, smoothed over the
+// previous windows. This is called from any task queueing a packet.
+uint8_t SignalGenerator::getUtilisation() {
+  portENTER_CRITICAL(&_utilisationMux);
+  if(millis() - _lastUtilisationUpdate >= DCC_UTILISATION_WINDOW) {
+    const uint32_t packets = _packetTransmissions;
+    const uint32_t idle = _idleTransmissions;
+    const uint32_t total = (packets - _lastPacketTransmissions) + (idle - _lastIdleTransmissions);
+    if(total) {
+      const uint32_t utilisation = ((packets - _lastPacketTransmissions) * 100) / total;
+      _utilisation = (_utilisation + utilisation) / 2;
+    }
+    _lastPacketTransmissions = packets;
+    _lastIdleTransmissions = idle;
+    _lastUtilisationUpdate = millis();
+  }
+  const uint8_t utilisation = _utilisation;
+  portEXIT_CRITICAL(&_utilisationMux);
+  return utilisation;
+}
+
+// picks the number of repeats for a packet, more repeats are used when the
+// track is idle and fewer when it is busy but never fewer than the minimum
+// for the packet class.
+uint8_t SignalGenerator::getRepeatCount(DCC_PACKET_CLASS packetClass) {
+  const DCCPacketRepeatPolicy &policy = packetRepeatPolicy[packetClass];
+  if(_toSend.size() > DCC_REPEAT_BUSY_QUEUE_DEPTH) {
+    return policy.minRepeats;
+  }
+  return policy.maxRepeats -
+    (((policy.maxRepeats - policy.minRepeats) * getUtilisation()) / 100);
+}
+
 void SignalGenerator::loadPacket(std::vector<uint8_t> data, int numberOfRepeats) {
   #if DEBUG_SIGNAL_GENERATOR
     log_v("[%s] Preparing DCC Packet containing %d bytes, %d repeats [%d in queue]", _name.c_str(), data.size(), numberOfRepeats, _toSend.size());
   #endif
+#if defined(FEDERATION_ENABLED) && FEDERATION_ENABLED
+  if(this == &dccSignal[DCC_SIGNAL_OPERATIONS]) {
+    Federation::forwardPacket(data, numberOfRepeats);
+  }
+#endif
   while(_availablePackets.empty()) {
     delay(2);
   }
-  Packet *packet = _availablePackets.front();
-  _availablePackets.pop();
+  Packet *packet = _availablePackets.pop();
 
   packet->numberOfRepeats = numberOfRepeats;
   packet->currentBit = 0;
+  if(data[0] >= 1 && data[0] <= 127) {
+    // short locomotive address
+    packet->locoAddress = data[0];
+  } else if(data[0] >= 0xC0 && data[0] <= 0xE7) {
+    // long locomotive address
+    packet->locoAddress = ((data[0] & 0x3F) << 8) | data[1];
+  } else {
+    packet->locoAddress = 0;
+  }
 
   // calculate checksum (XOR)
   // add first byte as checksum byte
@@ -163,30 +263,115 @@ void SignalGenerator::loadPacket(std::vector<uint8_t> data, int numberOfRepeats)
   log_v("[%s] <* %s / %d / %d>\n", _name.c_str(), packetHex.c_str(),
     packet->numberOfBits, packet->numberOfRepeats);
 #endif
+  portENTER_CRITICAL(&_recentPacketsMux);
+  RecentPacket &recent = _recentPackets[_recentPacketIndex];
+  recent.time = millis();
+  recent.repeats = numberOfRepeats;
+  recent.length = min(data.size(), (size_t)DCC_RECENT_PACKET_BYTES);
+  memcpy(recent.data, data.data(), recent.length);
+  _recentPacketIndex = (_recentPacketIndex + 1) % DCC_RECENT_PACKETS;
+  if(_recentPacketCount < DCC_RECENT_PACKETS) {
+    _recentPacketCount++;
+  }
+  portEXIT_CRITICAL(&_recentPacketsMux);
   _toSend.push(packet);
 }
 
+// copies the recently queued packets (oldest first) into the provided array
+// of DCC_RECENT_PACKETS entries and returns the number copied.
+uint8_t SignalGenerator::getRecentPackets(RecentPacket *packets) {
+  portENTER_CRITICAL(&_recentPacketsMux);
+  const uint8_t count = _recentPacketCount;
+  for(uint8_t index = 0; index < count; index++) {
+    packets[index] = _recentPackets[(_recentPacketIndex + DCC_RECENT_PACKETS - count + index) % DCC_RECENT_PACKETS];
+  }
+  portEXIT_CRITICAL(&_recentPacketsMux);
+  return count;
+}
+
+// The DCC signal ISRs are allocated as level DCC_SIGNAL_INTERRUPT_LEVEL
+// interrupts on DCC_SIGNAL_CORE and are safe to run while the flash cache is
+// disabled. Everything they touch is in DRAM (dccSignal, the packet queues and
+// packets) or IRAM and they update the timer and GPIO registers directly
+// instead of using the timer and GPIO HAL functions.
+
+// full cycle timer ISR, starts the next bit (or the RailCom cutout).
 template<int timerIndex>
-void IRAM_ATTR signalGeneratorPulseTimer(void)
+void IRAM_ATTR signalGeneratorPulseTimer(void *arg)
 {
   auto& signalGenerator = dccSignal[timerIndex];
+  volatile timg_dev_t *timerGroup = signalGenerator._timerGroup;
+  signalGenerator._outputPins.set();
+  // the full cycle timer reloads to zero when the alarm fires so the counter
+  // is the number of microseconds the edge was delayed by.
+  timerGroup->hw_timer[0].update = 1;
+  signalGenerator.recordEdgeLatency(timerGroup->hw_timer[0].cnt_low);
+  timerGroup->int_clr_timers.t0 = 1;
+  uint32_t pulseDuration = DCC_ZERO_BIT_PULSE_DURATION;
+  uint32_t totalDuration = DCC_ZERO_BIT_TOTAL_DURATION;
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  if(signalGenerator._railComCutoutState == RAILCOM_CUTOUT_ACTIVE) {
+    // end of the RailCom cutout, restore the track output before sending the
+    // preamble of the next packet.
+    if(signalGenerator._railComBrake) {
+      signalGenerator._railComPins.clear();
+    } else {
+      signalGenerator._railComPoweredPins.set();
+    }
+    signalGenerator._railComCutoutState = RAILCOM_CUTOUT_NONE;
+    RailComManager::cutoutComplete(signalGenerator._currentPacket->locoAddress);
+  } else if(signalGenerator._railComPins.any() && signalGenerator.isPacketComplete()) {
+    // the packet end bit has been sent, hold the signal for the cutout start
+    // delay before opening the cutout. The cutout ends when the full cycle
+    // timer fires again.
+    pulseDuration = RAILCOM_CUTOUT_START;
+    totalDuration = RAILCOM_CUTOUT_END;
+    signalGenerator._railComCutoutState = RAILCOM_CUTOUT_STARTING;
+  }
+  if(signalGenerator._railComCutoutState != RAILCOM_CUTOUT_STARTING &&
+     signalGenerator.getNextBitToSend()) {
+#else
   if(signalGenerator.getNextBitToSend()) {
-    timerAlarmWrite(signalGenerator._pulseTimer, DCC_ONE_BIT_PULSE_DURATION, false);
-    timerAlarmWrite(signalGenerator._fullCycleTimer, DCC_ONE_BIT_TOTAL_DURATION, true);
-  } else {
-    timerAlarmWrite(signalGenerator._pulseTimer, DCC_ZERO_BIT_PULSE_DURATION, false);
-    timerAlarmWrite(signalGenerator._fullCycleTimer, DCC_ZERO_BIT_TOTAL_DURATION, true);
+#endif
+    pulseDuration = DCC_ONE_BIT_PULSE_DURATION;
+    totalDuration = DCC_ONE_BIT_TOTAL_DURATION;
   }
-  timerWrite(signalGenerator._pulseTimer, 0);
-  timerAlarmEnable(signalGenerator._pulseTimer);
-  digitalWrite(signalGenerator._directionPin, HIGH);
+  // restart the pulse timer from zero with the alarm for this bit
+  timerGroup->hw_timer[1].alarm_high = 0;
+  timerGroup->hw_timer[1].alarm_low = pulseDuration;
+  timerGroup->hw_timer[1].load_high = 0;
+  timerGroup->hw_timer[1].load_low = 0;
+  timerGroup->hw_timer[1].reload = 1;
+  timerGroup->hw_timer[1].config.alarm_en = 1;
+  // the full cycle timer has already reloaded, update the alarm for this bit
+  // and re-arm it since the alarm is disabled by the hardware when it fires.
+  timerGroup->hw_timer[0].alarm_high = 0;
+  timerGroup->hw_timer[0].alarm_low = totalDuration;
+  timerGroup->hw_timer[0].config.alarm_en = 1;
 }
 
+// pulse timer ISR, generates the second half of the bit (or opens the RailCom
+// cutout).
 template<int timerIndex>
-void IRAM_ATTR signalGeneratorDirectionTimer()
+void IRAM_ATTR signalGeneratorDirectionTimer(void *arg)
 {
   auto& signalGenerator = dccSignal[timerIndex];
-  digitalWrite(signalGenerator._directionPin, LOW);
+  volatile timg_dev_t *timerGroup = signalGenerator._timerGroup;
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  if(signalGenerator._railComCutoutState == RAILCOM_CUTOUT_STARTING) {
+    if(signalGenerator._railComBrake) {
+      signalGenerator._railComPins.set();
+    } else {
+      signalGenerator._railComPins.clear();
+    }
+    signalGenerator._railComCutoutState = RAILCOM_CUTOUT_ACTIVE;
+  }
+#endif
+  signalGenerator._outputPins.clear();
+  // the pulse timer does not reload so the counter continues past the alarm
+  timerGroup->hw_timer[1].update = 1;
+  signalGenerator.recordEdgeLatency(timerGroup->hw_timer[1].cnt_low - timerGroup->hw_timer[1].alarm_low);
+  timerGroup->int_clr_timers.t1 = 1;
 }
 
 template<int timerIndex>
@@ -197,17 +382,46 @@ void SignalGenerator::configureSignal(String name, uint8_t directionPin, uint16_
 
   // create packets for this signal generator up front, they will be reused until
   // the base station is shutdown
+  _toSend.init(maxPackets);
+  _availablePackets.init(maxPackets);
   for(int index = 0; index < maxPackets; index++) {
     _availablePackets.push(new Packet());
   }
 
   // force the directionPin to low since it will be controlled by the DCC timer
-  pinMode(_directionPin, INPUT);
-  digitalWrite(_directionPin, LOW);
-  pinMode(_directionPin, OUTPUT);
+  addOutputPin(_directionPin);
   startSignal<timerIndex>();
 }
 
+// adds a pin that the DCC signal will be sent on, this is used for booster
+// outputs that mirror the OPERATIONS signal. All output pins are updated with
+// a single GPIO register write per edge so this does not require any extra
+// timers or ISR work.
+void SignalGenerator::addOutputPin(uint8_t pin) {
+  log_i("[%s] Sending DCC signal on pin %d", _name.c_str(), pin);
+  // force the pin to low since it will be controlled by the DCC timer
+  pinMode(pin, INPUT);
+  digitalWrite(pin, LOW);
+  pinMode(pin, OUTPUT);
+  _outputPins.add(pin);
+}
+
+// adds a pin used to generate the RailCom cutout, this can be called for the
+// enable pin of each motor board driven by this signal.
+void SignalGenerator::configureRailComCutout(uint8_t pin, bool brake) {
+  log_i("[%s] Enabling RailCom cutout using %s pin %d", _name.c_str(), brake ? "brake" : "enable", pin);
+  if(brake) {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+  _railComBrake = brake;
+  _railComPins.add(pin);
+  // the track may already be powered
+  if(!brake && digitalRead(pin)) {
+    _railComPoweredPins.add(pin);
+  }
+}
+
 template<int timerIndex>
 void SignalGenerator::startSignal() {
   // inject the required reset and idle packets into the queue
@@ -219,10 +433,11 @@ void SignalGenerator::startSignal() {
   log_i("[%s] Adding idle packet to packet queue", _name.c_str());
   loadBytePacket(dccSignal[timerIndex], idlePacket, 2, 10);
 
+  // Timer(2 * timerIndex) and Timer(2 * timerIndex + 1) are timers 0 and 1 of
+  // timer group timerIndex.
+  _timerGroup = timerIndex == 0 ? &TIMERG0 : &TIMERG1;
   log_i("[%s] Configuring Timer(%d) for generating DCC Signal (Full Wave)", _name.c_str(), 2 * timerIndex);
   _fullCycleTimer = timerBegin(2 * timerIndex, DCC_TIMER_PRESCALE, true);
-  log_i("[%s] Attaching interrupt handler to Timer(%d)", _name.c_str(), 2 * timerIndex);
-  timerAttachInterrupt(_fullCycleTimer, &signalGeneratorPulseTimer<timerIndex>, true);
   log_i("[%s] Configuring alarm on Timer(%d) to %dus", _name.c_str(), 2 * timerIndex, DCC_ONE_BIT_TOTAL_DURATION);
   timerAlarmWrite(_fullCycleTimer, DCC_ONE_BIT_TOTAL_DURATION, true);
   log_i("[%s] Setting load on Timer(%d) to zero", _name.c_str(), 2 * timerIndex);
@@ -230,13 +445,32 @@ void SignalGenerator::startSignal() {
 
   log_i("[%s] Configuring Timer(%d) for generating DCC Signal (Half Wave)", _name.c_str(), 2 * timerIndex + 1);
   _pulseTimer = timerBegin(2*timerIndex + 1, DCC_TIMER_PRESCALE, true);
-  log_i("[%s] Attaching interrupt handler to Timer(%d)", _name.c_str(), 2 * timerIndex + 1);
-  timerAttachInterrupt(_pulseTimer, &signalGeneratorDirectionTimer<timerIndex>, true);
   log_i("[%s] Configuring alarm on Timer(%d) to %dus", _name.c_str(), 2 * timerIndex + 1, DCC_ONE_BIT_TOTAL_DURATION / 2);
   timerAlarmWrite(_pulseTimer, DCC_ONE_BIT_PULSE_DURATION, false);
   log_i("[%s] Setting load on Timer(%d) to zero", _name.c_str(), 2 * timerIndex + 1);
   timerWrite(_pulseTimer, 0);
 
+  // the timer HAL shares a single level 1 interrupt for all timers which can
+  // be delayed by WiFi and other interrupts, instead a dedicated interrupt is
+  // allocated for each timer. Interrupts are allocated on the core that calls
+  // esp_intr_alloc so this is done via the IPC task of DCC_SIGNAL_CORE.
+  log_i("[%s] Attaching level %d interrupt handlers to Timer(%d) and Timer(%d) on core %d",
+    _name.c_str(), DCC_SIGNAL_INTERRUPT_LEVEL, 2 * timerIndex, 2 * timerIndex + 1, DCC_SIGNAL_CORE);
+  ESP_ERROR_CHECK(esp_ipc_call_blocking(DCC_SIGNAL_CORE, [](void *arg) {
+    auto& signalGenerator = dccSignal[timerIndex];
+    const int flags = ESP_INTR_FLAG_IRAM | (ESP_INTR_FLAG_LEVEL1 << (DCC_SIGNAL_INTERRUPT_LEVEL - 1));
+    ESP_ERROR_CHECK(esp_intr_alloc(timerIndex == 0 ? ETS_TG0_T0_LEVEL_INTR_SOURCE : ETS_TG1_T0_LEVEL_INTR_SOURCE,
+      flags, &signalGeneratorPulseTimer<timerIndex>, NULL, &signalGenerator._fullCycleInterrupt));
+    ESP_ERROR_CHECK(esp_intr_alloc(timerIndex == 0 ? ETS_TG0_T1_LEVEL_INTR_SOURCE : ETS_TG1_T1_LEVEL_INTR_SOURCE,
+      flags, &signalGeneratorDirectionTimer<timerIndex>, NULL, &signalGenerator._pulseInterrupt));
+  }, NULL));
+  _timerGroup->hw_timer[0].config.edge_int_en = 0;
+  _timerGroup->hw_timer[0].config.level_int_en = 1;
+  _timerGroup->hw_timer[1].config.edge_int_en = 0;
+  _timerGroup->hw_timer[1].config.level_int_en = 1;
+  _timerGroup->int_ena.t0 = 1;
+  _timerGroup->int_ena.t1 = 1;
+
   log_i("[%s] Enabling alarm on Timer(%d)", _name.c_str(), 2 * timerIndex);
   timerAlarmEnable(_fullCycleTimer);
   log_i("[%s] Enabling alarm on Timer(%d)", _name.c_str(), 2 * timerIndex + 1);
@@ -248,19 +482,37 @@ void SignalGenerator::stopSignal() {
   log_i("[%s] Shutting down Timer(%d) (Full Wave)", _name.c_str(), 2 * timerIndex);
   timerStop(_fullCycleTimer);
   timerAlarmDisable(_fullCycleTimer);
-  timerDetachInterrupt(_fullCycleTimer);
-  timerEnd(_fullCycleTimer);
+  _timerGroup->int_ena.t0 = 0;
 
   log_i("[%s] Shutting down Timer(%d) (Half Wave)", _name.c_str(), 2 * timerIndex + 1);
   timerStop(_pulseTimer);
   timerAlarmDisable(_pulseTimer);
-  timerDetachInterrupt(_pulseTimer);
+  _timerGroup->int_ena.t1 = 0;
+
+  // interrupts must be released on the core they were allocated on
+  ESP_ERROR_CHECK(esp_ipc_call_blocking(DCC_SIGNAL_CORE, [](void *arg) {
+    auto& signalGenerator = dccSignal[timerIndex];
+    esp_intr_free(signalGenerator._fullCycleInterrupt);
+    esp_intr_free(signalGenerator._pulseInterrupt);
+  }, NULL));
+  timerEnd(_fullCycleTimer);
   timerEnd(_pulseTimer);
 
   // give enough time for any timer ISR calls to complete before draining
   // the packet queue and returning
   delay(250);
 
+  // make sure a RailCom cutout in progress does not leave the track output
+  // shorted or disabled.
+  if(_railComCutoutState != RAILCOM_CUTOUT_NONE) {
+    if(_railComBrake) {
+      _railComPins.clear();
+    } else {
+      _railComPoweredPins.set();
+    }
+    _railComCutoutState = RAILCOM_CUTOUT_NONE;
+  }
+
   // if we have a current packet being processed move it to the available
   // queue if it is not the pre-canned idle packet.
   if(_currentPacket != NULL && _currentPacket != &_idlePacket) {
@@ -271,8 +523,7 @@ void SignalGenerator::stopSignal() {
   // drain any remaining packets that were not sent back into the available
   // to use packets.
   while(!_toSend.empty()) {
-    _currentPacket = _toSend.front();
-    _toSend.pop();
+    _currentPacket = _toSend.pop();
     // make sure the packet is zeroed before pushing it back to the queue
     memset(_currentPacket, 0, sizeof(Packet));
     _availablePackets.push(_currentPacket);
@@ -290,6 +541,81 @@ bool SignalGenerator::isQueueEmpty() {
   return _toSend.empty();
 }
 
+void SignalGenerator::resetEdgeLatency() {
+  _edgeCount = 0;
+  _edgeLatencyMax = 0;
+  _edgeLatencyTotal = 0;
+  for(uint8_t bucket = 0; bucket < DCC_SIGNAL_LATENCY_BUCKETS; bucket++) {
+    _edgeLatencyHistogram[bucket] = 0;
+  }
+}
+
+void getDCCSignalState(JsonArray &array) {
+  for(uint8_t index = 0; index < MAX_DCC_SIGNAL_GENERATORS; index++) {
+    auto& signalGenerator = dccSignal[index];
+    JsonObject &signal = array.createNestedObject();
+    signal[F("name")] = signalGenerator._name;
+    signal[F("queued")] = signalGenerator._toSend.size();
+    signal[F("utilisation")] = signalGenerator.getUtilisation();
+    if(index == DCC_SIGNAL_OPERATIONS) {
+      JsonObject &repeats = signal.createNestedObject(F("repeats"));
+      for(uint8_t packetClass = 0; packetClass < MAX_DCC_PACKET_CLASS; packetClass++) {
+        repeats[packetRepeatPolicy[packetClass].name] =
+          signalGenerator.getRepeatCount((DCC_PACKET_CLASS)packetClass);
+      }
+    }
+    signal[F("edges")] = signalGenerator._edgeCount;
+    signal[F("latencyMax")] = signalGenerator._edgeLatencyMax;
+    signal[F("latencyAvg")] = signalGenerator._edgeCount ?
+      (float)signalGenerator._edgeLatencyTotal / signalGenerator._edgeCount : 0;
+    JsonArray &histogram = signal.createNestedArray(F("latencyHistogram"));
+    for(uint8_t bucket = 0; bucket < DCC_SIGNAL_LATENCY_BUCKETS; bucket++) {
+      histogram.add(signalGenerator._edgeLatencyHistogram[bucket]);
+    }
+  }
+}
+
+bool dccSignalJitterActive = false;
+uint32_t dccSignalJitterStart = 0;
+uint32_t dccSignalJitterDuration = 0;
+
+// jitter benchmark, clears the edge latency statistics and starts a
+// measurement of the requested duration (in ms), the result is reported by
+// checkDCCSignalJitter once the duration has elapsed. Running this with and
+// without WiFi load (or with DCC_SIGNAL_INTERRUPT_LEVEL set to 1) shows the
+// effect on the DCC signal. Starting a new measurement while one is running
+// restarts it.
+void showDCCSignalJitter(uint32_t duration) {
+  for(uint8_t index = 0; index < MAX_DCC_SIGNAL_GENERATORS; index++) {
+    dccSignal[index].resetEdgeLatency();
+  }
+  dccSignalJitterStart = millis();
+  dccSignalJitterDuration = duration;
+  dccSignalJitterActive = true;
+}
+
+// reports the jitter benchmark result when the measurement has completed, for
+// each signal generator this sends:
+// <D JITTER NAME EDGES AVG_LATENCY MAX_LATENCY HISTOGRAM BUCKETS...>
+void checkDCCSignalJitter() {
+  if(!dccSignalJitterActive || millis() - dccSignalJitterStart < dccSignalJitterDuration) {
+    return;
+  }
+  dccSignalJitterActive = false;
+  for(uint8_t index = 0; index < MAX_DCC_SIGNAL_GENERATORS; index++) {
+    auto& signalGenerator = dccSignal[index];
+    String histogram = "";
+    for(uint8_t bucket = 0; bucket < DCC_SIGNAL_LATENCY_BUCKETS; bucket++) {
+      histogram += String(signalGenerator._edgeLatencyHistogram[bucket]) + " ";
+    }
+    histogram.trim();
+    wifiInterface.printf(F("<D JITTER %s %d %.2f %d %s>"), signalGenerator._name.c_str(),
+      signalGenerator._edgeCount, signalGenerator._edgeCount ?
+        (float)signalGenerator._edgeLatencyTotal / signalGenerator._edgeCount : 0.0f,
+      signalGenerator._edgeLatencyMax, histogram.c_str());
+  }
+}
+
 uint64_t sampleADCChannel(adc1_channel_t channel, uint8_t sampleCount) {
   uint64_t current = 0;
   int successfulReads = 0;
@@ -428,7 +754,7 @@ void writeOpsCVByte(const uint16_t locoNumber, const uint16_t cv, const uint8_t
       lowByte(cv - 1),
       cvValue,
       0x00};
-    loadBytePacket(signalGenerator, writeCVBytePacket, 5, 4);
+    loadBytePacket(signalGenerator, writeCVBytePacket, 5, DCC_PACKET_OPS_CV);
   } else {
     uint8_t writeCVBytePacket[] = {
       lowByte(locoNumber),
@@ -436,7 +762,7 @@ void writeOpsCVByte(const uint16_t locoNumber, const uint16_t cv, const uint8_t
       lowByte(cv - 1),
       cvValue,
       0x00};
-    loadBytePacket(signalGenerator, writeCVBytePacket, 4, 4);
+    loadBytePacket(signalGenerator, writeCVBytePacket, 4, DCC_PACKET_OPS_CV);
   }
 }
 
@@ -451,7 +777,7 @@ void writeOpsCVBit(const uint16_t locoNumber, const uint16_t cv, const uint8_t b
       lowByte(cv - 1),
       (uint8_t)(0xF0 + bit + value * 8),
       0x00};
-    loadBytePacket(signalGenerator, writeCVBitPacket, 5, 4);
+    loadBytePacket(signalGenerator, writeCVBitPacket, 5, DCC_PACKET_OPS_CV);
   } else {
     uint8_t writeCVBitPacket[] = {
       lowByte(locoNumber),
@@ -459,6 +785,54 @@ void writeOpsCVBit(const uint16_t locoNumber, const uint16_t cv, const uint8_t b
       lowByte(cv - 1),
       (uint8_t)(0xF0 + bit + value * 8),
       0x00};
-    loadBytePacket(signalGenerator, writeCVBitPacket, 4, 4);
+    loadBytePacket(signalGenerator, writeCVBitPacket, 4, DCC_PACKET_OPS_CV);
+  }
+}
+
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+// starts reading a CV from a locomotive on the OPERATIONS track by sending a
+// POM verify byte packet, the decoder replies with the CV value via a RailCom
+// channel 2 POM datagram and RailComManager::update reports it. Returns false
+// if another read is still pending.
+bool readOpsCV(const uint16_t locoNumber, const uint16_t cv) {
+  auto& signalGenerator = dccSignal[DCC_SIGNAL_OPERATIONS];
+  if(!RailComManager::expectPOM(locoNumber, cv)) {
+    log_w("[OPS] CV %d for loco %d, another read is pending", cv, locoNumber);
+    return false;
+  }
+  log_d("[OPS] Reading CV %d for loco %d", cv, locoNumber);
+  if(locoNumber > 127) {
+    uint8_t readCVBytePacket[] = {
+      (uint8_t)(0xC0 | highByte(locoNumber)),
+      lowByte(locoNumber),
+      (uint8_t)(0xE4 + (highByte(cv - 1) & 0x03)),
+      lowByte(cv - 1),
+      0x00,
+      0x00};
+    loadBytePacket(signalGenerator, readCVBytePacket, 5, DCC_PACKET_OPS_CV);
+  } else {
+    uint8_t readCVBytePacket[] = {
+      lowByte(locoNumber),
+      (uint8_t)(0xE4 + (highByte(cv - 1) & 0x03)),
+      lowByte(cv - 1),
+      0x00,
+      0x00};
+    loadBytePacket(signalGenerator, readCVBytePacket, 4, DCC_PACKET_OPS_CV);
   }
+  return true;
 }
+
+// tracks the state of the motor board enable pin so the RailCom cutout does
+// not re-enable a track that was turned off during the cutout.
+void setRailComTrackPower(const uint8_t enablePin, const bool on) {
+  for(uint8_t index = 0; index < MAX_DCC_SIGNAL_GENERATORS; index++) {
+    if(!dccSignal[index]._railComBrake && dccSignal[index]._railComPins.contains(enablePin)) {
+      if(on) {
+        dccSignal[index]._railComPoweredPins.add(enablePin);
+      } else {
+        dccSignal[index]._railComPoweredPins.remove(enablePin);
+      }
+    }
+  }
+}
+#endif
@@ -18,20 +18,162 @@ COPYRIGHT (c) 2017 Mike Dunston
 #define _SIGNALGENERATOR_H_
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
 #include <driver/timer.h>
+#include <soc/gpio_struct.h>
+#include <soc/timer_group_struct.h>
+#include <esp_intr_alloc.h>
 #include <vector>
-#include <queue>
 #include <stack>
 
 #define MAX_BYTES_IN_PACKET 10
 
+// CPU core the DCC signal timer interrupts are allocated on, the WiFi stack
+// runs on core 0 so by default the interrupts are handled by core 1.
+#ifndef DCC_SIGNAL_CORE
+#define DCC_SIGNAL_CORE 1
+#endif
+
+// interrupt level (1-3) for the DCC signal timer interrupts, level 3 is the
+// highest level that can be handled by a C interrupt handler.
+#ifndef DCC_SIGNAL_INTERRUPT_LEVEL
+#define DCC_SIGNAL_INTERRUPT_LEVEL 3
+#endif
+
+// number of buckets in the edge latency histogram, bucket 0 counts edges that
+// were on time and bucket N counts edges that were 2^(N-1) to 2^N - 1
+// microseconds late, the last bucket also counts anything later.
+#define DCC_SIGNAL_LATENCY_BUCKETS 8
+
+// time (in ms) over which the track utilisation is measured
+#define DCC_UTILISATION_WINDOW 250
+// when more than this number of packets are waiting to be sent every packet
+// class uses its minimum number of repeats
+#define DCC_REPEAT_BUSY_QUEUE_DEPTH 16
+
+// number of packets kept in the recent packet history of each signal and the
+// largest packet (including the checksum) that is recorded in it.
+#define DCC_RECENT_PACKETS 16
+#define DCC_RECENT_PACKET_BYTES 6
+
+// packet recorded in the recent packet history when it was queued
+struct RecentPacket {
+  uint32_t time;
+  uint8_t length;
+  uint8_t repeats;
+  uint8_t data[DCC_RECENT_PACKET_BYTES];
+};
+
+// classes of packets sent on the OPERATIONS track, the number of times a
+// packet is repeated is chosen per class based on the track utilisation.
+enum DCC_PACKET_CLASS {
+  DCC_PACKET_SPEED,
+  DCC_PACKET_EMERGENCY_STOP,
+  DCC_PACKET_FUNCTION,
+  DCC_PACKET_ACCESSORY,
+  DCC_PACKET_OPS_CV,
+  MAX_DCC_PACKET_CLASS
+};
+
 struct Packet {
   uint8_t buffer[MAX_BYTES_IN_PACKET];
   uint8_t numberOfBits;
   uint8_t numberOfRepeats;
   uint8_t currentBit;
+  // address of the locomotive decoder the packet is for, zero for broadcast,
+  // accessory and idle packets. Used to attribute RailCom replies.
+  uint16_t locoAddress;
 }; // Packet
 
+// fixed size single producer / single consumer queue of packets. This is used
+// between the DCC signal ISR and the tasks loading packets without locking and
+// does not allocate memory or call any flash resident code after init.
+struct PacketQueue {
+  Packet **_buffer = NULL;
+  uint16_t _size = 0;
+  volatile uint16_t _head = 0;
+  volatile uint16_t _tail = 0;
+
+  void init(uint16_t capacity) {
+    _size = capacity + 1;
+    _buffer = new Packet *[_size];
+    _head = _tail = 0;
+  }
+  bool IRAM_ATTR empty() const {
+    return _head == _tail;
+  }
+  uint16_t size() const {
+    return (_tail + _size - _head) % _size;
+  }
+  bool IRAM_ATTR push(Packet *packet) {
+    uint16_t next = (_tail + 1) % _size;
+    if(next == _head) {
+      return false;
+    }
+    _buffer[_tail] = packet;
+    _tail = next;
+    return true;
+  }
+  Packet * IRAM_ATTR pop() {
+    if(_head == _tail) {
+      return NULL;
+    }
+    Packet *packet = _buffer[_head];
+    _head = (_head + 1) % _size;
+    return packet;
+  }
+};
+
+// set of GPIO pins that are set or cleared together with a single register
+// write per GPIO bank.
+struct GPIOMask {
+  uint32_t low = 0;
+  uint32_t high = 0;
+
+  void add(uint8_t pin) {
+    if(pin < 32) {
+      low |= (1UL << pin);
+    } else {
+      high |= (1UL << (pin - 32));
+    }
+  }
+  void remove(uint8_t pin) {
+    if(pin < 32) {
+      low &= ~(1UL << pin);
+    } else {
+      high &= ~(1UL << (pin - 32));
+    }
+  }
+  bool contains(uint8_t pin) const {
+    return pin < 32 ? (low & (1UL << pin)) : (high & (1UL << (pin - 32)));
+  }
+  bool any() const {
+    return low || high;
+  }
+  void IRAM_ATTR set() const {
+    if(low) {
+      GPIO.out_w1ts = low;
+    }
+    if(high) {
+      GPIO.out1_w1ts.val = high;
+    }
+  }
+  void IRAM_ATTR clear() const {
+    if(low) {
+      GPIO.out_w1tc = low;
+    }
+    if(high) {
+      GPIO.out1_w1tc.val = high;
+    }
+  }
+};
+
+enum RAILCOM_CUTOUT_STATE {
+  RAILCOM_CUTOUT_NONE,
+  RAILCOM_CUTOUT_STARTING,
+  RAILCOM_CUTOUT_ACTIVE
+};
+
 struct SignalGenerator {
   template<int timerIndex>
   void configureSignal(String, uint8_t, uint16_t);
@@ -40,19 +182,84 @@ struct SignalGenerator {
   template<int timerIndex>
   void stopSignal();
 
+  void addOutputPin(uint8_t);
+  void configureRailComCutout(uint8_t, bool);
+
   bool IRAM_ATTR getNextBitToSend();
+  bool IRAM_ATTR isPacketComplete() {
+    return _currentPacket != NULL && _currentPacket->currentBit == _currentPacket->numberOfBits;
+  }
   void loadPacket(std::vector<uint8_t>, int);
+  void loadPacket(std::vector<uint8_t>, DCC_PACKET_CLASS);
+  uint8_t getRepeatCount(DCC_PACKET_CLASS);
+  uint8_t getUtilisation();
   void waitForQueueEmpty();
   bool isQueueEmpty();
+  uint8_t getRecentPackets(RecentPacket *);
+
+  // records how late (in microseconds) an edge was generated after its timer
+  // alarm fired, the value is read from the timer counter in the ISR.
+  void IRAM_ATTR recordEdgeLatency(uint32_t latency) {
+    if(latency > _edgeLatencyMax) {
+      _edgeLatencyMax = latency;
+    }
+    _edgeLatencyTotal += latency;
+    _edgeCount++;
+    uint8_t bucket = latency ? 32 - __builtin_clz(latency) : 0;
+    if(bucket >= DCC_SIGNAL_LATENCY_BUCKETS) {
+      bucket = DCC_SIGNAL_LATENCY_BUCKETS - 1;
+    }
+    _edgeLatencyHistogram[bucket]++;
+  }
+  void resetEdgeLatency();
 
   hw_timer_t *_fullCycleTimer;
   hw_timer_t *_pulseTimer;
+  // timer group used by this signal generator, timer 0 generates the full
+  // cycle and timer 1 the pulse (half cycle) of each bit. The ISRs update the
+  // timer registers directly rather than using the timer HAL.
+  volatile timg_dev_t *_timerGroup;
+  intr_handle_t _fullCycleInterrupt;
+  intr_handle_t _pulseInterrupt;
   String _name;
   uint8_t _directionPin;
+  // all pins the DCC signal is sent on, this includes _directionPin and any
+  // booster outputs added via addOutputPin.
+  GPIOMask _outputPins;
   int _currentMonitorPin;
-  std::queue<Packet *> _toSend;
-  std::queue<Packet *> _availablePackets;
+  PacketQueue _toSend;
+  PacketQueue _availablePackets;
   Packet *_currentPacket;
+  // pins used to generate the RailCom cutout, empty when no cutout is
+  // generated. When _railComBrake is set these are motor board BRAKE pins that
+  // are set HIGH during the cutout, otherwise these are motor board enable pins
+  // which are set LOW during the cutout and those in _railComPoweredPins are
+  // restored afterwards.
+  GPIOMask _railComPins;
+  GPIOMask _railComPoweredPins;
+  bool _railComBrake = false;
+  volatile RAILCOM_CUTOUT_STATE _railComCutoutState = RAILCOM_CUTOUT_NONE;
+  // number of packet transmissions (including repeats) that were not / were
+  // the idle packet, used for calculating the track utilisation.
+  volatile uint32_t _packetTransmissions = 0;
+  volatile uint32_t _idleTransmissions = 0;
+  uint32_t _lastPacketTransmissions = 0;
+  uint32_t _lastIdleTransmissions = 0;
+  uint32_t _lastUtilisationUpdate = 0;
+  // percentage of recent transmissions that were not the idle packet, the
+  // window fields above and this are guarded by _utilisationMux.
+  uint8_t _utilisation = 0;
+  portMUX_TYPE _utilisationMux = portMUX_INITIALIZER_UNLOCKED;
+  // edge latency statistics, see recordEdgeLatency.
+  volatile uint32_t _edgeCount = 0;
+  volatile uint32_t _edgeLatencyMax = 0;
+  volatile uint64_t _edgeLatencyTotal = 0;
+  volatile uint32_t _edgeLatencyHistogram[DCC_SIGNAL_LATENCY_BUCKETS] = {0};
+  // recently queued packets, _recentPacketIndex is the next entry written.
+  RecentPacket _recentPackets[DCC_RECENT_PACKETS];
+  uint8_t _recentPacketIndex = 0;
+  uint8_t _recentPacketCount = 0;
+  portMUX_TYPE _recentPacketsMux = portMUX_INITIALIZER_UNLOCKED;
   // pre-encoded idle packet that gets sent when the _toSend queue is empty.
   Packet _idlePacket = {
     { 0xFF, 0xFF, 0xFD, 0xFE, 0x00, 0x7F, 0x80, 0x00, 0x00, 0x00 }, // packet bytes
@@ -64,14 +271,22 @@ struct SignalGenerator {
 
 extern SignalGenerator dccSignal[2];
 void configureDCCSignalGenerators();
+void addDCCSignalBooster(const uint8_t, const uint8_t);
 void startDCCSignalGenerators();
 void stopDCCSignalGenerators();
+void getDCCSignalState(JsonArray &);
+void showDCCSignalJitter(uint32_t);
+void checkDCCSignalJitter();
 
 int16_t readCV(const uint16_t);
 bool writeProgCVByte(const uint16_t, const uint8_t);
 bool writeProgCVBit(const uint16_t, const uint8_t, const bool);
 void writeOpsCVByte(const uint16_t, const uint16_t, const uint8_t);
 void writeOpsCVBit(const uint16_t, const uint16_t, const uint8_t, const bool);
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+bool readOpsCV(const uint16_t, const uint16_t);
+void setRailComTrackPower(const uint8_t, const bool);
+#endif
 
 #define DCC_SIGNAL_OPERATIONS 0
 #define DCC_SIGNAL_PROGRAMMING 1
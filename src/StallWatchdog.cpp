@@ -0,0 +1,199 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+
+#include "StallWatchdog.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION records any stall of the main loop (or the AsyncTCP
+task when it is processing web socket commands). A low priority monitoring
+task checks every STALL_WATCHDOG_CHECK_INTERVAL ms which subsystem and command
+each monitored task is running, if a task has been busy for more than
+STALL_WATCHDOG_THRESHOLD ms a stall event is recorded containing:
+
+  TIMESTAMP: the millis() value when the activity started.
+  DURATION:  how long the activity took, updated when the activity completes.
+  TASK:      the FreeRTOS task that stalled.
+  SUBSYSTEM: the innermost subsystem that was running (scheduler task name,
+             WiFi send, etc).
+  COMMAND:   the DCC++ command that was being processed (if any).
+
+The most recent STALL_WATCHDOG_HISTORY events are kept and are available via
+the /espinfo web endpoint and the <D STALLS> command which returns:
+
+  <D STALLS COUNT> followed by <D STALL TIMESTAMP DURATION TASK SUBSYSTEM COMMAND>
+  for each recorded event.
+
+**********************************************************************/
+
+struct StallWatchdogSlot {
+  TaskHandle_t task;
+  const char *subsystem;
+  const char *command;
+  uint32_t startTime;
+  int8_t eventIndex;
+};
+
+StallWatchdogSlot stallWatchdogSlots[STALL_WATCHDOG_MAX_TASKS];
+StallEvent stallEvents[STALL_WATCHDOG_HISTORY];
+uint8_t nextStallEvent = 0;
+uint32_t stallCount = 0;
+portMUX_TYPE stallWatchdogMux = portMUX_INITIALIZER_UNLOCKED;
+
+StallWatchdogSlot *getStallWatchdogSlot() {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  for(int index = 0; index < STALL_WATCHDOG_MAX_TASKS; index++) {
+    if(stallWatchdogSlots[index].task == task) {
+      return &stallWatchdogSlots[index];
+    }
+  }
+  StallWatchdogSlot *slot = NULL;
+  portENTER_CRITICAL(&stallWatchdogMux);
+  for(int index = 0; index < STALL_WATCHDOG_MAX_TASKS && slot == NULL; index++) {
+    if(stallWatchdogSlots[index].task == NULL) {
+      slot = &stallWatchdogSlots[index];
+      slot->eventIndex = -1;
+      slot->task = task;
+    }
+  }
+  portEXIT_CRITICAL(&stallWatchdogMux);
+  return slot;
+}
+
+void stallWatchdogTask(void *arg) {
+  while(true) {
+    vTaskDelay(pdMS_TO_TICKS(STALL_WATCHDOG_CHECK_INTERVAL));
+    uint32_t now = millis();
+    for(int index = 0; index < STALL_WATCHDOG_MAX_TASKS; index++) {
+      StallWatchdogSlot &slot = stallWatchdogSlots[index];
+      bool newStall = false;
+      portENTER_CRITICAL(&stallWatchdogMux);
+      if(slot.task != NULL && slot.subsystem != NULL && slot.eventIndex < 0 &&
+        now - slot.startTime > STALL_WATCHDOG_THRESHOLD) {
+        StallEvent &event = stallEvents[nextStallEvent];
+        slot.eventIndex = nextStallEvent;
+        ++nextStallEvent %= STALL_WATCHDOG_HISTORY;
+        stallCount++;
+        event.timestamp = slot.startTime;
+        event.duration = now - slot.startTime;
+        event.task = pcTaskGetTaskName(slot.task);
+        event.subsystem = slot.subsystem;
+        event.command[0] = 0;
+        if(slot.command != NULL) {
+          strlcpy(event.command, slot.command, STALL_WATCHDOG_COMMAND_LENGTH);
+        }
+        event.active = true;
+        newStall = true;
+      }
+      portEXIT_CRITICAL(&stallWatchdogMux);
+      if(newStall) {
+        StallEvent &event = stallEvents[slot.eventIndex];
+        log_w("[%s] Stall detected in %s (%s) running for %d ms", event.task,
+          event.subsystem, event.command, event.duration);
+      }
+    }
+  }
+}
+
+void StallWatchdog::init() {
+  memset(stallEvents, 0, sizeof(stallEvents));
+  xTaskCreate(stallWatchdogTask, "StallWatchdog", 2048, NULL, 2, NULL);
+}
+
+void StallWatchdog::enter(const char *subsystem, const char *command) {
+  StallWatchdogSlot *slot = getStallWatchdogSlot();
+  if(slot == NULL) {
+    return;
+  }
+  portENTER_CRITICAL(&stallWatchdogMux);
+  if(slot->subsystem == NULL) {
+    slot->startTime = millis();
+    slot->command = NULL;
+  }
+  slot->subsystem = subsystem;
+  if(command != NULL) {
+    slot->command = command;
+  }
+  portEXIT_CRITICAL(&stallWatchdogMux);
+}
+
+void StallWatchdog::leave(const char *previousSubsystem, const char *previousCommand, bool outermost) {
+  StallWatchdogSlot *slot = getStallWatchdogSlot();
+  if(slot == NULL) {
+    return;
+  }
+  portENTER_CRITICAL(&stallWatchdogMux);
+  if(outermost) {
+    if(slot->eventIndex >= 0) {
+      stallEvents[slot->eventIndex].duration = millis() - slot->startTime;
+      stallEvents[slot->eventIndex].active = false;
+      slot->eventIndex = -1;
+    }
+    slot->subsystem = NULL;
+    slot->command = NULL;
+  } else {
+    slot->subsystem = previousSubsystem;
+    slot->command = previousCommand;
+  }
+  portEXIT_CRITICAL(&stallWatchdogMux);
+}
+
+const char *StallWatchdog::getSubsystem() {
+  StallWatchdogSlot *slot = getStallWatchdogSlot();
+  return slot != NULL ? slot->subsystem : NULL;
+}
+
+const char *StallWatchdog::getCommand() {
+  StallWatchdogSlot *slot = getStallWatchdogSlot();
+  return slot != NULL ? slot->command : NULL;
+}
+
+uint32_t StallWatchdog::getStallCount() {
+  return stallCount;
+}
+
+void StallWatchdog::getState(JsonObject &root) {
+  root[F("stallCount")] = stallCount;
+  JsonArray &stalls = root.createNestedArray(F("stalls"));
+  for(int index = 0; index < STALL_WATCHDOG_HISTORY; index++) {
+    // walk the history from oldest to newest
+    StallEvent &event = stallEvents[(nextStallEvent + index) % STALL_WATCHDOG_HISTORY];
+    if(event.task != NULL) {
+      JsonObject &stall = stalls.createNestedObject();
+      stall[F("timestamp")] = event.timestamp;
+      stall[F("duration")] = event.duration;
+      stall[F("task")] = event.task;
+      stall[F("subsystem")] = event.subsystem;
+      stall[F("command")] = event.command;
+      stall[F("active")] = event.active;
+    }
+  }
+}
+
+void StallWatchdog::showStatus() {
+  wifiInterface.printf(F("<D STALLS %d>"), stallCount);
+  for(int index = 0; index < STALL_WATCHDOG_HISTORY; index++) {
+    StallEvent &event = stallEvents[(nextStallEvent + index) % STALL_WATCHDOG_HISTORY];
+    if(event.task != NULL) {
+      wifiInterface.printf(F("<D STALL %d %d %s %s %s>"), event.timestamp,
+        event.duration, event.task, event.subsystem,
+        strlen(event.command) ? event.command : "-");
+    }
+  }
+}
@@ -0,0 +1,70 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _STALL_WATCHDOG_H_
+#define _STALL_WATCHDOG_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Maximum length of a command captured in a stall event.
+#define STALL_WATCHDOG_COMMAND_LENGTH 32
+
+struct StallEvent {
+  uint32_t timestamp;
+  uint32_t duration;
+  const char *task;
+  const char *subsystem;
+  char command[STALL_WATCHDOG_COMMAND_LENGTH];
+  bool active;
+};
+
+// Monitors the tasks that process commands and run subsystems. When a task has
+// been inside the same activity for longer than STALL_WATCHDOG_THRESHOLD ms a
+// stall event is recorded with the subsystem and command that were running.
+class StallWatchdog {
+public:
+  static void init();
+  static void enter(const char *, const char *);
+  static void leave(const char *, const char *, bool);
+  static const char *getSubsystem();
+  static const char *getCommand();
+  static uint32_t getStallCount();
+  static void getState(JsonObject &);
+  static void showStatus();
+};
+
+// Marks the current task as running a subsystem (and optionally a command)
+// until the scope ends. Scopes can be nested, the innermost subsystem is
+// recorded as the culprit while the stall time is measured from the outermost
+// scope.
+class StallWatchdogScope {
+public:
+  StallWatchdogScope(const char *subsystem, const char *command=NULL) :
+    _previousSubsystem(StallWatchdog::getSubsystem()),
+    _previousCommand(StallWatchdog::getCommand()) {
+    StallWatchdog::enter(subsystem, command);
+  }
+  ~StallWatchdogScope() {
+    StallWatchdog::leave(_previousSubsystem, _previousCommand, _previousSubsystem == NULL);
+  }
+private:
+  const char *_previousSubsystem;
+  const char *_previousCommand;
+};
+
+#endif
@@ -0,0 +1,189 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <algorithm>
+#include "StartupSync.h"
+#include "MotorBoard.h"
+#include "Outputs.h"
+#include "Turnouts.h"
+#include "StateObserver.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can send the stored turnout positions and output states
+again after startup so the layout matches the state reported to the clients.
+Without this the turnouts stay wherever they were left and only match the
+reported state once they have been thrown or closed.
+
+Outputs loaded from the configuration that should be on are left off during
+startup. Once track power is turned on for the MAIN track the turnout
+positions are sent (or the servos moved) one at a time, followed by turning on
+the deferred outputs, STARTUP_SYNC_INTERVAL ms apart. This avoids a burst of
+accessory packets on the track and the current spike of all accessory decoders,
+servos and outputs switching at once.
+
+A turnout or output that is changed by a client before it has been synced is
+skipped.
+
+**********************************************************************/
+
+#if defined(STARTUP_SYNC_ENABLED) && STARTUP_SYNC_ENABLED
+
+extern LinkedList<Turnout *> turnouts;
+
+// turnouts and outputs to be synced, these are only changed by init and by
+// update (under the mux). The observer (which can be called from any task)
+// only marks entries that have been changed by a client as skipped.
+std::vector<uint16_t> startupSyncTurnouts;
+std::vector<uint16_t> startupSyncOutputs;
+std::vector<uint8_t> startupSyncTurnoutSkipped;
+std::vector<uint8_t> startupSyncOutputSkipped;
+// next entry of each list to be synced
+size_t startupSyncNextTurnout = 0;
+size_t startupSyncNextOutput = 0;
+portMUX_TYPE startupSyncMux = portMUX_INITIALIZER_UNLOCKED;
+bool startupSyncStarted = false;
+volatile bool startupSyncComplete = false;
+uint16_t startupSyncTurnoutCount = 0;
+uint16_t startupSyncOutputCount = 0;
+uint32_t startupSyncStartTime = 0;
+uint32_t startupSyncDuration = 0;
+
+void startupSyncSkip(const std::vector<uint16_t> &pending, std::vector<uint8_t> &skipped,
+  size_t next, uint16_t id) {
+  for(size_t index = next; index < pending.size(); index++) {
+    if(pending[index] == id) {
+      skipped[index] = true;
+    }
+  }
+}
+
+class StartupSyncObserver : public StateObserver {
+public:
+  void turnoutChanged(uint16_t id, bool thrown) {
+    if(startupSyncComplete) {
+      return;
+    }
+    portENTER_CRITICAL(&startupSyncMux);
+    startupSyncSkip(startupSyncTurnouts, startupSyncTurnoutSkipped, startupSyncNextTurnout, id);
+    portEXIT_CRITICAL(&startupSyncMux);
+  }
+  void outputChanged(uint16_t id, bool active) {
+    if(startupSyncComplete) {
+      return;
+    }
+    portENTER_CRITICAL(&startupSyncMux);
+    startupSyncSkip(startupSyncOutputs, startupSyncOutputSkipped, startupSyncNextOutput, id);
+    portEXIT_CRITICAL(&startupSyncMux);
+  }
+};
+
+// records the turnouts loaded from the configuration, this must be called
+// after the turnouts and outputs have been loaded.
+void StartupSync::init() {
+  for (const auto& turnout : turnouts) {
+    startupSyncTurnouts.push_back(turnout->getID());
+  }
+  startupSyncTurnoutSkipped.assign(startupSyncTurnouts.size(), false);
+  startupSyncOutputSkipped.assign(startupSyncOutputs.size(), false);
+  startupSyncTurnoutCount = startupSyncTurnouts.size();
+  startupSyncOutputCount = startupSyncOutputs.size();
+  StateObservers::registerObserver(new StartupSyncObserver());
+  log_i("[StartupSync] %d turnouts and %d outputs will be synced once track power is on",
+    startupSyncTurnoutCount, startupSyncOutputCount);
+}
+
+// called by the loading Output constructor for an output that should be on
+void StartupSync::deferOutput(uint16_t id) {
+  startupSyncOutputs.push_back(id);
+}
+
+void StartupSync::update() {
+  if(startupSyncComplete) {
+    return;
+  }
+  if(!startupSyncStarted) {
+    GenericMotorBoard *mainBoard = MotorBoardManager::getBoardByName(MOTORBOARD_NAME_MAIN);
+    if(mainBoard == NULL || !mainBoard->isOn()) {
+      return;
+    }
+    log_i("[StartupSync] Track power is on, syncing turnouts and outputs");
+    startupSyncStarted = true;
+    startupSyncStartTime = millis();
+  }
+  // one turnout or output is sent per run, skipped entries are passed over
+  int32_t turnoutID = -1;
+  int32_t outputID = -1;
+  portENTER_CRITICAL(&startupSyncMux);
+  while(startupSyncNextTurnout < startupSyncTurnouts.size() && turnoutID < 0) {
+    if(!startupSyncTurnoutSkipped[startupSyncNextTurnout]) {
+      turnoutID = startupSyncTurnouts[startupSyncNextTurnout];
+    }
+    startupSyncNextTurnout++;
+  }
+  while(turnoutID < 0 && startupSyncNextOutput < startupSyncOutputs.size() && outputID < 0) {
+    if(!startupSyncOutputSkipped[startupSyncNextOutput]) {
+      outputID = startupSyncOutputs[startupSyncNextOutput];
+    }
+    startupSyncNextOutput++;
+  }
+  const bool pending = startupSyncNextTurnout < startupSyncTurnouts.size() ||
+    startupSyncNextOutput < startupSyncOutputs.size();
+  portEXIT_CRITICAL(&startupSyncMux);
+  if(turnoutID >= 0) {
+    Turnout *turnout = TurnoutManager::getTurnoutByID(turnoutID);
+    if(turnout != NULL) {
+      turnout->set(turnout->isThrown());
+    }
+  } else if(outputID >= 0) {
+    OutputManager::set(outputID, true);
+  }
+  if(!pending) {
+    startupSyncDuration = millis() - startupSyncStartTime;
+    log_i("[StartupSync] Sync completed in %dms", startupSyncDuration);
+    // the pending lists are not needed again, they are swapped out under the
+    // mux and released once it has been exited.
+    std::vector<uint16_t> turnoutIDs, outputIDs;
+    std::vector<uint8_t> turnoutSkipped, outputSkipped;
+    portENTER_CRITICAL(&startupSyncMux);
+    startupSyncComplete = true;
+    startupSyncTurnouts.swap(turnoutIDs);
+    startupSyncOutputs.swap(outputIDs);
+    startupSyncTurnoutSkipped.swap(turnoutSkipped);
+    startupSyncOutputSkipped.swap(outputSkipped);
+    startupSyncNextTurnout = 0;
+    startupSyncNextOutput = 0;
+    portEXIT_CRITICAL(&startupSyncMux);
+  }
+}
+
+void StartupSync::getState(JsonObject &root) {
+  root[F("interval")] = STARTUP_SYNC_INTERVAL;
+  root[F("started")] = startupSyncStarted;
+  root[F("complete")] = startupSyncComplete;
+  root[F("turnouts")] = startupSyncTurnoutCount;
+  root[F("outputs")] = startupSyncOutputCount;
+  portENTER_CRITICAL(&startupSyncMux);
+  const size_t pendingTurnouts = startupSyncTurnouts.size() - startupSyncNextTurnout;
+  const size_t pendingOutputs = startupSyncOutputs.size() - startupSyncNextOutput;
+  portEXIT_CRITICAL(&startupSyncMux);
+  root[F("pendingTurnouts")] = pendingTurnouts;
+  root[F("pendingOutputs")] = pendingOutputs;
+  root[F("duration")] = startupSyncDuration;
+}
+#endif
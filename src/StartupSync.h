@@ -0,0 +1,38 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _STARTUP_SYNC_H_
+#define _STARTUP_SYNC_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// time (in ms) between the turnout positions and output states sent by the
+// startup sync.
+#ifndef STARTUP_SYNC_INTERVAL
+#define STARTUP_SYNC_INTERVAL 100
+#endif
+
+class StartupSync {
+public:
+  static void init();
+  static void update();
+  static void deferOutput(uint16_t);
+  static void getState(JsonObject &);
+};
+
+#endif
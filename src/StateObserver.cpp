@@ -0,0 +1,67 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include "StateObserver.h"
+
+std::vector<StateObserver *> stateObservers;
+
+void StateObservers::registerObserver(StateObserver *observer) {
+  stateObservers.push_back(observer);
+}
+
+void StateObservers::sensorChanged(uint16_t id, bool active) {
+  for (const auto& observer : stateObservers) {
+    observer->sensorChanged(id, active);
+  }
+}
+
+void StateObservers::turnoutChanged(uint16_t id, bool thrown) {
+  for (const auto& observer : stateObservers) {
+    observer->turnoutChanged(id, thrown);
+  }
+}
+
+void StateObservers::turnoutFailed(uint16_t id, bool thrown) {
+  for (const auto& observer : stateObservers) {
+    observer->turnoutFailed(id, thrown);
+  }
+}
+
+void StateObservers::outputChanged(uint16_t id, bool active) {
+  for (const auto& observer : stateObservers) {
+    observer->outputChanged(id, active);
+  }
+}
+
+void StateObservers::powerChanged(const String &name, bool on, bool overCurrent) {
+  for (const auto& observer : stateObservers) {
+    observer->powerChanged(name, on, overCurrent);
+  }
+}
+
+void StateObservers::locomotiveChanged(Locomotive *locomotive) {
+  for (const auto& observer : stateObservers) {
+    observer->locomotiveChanged(locomotive);
+  }
+}
+
+void StateObservers::layoutChanged() {
+  for (const auto& observer : stateObservers) {
+    observer->layoutChanged();
+  }
+}
@@ -0,0 +1,56 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _STATE_OBSERVER_H_
+#define _STATE_OBSERVER_H_
+
+#include <Arduino.h>
+
+class Locomotive;
+
+// Class definition for a receiver of layout state changes, used by the
+// additional network interfaces to push state changes to their clients. The
+// default implementations ignore the change.
+class StateObserver {
+public:
+  virtual void sensorChanged(uint16_t, bool) {}
+  virtual void turnoutChanged(uint16_t, bool) {}
+  // called when the feedback sensors did not confirm the requested position of
+  // a turnout, turnoutChanged is called if the position is confirmed later.
+  virtual void turnoutFailed(uint16_t, bool) {}
+  virtual void outputChanged(uint16_t, bool) {}
+  virtual void powerChanged(const String &, bool, bool) {}
+  virtual void locomotiveChanged(Locomotive *) {}
+  // called when a sensor, turnout or output has been added, removed or
+  // renumbered.
+  virtual void layoutChanged() {}
+};
+
+// Dispatches layout state changes to all registered observers.
+class StateObservers {
+public:
+  static void registerObserver(StateObserver *);
+  static void sensorChanged(uint16_t, bool);
+  static void turnoutChanged(uint16_t, bool);
+  static void turnoutFailed(uint16_t, bool);
+  static void outputChanged(uint16_t, bool);
+  static void powerChanged(const String &, bool, bool);
+  static void locomotiveChanged(Locomotive *);
+  static void layoutChanged();
+};
+
+#endif
@@ -17,6 +17,10 @@ COPYRIGHT (c) 2017 Mike Dunston
 
 #include "DCCppESP32.h"
 #include "Turnouts.h"
+#include "Sensors.h"
+#include "StateObserver.h"
+#include <driver/ledc.h>
+#include <esp_timer.h>
 
 /**********************************************************************
 
@@ -37,9 +41,15 @@ define/edit/delete such turnouts using the following variations of the "T"
 command:
   <T ID ADDRESS SUBADDRESS>:   creates a new turnout ID, with specified ADDRESS
                                and SUBADDRESS. If turnout ID already exists, it
-                               is updated with specificed ADDRESS and SUBADDRESS
+                               is updated with specificed ADDRESS and SUBADDRESS,
+                               any feedback sensors are kept
       returns: <O> if successful and <X> if unsuccessful (e.g. out of memory)
 
+  <T ID ADDRESS SUBADDRESS THROWN_SENSOR CLOSED_SENSOR>:
+                               creates or updates turnout ID as above with
+                               feedback sensors, use -1 for no sensor
+      returns: <O> if successful and <X> if unsuccessful
+
   <T ID>:                      deletes definition of turnout ID
       returns: <O> if successful and <X> if unsuccessful (e.g. ID does not exist)
 
@@ -70,9 +80,152 @@ current directions of each Turnout in the form <H ID THROW> is generated by this
 sketch whenever the <s> status command is invoked. This provides an efficient
 way of initializing the directions of any Turnouts being monitored or controlled
 by a separate interface or GUI program.
+
+Turnouts with feedback sensors (THROWN_SENSOR is active when the turnout is
+thrown, CLOSED_SENSOR is active when it is closed, either can be omitted) are
+verified after being thrown. The <H ID THROW> reply is sent once the sensors
+confirm the position. If they do not confirm it within TURNOUT_FEEDBACK_TIMEOUT
+the accessory packet is resent up to TURNOUT_FEEDBACK_RETRIES times after which
+the turnout is reported as failed:
+  <H ID E>
+The sensors are still watched after a failure, <H ID THROW> is sent if they
+confirm the position later.
+
+Turnouts can also be driven directly by a hobby servo connected to the ESP32
+rather than by an accessory decoder (up to TURNOUT_SERVO_CHANNELS turnouts):
+  <T ID SERVO PIN THROWN_PULSE CLOSED_PULSE SPEED>:
+                               creates or updates turnout ID as a servo turnout
+      returns: <O> if successful and <X> if unsuccessful (e.g. all servo
+               channels are in use or a pulse is out of range)
+where
+  PIN:          the GPIO pin the servo signal is connected to
+  THROWN_PULSE: the servo pulse width (in microseconds) for the thrown position,
+                TURNOUT_SERVO_MIN_PULSE to TURNOUT_SERVO_MAX_PULSE
+  CLOSED_PULSE: the servo pulse width (in microseconds) for the closed position,
+                TURNOUT_SERVO_MIN_PULSE to TURNOUT_SERVO_MAX_PULSE
+  SPEED:        the change of the pulse width (in microseconds) every
+                TURNOUT_SERVO_STEP_INTERVAL ms, 0 moves the servo immediately
+
+The servo is moved slowly towards the new position by a high resolution timer,
+no accessory packets are sent on the track. Once the servo has reached the new
+position the servo pulses are stopped so the servo is not powered while idle
+and the <H ID THROW> reply is sent (or the feedback sensors are checked). A
+servo turnout that could not be given a servo channel (ie: one loaded from
+the stored configuration) is never moved and <H ID E> is returned instead.
 **********************************************************************/
 
 LinkedList<Turnout *> turnouts([](Turnout *turnout) {delete turnout; });
+extern LinkedList<Sensor *> sensors;
+
+// state of each LEDC channel driving a servo turnout, the servo timer only uses
+// this table so it never needs to access the turnouts list. The table is
+// guarded by turnoutServoMux and only the servo timer writes the servo pulses.
+struct TurnoutServoChannel {
+  bool inUse;
+  volatile bool moving;
+  bool powered;
+  uint16_t target;
+  uint16_t current;
+  uint16_t speed;
+  uint8_t holdSteps;
+};
+
+TurnoutServoChannel turnoutServoChannels[TURNOUT_SERVO_CHANNELS];
+portMUX_TYPE turnoutServoMux = portMUX_INITIALIZER_UNLOCKED;
+esp_timer_handle_t turnoutServoTimer = NULL;
+
+// sets the servo pulse width (in microseconds), the LEDC timer uses 16 bit
+// duty resolution.
+void turnoutServoWrite(uint8_t channel, uint16_t pulse) {
+  uint32_t duty = ((uint32_t)pulse << 16) / (1000000UL / TURNOUT_SERVO_FREQUENCY);
+  ledc_set_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, duty);
+  ledc_update_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel);
+}
+
+void turnoutServoTimerTick(void *arg) {
+  for(uint8_t channel = 0; channel < TURNOUT_SERVO_CHANNELS; channel++) {
+    TurnoutServoChannel &servo = turnoutServoChannels[channel];
+    bool write = false;
+    bool stop = false;
+    uint16_t pulse = 0;
+    portENTER_CRITICAL(&turnoutServoMux);
+    if(servo.inUse && servo.moving) {
+      if(!servo.powered) {
+        // power the servo at its last position before moving it
+        write = true;
+      } else if(servo.current != servo.target) {
+        if(servo.speed == 0 || abs(servo.target - servo.current) <= servo.speed) {
+          servo.current = servo.target;
+        } else if(servo.current < servo.target) {
+          servo.current += servo.speed;
+        } else {
+          servo.current -= servo.speed;
+        }
+        write = true;
+      } else if(servo.holdSteps) {
+        servo.holdSteps--;
+      } else {
+        servo.moving = false;
+        servo.powered = false;
+        stop = true;
+      }
+      if(write) {
+        servo.powered = true;
+        pulse = servo.current;
+      }
+    }
+    portEXIT_CRITICAL(&turnoutServoMux);
+    if(write) {
+      turnoutServoWrite(channel, pulse);
+    } else if(stop) {
+      // stop the pulses so the servo is not powered until the next movement
+      ledc_set_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, 0);
+      ledc_update_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel);
+    }
+  }
+}
+
+// returns a free LEDC channel configured for the pin or -1 if all channels are
+// in use. The LEDC timer and servo timer are set up on first use.
+int8_t allocateTurnoutServoChannel(uint8_t pin) {
+  if(turnoutServoTimer == NULL) {
+    ledc_timer_config_t timerConfig;
+    memset(&timerConfig, 0, sizeof(ledc_timer_config_t));
+    timerConfig.speed_mode = LEDC_LOW_SPEED_MODE;
+    timerConfig.duty_resolution = LEDC_TIMER_16_BIT;
+    timerConfig.timer_num = LEDC_TIMER_1;
+    timerConfig.freq_hz = TURNOUT_SERVO_FREQUENCY;
+    ledc_timer_config(&timerConfig);
+    esp_timer_create_args_t timerArgs;
+    memset(&timerArgs, 0, sizeof(esp_timer_create_args_t));
+    timerArgs.callback = turnoutServoTimerTick;
+    timerArgs.name = "TurnoutServo";
+    esp_timer_create(&timerArgs, &turnoutServoTimer);
+    esp_timer_start_periodic(turnoutServoTimer, TURNOUT_SERVO_STEP_INTERVAL * 1000);
+  }
+  for(uint8_t channel = 0; channel < TURNOUT_SERVO_CHANNELS; channel++) {
+    if(!turnoutServoChannels[channel].inUse) {
+      ledc_channel_config_t channelConfig;
+      memset(&channelConfig, 0, sizeof(ledc_channel_config_t));
+      channelConfig.gpio_num = pin;
+      channelConfig.speed_mode = LEDC_LOW_SPEED_MODE;
+      channelConfig.channel = (ledc_channel_t)channel;
+      channelConfig.intr_type = LEDC_INTR_DISABLE;
+      channelConfig.timer_sel = LEDC_TIMER_1;
+      channelConfig.duty = 0;
+      ledc_channel_config(&channelConfig);
+      // the servo position is not known until it has been moved once
+      portENTER_CRITICAL(&turnoutServoMux);
+      turnoutServoChannels[channel].moving = false;
+      turnoutServoChannels[channel].powered = false;
+      turnoutServoChannels[channel].current = 0;
+      turnoutServoChannels[channel].inUse = true;
+      portEXIT_CRITICAL(&turnoutServoMux);
+      return channel;
+    }
+  }
+  return -1;
+}
 
 void TurnoutManager::init() {
   log_i("Initializing turnout list");
@@ -81,11 +234,13 @@ void TurnoutManager::init() {
   for(int index = 0; index < turnoutCount; index++) {
     turnouts.add(new Turnout(index));
   }
+  StateObservers::layoutChanged();
 }
 
 void TurnoutManager::clear() {
   configStore.putUShort("TurnoutCount", 0);
   turnouts.free();
+  StateObservers::layoutChanged();
 }
 
 uint16_t TurnoutManager::store() {
@@ -136,6 +291,34 @@ void TurnoutManager::getState(JsonArray & array) {
     } else {
       turnoutJson[F("state")] = "Closed";
     }
+    // the state is the requested position until it has been confirmed
+    turnoutJson[F("verified")] = !turnout->hasFeedback() ||
+      turnout->getFeedbackState() == TURNOUT_FEEDBACK_VERIFIED;
+    if(turnout->getServoPin() != TURNOUT_NO_SERVO) {
+      turnoutJson[F("servoPin")] = turnout->getServoPin();
+      turnoutJson[F("thrownPulse")] = turnout->getThrownPulse();
+      turnoutJson[F("closedPulse")] = turnout->getClosedPulse();
+      turnoutJson[F("speed")] = turnout->getServoSpeed();
+      turnoutJson[F("moving")] = turnout->isServoMoving();
+    }
+    if(turnout->hasFeedback()) {
+      turnoutJson[F("thrownSensor")] = turnout->getThrownSensor();
+      turnoutJson[F("closedSensor")] = turnout->getClosedSensor();
+      switch(turnout->getFeedbackState()) {
+        case TURNOUT_FEEDBACK_PENDING:
+          turnoutJson[F("feedback")] = "Pending";
+          break;
+        case TURNOUT_FEEDBACK_VERIFIED:
+          turnoutJson[F("feedback")] = "Verified";
+          break;
+        case TURNOUT_FEEDBACK_FAILED:
+          turnoutJson[F("feedback")] = "Failed";
+          break;
+        default:
+          turnoutJson[F("feedback")] = "Unknown";
+          break;
+      }
+    }
   }
 }
 
@@ -145,14 +328,55 @@ void TurnoutManager::showStatus() {
   }
 }
 
-void TurnoutManager::createOrUpdate(const uint16_t id, const uint16_t address, const uint8_t subAddress) {
+// verifies the position of any turnouts waiting for feedback sensors or a
+// servo movement to complete
+void TurnoutManager::check() {
+  for (const auto& turnout : turnouts) {
+    turnout->checkFeedback();
+  }
+}
+
+void TurnoutManager::createOrUpdate(const uint16_t id, const uint16_t address, const uint8_t subAddress,
+  const int16_t thrownSensor, const int16_t closedSensor) {
   for (const auto& turnout : turnouts) {
     if(turnout->getID() == id) {
       turnout->update(address, subAddress);
+      turnout->setServo(TURNOUT_NO_SERVO);
+      turnout->setFeedbackSensors(thrownSensor, closedSensor);
       return;
     }
   }
-  turnouts.add(new Turnout(id, address, subAddress));
+  Turnout *turnout = new Turnout(id, address, subAddress);
+  turnout->setFeedbackSensors(thrownSensor, closedSensor);
+  turnouts.add(turnout);
+  StateObservers::layoutChanged();
+}
+
+// returns false when a servo pulse is outside TURNOUT_SERVO_MIN_PULSE and
+// TURNOUT_SERVO_MAX_PULSE or no servo channel is available for the turnout, a
+// new turnout is not created in that case.
+bool TurnoutManager::createOrUpdateServo(const uint16_t id, const int8_t pin, const int32_t thrownPulse,
+  const int32_t closedPulse, const uint16_t speed, const int16_t thrownSensor, const int16_t closedSensor) {
+  if(thrownPulse < TURNOUT_SERVO_MIN_PULSE || thrownPulse > TURNOUT_SERVO_MAX_PULSE ||
+    closedPulse < TURNOUT_SERVO_MIN_PULSE || closedPulse > TURNOUT_SERVO_MAX_PULSE) {
+    log_w("Turnout %d servo pulses %d/%d are out of range", id, (int)thrownPulse, (int)closedPulse);
+    return false;
+  }
+  for (const auto& turnout : turnouts) {
+    if(turnout->getID() == id) {
+      turnout->setFeedbackSensors(thrownSensor, closedSensor);
+      return turnout->setServo(pin, thrownPulse, closedPulse, speed);
+    }
+  }
+  Turnout *turnout = new Turnout(id, 0, 0);
+  if(!turnout->setServo(pin, thrownPulse, closedPulse, speed)) {
+    delete turnout;
+    return false;
+  }
+  turnout->setFeedbackSensors(thrownSensor, closedSensor);
+  turnouts.add(turnout);
+  StateObservers::layoutChanged();
+  return true;
 }
 
 bool TurnoutManager::remove(const uint16_t id) {
@@ -164,12 +388,34 @@ bool TurnoutManager::remove(const uint16_t id) {
   }
   if(turnoutToRemoved != NULL) {
     turnouts.remove(turnoutToRemoved);
+    StateObservers::layoutChanged();
     return true;
   }
   return false;
 }
 
-Turnout::Turnout(uint16_t turnoutID, uint16_t address, uint8_t subAddress, bool thrown) : _turnoutID(turnoutID), _address(address), _subAddress(subAddress), _thrown(thrown) {
+Turnout *TurnoutManager::getTurnoutByID(const uint16_t id) {
+  for (const auto& turnout : turnouts) {
+    if(turnout->getID() == id) {
+      return turnout;
+    }
+  }
+  return NULL;
+}
+
+Turnout *TurnoutManager::getTurnoutByAddress(const uint16_t address, const uint8_t subAddress) {
+  for (const auto& turnout : turnouts) {
+    if(turnout->getAddress() == address && turnout->getSubAddress() == subAddress) {
+      return turnout;
+    }
+  }
+  return NULL;
+}
+
+Turnout::Turnout(uint16_t turnoutID, uint16_t address, uint8_t subAddress, bool thrown) : _turnoutID(turnoutID), _address(address), _subAddress(subAddress), _thrown(thrown),
+  _thrownSensor(TURNOUT_NO_SENSOR), _closedSensor(TURNOUT_NO_SENSOR), _feedbackState(TURNOUT_FEEDBACK_NONE),
+  _feedbackTime(0), _feedbackAttempts(0), _servoPin(TURNOUT_NO_SERVO), _servoChannel(-1),
+  _thrownPulse(0), _closedPulse(0), _servoSpeed(0), _reportPending(false) {
   log_i("Turnout %d created using address %d/%d", turnoutID, address, subAddress);
 }
 
@@ -178,11 +424,32 @@ Turnout::Turnout(uint16_t index) {
   String turnoutAddrKey = turnoutIDKey + String("_a");
   String turnoutSubAddrKey = turnoutIDKey + String("_s");
   String turnoutStateKey = turnoutIDKey + String("_st");
+  String turnoutThrownSensorKey = turnoutIDKey + String("_fs");
+  String turnoutClosedSensorKey = turnoutIDKey + String("_fc");
   _turnoutID = configStore.getUShort(turnoutIDKey.c_str(), index);
   _address = configStore.getUShort(turnoutAddrKey.c_str(), 0);
   _subAddress = configStore.getUChar(turnoutSubAddrKey.c_str(), 0);
   _thrown = configStore.getBool(turnoutStateKey.c_str(), false);
+  _thrownSensor = configStore.getShort(turnoutThrownSensorKey.c_str(), TURNOUT_NO_SENSOR);
+  _closedSensor = configStore.getShort(turnoutClosedSensorKey.c_str(), TURNOUT_NO_SENSOR);
+  _feedbackState = TURNOUT_FEEDBACK_NONE;
+  _feedbackTime = 0;
+  _feedbackAttempts = 0;
+  _servoPin = TURNOUT_NO_SERVO;
+  _servoChannel = -1;
+  _reportPending = false;
+  int8_t servoPin = configStore.getChar((turnoutIDKey + String("_vp")).c_str(), TURNOUT_NO_SERVO);
+  _thrownPulse = configStore.getUShort((turnoutIDKey + String("_vt")).c_str(), 0);
+  _closedPulse = configStore.getUShort((turnoutIDKey + String("_vc")).c_str(), 0);
+  _servoSpeed = configStore.getUShort((turnoutIDKey + String("_vs")).c_str(), 0);
   log_i("Turnout(%d, %d, %d)", _turnoutID, _address, _subAddress);
+  if(servoPin != TURNOUT_NO_SERVO) {
+    setServo(servoPin, _thrownPulse, _closedPulse, _servoSpeed);
+  }
+}
+
+Turnout::~Turnout() {
+  releaseServo();
 }
 
 void Turnout::update(uint16_t address, uint8_t subAddress) {
@@ -191,6 +458,77 @@ void Turnout::update(uint16_t address, uint8_t subAddress) {
   log_i("Turnout %d updated to address %d/%d", _turnoutID, _address, _subAddress);
 }
 
+// TURNOUT_KEEP_SENSOR leaves the corresponding sensor unchanged, any other
+// negative ID removes it.
+void Turnout::setFeedbackSensors(int16_t thrownSensor, int16_t closedSensor) {
+  if(thrownSensor != TURNOUT_KEEP_SENSOR) {
+    _thrownSensor = thrownSensor < 0 ? TURNOUT_NO_SENSOR : thrownSensor;
+  }
+  if(closedSensor != TURNOUT_KEEP_SENSOR) {
+    _closedSensor = closedSensor < 0 ? TURNOUT_NO_SENSOR : closedSensor;
+  }
+  _feedbackState = TURNOUT_FEEDBACK_NONE;
+  if(hasFeedback()) {
+    log_i("Turnout %d using feedback sensors %d (thrown) / %d (closed)", _turnoutID, _thrownSensor, _closedSensor);
+  }
+}
+
+// returns false when the turnout should be driven by a servo but no servo
+// channel is available.
+bool Turnout::setServo(int8_t pin, uint16_t thrownPulse, uint16_t closedPulse, uint16_t speed) {
+  releaseServo();
+  _servoPin = pin < 0 ? TURNOUT_NO_SERVO : pin;
+  _thrownPulse = thrownPulse;
+  _closedPulse = closedPulse;
+  _servoSpeed = speed;
+  if(_servoPin == TURNOUT_NO_SERVO) {
+    return true;
+  }
+  _servoChannel = allocateTurnoutServoChannel(_servoPin);
+  if(_servoChannel < 0) {
+    log_w("Turnout %d no servo channel available for pin %d", _turnoutID, _servoPin);
+    return false;
+  }
+  portENTER_CRITICAL(&turnoutServoMux);
+  turnoutServoChannels[_servoChannel].speed = _servoSpeed;
+  portEXIT_CRITICAL(&turnoutServoMux);
+  log_i("Turnout %d using servo on pin %d (thrown: %dus, closed: %dus, speed: %d)", _turnoutID,
+    _servoPin, _thrownPulse, _closedPulse, _servoSpeed);
+  return true;
+}
+
+void Turnout::releaseServo() {
+  if(_servoChannel >= 0) {
+    portENTER_CRITICAL(&turnoutServoMux);
+    turnoutServoChannels[_servoChannel].moving = false;
+    turnoutServoChannels[_servoChannel].inUse = false;
+    portEXIT_CRITICAL(&turnoutServoMux);
+    ledc_stop(LEDC_LOW_SPEED_MODE, (ledc_channel_t)_servoChannel, 0);
+    pinMatrixOutDetach(_servoPin, false, false);
+    _servoChannel = -1;
+  }
+}
+
+bool Turnout::isServoMoving() {
+  return _servoChannel >= 0 && turnoutServoChannels[_servoChannel].moving;
+}
+
+// starts moving the servo towards the current position, the servo timer
+// powers the servo again at its last position before moving.
+void Turnout::moveToPosition() {
+  TurnoutServoChannel &servo = turnoutServoChannels[_servoChannel];
+  portENTER_CRITICAL(&turnoutServoMux);
+  servo.target = _thrown ? _thrownPulse : _closedPulse;
+  servo.holdSteps = TURNOUT_SERVO_HOLD_STEPS;
+  if(!servo.moving) {
+    if(servo.current == 0) {
+      servo.current = servo.target;
+    }
+    servo.moving = true;
+  }
+  portEXIT_CRITICAL(&turnoutServoMux);
+}
+
 void Turnout::store(uint16_t index) {
   String turnoutIDKey = String("T_") + String(index);
   String turnoutAddrKey = turnoutIDKey + String("_a");
@@ -200,24 +538,117 @@ void Turnout::store(uint16_t index) {
   configStore.putUShort(turnoutAddrKey.c_str(), _address);
   configStore.putUChar(turnoutSubAddrKey.c_str(), _subAddress);
   configStore.putBool(turnoutStateKey.c_str(), _thrown);
+  String turnoutThrownSensorKey = turnoutIDKey + String("_fs");
+  String turnoutClosedSensorKey = turnoutIDKey + String("_fc");
+  configStore.putShort(turnoutThrownSensorKey.c_str(), _thrownSensor);
+  configStore.putShort(turnoutClosedSensorKey.c_str(), _closedSensor);
+  configStore.putChar((turnoutIDKey + String("_vp")).c_str(), _servoPin);
+  if(_servoPin != TURNOUT_NO_SERVO) {
+    configStore.putUShort((turnoutIDKey + String("_vt")).c_str(), _thrownPulse);
+    configStore.putUShort((turnoutIDKey + String("_vc")).c_str(), _closedPulse);
+    configStore.putUShort((turnoutIDKey + String("_vs")).c_str(), _servoSpeed);
+  }
 }
 
 void Turnout::set(bool thrown) {
+  if(_servoPin != TURNOUT_NO_SERVO && !isServo()) {
+    // the turnout does not have a decoder address, it must not fall back to
+    // sending accessory packets.
+    log_w("Turnout(%d) has no servo channel for pin %d, not moved", _turnoutID, _servoPin);
+    wifiInterface.printf(F("<H %d E>"), _turnoutID);
+    return;
+  }
   _thrown = thrown;
-  std::vector<String> args;
-  args.push_back(String(_address));
-  args.push_back(String(_subAddress));
-  args.push_back(String(_thrown));
-  DCCPPProtocolHandler::getCommandHandler("a")->process(args);
-  wifiInterface.printf(F("<H %d %d>"), _turnoutID, !_thrown);
+  if(isServo()) {
+    moveToPosition();
+  } else {
+    AccessoryCommand::sendPacket(_address, _subAddress, _thrown);
+  }
+  if(hasFeedback()) {
+    // the position will be reported once the feedback sensors confirm it
+    _feedbackState = TURNOUT_FEEDBACK_PENDING;
+    _feedbackAttempts = 1;
+    _feedbackTime = millis();
+  } else if(isServo()) {
+    // the position will be reported once the servo has stopped
+    _reportPending = true;
+  } else {
+    reportPosition();
+  }
   log_i("Turnout(%d) %s", _turnoutID, _thrown ? "Thrown" : "Closed");
 }
 
+void Turnout::reportPosition() {
+  wifiInterface.printf(F("<H %d %d>"), _turnoutID, !_thrown);
+  StateObservers::turnoutChanged(_turnoutID, _thrown);
+}
+
+// returns true when the feedback sensors match the requested position, a
+// feedback sensor that does not exist can not confirm the position.
+bool Turnout::isPositionConfirmed() {
+  bool thrownConfirmed = _thrownSensor == TURNOUT_NO_SENSOR;
+  bool closedConfirmed = _closedSensor == TURNOUT_NO_SENSOR;
+  for (const auto& sensor : sensors) {
+    if(sensor->getID() == _thrownSensor) {
+      thrownConfirmed = sensor->isActive() == _thrown;
+    }
+    if(sensor->getID() == _closedSensor) {
+      closedConfirmed = sensor->isActive() != _thrown;
+    }
+  }
+  return thrownConfirmed && closedConfirmed;
+}
+
+void Turnout::checkFeedback() {
+  if(_reportPending && !isServoMoving()) {
+    _reportPending = false;
+    reportPosition();
+  }
+  if(_feedbackState == TURNOUT_FEEDBACK_FAILED) {
+    // keep watching the sensors, the turnout may still reach the position
+    if(!isServoMoving() && isPositionConfirmed()) {
+      log_i("Turnout(%d) %s confirmed after failing", _turnoutID, _thrown ? "Thrown" : "Closed");
+      _feedbackState = TURNOUT_FEEDBACK_VERIFIED;
+      reportPosition();
+    }
+    return;
+  }
+  if(_feedbackState != TURNOUT_FEEDBACK_PENDING) {
+    return;
+  }
+  if(isServoMoving()) {
+    // the feedback timeout starts once the servo has stopped
+    _feedbackTime = millis();
+  } else if(isPositionConfirmed()) {
+    log_i("Turnout(%d) %s confirmed after %dms", _turnoutID, _thrown ? "Thrown" : "Closed",
+      millis() - _feedbackTime);
+    _feedbackState = TURNOUT_FEEDBACK_VERIFIED;
+    reportPosition();
+  } else if(millis() - _feedbackTime >= TURNOUT_FEEDBACK_TIMEOUT) {
+    if(_feedbackAttempts <= TURNOUT_FEEDBACK_RETRIES) {
+      log_w("Turnout(%d) %s not confirmed, retrying [%d/%d]", _turnoutID, _thrown ? "Thrown" : "Closed",
+        _feedbackAttempts, TURNOUT_FEEDBACK_RETRIES);
+      _feedbackAttempts++;
+      _feedbackTime = millis();
+      if(isServo()) {
+        moveToPosition();
+      } else if(_servoPin == TURNOUT_NO_SERVO) {
+        AccessoryCommand::sendPacket(_address, _subAddress, _thrown);
+      }
+    } else {
+      log_e("Turnout(%d) %s could not be confirmed", _turnoutID, _thrown ? "Thrown" : "Closed");
+      _feedbackState = TURNOUT_FEEDBACK_FAILED;
+      wifiInterface.printf(F("<H %d E>"), _turnoutID);
+      StateObservers::turnoutFailed(_turnoutID, _thrown);
+    }
+  }
+}
+
 void Turnout::showStatus() {
   wifiInterface.printf(F("<H %d %d %d %d>"), _turnoutID, _address, _subAddress, _thrown);
 }
 
-void TurnoutCommandAdapter::process(const std::vector<String> arguments) {
+void TurnoutCommandAdapter::process(const DCCPPProtocolArguments &arguments) {
   if(arguments.empty()) {
     // list all turnouts
     TurnoutManager::showStatus();
@@ -232,17 +663,31 @@ void TurnoutCommandAdapter::process(const std::vector<String> arguments) {
       // create/update turnout
       TurnoutManager::createOrUpdate(turnoutID, arguments[1].toInt(), arguments[2].toInt());
       wifiInterface.printf(F("<O>"));
+    } else if (arguments.size() == 6 && arguments[1].equalsIgnoreCase("SERVO")) {
+      // create/update servo turnout
+      if(TurnoutManager::createOrUpdateServo(turnoutID, arguments[2].toInt(), arguments[3].toInt(),
+        arguments[4].toInt(), arguments[5].toInt())) {
+        wifiInterface.printf(F("<O>"));
+      } else {
+        wifiInterface.printf(F("<X>"));
+      }
+    } else if (arguments.size() == 5) {
+      // create/update turnout with feedback sensors
+      TurnoutManager::createOrUpdate(turnoutID, arguments[1].toInt(), arguments[2].toInt(),
+        arguments[3].toInt(), arguments[4].toInt());
+      wifiInterface.printf(F("<O>"));
     } else {
       wifiInterface.printf(F("<X>"));
     }
   }
 }
 
-void AccessoryCommand::process(const std::vector<String> arguments) {
+void AccessoryCommand::process(const DCCPPProtocolArguments &arguments) {
+  sendPacket(arguments[0].toInt(), arguments[1].toInt(), arguments[2].toInt() == 1);
+}
+
+void AccessoryCommand::sendPacket(uint16_t accessoryAddress, uint8_t accessoryIndex, bool activate) {
   std::vector<uint8_t> packetBuffer;
-  uint16_t accessoryAddress = arguments[0].toInt();
-  uint8_t accessoryIndex = arguments[1].toInt();
-  bool activate = arguments[2].toInt() == 1;
   // first byte is of the form 10AAAAAA, where AAAAAA represent 6 least
   // signifcant bits of accessory address
   packetBuffer.push_back(0x80 + accessoryAddress % 64);
@@ -250,5 +695,5 @@ void AccessoryCommand::process(const std::vector<String> arguments) {
   // significant D represent activate/deactivate
   packetBuffer.push_back(((((accessoryAddress / 64) % 8) << 4) +
     (accessoryIndex % 4 << 1) + activate) ^ 0xF8);
-  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, 4);
+  dccSignal[DCC_SIGNAL_OPERATIONS].loadPacket(packetBuffer, DCC_PACKET_ACCESSORY);
 }
@@ -20,12 +20,48 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include <ArduinoJson.h>
 #include "DCCppProtocol.h"
 
+// time (in ms) to wait for the feedback sensors to confirm a turnout position
+#define TURNOUT_FEEDBACK_TIMEOUT 1500
+// number of times the accessory packet is resent when the position has not
+// been confirmed within TURNOUT_FEEDBACK_TIMEOUT
+#define TURNOUT_FEEDBACK_RETRIES 2
+// sensor ID used when a turnout does not have a feedback sensor
+#define TURNOUT_NO_SENSOR -1
+// sensor ID used when updating a turnout to keep its current feedback sensor
+#define TURNOUT_KEEP_SENSOR -2
+
+// servo turnouts use the low speed LEDC channels and timer 1 so they do not
+// share a timer with the PWM outputs.
+#define TURNOUT_SERVO_CHANNELS 8
+#define TURNOUT_SERVO_FREQUENCY 50
+// interval (in ms) between servo movement steps, this matches the servo frame
+#define TURNOUT_SERVO_STEP_INTERVAL 20
+// number of steps the servo is held at its final position before the pulses
+// are stopped, this gives the servo time to settle.
+#define TURNOUT_SERVO_HOLD_STEPS 10
+// range (in microseconds) accepted for the thrown and closed servo pulses
+#define TURNOUT_SERVO_MIN_PULSE 500
+#define TURNOUT_SERVO_MAX_PULSE 2500
+// pin used when a turnout is not driven by a servo
+#define TURNOUT_NO_SERVO -1
+
+enum TURNOUT_FEEDBACK_STATE {
+  TURNOUT_FEEDBACK_NONE,
+  TURNOUT_FEEDBACK_PENDING,
+  TURNOUT_FEEDBACK_VERIFIED,
+  TURNOUT_FEEDBACK_FAILED
+};
+
 class Turnout {
 public:
   Turnout(uint16_t, uint16_t, uint8_t, bool=false);
   Turnout(uint16_t);
+  virtual ~Turnout();
   void update(uint16_t, uint8_t);
+  void setFeedbackSensors(int16_t, int16_t);
+  bool setServo(int8_t, uint16_t=0, uint16_t=0, uint16_t=0);
   void set(bool=false);
+  void checkFeedback();
   void store(uint16_t);
   const uint16_t getID() {
     return _turnoutID;
@@ -39,12 +75,62 @@ public:
   const bool isThrown() {
     return _thrown;
   }
+  const int16_t getThrownSensor() {
+    return _thrownSensor;
+  }
+  const int16_t getClosedSensor() {
+    return _closedSensor;
+  }
+  const bool hasFeedback() {
+    return _thrownSensor != TURNOUT_NO_SENSOR || _closedSensor != TURNOUT_NO_SENSOR;
+  }
+  const TURNOUT_FEEDBACK_STATE getFeedbackState() {
+    return _feedbackState;
+  }
+  // true when the feedback sensors did not confirm the requested position
+  const bool isPositionFailed() {
+    return _feedbackState == TURNOUT_FEEDBACK_FAILED;
+  }
+  const bool isServo() {
+    return _servoChannel >= 0;
+  }
+  const int8_t getServoPin() {
+    return _servoPin;
+  }
+  const uint16_t getThrownPulse() {
+    return _thrownPulse;
+  }
+  const uint16_t getClosedPulse() {
+    return _closedPulse;
+  }
+  const uint16_t getServoSpeed() {
+    return _servoSpeed;
+  }
+  bool isServoMoving();
   void showStatus();
 private:
+  bool isPositionConfirmed();
+  void reportPosition();
+  void moveToPosition();
+  void releaseServo();
   uint16_t _turnoutID;
   uint16_t _address;
   uint8_t _subAddress;
   bool _thrown;
+  // sensor that is active when the turnout is thrown / closed
+  int16_t _thrownSensor;
+  int16_t _closedSensor;
+  TURNOUT_FEEDBACK_STATE _feedbackState;
+  uint32_t _feedbackTime;
+  uint8_t _feedbackAttempts;
+  // servo settings, pulse widths are in microseconds and the speed is the
+  // number of microseconds the pulse changes per step (0 moves immediately).
+  int8_t _servoPin;
+  int8_t _servoChannel;
+  uint16_t _thrownPulse;
+  uint16_t _closedPulse;
+  uint16_t _servoSpeed;
+  bool _reportPending;
 };
 
 class TurnoutManager {
@@ -56,22 +142,29 @@ public:
   static bool toggle(uint16_t);
   static void getState(JsonArray &);
   static void showStatus();
-  static void createOrUpdate(const uint16_t, const uint16_t, const uint8_t);
+  static void check();
+  static void createOrUpdate(const uint16_t, const uint16_t, const uint8_t,
+    const int16_t=TURNOUT_KEEP_SENSOR, const int16_t=TURNOUT_KEEP_SENSOR);
+  static bool createOrUpdateServo(const uint16_t, const int8_t, const int32_t, const int32_t,
+    const uint16_t, const int16_t=TURNOUT_KEEP_SENSOR, const int16_t=TURNOUT_KEEP_SENSOR);
   static bool remove(const uint16_t);
+  static Turnout *getTurnoutByID(const uint16_t);
+  static Turnout *getTurnoutByAddress(const uint16_t, const uint8_t);
 };
 
 class TurnoutCommandAdapter : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String>);
-  String getID() {
+  void process(const DCCPPProtocolArguments &);
+  const char *getID() {
     return "T";
   }
 };
 
 class AccessoryCommand : public DCCPPProtocolCommand {
 public:
-  void process(const std::vector<String>);
-  String getID() {
+  void process(const DCCPPProtocolArguments &);
+  static void sendPacket(uint16_t, uint8_t, bool);
+  const char *getID() {
     return "a";
   }
 };
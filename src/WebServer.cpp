@@ -25,31 +25,56 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include "Turnouts.h"
 #include "Sensors.h"
 #include "S88Sensors.h"
+#include "Scheduler.h"
+#include "StallWatchdog.h"
+#include "Z21Server.h"
+#include "MQTTInterface.h"
+#include "LCCInterface.h"
+#include "MulticastBroadcaster.h"
+#include "Federation.h"
+#include "HotRestart.h"
+#include "SerialInterface.h"
+#include "CommandQueue.h"
+#include "StartupSync.h"
+#include "FaultCapture.h"
+#include "RailCom.h"
 #include "index_html.h"
 
 enum HTTP_STATUS_CODES {
   STATUS_OK = 200,
   STATUS_NOT_MODIFIED = 304,
+  STATUS_BAD_REQUEST = 400,
   STATUS_NOT_FOUND = 404,
   STATUS_NOT_ALLOWED = 405,
   STATUS_NOT_ACCEPTABLE = 406,
   STATUS_CONFLICT = 409,
   STATUS_PRECONDITION_FAILED = 412,
+  STATUS_PAYLOAD_TOO_LARGE = 413,
   STATUS_SERVER_ERROR = 500
 };
 
+const char *webSocketTopicNames[WEB_SOCKET_TOPIC_MAX] = {
+  "throttle", "sensors", "power", "programmer", "accessories"
+};
+
 class WebSocketClient {
 public:
-  WebSocketClient(int clientID) : _id(clientID) {
+  WebSocketClient(int clientID) : _id(clientID), _topics(WEB_SOCKET_TOPICS_ALL),
+    _sent(0), _filtered(0) {
     buffer.reserve(128);
+    _queue = CommandQueue::registerClient("ws", clientID);
+  }
+  ~WebSocketClient() {
+    CommandQueue::releaseClient(_queue);
   }
-  int getID() {
+  uint32_t getID() {
     return _id;
   }
-  void appendData(uint8_t * data, size_t len) {
-    for(int i = 0; i < len; i++) {
-      buffer.emplace_back(data[i]);
-    }
+  uint8_t getTopics() {
+    return _topics;
+  }
+  void appendData(AsyncWebSocketClient *client, uint8_t * data, size_t len) {
+    buffer.insert(buffer.end(), data, data + len);
     auto s = buffer.begin();
     auto consumed = buffer.begin();
     for(; s != buffer.end();) {
@@ -60,20 +85,112 @@ public:
         s++;
         // discard the >
         *e = 0;
-        String str(reinterpret_cast<char*>(&*s));
-        wifiInterface.printf(F("<%s>"), str.c_str());
-        DCCPPProtocolHandler::process(std::move(str));
+        const char *command = reinterpret_cast<char*>(&*s);
+        if(!strncmp(command, "subscribe", 9)) {
+          subscribe(client, command + 9);
+        } else {
+          CommandQueue::enqueue(_queue, command);
+        }
         consumed = e;
       }
       s = e;
     }
     buffer.erase(buffer.begin(), consumed); // drop everything we used from the buffer.
   }
+  // counts a response as sent to or filtered for this client, this is only
+  // called while holding webSocketSessionsMux.
+  void countResponse(bool sent) {
+    if(sent) {
+      _sent++;
+    } else {
+      _filtered++;
+    }
+  }
+  uint32_t getSent() {
+    return _sent;
+  }
+  uint32_t getFiltered() {
+    return _filtered;
+  }
 private:
+  // <subscribe [TOPIC ...]> replaces the topics of this client, "all" selects
+  // every topic and no topics (or "none") leaves only the untagged responses.
+  void subscribe(AsyncWebSocketClient *client, char *topics) {
+    uint8_t subscribed = 0;
+    char *tokenState = NULL;
+    char *token = strtok_r(topics, " ", &tokenState);
+    while(token != NULL) {
+      if(!strcmp(token, "all")) {
+        subscribed = WEB_SOCKET_TOPICS_ALL;
+      }
+      for(uint8_t topic = 0; topic < WEB_SOCKET_TOPIC_MAX; topic++) {
+        if(!strcmp(token, webSocketTopicNames[topic])) {
+          bitSet(subscribed, topic);
+        }
+      }
+      token = strtok_r(NULL, " ", &tokenState);
+    }
+    _topics = subscribed;
+    String reply = "<subscribed";
+    for(uint8_t topic = 0; topic < WEB_SOCKET_TOPIC_MAX; topic++) {
+      if(bitRead(_topics, topic)) {
+        reply += " ";
+        reply += webSocketTopicNames[topic];
+      }
+    }
+    reply += ">";
+    client->text(reply);
+  }
   uint32_t _id;
+  int8_t _queue;
+  volatile uint8_t _topics;
+  uint32_t _sent;
+  uint32_t _filtered;
   std::vector<uint8_t> buffer;
 };
-LinkedList<WebSocketClient *> webSocketClients([](WebSocketClient *client) {delete client;});
+
+struct WebSocketSessionState {
+  uint32_t id;
+  uint8_t topics;
+  uint32_t sent;
+  uint32_t filtered;
+};
+
+// connected WebSocket clients, a NULL entry is a free slot. Clients are only
+// added and removed by the WebSocket event handler but the table is read by
+// broadcastToWS from any task. The sessions are allocated and deleted outside
+// of webSocketSessionsMux, only the slot pointers change under it.
+WebSocketClient *webSocketSessions[WEB_SOCKET_MAX_SESSIONS];
+uint8_t webSocketSessionCount = 0;
+portMUX_TYPE webSocketSessionsMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t webSocketBroadcasts = 0;
+uint32_t webSocketRejected = 0;
+
+// returns the topic of a response based on its DCC++ response code or -1
+// for responses that are sent to all clients.
+int8_t webSocketTopicOf(const char *buf) {
+  if(buf[0] != '<') {
+    return -1;
+  }
+  switch(buf[1]) {
+    case 'T':
+    case 'l':
+      return WEB_SOCKET_TOPIC_THROTTLE;
+    case 'Q':
+    case 'q':
+    case 'S':
+      return WEB_SOCKET_TOPIC_SENSORS;
+    case 'p':
+    case 'a':
+      return WEB_SOCKET_TOPIC_POWER;
+    case 'r':
+      return WEB_SOCKET_TOPIC_PROGRAMMER;
+    case 'H':
+    case 'Y':
+      return WEB_SOCKET_TOPIC_ACCESSORIES;
+  }
+  return -1;
+}
 
 DCCPPWebServer::DCCPPWebServer() : AsyncWebServer(80), webSocket("/ws") {
   rewrite("/", "/index.html");
@@ -96,11 +213,63 @@ DCCPPWebServer::DCCPPWebServer() : AsyncWebServer(80), webSocket("/ws") {
     root[F("s88")] = "true";
 #else
     root[F("s88")] = "false";
+#endif
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+    root[F("railcom")] = "true";
+#else
+    root[F("railcom")] = "false";
+#endif
+#if defined(Z21_ENABLED) && Z21_ENABLED
+    root[F("z21")] = "true";
+#else
+    root[F("z21")] = "false";
+#endif
+#if defined(MQTT_ENABLED) && MQTT_ENABLED
+    root[F("mqtt")] = "true";
+#else
+    root[F("mqtt")] = "false";
+#endif
+#if defined(LCC_ENABLED) && LCC_ENABLED
+    root[F("lcc")] = "true";
+#else
+    root[F("lcc")] = "false";
+#endif
+#if defined(MULTICAST_ENABLED) && MULTICAST_ENABLED
+    root[F("multicast")] = "true";
+#else
+    root[F("multicast")] = "false";
+#endif
+#if defined(FEDERATION_ENABLED) && FEDERATION_ENABLED
+    root[F("federation")] = "true";
+#else
+    root[F("federation")] = "false";
+#endif
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+    root[F("serial")] = "true";
+#else
+    root[F("serial")] = "false";
+#endif
+#if defined(HOT_RESTART_ENABLED) && HOT_RESTART_ENABLED
+    root[F("hotRestart")] = "true";
+#else
+    root[F("hotRestart")] = "false";
+#endif
+#if defined(STARTUP_SYNC_ENABLED) && STARTUP_SYNC_ENABLED
+    root[F("startupSync")] = "true";
+#else
+    root[F("startupSync")] = "false";
+#endif
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+    root[F("faultCapture")] = "true";
+#else
+    root[F("faultCapture")] = "false";
 #endif
     jsonResponse->setCode(STATUS_OK);
     jsonResponse->setLength();
    	request->send(jsonResponse);
   });
+  on("/espinfo", HTTP_GET,
+    std::bind(&DCCPPWebServer::handleESPInfo, this, std::placeholders::_1));
   on("/programmer", HTTP_GET | HTTP_POST,
     std::bind(&DCCPPWebServer::handleProgrammer, this, std::placeholders::_1));
   on("/powerStatus", HTTP_GET,
@@ -111,44 +280,227 @@ DCCPPWebServer::DCCPPWebServer() : AsyncWebServer(80), webSocket("/ws") {
     std::bind(&DCCPPWebServer::handleTurnouts, this, std::placeholders::_1));
   on("/sensors", HTTP_GET | HTTP_POST | HTTP_DELETE,
     std::bind(&DCCPPWebServer::handleSensors, this, std::placeholders::_1));
+  on("/sensorEvents", HTTP_GET,
+    std::bind(&DCCPPWebServer::handleSensorEvents, this, std::placeholders::_1));
+  on("/sensorBitmap", HTTP_GET,
+    std::bind(&DCCPPWebServer::handleSensorBitmap, this, std::placeholders::_1));
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+  on("/faults", HTTP_GET,
+    std::bind(&DCCPPWebServer::handleFaults, this, std::placeholders::_1));
+#endif
 #if defined(S88_ENABLED) && S88_ENABLED
   on("/s88sensors", HTTP_GET | HTTP_POST | HTTP_DELETE,
     std::bind(&DCCPPWebServer::handleS88Sensors, this, std::placeholders::_1));
 #endif
   on("/config", HTTP_POST | HTTP_DELETE,
     std::bind(&DCCPPWebServer::handleConfig, this, std::placeholders::_1));
-  webSocket.onEvent([](AsyncWebSocket * server, AsyncWebSocketClient * client,
+  on("/batch", HTTP_POST,
+    std::bind(&DCCPPWebServer::handleBatch, this, std::placeholders::_1), NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      // collect the request body, it is processed by handleBatch once it has
+      // been received. The buffer is released with the request.
+      if(index == 0 && total <= WEB_BATCH_MAX_BODY) {
+        request->_tempObject = malloc(total + 1);
+      }
+      if(request->_tempObject != NULL && index + len <= total) {
+        memcpy((uint8_t *)request->_tempObject + index, data, len);
+        ((char *)request->_tempObject)[index + len] = 0;
+      }
+    });
+  webSocket.onEvent([this](AsyncWebSocket * server, AsyncWebSocketClient * client,
       AwsEventType type, void * arg, uint8_t *data, size_t len) {
-    if (type == WS_EVT_CONNECT) {
-      webSocketClients.add(new WebSocketClient(client->id()));
-      client->printf("DCC++ESP v%s. READY!", VERSION);
-  #if INFO_SCREEN_WS_CLIENTS_LINE >= 0
-      InfoScreen::printf(12, INFO_SCREEN_WS_CLIENTS_LINE, F("%02d"), webSocketClients.length());
-  #endif
-    } else if (type == WS_EVT_DISCONNECT) {
-      WebSocketClient *toRemove = NULL;
-      for (const auto& clientNode : webSocketClients) {
-        if(clientNode->getID() == client->id()) {
-          toRemove = clientNode;
-        }
+    handleWebSocketEvent(client, type, data, len);
+  });
+  addHandler(&webSocket);
+}
+
+void DCCPPWebServer::handleWebSocketEvent(AsyncWebSocketClient *client, AwsEventType type,
+  uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    WebSocketClient *session = new WebSocketClient(client->id());
+    bool added = false;
+    portENTER_CRITICAL(&webSocketSessionsMux);
+    for(uint8_t index = 0; index < WEB_SOCKET_MAX_SESSIONS && !added; index++) {
+      if(webSocketSessions[index] == NULL) {
+        webSocketSessions[index] = session;
+        webSocketSessionCount++;
+        added = true;
       }
-      if(toRemove != NULL) {
-        webSocketClients.remove(toRemove);
+    }
+    const uint8_t sessionCount = webSocketSessionCount;
+    portEXIT_CRITICAL(&webSocketSessionsMux);
+    if(!added) {
+      log_w("[WS] Rejecting client %d, too many clients", client->id());
+      delete session;
+      webSocketRejected++;
+      client->close();
+      return;
+    }
+    client->printf("DCC++ESP v%s. READY!", VERSION);
+#if INFO_SCREEN_WS_CLIENTS_LINE >= 0
+    InfoScreen::printf(12, INFO_SCREEN_WS_CLIENTS_LINE, F("%02d"), sessionCount);
+#endif
+  } else if (type == WS_EVT_DISCONNECT) {
+    WebSocketClient *toRemove = NULL;
+    portENTER_CRITICAL(&webSocketSessionsMux);
+    for(uint8_t index = 0; index < WEB_SOCKET_MAX_SESSIONS; index++) {
+      if(webSocketSessions[index] != NULL && webSocketSessions[index]->getID() == client->id()) {
+        toRemove = webSocketSessions[index];
+        webSocketSessions[index] = NULL;
+        webSocketSessionCount--;
+        break;
       }
-  #if INFO_SCREEN_WS_CLIENTS_LINE >= 0
-      InfoScreen::printf(12, INFO_SCREEN_WS_CLIENTS_LINE, F("%02d"), webSocketClients.length());
-  #endif
-    } else if (type == WS_EVT_DATA) {
-      for (const auto& clientNode : webSocketClients) {
-        if(clientNode->getID() == client->id()) {
-          clientNode->appendData(data, len);
-        }
+    }
+    const uint8_t sessionCount = webSocketSessionCount;
+    portEXIT_CRITICAL(&webSocketSessionsMux);
+    if(toRemove != NULL) {
+      delete toRemove;
+    }
+#if INFO_SCREEN_WS_CLIENTS_LINE >= 0
+    InfoScreen::printf(12, INFO_SCREEN_WS_CLIENTS_LINE, F("%02d"), sessionCount);
+#endif
+  } else if (type == WS_EVT_DATA) {
+    // sessions are only deleted by this handler so it is safe to use the
+    // session after releasing the lock.
+    WebSocketClient *session = NULL;
+    portENTER_CRITICAL(&webSocketSessionsMux);
+    for(uint8_t index = 0; index < WEB_SOCKET_MAX_SESSIONS; index++) {
+      if(webSocketSessions[index] != NULL && webSocketSessions[index]->getID() == client->id()) {
+        session = webSocketSessions[index];
+        break;
       }
     }
-  });
-  addHandler(&webSocket);
+    portEXIT_CRITICAL(&webSocketSessionsMux);
+    if(session != NULL) {
+      session->appendData(client, data, len);
+    }
+  }
+}
+
+// sends a response to the WebSocket clients that subscribed to its topic, when
+// all clients want it the response is only formatted once.
+void DCCPPWebServer::broadcastToWS(const char *buf) {
+  const int8_t topic = webSocketTopicOf(buf);
+  uint32_t targets[WEB_SOCKET_MAX_SESSIONS];
+  uint8_t targetCount = 0;
+  uint8_t sessionCount = 0;
+  portENTER_CRITICAL(&webSocketSessionsMux);
+  for (const auto& session : webSocketSessions) {
+    if(session == NULL) {
+      continue;
+    }
+    sessionCount++;
+    const bool wanted = topic < 0 || bitRead(session->getTopics(), topic);
+    if(wanted) {
+      targets[targetCount++] = session->getID();
+    }
+    session->countResponse(wanted);
+  }
+  portEXIT_CRITICAL(&webSocketSessionsMux);
+  if(!targetCount) {
+    return;
+  }
+  webSocketBroadcasts++;
+  if(targetCount == sessionCount) {
+    webSocket.textAll(buf);
+  } else {
+    for(uint8_t index = 0; index < targetCount; index++) {
+      webSocket.text(targets[index], buf);
+    }
+  }
 }
 
+void DCCPPWebServer::handleESPInfo(AsyncWebServerRequest *request) {
+  auto jsonResponse = new AsyncJsonResponse();
+  JsonObject &root = jsonResponse->getRoot();
+  root[F("version")] = VERSION;
+  root[F("uptime")] = millis();
+  ScratchArena::getState(root);
+  JsonArray &tasks = root.createNestedArray(F("tasks"));
+  Scheduler::getState(tasks);
+  StallWatchdog::getState(root);
+  JsonObject &commandQueue = root.createNestedObject(F("commandQueue"));
+  CommandQueue::getState(commandQueue);
+  JsonObject &webSockets = root.createNestedObject(F("webSockets"));
+  webSockets[F("broadcasts")] = webSocketBroadcasts;
+  webSockets[F("rejected")] = webSocketRejected;
+  JsonArray &sessions = webSockets.createNestedArray(F("sessions"));
+  WebSocketSessionState sessionStates[WEB_SOCKET_MAX_SESSIONS];
+  uint8_t sessionCount = 0;
+  portENTER_CRITICAL(&webSocketSessionsMux);
+  for (const auto& session : webSocketSessions) {
+    if(session != NULL) {
+      sessionStates[sessionCount++] = {session->getID(), session->getTopics(),
+        session->getSent(), session->getFiltered()};
+    }
+  }
+  portEXIT_CRITICAL(&webSocketSessionsMux);
+  for(uint8_t index = 0; index < sessionCount; index++) {
+    JsonObject &session = sessions.createNestedObject();
+    session[F("id")] = sessionStates[index].id;
+    JsonArray &topics = session.createNestedArray(F("topics"));
+    for(uint8_t topic = 0; topic < WEB_SOCKET_TOPIC_MAX; topic++) {
+      if(bitRead(sessionStates[index].topics, topic)) {
+        topics.add(webSocketTopicNames[topic]);
+      }
+    }
+    session[F("sent")] = sessionStates[index].sent;
+    session[F("filtered")] = sessionStates[index].filtered;
+  }
+  JsonArray &signals = root.createNestedArray(F("dccSignals"));
+  getDCCSignalState(signals);
+#if defined(RAILCOM_ENABLED) && RAILCOM_ENABLED
+  JsonObject &railcom = root.createNestedObject(F("railcom"));
+  RailComManager::getState(railcom);
+#endif
+#if defined(Z21_ENABLED) && Z21_ENABLED
+  JsonObject &z21 = root.createNestedObject(F("z21"));
+  Z21Server::getState(z21);
+#endif
+#if defined(MQTT_ENABLED) && MQTT_ENABLED
+  JsonObject &mqtt = root.createNestedObject(F("mqtt"));
+  MQTTInterface::getState(mqtt);
+#endif
+#if defined(LCC_ENABLED) && LCC_ENABLED
+  JsonObject &lcc = root.createNestedObject(F("lcc"));
+  LCCInterface::getState(lcc);
+#endif
+#if defined(MULTICAST_ENABLED) && MULTICAST_ENABLED
+  JsonObject &multicast = root.createNestedObject(F("multicast"));
+  MulticastBroadcaster::getState(multicast);
+#endif
+#if defined(FEDERATION_ENABLED) && FEDERATION_ENABLED
+  JsonObject &federation = root.createNestedObject(F("federation"));
+  Federation::getState(federation);
+#endif
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+  JsonObject &serial = root.createNestedObject(F("serial"));
+  SerialInterface::getState(serial);
+#endif
+#if defined(HOT_RESTART_ENABLED) && HOT_RESTART_ENABLED
+  JsonObject &hotRestart = root.createNestedObject(F("hotRestart"));
+  HotRestart::getState(hotRestart);
+#endif
+#if defined(STARTUP_SYNC_ENABLED) && STARTUP_SYNC_ENABLED
+  JsonObject &startupSync = root.createNestedObject(F("startupSync"));
+  StartupSync::getState(startupSync);
+#endif
+  jsonResponse->setCode(STATUS_OK);
+  jsonResponse->setLength();
+  request->send(jsonResponse);
+}
+
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+void DCCPPWebServer::handleFaults(AsyncWebServerRequest *request) {
+  auto jsonResponse = new AsyncJsonResponse(true);
+  JsonArray &root = jsonResponse->getRoot();
+  FaultCapture::getState(root);
+  jsonResponse->setCode(STATUS_OK);
+  jsonResponse->setLength();
+  request->send(jsonResponse);
+}
+#endif
+
 void DCCPPWebServer::handleProgrammer(AsyncWebServerRequest *request) {
  	auto jsonResponse = new AsyncJsonResponse();
 	// new programmer request
@@ -201,6 +553,20 @@ void DCCPPWebServer::handlePowerStatus(AsyncWebServerRequest *request) {
  	request->send(jsonResponse);
  }
 
+uint8_t getOutputFlags(bool inverted, bool forceState, bool defaultState) {
+  uint8_t outputFlags = 0;
+  if(inverted) {
+    bitSet(outputFlags, OUTPUT_IFLAG_INVERT);
+  }
+  if(forceState) {
+    bitSet(outputFlags, OUTPUT_IFLAG_RESTORE_STATE);
+    if(defaultState) {
+      bitSet(outputFlags, OUTPUT_IFLAG_FORCE_STATE);
+    }
+  }
+  return outputFlags;
+}
+
 void DCCPPWebServer::handleOutputs(AsyncWebServerRequest *request) {
   auto jsonResponse = new AsyncJsonResponse(true);
   if (request->method() == HTTP_GET) {
@@ -212,17 +578,16 @@ void DCCPPWebServer::handleOutputs(AsyncWebServerRequest *request) {
     bool inverted = request->arg(F("inverted")) == "true";
     bool forceState = request->arg(F("forceState")) == "true";
     bool defaultState = request->arg(F("defaultState")) == "true";
-    uint8_t outputFlags = 0;
-    if(inverted) {
-      bitSet(outputFlags, OUTPUT_IFLAG_INVERT);
-    }
-    if(forceState) {
-      bitSet(outputFlags, OUTPUT_IFLAG_RESTORE_STATE);
-      if(defaultState) {
-        bitSet(outputFlags, OUTPUT_IFLAG_FORCE_STATE);
+    OutputManager::createOrUpdate(outputID, pin, getOutputFlags(inverted, forceState, defaultState));
+    if(request->hasArg("brightness") || request->hasArg("effect")) {
+      if(!OutputManager::setPWM(outputID,
+        request->hasArg("brightness") ? request->arg(F("brightness")).toInt() : OUTPUT_PWM_MAX_DUTY,
+        request->arg(F("fadeTime")).toInt(),
+        OutputManager::getEffectByName(request->arg(F("effect"))),
+        request->hasArg("period") ? request->arg(F("period")).toInt() : 1000)) {
+        jsonResponse->setCode(STATUS_BAD_REQUEST);
       }
     }
-    OutputManager::createOrUpdate(outputID, pin, outputFlags);
   } else if(request->method() == HTTP_DELETE) {
     if(!OutputManager::remove(request->arg(F("id")).toInt())) {
       jsonResponse->setCode(STATUS_NOT_FOUND);
@@ -243,7 +608,20 @@ void DCCPPWebServer::handleTurnouts(AsyncWebServerRequest *request) {
     uint16_t turnoutID = request->arg(F("id")).toInt();
     uint16_t turnoutAddress = request->arg(F("address")).toInt();
     uint8_t turnoutSubAddress = request->arg(F("subAddress")).toInt();
-    TurnoutManager::createOrUpdate(turnoutID, turnoutAddress, turnoutSubAddress);
+    int16_t thrownSensor = request->hasArg(F("thrownSensor")) ?
+      request->arg(F("thrownSensor")).toInt() : TURNOUT_KEEP_SENSOR;
+    int16_t closedSensor = request->hasArg(F("closedSensor")) ?
+      request->arg(F("closedSensor")).toInt() : TURNOUT_KEEP_SENSOR;
+    if(request->hasArg("servoPin")) {
+      if(!TurnoutManager::createOrUpdateServo(turnoutID, request->arg(F("servoPin")).toInt(),
+        request->arg(F("thrownPulse")).toInt(), request->arg(F("closedPulse")).toInt(),
+        request->arg(F("speed")).toInt(), thrownSensor, closedSensor)) {
+        jsonResponse->setCode(STATUS_NOT_ACCEPTABLE);
+      }
+    } else {
+      TurnoutManager::createOrUpdate(turnoutID, turnoutAddress, turnoutSubAddress,
+        thrownSensor, closedSensor);
+    }
   } else if(request->method() == HTTP_DELETE) {
     uint16_t turnoutID = request->arg(F("id")).toInt();
     if(!TurnoutManager::remove(turnoutID)) {
@@ -257,6 +635,31 @@ void DCCPPWebServer::handleTurnouts(AsyncWebServerRequest *request) {
   request->send(jsonResponse);
 }
 
+void DCCPPWebServer::handleSensorEvents(AsyncWebServerRequest *request) {
+  auto jsonResponse = new AsyncJsonResponse();
+  JsonObject &root = jsonResponse->getRoot();
+  SensorEventHistory::getState(root, request->arg(F("since")).toInt());
+  jsonResponse->setLength();
+  request->send(jsonResponse);
+}
+
+void DCCPPWebServer::handleSensorBitmap(AsyncWebServerRequest *request) {
+  auto jsonResponse = new AsyncJsonResponse();
+  JsonObject &root = jsonResponse->getRoot();
+  uint16_t first = request->arg(F("first")).toInt();
+  uint16_t count = SensorManager::getMaxSensorID() >= first ?
+    SensorManager::getMaxSensorID() - first + 1 : 0;
+  if(request->hasArg(F("count"))) {
+    count = request->arg(F("count")).toInt();
+  }
+  count = std::min(count, (uint16_t)SENSOR_BITMAP_MAX_IDS);
+  root[F("first")] = first;
+  root[F("count")] = count;
+  root[F("bitmap")] = SensorManager::getStateBitmapBase64(first, count);
+  jsonResponse->setLength();
+  request->send(jsonResponse);
+}
+
 void DCCPPWebServer::handleSensors(AsyncWebServerRequest *request) {
   auto jsonResponse = new AsyncJsonResponse(true);
   if (request->method() == HTTP_GET) {
@@ -264,17 +667,18 @@ void DCCPPWebServer::handleSensors(AsyncWebServerRequest *request) {
     SensorManager::getState(array);
   } else if(request->method() == HTTP_POST) {
     uint16_t sensorID = request->arg(F("id")).toInt();
-    uint8_t sensorPin = request->arg(F("pin")).toInt();
+    int32_t sensorPin = request->arg(F("pin")).toInt();
     bool sensorPullUp = request->arg(F("pullUp")) == "true";
-    if(sensorPin <= 0) {
+    if(sensorPin <= 0 || sensorPin > INT8_MAX) {
       jsonResponse->setCode(STATUS_NOT_ACCEPTABLE);
     } else {
       SensorManager::createOrUpdate(sensorID, sensorPin, sensorPullUp);
     }
   } else if(request->method() == HTTP_DELETE) {
     uint16_t sensorID = request->arg(F("id")).toInt();
-    if(SensorManager::getSensorPin(sensorID) < 0) {
-      // attempt to delete S88
+    const int8_t sensorPin = SensorManager::getSensorPin(sensorID);
+    if(sensorPin != SENSOR_NOT_FOUND_PIN && sensorPin < 0) {
+      // attempt to delete S88 or federation sensor
       jsonResponse->setCode(STATUS_NOT_ALLOWED);
     } else if(!SensorManager::remove(sensorID)) {
       jsonResponse->setCode(STATUS_NOT_FOUND);
@@ -285,7 +689,8 @@ void DCCPPWebServer::handleSensors(AsyncWebServerRequest *request) {
 }
 
 void DCCPPWebServer::handleConfig(AsyncWebServerRequest *request) {
-  std::vector<String> arguments;
+  ScratchArenaScope scratchScope;
+  DCCPPProtocolArguments arguments;
   if(request->method() == HTTP_POST) {
     DCCPPProtocolHandler::getCommandHandler("E")->process(arguments);
   } else {
@@ -315,3 +720,106 @@ void DCCPPWebServer::handleS88Sensors(AsyncWebServerRequest *request) {
   request->send(jsonResponse);
 }
 #endif
+
+// executes a single /batch operation and returns the HTTP status code for it.
+uint16_t processBatchOperation(JsonObject &operation) {
+  const String type = operation[F("type")] | "";
+  const String action = operation[F("action")] | "";
+  const uint16_t id = operation[F("id")];
+  const bool create = action == "create" || action == "update";
+  if(type == "turnout") {
+    if(create && operation.containsKey(F("servoPin"))) {
+      return TurnoutManager::createOrUpdateServo(id, operation[F("servoPin")],
+        operation[F("thrownPulse")].as<int32_t>(), operation[F("closedPulse")].as<int32_t>(),
+        operation[F("speed")] | 0,
+        operation[F("thrownSensor")] | TURNOUT_KEEP_SENSOR,
+        operation[F("closedSensor")] | TURNOUT_KEEP_SENSOR) ? STATUS_OK : STATUS_NOT_ACCEPTABLE;
+    } else if(create) {
+      TurnoutManager::createOrUpdate(id, operation[F("address")], operation[F("subAddress")],
+        operation[F("thrownSensor")] | TURNOUT_KEEP_SENSOR,
+        operation[F("closedSensor")] | TURNOUT_KEEP_SENSOR);
+      return STATUS_OK;
+    } else if(action == "delete") {
+      return TurnoutManager::remove(id) ? STATUS_OK : STATUS_NOT_FOUND;
+    } else if(action == "toggle") {
+      return TurnoutManager::toggle(id) ? STATUS_OK : STATUS_NOT_FOUND;
+    } else if(action == "set") {
+      return TurnoutManager::set(id, operation[F("thrown")]) ? STATUS_OK : STATUS_NOT_FOUND;
+    }
+  } else if(type == "output") {
+    if(create) {
+      OutputManager::createOrUpdate(id, operation[F("pin")],
+        getOutputFlags(operation[F("inverted")], operation[F("forceState")],
+          operation[F("defaultState")]));
+      if(operation.containsKey(F("brightness")) || operation.containsKey(F("effect"))) {
+        if(!OutputManager::setPWM(id, operation[F("brightness")] | OUTPUT_PWM_MAX_DUTY,
+          operation[F("fadeTime")] | 0,
+          OutputManager::getEffectByName(operation[F("effect")] | "none"),
+          operation[F("period")] | 1000)) {
+          return STATUS_BAD_REQUEST;
+        }
+      }
+      return STATUS_OK;
+    } else if(action == "delete") {
+      return OutputManager::remove(id) ? STATUS_OK : STATUS_NOT_FOUND;
+    } else if(action == "toggle") {
+      return OutputManager::toggle(id) ? STATUS_OK : STATUS_NOT_FOUND;
+    } else if(action == "set") {
+      return OutputManager::set(id, operation[F("active")]) ? STATUS_OK : STATUS_NOT_FOUND;
+    }
+  } else if(type == "sensor") {
+    if(create) {
+      const int32_t pin = operation[F("pin")] | -1;
+      if(pin <= 0 || pin > INT8_MAX) {
+        return STATUS_NOT_ACCEPTABLE;
+      }
+      SensorManager::createOrUpdate(id, pin, operation[F("pullUp")]);
+      return STATUS_OK;
+    } else if(action == "delete") {
+      const int8_t pin = SensorManager::getSensorPin(id);
+      if(pin != SENSOR_NOT_FOUND_PIN && pin < 0) {
+        // attempt to delete S88 or federation sensor
+        return STATUS_NOT_ALLOWED;
+      }
+      return SensorManager::remove(id) ? STATUS_OK : STATUS_NOT_FOUND;
+    }
+#if defined(S88_ENABLED) && S88_ENABLED
+  } else if(type == "s88") {
+    if(create) {
+      // duplicate pin/id
+      return S88BusManager::createOrUpdateBus(id, operation[F("dataPin")],
+        operation[F("sensorCount")]) ? STATUS_OK : STATUS_NOT_ALLOWED;
+    } else if(action == "delete") {
+      return S88BusManager::removeBus(id) ? STATUS_OK : STATUS_NOT_FOUND;
+    }
+#endif
+  }
+  return STATUS_BAD_REQUEST;
+}
+
+// executes a JSON array of operations in a single request, each operation is
+// an object with "type" (turnout, output, sensor, s88), "action" (create,
+// update, delete, toggle, set), "id" and the same fields as the individual
+// endpoints. The response is an array with the status code of each operation.
+void DCCPPWebServer::handleBatch(AsyncWebServerRequest *request) {
+  auto jsonResponse = new AsyncJsonResponse(true);
+  if(request->contentLength() > WEB_BATCH_MAX_BODY) {
+    jsonResponse->setCode(STATUS_PAYLOAD_TOO_LARGE);
+  } else if(request->_tempObject == NULL) {
+    jsonResponse->setCode(STATUS_BAD_REQUEST);
+  } else {
+    DynamicJsonBuffer jsonBuffer;
+    JsonArray &operations = jsonBuffer.parseArray((char *)request->_tempObject);
+    if(!operations.success()) {
+      jsonResponse->setCode(STATUS_BAD_REQUEST);
+    } else {
+      JsonArray &results = jsonResponse->getRoot();
+      for(size_t index = 0; index < operations.size(); index++) {
+        results.add(processBatchOperation(operations.get<JsonObject>(index)));
+      }
+      jsonResponse->setCode(STATUS_OK);
+    }
+  }
+  jsonResponse->setLength();
+  request->send(jsonResponse);
+}
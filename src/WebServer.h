@@ -19,6 +19,24 @@ COPYRIGHT (c) 2017 Mike Dunston
 
 #include "InfoScreen.h"
 
+// maximum size (in bytes) of a /batch request body
+#define WEB_BATCH_MAX_BODY 16384
+
+// maximum number of connected WebSocket clients
+#define WEB_SOCKET_MAX_SESSIONS 8
+
+// topics a WebSocket client can subscribe to with <subscribe TOPIC ...>, the
+// responses that do not belong to a topic are sent to all clients.
+enum WEB_SOCKET_TOPIC {
+  WEB_SOCKET_TOPIC_THROTTLE = 0,
+  WEB_SOCKET_TOPIC_SENSORS,
+  WEB_SOCKET_TOPIC_POWER,
+  WEB_SOCKET_TOPIC_PROGRAMMER,
+  WEB_SOCKET_TOPIC_ACCESSORIES,
+  WEB_SOCKET_TOPIC_MAX
+};
+#define WEB_SOCKET_TOPICS_ALL ((1 << WEB_SOCKET_TOPIC_MAX) - 1)
+
 class DCCPPWebServer : public AsyncWebServer {
 public:
   DCCPPWebServer();
@@ -29,18 +47,23 @@ public:
       InfoScreen::replaceLine(INFO_SCREEN_WS_CLIENTS_LINE, F("WS Clients: 0"));
     #endif
   }
-  void broadcastToWS(const char *buf) {
-    webSocket.textAll(buf);
-  }
+  void broadcastToWS(const char *);
 private:
   AsyncWebSocket webSocket;
   void handleESPInfo(AsyncWebServerRequest *);
+  void handleWebSocketEvent(AsyncWebSocketClient *, AwsEventType, uint8_t *, size_t);
   void handleProgrammer(AsyncWebServerRequest *);
   void handlePowerStatus(AsyncWebServerRequest *);
   void handleOutputs(AsyncWebServerRequest *);
   void handleTurnouts(AsyncWebServerRequest *);
   void handleSensors(AsyncWebServerRequest *);
+  void handleSensorEvents(AsyncWebServerRequest *);
+  void handleSensorBitmap(AsyncWebServerRequest *);
   void handleConfig(AsyncWebServerRequest *);
+  void handleBatch(AsyncWebServerRequest *);
+#if defined(FAULT_CAPTURE_ENABLED) && FAULT_CAPTURE_ENABLED
+  void handleFaults(AsyncWebServerRequest *);
+#endif
 #if defined(S88_ENABLED) && S88_ENABLED
   void handleS88Sensors(AsyncWebServerRequest *);
 #endif
@@ -22,6 +22,9 @@ COPYRIGHT (c) 2017 Mike Dunston
 #include <ESPAsyncWebServer.h>
 #include <IPAddress.h>
 #include "WebServer.h"
+#include "StallWatchdog.h"
+#include "SerialInterface.h"
+#include "CommandQueue.h"
 
 DCCPPWebServer dccppWebServer;
 
@@ -31,6 +34,9 @@ const String wifiPassword = WIFI_PASSWORD;
 WiFiServer DCCppServer(DCCPP_CLIENT_PORT);
 WiFiClient DCCppClients[MAX_DCCPP_CLIENTS];
 std::vector<uint8_t> DCCppClientBuffer[MAX_DCCPP_CLIENTS];
+// command queue of each client, a new client is given its own queue when it
+// connects (zero is the shared queue).
+int8_t DCCppClientQueue[MAX_DCCPP_CLIENTS];
 
 WiFiInterface::WiFiInterface() {
 }
@@ -85,6 +91,9 @@ void WiFiInterface::update() {
 					DCCppClients[i].stop();
 				}
 				DCCppClients[i] = DCCppServer.available();
+				DCCppClientBuffer[i].clear();
+				CommandQueue::releaseClient(DCCppClientQueue[i]);
+				DCCppClientQueue[i] = CommandQueue::registerClient("tcp", i);
 				continue;
 			}
 		}
@@ -93,40 +102,62 @@ void WiFiInterface::update() {
 	//check clients for data
 	for (int i = 0; i < MAX_DCCPP_CLIENTS; i++) {
 		if (DCCppClients[i] && DCCppClients[i].connected()) {
-			if (DCCppClients[i].available()) {
-        auto len = DCCppClients[i].available();
+			// anything that does not fit in the buffer is left with the TCP stack
+			int len = std::min(DCCppClients[i].available(),
+				(int)(DCCPP_CLIENT_MAX_BUFFER - DCCppClientBuffer[i].size()));
+			if (len > 0) {
 				auto read_dest = DCCppClientBuffer[i].insert(DCCppClientBuffer[i].end(), len + 1, 0);
 				auto added = DCCppClients[i].read(&*read_dest, len);
 				DCCppClientBuffer[i].erase(read_dest + added, DCCppClientBuffer[i].end());
-				auto s = DCCppClientBuffer[i].begin();
-				auto consumed = DCCppClientBuffer[i].begin();
-				for(; s != DCCppClientBuffer[i].end();) {
-					s = std::find(s, DCCppClientBuffer[i].end(), '<');
-					auto e = std::find(s, DCCppClientBuffer[i].end(), '>');
-					if(s != DCCppClientBuffer[i].end() && e != DCCppClientBuffer[i].end()) {
-            // discard the <
-            s++;
-            // discard the >
-						*e = 0;
-						String str(reinterpret_cast<char*>(&*s));
-            printf(F("<%s>"), str.c_str());
-            log_d("Command: <%s>", str.c_str());
-            DCCPPProtocolHandler::process(std::move(str));
-						consumed = e;
-					}
-					s = e;
-				}
-				DCCppClientBuffer[i].erase(DCCppClientBuffer[i].begin(), consumed); // drop everything we used from the buffer.
+			}
+			if (!DCCppClientBuffer[i].empty() &&
+				!processFrames(DCCppClientBuffer[i], DCCppClientQueue[i]) &&
+				DCCppClientBuffer[i].size() >= DCCPP_CLIENT_MAX_BUFFER) {
+				// no complete command in the buffer, this is noise or a runaway frame
+				DCCppClientBuffer[i].clear();
 			}
 		}
 	}
 }
 
+// queues all complete <COMMAND> frames in the buffer for the client, anything
+// after the last complete frame is kept for the next call. When the client's
+// queue is full the remaining frames are also kept and true is returned, the
+// caller should stop reading from the client until they have been queued.
+// This is shared by all stream based command interfaces.
+bool WiFiInterface::processFrames(std::vector<uint8_t> &buffer, int8_t queue) {
+	bool full = false;
+	auto s = buffer.begin();
+	auto consumed = buffer.begin();
+	for(; s != buffer.end() && !full;) {
+		s = std::find(s, buffer.end(), '<');
+		auto e = std::find(s, buffer.end(), '>');
+		if(s != buffer.end() && e != buffer.end()) {
+      // discard the <
+      s++;
+      // discard the >
+			*e = 0;
+			const char *command = reinterpret_cast<char*>(&*s);
+			if(CommandQueue::enqueue(queue, command, false) == COMMAND_QUEUE_FULL) {
+				// restore the frame so it is offered again on the next call
+				*e = '>';
+				full = true;
+				continue;
+			}
+			consumed = e;
+		}
+		s = e;
+	}
+	buffer.erase(buffer.begin(), consumed); // drop everything we used from the buffer.
+	return full;
+}
+
 void WiFiInterface::showInitInfo() {
 	printf(F("<N1: %s>"), WiFi.localIP().toString().c_str());
 }
 
 void WiFiInterface::send(const char *buf) {
+  StallWatchdogScope watchdogScope("WiFiSend");
   for (int i = 0; i < MAX_DCCPP_CLIENTS; i++) {
     if (DCCppClients[i] && DCCppClients[i].connected()) {
       DCCppClients[i].print(buf);
@@ -134,6 +165,9 @@ void WiFiInterface::send(const char *buf) {
     }
   }
   dccppWebServer.broadcastToWS(buf);
+#if defined(SERIAL_INTERFACE_ENABLED) && SERIAL_INTERFACE_ENABLED
+  SerialInterface::send(buf);
+#endif
 }
 
 void WiFiInterface::printf(const __FlashStringHelper *fmt, ...) {
@@ -19,6 +19,7 @@ COPYRIGHT (c) 2017 Mike Dunston
 #define _WIFI_INTERFACE_H_
 
 #include <ESPAsyncWebServer.h>
+#include <vector>
 
 class WiFiInterface {
 public:
@@ -29,6 +30,7 @@ public:
 	void showInitInfo();
 	void send(const char *buf);
 	void printf(const __FlashStringHelper *fmt, ...);
+	bool processFrames(std::vector<uint8_t> &, int8_t);
 };
 
 #endif
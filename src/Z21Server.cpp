@@ -0,0 +1,662 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DCCppESP32.h"
+#include <WiFiUdp.h>
+
+#include "Z21Server.h"
+#include "StateObserver.h"
+#include "MotorBoard.h"
+#include "Locomotive.h"
+#include "Turnouts.h"
+#include "Sensors.h"
+
+/**********************************************************************
+
+DCC++ESP32 BASE STATION can act as a Roco Z21 command station for throttle
+apps that speak the Z21 LAN protocol over UDP (port 21105). The following
+Z21 requests are supported:
+
+  LAN_GET_SERIAL_NUMBER, LAN_GET_CODE, LAN_GET_HWINFO, LAN_LOGOFF
+  LAN_SET_BROADCASTFLAGS, LAN_GET_BROADCASTFLAGS
+  LAN_SYSTEMSTATE_GETDATA, LAN_RMBUS_GETDATA
+  LAN_X_GET_VERSION, LAN_X_GET_FIRMWARE_VERSION, LAN_X_GET_STATUS
+  LAN_X_SET_TRACK_POWER_ON, LAN_X_SET_TRACK_POWER_OFF, LAN_X_SET_STOP
+  LAN_X_GET_LOCO_INFO, LAN_X_SET_LOCO_DRIVE, LAN_X_SET_LOCO_FUNCTION
+  LAN_X_GET_TURNOUT_INFO, LAN_X_SET_TURNOUT
+
+Locomotives are mapped onto the locomotive registers by address, a register
+is allocated the first time a Z21 client drives a locomotive. Z21 turnout
+addresses are mapped onto DCC accessory ADDRESS/SUBADDRESS pairs, if a turnout
+has been defined for that address its state is tracked as with <T ID THROW>.
+
+Sensors are reported as R-Bus feedback (sensor IDs starting at
+Z21_RBUS_FIRST_SENSOR, 160 inputs in two groups of 80) and as LocoNet
+occupancy detector events using the sensor ID as the feedback address.
+
+Clients only receive unsolicited state changes for the broadcast flags they
+have set via LAN_SET_BROADCASTFLAGS, clients that have been silent for more
+than Z21_CLIENT_TIMEOUT ms are dropped as per the Z21 specification. State
+changes made by other tasks (the web server for example) are queued and
+broadcast from the Z21 server task.
+
+**********************************************************************/
+
+#if defined(Z21_ENABLED) && Z21_ENABLED
+
+#ifndef Z21_RBUS_FIRST_SENSOR
+#define Z21_RBUS_FIRST_SENSOR 0
+#endif
+
+// number of R-Bus feedback inputs reported per group
+#define Z21_RBUS_INPUTS_PER_GROUP 80
+
+// Z21 LAN headers
+#define LAN_GET_SERIAL_NUMBER 0x10
+#define LAN_GET_CODE 0x18
+#define LAN_GET_HWINFO 0x1A
+#define LAN_LOGOFF 0x30
+#define LAN_X 0x40
+#define LAN_SET_BROADCASTFLAGS 0x50
+#define LAN_GET_BROADCASTFLAGS 0x51
+#define LAN_RMBUS_DATACHANGED 0x80
+#define LAN_RMBUS_GETDATA 0x81
+#define LAN_SYSTEMSTATE_DATACHANGED 0x84
+#define LAN_SYSTEMSTATE_GETDATA 0x85
+#define LAN_LOCONET_DETECTOR 0xA4
+
+// maximum number of state changes waiting to be broadcast
+#define Z21_MAX_PENDING 32
+
+// pending state change types
+#define Z21_PENDING_SENSOR 0
+#define Z21_PENDING_TURNOUT 1
+#define Z21_PENDING_POWER 2
+#define Z21_PENDING_LOCO 3
+
+// Z21 central state bits
+#define Z21_CENTRAL_STATE_EMERGENCY_STOP 0x01
+#define Z21_CENTRAL_STATE_TRACK_VOLTAGE_OFF 0x02
+#define Z21_CENTRAL_STATE_SHORT_CIRCUIT 0x04
+
+extern LinkedList<Sensor *> sensors;
+
+WiFiUDP z21Socket;
+Z21Client z21Clients[Z21_MAX_CLIENTS];
+bool z21EmergencyStop = false;
+uint32_t z21PacketsReceived = 0;
+uint32_t z21PacketsSent = 0;
+uint32_t z21PendingOverflows = 0;
+
+struct Z21PendingChange {
+  uint8_t type;
+  uint16_t id;
+  bool state;
+};
+
+// state changes waiting to be broadcast by update, these are added by the
+// observer which can be called from any task.
+Z21PendingChange z21Pending[Z21_MAX_PENDING];
+uint8_t z21PendingCount = 0;
+portMUX_TYPE z21PendingMux = portMUX_INITIALIZER_UNLOCKED;
+
+void z21Send(const IPAddress &address, uint16_t port, uint16_t header, const uint8_t *data, uint8_t length) {
+  uint8_t packet[Z21_MAX_DATAGRAM];
+  uint16_t packetLength = length + 4;
+  packet[0] = lowByte(packetLength);
+  packet[1] = highByte(packetLength);
+  packet[2] = lowByte(header);
+  packet[3] = highByte(header);
+  memcpy(&packet[4], data, length);
+  z21Socket.beginPacket(address, port);
+  z21Socket.write(packet, packetLength);
+  z21Socket.endPacket();
+  z21PacketsSent++;
+}
+
+// sends a LAN_X packet, the XOR checksum is appended to the provided data
+void z21SendX(const IPAddress &address, uint16_t port, uint8_t *data, uint8_t length) {
+  uint8_t checksum = 0;
+  for(uint8_t index = 0; index < length; index++) {
+    checksum ^= data[index];
+  }
+  data[length] = checksum;
+  z21Send(address, port, LAN_X, data, length + 1);
+}
+
+void z21SendX(Z21Client &client, uint8_t *data, uint8_t length) {
+  z21SendX(client.address, client.port, data, length);
+}
+
+// sends the packet to every client that has one of the broadcast flags set
+void z21Broadcast(uint32_t flags, uint16_t header, const uint8_t *data, uint8_t length) {
+  for(uint8_t index = 0; index < Z21_MAX_CLIENTS; index++) {
+    if(z21Clients[index].port && (z21Clients[index].broadcastFlags & flags)) {
+      z21Send(z21Clients[index].address, z21Clients[index].port, header, data, length);
+    }
+  }
+}
+
+void z21BroadcastX(uint32_t flags, uint8_t *data, uint8_t length) {
+  uint8_t checksum = 0;
+  for(uint8_t index = 0; index < length; index++) {
+    checksum ^= data[index];
+  }
+  data[length] = checksum;
+  z21Broadcast(flags, LAN_X, data, length + 1);
+}
+
+Z21Client *z21FindClient(const IPAddress &address, uint16_t port, bool create) {
+  Z21Client *freeSlot = NULL;
+  for(uint8_t index = 0; index < Z21_MAX_CLIENTS; index++) {
+    Z21Client &client = z21Clients[index];
+    if(client.port == port && client.address == address) {
+      return &client;
+    } else if(client.port == 0 && freeSlot == NULL) {
+      freeSlot = &client;
+    }
+  }
+  if(create && freeSlot != NULL) {
+    log_i("[Z21] Client %s:%d connected", address.toString().c_str(), port);
+    freeSlot->address = address;
+    freeSlot->port = port;
+    freeSlot->broadcastFlags = 0;
+    freeSlot->locoCount = 0;
+  }
+  return create ? freeSlot : NULL;
+}
+
+void z21SubscribeLoco(Z21Client &client, uint16_t locoNumber) {
+  for(uint8_t index = 0; index < client.locoCount; index++) {
+    if(client.locos[index] == locoNumber) {
+      return;
+    }
+  }
+  // the oldest subscription is dropped when the client is subscribed to the
+  // maximum number of locomotives.
+  if(client.locoCount == Z21_MAX_LOCO_SUBSCRIPTIONS) {
+    memmove(&client.locos[0], &client.locos[1], sizeof(uint16_t) * (Z21_MAX_LOCO_SUBSCRIPTIONS - 1));
+    client.locoCount--;
+  }
+  client.locos[client.locoCount++] = locoNumber;
+}
+
+bool z21IsSubscribed(Z21Client &client, uint16_t locoNumber) {
+  if(client.broadcastFlags & Z21_BCFLAG_ALL_LOCOS) {
+    return true;
+  }
+  if(client.broadcastFlags & Z21_BCFLAG_DRIVING_SWITCHING) {
+    for(uint8_t index = 0; index < client.locoCount; index++) {
+      if(client.locos[index] == locoNumber) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool z21IsTrackPowerOn() {
+  GenericMotorBoard *mainBoard = MotorBoardManager::getBoardByName(MOTORBOARD_NAME_MAIN);
+  return mainBoard != NULL && mainBoard->isOn();
+}
+
+uint8_t z21GetCentralState() {
+  GenericMotorBoard *mainBoard = MotorBoardManager::getBoardByName(MOTORBOARD_NAME_MAIN);
+  uint8_t state = 0;
+  if(z21EmergencyStop) {
+    state |= Z21_CENTRAL_STATE_EMERGENCY_STOP;
+  }
+  if(mainBoard == NULL || !mainBoard->isOn()) {
+    state |= Z21_CENTRAL_STATE_TRACK_VOLTAGE_OFF;
+  }
+  if(mainBoard != NULL && mainBoard->isOverCurrent()) {
+    state |= Z21_CENTRAL_STATE_SHORT_CIRCUIT;
+  }
+  return state;
+}
+
+// builds the LAN_X_LOCO_INFO payload (without checksum) for a locomotive
+uint8_t z21BuildLocoInfo(uint16_t locoNumber, uint8_t *data) {
+  Locomotive *loco = LocomotiveManager::getLocomotive(locoNumber, false);
+  int8_t speed = loco != NULL ? loco->getSpeed() : 0;
+  uint32_t functions = loco != NULL ? loco->getFunctions() : 0;
+  data[0] = 0xEF;
+  data[1] = highByte(locoNumber) | (locoNumber > 127 ? 0xC0 : 0x00);
+  data[2] = lowByte(locoNumber);
+  // 128 speed steps
+  data[3] = 0x04;
+  data[4] = (loco != NULL && loco->isDirectionForward()) ? 0x80 : 0x00;
+  if(speed < 0) {
+    data[4] |= 0x01;
+  } else if(speed > 0) {
+    data[4] |= (speed + 1) & 0x7F;
+  }
+  data[5] = (bitRead(functions, 0) << 4) | ((functions >> 1) & 0x0F);
+  data[6] = (functions >> 5) & 0xFF;
+  data[7] = (functions >> 13) & 0xFF;
+  data[8] = (functions >> 21) & 0xFF;
+  return 9;
+}
+
+void z21SendLocoInfo(Z21Client &client, uint16_t locoNumber) {
+  uint8_t data[16];
+  z21SendX(client, data, z21BuildLocoInfo(locoNumber, data));
+}
+
+// builds the LAN_RMBUS_DATACHANGED payload for one group of 80 inputs
+void z21BuildRBusGroup(uint8_t group, uint8_t *data) {
+  memset(data, 0, 11);
+  data[0] = group;
+  const int32_t firstInput = Z21_RBUS_FIRST_SENSOR + (group * Z21_RBUS_INPUTS_PER_GROUP);
+  for (const auto& sensor : sensors) {
+    int32_t input = sensor->getID() - firstInput;
+    if(input >= 0 && input < Z21_RBUS_INPUTS_PER_GROUP && sensor->isActive()) {
+      bitSet(data[1 + (input / 8)], input % 8);
+    }
+  }
+}
+
+void z21SendSystemState(const IPAddress &address, uint16_t port, bool broadcast) {
+  uint8_t data[16] = {0};
+  GenericMotorBoard *mainBoard = MotorBoardManager::getBoardByName(MOTORBOARD_NAME_MAIN);
+  GenericMotorBoard *progBoard = MotorBoardManager::getBoardByName(MOTORBOARD_NAME_PROG);
+  int16_t mainCurrent = mainBoard != NULL ? mainBoard->getCurrentDraw() : 0;
+  int16_t progCurrent = progBoard != NULL ? progBoard->getCurrentDraw() : 0;
+  data[0] = lowByte(mainCurrent);
+  data[1] = highByte(mainCurrent);
+  data[2] = lowByte(progCurrent);
+  data[3] = highByte(progCurrent);
+  data[4] = lowByte(mainCurrent);
+  data[5] = highByte(mainCurrent);
+  // temperature, supply and VCC voltage are not measured and are left as zero
+  data[12] = z21GetCentralState();
+  if(broadcast) {
+    z21Broadcast(Z21_BCFLAG_SYSTEM_STATE, LAN_SYSTEMSTATE_DATACHANGED, data, sizeof(data));
+  } else {
+    z21Send(address, port, LAN_SYSTEMSTATE_DATACHANGED, data, sizeof(data));
+  }
+}
+
+void z21SendTrackPowerState(uint32_t flags, Z21Client *client, bool overCurrent) {
+  uint8_t data[3] = {0x61, 0x00, 0x00};
+  if(overCurrent) {
+    data[1] = 0x08;
+  } else if(z21IsTrackPowerOn()) {
+    data[1] = 0x01;
+  }
+  if(client != NULL) {
+    z21SendX(*client, data, 2);
+  } else {
+    z21BroadcastX(flags, data, 2);
+  }
+}
+
+// converts a Z21 speed byte (RVVVVVVV) to a DCC++ 128 step speed
+int8_t z21DecodeSpeed(uint8_t speedSteps, uint8_t speedByte) {
+  uint8_t speed = speedByte & 0x7F;
+  if(speedSteps == 0x13) {
+    // 128 speed steps: 0 = stop, 1 = emergency stop, 2-127 = speed 1-126
+    return speed == 1 ? -1 : (speed > 1 ? speed - 1 : 0);
+  } else if(speedSteps == 0x12) {
+    // 28 speed steps: 0 = stop, 1 = emergency stop, 4-31 = speed 1-28,
+    // bit 4 is the intermediate step.
+    speed = ((speed & 0x0F) << 1) | ((speed >> 4) & 0x01);
+    if(speed == 2 || speed == 3) {
+      return -1;
+    }
+    return speed > 3 ? ((speed - 3) * 126) / 28 : 0;
+  }
+  // 14 speed steps: 0 = stop, 1 = emergency stop, 2-15 = speed 1-14
+  speed &= 0x0F;
+  return speed == 1 ? -1 : (speed > 1 ? ((speed - 1) * 126) / 14 : 0);
+}
+
+void z21HandleX(Z21Client &client, uint8_t *data, uint8_t length) {
+  if(length < 2) {
+    log_w("[Z21] Dropping LAN_X packet without checksum");
+    return;
+  }
+  uint8_t checksum = 0;
+  for(uint8_t index = 0; index < length - 1; index++) {
+    checksum ^= data[index];
+  }
+  if(checksum != data[length - 1]) {
+    log_w("[Z21] Dropping LAN_X packet with invalid checksum");
+    return;
+  }
+  uint8_t reply[16];
+  switch(data[0]) {
+    case 0x21:
+      if(data[1] == 0x21) {
+        // LAN_X_GET_VERSION: X-Bus V3.0, command station ID 0x12 (Z21)
+        reply[0] = 0x63;
+        reply[1] = 0x21;
+        reply[2] = 0x30;
+        reply[3] = 0x12;
+        z21SendX(client, reply, 4);
+      } else if(data[1] == 0x24) {
+        // LAN_X_GET_STATUS
+        reply[0] = 0x62;
+        reply[1] = 0x22;
+        reply[2] = z21GetCentralState();
+        z21SendX(client, reply, 3);
+      } else if(data[1] == 0x80) {
+        // LAN_X_SET_TRACK_POWER_OFF, the broadcast is sent by the observer
+        MotorBoardManager::powerOffAll();
+      } else if(data[1] == 0x81) {
+        // LAN_X_SET_TRACK_POWER_ON
+        z21EmergencyStop = false;
+        MotorBoardManager::powerOnAll();
+      }
+      return;
+    case 0x80:
+      // LAN_X_SET_STOP
+      z21EmergencyStop = true;
+      LocomotiveManager::emergencyStop();
+      reply[0] = 0x81;
+      reply[1] = 0x00;
+      z21BroadcastX(Z21_BCFLAG_DRIVING_SWITCHING, reply, 2);
+      return;
+    case 0xF1:
+      if(data[1] == 0x0A) {
+        // LAN_X_GET_FIRMWARE_VERSION, BCD encoded
+        reply[0] = 0xF3;
+        reply[1] = 0x0A;
+        reply[2] = 0x01;
+        reply[3] = 0x20;
+        z21SendX(client, reply, 4);
+        return;
+      }
+      break;
+    case 0xE3:
+      if(data[1] == 0xF0 && length >= 5) {
+        // LAN_X_GET_LOCO_INFO
+        uint16_t locoNumber = ((data[2] & 0x3F) << 8) | data[3];
+        z21SubscribeLoco(client, locoNumber);
+        z21SendLocoInfo(client, locoNumber);
+        return;
+      }
+      break;
+    case 0xE4:
+      if(length >= 6) {
+        uint16_t locoNumber = ((data[2] & 0x3F) << 8) | data[3];
+        z21SubscribeLoco(client, locoNumber);
+        Locomotive *loco = LocomotiveManager::getLocomotive(locoNumber);
+        if(data[1] == 0xF8) {
+          // LAN_X_SET_LOCO_FUNCTION: TTNNNNNN, TT: 0=off, 1=on, 2=toggle
+          uint8_t function = data[4] & 0x3F;
+          uint8_t action = data[4] >> 6;
+          loco->setFunction(function, action == 2 ? !loco->isFunctionEnabled(function) : action == 1);
+        } else if((data[1] & 0xF0) == 0x10) {
+          // LAN_X_SET_LOCO_DRIVE
+          loco->setSpeed(z21DecodeSpeed(data[1], data[4]));
+          loco->setDirection(data[4] & 0x80);
+          loco->sendLocoUpdate();
+          loco->showStatus();
+          StateObservers::locomotiveChanged(loco);
+        }
+        return;
+      }
+      break;
+    case 0x43:
+      if(length >= 4) {
+        // LAN_X_GET_TURNOUT_INFO
+        uint16_t turnoutAddress = (data[1] << 8) | data[2];
+        Turnout *turnout = TurnoutManager::getTurnoutByAddress((turnoutAddress / 4) + 1, turnoutAddress % 4);
+        reply[0] = 0x43;
+        reply[1] = data[1];
+        reply[2] = data[2];
+        // position 0 (unknown) is reported until the feedback confirms it
+        reply[3] = turnout == NULL || turnout->isPositionFailed() ? 0x00 : (turnout->isThrown() ? 0x02 : 0x01);
+        z21SendX(client, reply, 4);
+        return;
+      }
+      break;
+    case 0x53:
+      if(length >= 5) {
+        // LAN_X_SET_TURNOUT: 10Q0A00P, only activation requests are used
+        uint16_t turnoutAddress = (data[1] << 8) | data[2];
+        bool activate = data[3] & 0x08;
+        bool thrown = data[3] & 0x01;
+        if(activate) {
+          uint16_t address = (turnoutAddress / 4) + 1;
+          uint8_t subAddress = turnoutAddress % 4;
+          Turnout *turnout = TurnoutManager::getTurnoutByAddress(address, subAddress);
+          if(turnout != NULL) {
+            turnout->set(thrown);
+          } else {
+            AccessoryCommand::sendPacket(address, subAddress, thrown);
+            reply[0] = 0x43;
+            reply[1] = data[1];
+            reply[2] = data[2];
+            reply[3] = thrown ? 0x02 : 0x01;
+            z21BroadcastX(Z21_BCFLAG_DRIVING_SWITCHING, reply, 4);
+          }
+        }
+        return;
+      }
+      break;
+  }
+  // LAN_X_UNKNOWN_COMMAND
+  reply[0] = 0x61;
+  reply[1] = 0x82;
+  z21SendX(client, reply, 2);
+}
+
+void z21HandlePacket(const IPAddress &address, uint16_t port, uint16_t header, uint8_t *data, uint8_t length) {
+  if(header == LAN_LOGOFF) {
+    Z21Client *client = z21FindClient(address, port, false);
+    if(client != NULL) {
+      log_i("[Z21] Client %s:%d logged off", address.toString().c_str(), port);
+      client->port = 0;
+    }
+    return;
+  }
+  Z21Client *client = z21FindClient(address, port, true);
+  if(client == NULL) {
+    log_w("[Z21] Rejecting client %s:%d, too many clients", address.toString().c_str(), port);
+    return;
+  }
+  client->lastSeen = millis();
+  uint8_t reply[16] = {0};
+  switch(header) {
+    case LAN_GET_SERIAL_NUMBER:
+      {
+        uint32_t serial = (uint32_t)ESP.getEfuseMac();
+        memcpy(reply, &serial, sizeof(serial));
+        z21Send(address, port, LAN_GET_SERIAL_NUMBER, reply, 4);
+      }
+      break;
+    case LAN_GET_CODE:
+      // 0x00: no feature restrictions
+      z21Send(address, port, LAN_GET_CODE, reply, 1);
+      break;
+    case LAN_GET_HWINFO:
+      // hardware type 0x00000201 (Z21 2013), firmware 1.20 (BCD)
+      reply[0] = 0x01;
+      reply[1] = 0x02;
+      reply[4] = 0x20;
+      reply[5] = 0x01;
+      z21Send(address, port, LAN_GET_HWINFO, reply, 8);
+      break;
+    case LAN_SET_BROADCASTFLAGS:
+      if(length >= 4) {
+        memcpy(&client->broadcastFlags, data, sizeof(uint32_t));
+        log_i("[Z21] Client %s:%d broadcast flags %08x", address.toString().c_str(), port, client->broadcastFlags);
+      }
+      break;
+    case LAN_GET_BROADCASTFLAGS:
+      memcpy(reply, &client->broadcastFlags, sizeof(uint32_t));
+      z21Send(address, port, LAN_GET_BROADCASTFLAGS, reply, 4);
+      break;
+    case LAN_SYSTEMSTATE_GETDATA:
+      z21SendSystemState(address, port, false);
+      break;
+    case LAN_RMBUS_GETDATA:
+      if(length >= 1 && data[0] < 2) {
+        z21BuildRBusGroup(data[0], reply);
+        z21Send(address, port, LAN_RMBUS_DATACHANGED, reply, 11);
+      }
+      break;
+    case LAN_X:
+      z21HandleX(*client, data, length);
+      break;
+    default:
+      log_d("[Z21] Unsupported request %04x", header);
+  }
+}
+
+void z21QueueChange(uint8_t type, uint16_t id, bool state) {
+  portENTER_CRITICAL(&z21PendingMux);
+  bool queued = false;
+  for(uint8_t index = 0; index < z21PendingCount && !queued; index++) {
+    if(z21Pending[index].type == type && z21Pending[index].id == id) {
+      z21Pending[index].state = state;
+      queued = true;
+    }
+  }
+  if(!queued) {
+    if(z21PendingCount < Z21_MAX_PENDING) {
+      z21Pending[z21PendingCount++] = {type, id, state};
+    } else {
+      z21PendingOverflows++;
+    }
+  }
+  portEXIT_CRITICAL(&z21PendingMux);
+}
+
+void z21SendChange(const Z21PendingChange &change) {
+  uint8_t data[16];
+  if(change.type == Z21_PENDING_SENSOR) {
+    int32_t input = change.id - Z21_RBUS_FIRST_SENSOR;
+    if(input >= 0 && input < 2 * Z21_RBUS_INPUTS_PER_GROUP) {
+      z21BuildRBusGroup(input / Z21_RBUS_INPUTS_PER_GROUP, data);
+      z21Broadcast(Z21_BCFLAG_RBUS, LAN_RMBUS_DATACHANGED, data, 11);
+    }
+    // LAN_LOCONET_DETECTOR: type 0x01 (occupancy), feedback address, state
+    uint8_t detector[4] = {0x01, lowByte(change.id), highByte(change.id), change.state};
+    z21Broadcast(Z21_BCFLAG_LOCONET_DETECTOR, LAN_LOCONET_DETECTOR, detector, sizeof(detector));
+  } else if(change.type == Z21_PENDING_TURNOUT) {
+    Turnout *turnout = TurnoutManager::getTurnoutByID(change.id);
+    if(turnout != NULL) {
+      uint16_t turnoutAddress = ((turnout->getAddress() - 1) * 4) + turnout->getSubAddress();
+      data[0] = 0x43;
+      data[1] = highByte(turnoutAddress);
+      data[2] = lowByte(turnoutAddress);
+      data[3] = turnout->isPositionFailed() ? 0x00 : (change.state ? 0x02 : 0x01);
+      z21BroadcastX(Z21_BCFLAG_DRIVING_SWITCHING, data, 4);
+    }
+  } else if(change.type == Z21_PENDING_POWER) {
+    z21SendTrackPowerState(Z21_BCFLAG_DRIVING_SWITCHING, NULL, change.state);
+    z21SendSystemState(IPAddress(), 0, true);
+  } else if(change.type == Z21_PENDING_LOCO) {
+    uint8_t length = z21BuildLocoInfo(change.id, data);
+    for(uint8_t index = 0; index < Z21_MAX_CLIENTS; index++) {
+      if(z21Clients[index].port && z21IsSubscribed(z21Clients[index], change.id)) {
+        z21SendX(z21Clients[index], data, length);
+      }
+    }
+  }
+}
+
+// sends the queued state changes, the Z21 socket is only used by the task
+// running update.
+void z21Flush() {
+  Z21PendingChange changes[Z21_MAX_PENDING];
+  portENTER_CRITICAL(&z21PendingMux);
+  uint8_t count = z21PendingCount;
+  memcpy(changes, z21Pending, sizeof(Z21PendingChange) * count);
+  z21PendingCount = 0;
+  portEXIT_CRITICAL(&z21PendingMux);
+  for(uint8_t index = 0; index < count; index++) {
+    z21SendChange(changes[index]);
+  }
+}
+
+class Z21StateObserver : public StateObserver {
+public:
+  void sensorChanged(uint16_t id, bool active) {
+    z21QueueChange(Z21_PENDING_SENSOR, id, active);
+  }
+  void turnoutChanged(uint16_t id, bool thrown) {
+    z21QueueChange(Z21_PENDING_TURNOUT, id, thrown);
+  }
+  void turnoutFailed(uint16_t id, bool thrown) {
+    z21QueueChange(Z21_PENDING_TURNOUT, id, thrown);
+  }
+  void powerChanged(const String &name, bool on, bool overCurrent) {
+    if(name == MOTORBOARD_NAME_MAIN) {
+      z21QueueChange(Z21_PENDING_POWER, 0, overCurrent);
+    }
+  }
+  void locomotiveChanged(Locomotive *loco) {
+    z21QueueChange(Z21_PENDING_LOCO, loco->getLocoNumber(), false);
+  }
+};
+
+void Z21Server::init() {
+  memset(z21Clients, 0, sizeof(z21Clients));
+  log_i("[Z21] Listening on UDP port %d", Z21_UDP_PORT);
+  z21Socket.begin(Z21_UDP_PORT);
+  StateObservers::registerObserver(new Z21StateObserver());
+}
+
+void Z21Server::update() {
+  uint8_t datagram[Z21_MAX_DATAGRAM];
+  int datagramSize = z21Socket.parsePacket();
+  while(datagramSize > 0) {
+    IPAddress remoteAddress = z21Socket.remoteIP();
+    uint16_t remotePort = z21Socket.remotePort();
+    int length = z21Socket.read(datagram, sizeof(datagram));
+    // a datagram can contain multiple Z21 packets back to back
+    int offset = 0;
+    while(offset + 4 <= length) {
+      uint16_t packetLength = datagram[offset] | (datagram[offset + 1] << 8);
+      uint16_t header = datagram[offset + 2] | (datagram[offset + 3] << 8);
+      if(packetLength < 4 || offset + packetLength > length) {
+        log_w("[Z21] Dropping malformed datagram from %s", remoteAddress.toString().c_str());
+        break;
+      }
+      z21PacketsReceived++;
+      z21HandlePacket(remoteAddress, remotePort, header, &datagram[offset + 4], packetLength - 4);
+      offset += packetLength;
+    }
+    datagramSize = z21Socket.parsePacket();
+  }
+  // drop any clients that have timed out
+  for(uint8_t index = 0; index < Z21_MAX_CLIENTS; index++) {
+    if(z21Clients[index].port && millis() - z21Clients[index].lastSeen > Z21_CLIENT_TIMEOUT) {
+      log_i("[Z21] Client %s:%d timed out", z21Clients[index].address.toString().c_str(), z21Clients[index].port);
+      z21Clients[index].port = 0;
+    }
+  }
+  z21Flush();
+}
+
+void Z21Server::getState(JsonObject &root) {
+  uint8_t clientCount = 0;
+  for(uint8_t index = 0; index < Z21_MAX_CLIENTS; index++) {
+    if(z21Clients[index].port) {
+      clientCount++;
+    }
+  }
+  root[F("clients")] = clientCount;
+  root[F("received")] = z21PacketsReceived;
+  root[F("sent")] = z21PacketsSent;
+  root[F("overflows")] = z21PendingOverflows;
+}
+#endif
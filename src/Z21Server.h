@@ -0,0 +1,59 @@
+/**********************************************************************
+DCC++ BASE STATION FOR ESP32
+
+COPYRIGHT (c) 2017 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _Z21_SERVER_H_
+#define _Z21_SERVER_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <IPAddress.h>
+
+// UDP port used by the Z21 LAN protocol
+#define Z21_UDP_PORT 21105
+// maximum number of Z21 clients tracked at once
+#define Z21_MAX_CLIENTS 16
+// maximum number of locomotives a single client can subscribe to
+#define Z21_MAX_LOCO_SUBSCRIPTIONS 16
+// clients that have not sent anything in this many ms are dropped
+#define Z21_CLIENT_TIMEOUT 60000
+// largest datagram that will be processed
+#define Z21_MAX_DATAGRAM 128
+
+// Z21 broadcast flags (LAN_SET_BROADCASTFLAGS)
+#define Z21_BCFLAG_DRIVING_SWITCHING 0x00000001
+#define Z21_BCFLAG_RBUS 0x00000002
+#define Z21_BCFLAG_SYSTEM_STATE 0x00000100
+#define Z21_BCFLAG_ALL_LOCOS 0x00010000
+#define Z21_BCFLAG_LOCONET_DETECTOR 0x08000000
+
+struct Z21Client {
+  IPAddress address;
+  uint16_t port;
+  uint32_t broadcastFlags;
+  uint32_t lastSeen;
+  uint16_t locos[Z21_MAX_LOCO_SUBSCRIPTIONS];
+  uint8_t locoCount;
+};
+
+class Z21Server {
+public:
+  static void init();
+  static void update();
+  static void getState(JsonObject &);
+};
+
+#endif